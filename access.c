@@ -0,0 +1,347 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file access.c                                                  */
+/*                                                                 */
+/* @brief The binary access log (format in access.h). What is      */
+/* known of a response is noted on its connection as it goes: the */
+/* method, URI and timings when its request is parsed, the status  */
+/* when its head is queued. When it is complete the record is      */
+/* built on the stack and copied into a file mapped with mmap, so  */
+/* logging costs one memcpy and no system call. A URI is written   */
+/* out once per file and hashed into a table that later requests   */
+/* for it find it by. A full file (LISO_ACCESS_LOG_SIZE) is cut to */
+/* length and moved aside as <name>.<seconds>, and a new one       */
+/* started. lisolog decodes them.                                  */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "access.h"
+#include "lisod.h"
+#include "config.h"
+#include "util.h"
+#include "logger.h"
+
+#define ACCESS_URIS 4096   /* URIs remembered per file (power of 2) */
+
+extern FILE* logfile;
+
+/* A URI already in the current file */
+typedef struct uri_slot {
+  uint64_t hash;
+  uint32_t off;
+} uri_slot;
+
+access_counters access_stats;
+
+static char*    path;          /* NULL: no access log */
+static int      fd = -1;
+static char*    map;           /* The file, config.access_log_size bytes */
+static size_t   used;          /* Bytes of it written */
+static unsigned gen;           /* Bumped for every new file */
+static uint64_t wall_offset;   /* Wall clock minus monotonic, in us */
+static uri_slot uris[ACCESS_URIS];
+
+/* Monotonic microseconds: the request phases are timed with this */
+uint64_t access_clock(void)
+{
+  return mono_ns() / 1000;
+}
+
+/* Cuts the current file to what was written and unmaps it */
+static void finish(void)
+{
+  if (map == NULL)
+    return;
+
+  munmap(map, config.access_log_size);
+  if (ftruncate(fd, used) < 0)
+    log_error("Unable to trim the access log", logfile);
+  close(fd);
+  map = NULL;
+  fd  = -1;
+}
+
+/* Moves the file at path aside as path.<seconds it was started>, or
+   path.<seconds>.<n> if files filled within the second are there */
+static void move_aside(uint64_t created_us)
+{
+  char aside[BUF_SIZE];
+  int n;
+
+  for (n = 0; n < 1000; n++)
+  {
+    if (n == 0)
+      snprintf(aside, sizeof(aside), "%s.%llu", path,
+               (unsigned long long)(created_us / 1000000));
+    else
+      snprintf(aside, sizeof(aside), "%s.%llu.%d", path,
+               (unsigned long long)(created_us / 1000000), n);
+
+    if (link(path, aside) == 0)
+    {
+      unlink(path);
+      return;
+    }
+    if (errno != EEXIST)
+      break;
+  }
+  log_error("Unable to move the access log aside", logfile);
+}
+
+/* Starts a new file at path, moving an old one aside first */
+static int start_file(void)
+{
+  access_hdr* hdr;
+  access_hdr old;
+  int n;
+
+  if ((fd = open(path, O_RDONLY)) >= 0)
+  {
+    n = read(fd, &old, sizeof(old));
+    close(fd);
+    if (n == sizeof(old) && !memcmp(old.magic, ACCESS_MAGIC, 8))
+      move_aside(old.created_us);
+  }
+
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    return -1;
+
+  if (ftruncate(fd, config.access_log_size) < 0 ||
+      (map = mmap(NULL, config.access_log_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0)) == MAP_FAILED)
+  {
+    map = NULL;
+    close(fd);
+    fd = -1;
+    return -1;
+  }
+
+  hdr = (access_hdr*)map;
+  memcpy(hdr->magic, ACCESS_MAGIC, 8);
+  hdr->version    = ACCESS_VERSION;
+  hdr->rec_size   = ACCESS_REC;
+  hdr->created_us = access_clock() + wall_offset;
+  used = sizeof(access_hdr);
+
+  memset(uris, 0, sizeof(uris));
+  gen++;
+  return 0;
+}
+
+/* Room for len more bytes, starting a new file if this one is full */
+static int room(size_t len)
+{
+  if (map != NULL && used + len <= config.access_log_size)
+    return 0;
+
+  if (map != NULL)
+  {
+    finish();
+    access_stats.rotations++;
+  }
+  if (start_file())
+  {
+    access_stats.failed++;
+    return -1;
+  }
+  return 0;
+}
+
+/*******************************************************************/
+/* @brief Opens the access log, if LISO_ACCESS_LOG names one.      */
+/*                                                                 */
+/* @retval 0 on success (or none configured), -1 on failure        */
+/*******************************************************************/
+int access_init(void)
+{
+  struct timespec now;
+
+  if (config.access_log == NULL || config.access_log[0] == '\0')
+    return 0;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  wall_offset = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 -
+                access_clock();
+
+  path = config.access_log;
+  if (start_file())
+  {
+    fprintf(stderr, "Unable to open the access log %s\n", path);
+    path = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int access_enabled(void)
+{
+  return path != NULL;
+}
+
+/* The record of where a URI is in the current file, writing it out
+   if it isn't yet. 0 if it can't be */
+static uint32_t uri_offset(const char* uri, size_t len, uint64_t hash)
+{
+  uri_slot* slot = &uris[hash & (ACCESS_URIS - 1)];
+  access_uri* rec;
+  size_t size;
+
+  if (slot->hash == hash && slot->off != 0)
+    return slot->off;
+
+  if (len > ACCESS_URI_MAX)
+    len = ACCESS_URI_MAX;
+  size = (sizeof(access_uri) + len + ACCESS_REC - 1) & ~(ACCESS_REC - 1);
+  if (room(size + ACCESS_REC))
+    return 0;
+
+  rec = (access_uri*)(map + used);
+  rec->len  = len;
+  rec->size = size;
+  rec->hash = hash;
+  memcpy(rec->text, uri, len);
+  rec->kind = ACCESS_KIND_URI;
+
+  slot->hash = hash;
+  slot->off  = used;
+  used += size;
+  access_stats.uris++;
+  return slot->off;
+}
+
+/******************************************************************/
+/* @brief Notes a request just parsed, for the response it is     */
+/* about to be given (state->seq_next).                           */
+/******************************************************************/
+void access_begin(fsm* state)
+{
+  access_note* note = &state->cold->acc[state->seq_next % RESP_MAX];
+  size_t len = strlen(state->uri);
+
+  note->open    = 1;
+  note->parsed  = access_clock();
+  note->start   = state->cold->started[state->seq_next % RESP_MAX];
+  note->head    = 0;
+  note->bytes   = 0;
+  note->status  = 0;
+  note->flags   = (state->context != NULL ? ACCESS_TLS : 0) |
+                  (state->conn ? 0 : ACCESS_CLOSE);
+  note->method  = !strcmp(state->method, "GET")  ? ACCESS_GET :
+                  !strcmp(state->method, "HEAD") ? ACCESS_HEAD :
+                  !strcmp(state->method, "POST") ? ACCESS_POST :
+                  ACCESS_OTHER;
+  note->uri_len  = len > 65535 ? 65535 : len;
+  note->uri_hash = fnv1a(state->uri, len);
+  note->uri_off  = uri_offset(state->uri, len, note->uri_hash);
+  note->gen      = gen;
+}
+
+/* Response seq's head is queued: its status is in it */
+void access_head(fsm* state, unsigned seq, const char* head)
+{
+  access_note* note = &state->cold->acc[seq % RESP_MAX];
+
+  if (note->head != 0 && note->open)
+    return;
+
+  /* A request that didn't parse (a 400) gets a note here */
+  if (!note->open)
+  {
+    memset(note, 0, sizeof(access_note));
+    note->open   = 1;
+    note->parsed = access_clock();
+    note->start  = state->cold->started[seq % RESP_MAX];
+    note->flags  = state->context != NULL ? ACCESS_TLS : 0;
+  }
+
+  note->head = access_clock();
+  if (!strncmp(head, "HTTP/1.", 7) && head[8] == ' ')
+    note->status = atoi(head + 9);
+}
+
+/* Response seq was cut short after it started */
+void access_cut(fsm* state, unsigned seq)
+{
+  state->cold->acc[seq % RESP_MAX].flags |= ACCESS_CUT | ACCESS_CLOSE;
+}
+
+/* Response seq is being produced elsewhere: CGI, FastCGI, a plugin */
+void access_deferred(fsm* state, unsigned seq)
+{
+  state->cold->acc[seq % RESP_MAX].flags |= ACCESS_DEFERRED;
+}
+
+static uint32_t span(uint64_t from, uint64_t to)
+{
+  return to > from ? (to - from > UINT32_MAX ? UINT32_MAX : to - from) : 0;
+}
+
+/******************************************************************/
+/* @brief Logs response seq, now complete, with bytes queued for  */
+/* it besides the ones noted already.                             */
+/******************************************************************/
+void access_done(fsm* state, unsigned seq, size_t bytes)
+{
+  access_note* note = &state->cold->acc[seq % RESP_MAX];
+  uint64_t now = access_clock();
+  struct in_addr addr;
+  access_rec rec;
+
+  if (!note->open)
+    return;
+  note->open = 0;
+
+  if (room(sizeof(rec)))
+    return;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.kind      = ACCESS_KIND_REQ;
+  rec.method    = note->method;
+  rec.flags     = note->flags;
+  rec.status    = note->status;
+  rec.uri_len   = note->uri_len;
+  rec.uri_off   = note->gen == gen ? note->uri_off : 0;
+  rec.uri_hash  = note->uri_hash;
+  rec.addr      = inet_pton(AF_INET, state->cold->cli_ip, &addr) == 1 ?
+                  addr.s_addr : 0;
+  rec.time_us   = note->start + wall_offset;
+  rec.bytes     = note->bytes + bytes;
+  rec.read_us   = span(note->start, note->parsed);
+  rec.handle_us = span(note->parsed, note->head ? note->head : now);
+  rec.body_us   = note->head ? span(note->head, now) : 0;
+
+  memcpy(map + used, &rec, sizeof(rec));
+  used += sizeof(rec);
+  access_stats.records++;
+}
+
+/* At exit: the file is cut to what was written */
+void access_close(void)
+{
+  finish();
+}
+
+void access_print(FILE* file)
+{
+  if (path == NULL)
+    return;
+
+  fprintf(file, "Access log: %lu records, %lu URIs, %lu rotations, "
+          "%lu lost; %zu bytes in %s\n", access_stats.records,
+          access_stats.uris, access_stats.rotations, access_stats.failed,
+          used, path);
+  fflush(file);
+}
@@ -0,0 +1,110 @@
+#ifndef ACCESS_H
+#define ACCESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* The binary access log (LISO_ACCESS_LOG), read back by lisolog.c.
+   A file is an access_hdr followed by ACCESS_REC-byte records: one
+   access_rec per response, and an access_uri in front of the first
+   response in the file for each URI, which later ones point back to.
+   The records after the last one are zero. Integers are in the
+   writer's byte order. */
+
+#define ACCESS_MAGIC   "LISOACC1"
+#define ACCESS_VERSION 1
+#define ACCESS_REC     64     /* Every record is a multiple of this    */
+#define ACCESS_URI_MAX 2048   /* Longer URIs are kept cut short        */
+
+/* access_rec.kind */
+#define ACCESS_KIND_REQ 1
+#define ACCESS_KIND_URI 2
+
+/* access_rec.method */
+#define ACCESS_OTHER 0   /* Not parsed: a 400, 501 or 505 */
+#define ACCESS_GET   1
+#define ACCESS_HEAD  2
+#define ACCESS_POST  3
+
+/* access_rec.flags */
+#define ACCESS_TLS       1   /* Came in over HTTPS                     */
+#define ACCESS_CLOSE     2   /* The connection closed after it         */
+#define ACCESS_CUT       4   /* Cut short after it had started         */
+#define ACCESS_DEFERRED  8   /* CGI, FastCGI or a plugin answered it   */
+
+typedef struct access_hdr {
+  char     magic[8];      // ACCESS_MAGIC
+  uint32_t version;       // ACCESS_VERSION
+  uint32_t rec_size;      // ACCESS_REC
+  uint64_t created_us;    // Wall clock, microseconds since the epoch
+  char     pad[ACCESS_REC - 24];
+} access_hdr;
+
+typedef struct access_rec {
+  uint8_t  kind;          // ACCESS_KIND_REQ
+  uint8_t  method;        // ACCESS_GET ...
+  uint8_t  flags;         // ACCESS_TLS ...
+  uint8_t  pad;
+  uint16_t status;
+  uint16_t uri_len;       // Of the URI as requested (capped at 65535)
+  uint32_t addr;          // Client IPv4 address, network byte order
+  uint32_t uri_off;       // File offset of its access_uri, 0 if none
+  uint64_t time_us;       // Wall clock when its first byte came in
+  uint64_t uri_hash;      // FNV-1a of the URI
+  uint64_t bytes;         // Response bytes queued, head included
+  uint32_t read_us;       // First byte of the request -> parsed
+  uint32_t handle_us;     // Parsed -> response head ready
+  uint32_t body_us;       // Head -> last byte of the response queued
+  uint32_t reserved[3];
+} access_rec;
+
+typedef struct access_uri {
+  uint8_t  kind;          // ACCESS_KIND_URI
+  uint8_t  pad;
+  uint16_t len;           // Bytes of text that follow
+  uint32_t size;          // Of the record, padded to ACCESS_REC
+  uint64_t hash;          // FNV-1a of the whole URI
+  char     text[];        // Not NUL terminated
+} access_uri;
+
+/* What is known so far about one response in flight, by seq (kept in
+   the connection's fsm_cold) */
+typedef struct access_note {
+  int      open;          // Begun, not logged yet
+  unsigned gen;           // File uri_off is in
+  uint64_t start;         // Monotonic microseconds
+  uint64_t parsed;
+  uint64_t head;
+  uint64_t bytes;
+  uint64_t uri_hash;
+  uint32_t uri_off;
+  uint16_t uri_len;
+  uint8_t  method;
+  uint8_t  flags;
+  uint16_t status;
+} access_note;
+
+typedef struct access_counters {
+  unsigned long records;   // Responses logged
+  unsigned long uris;      // URI records written
+  unsigned long rotations; // Files filled and moved aside
+  unsigned long failed;    // Lost: no file to write them to
+} access_counters;
+
+extern access_counters access_stats;
+
+struct state;
+
+int      access_init(void);
+int      access_enabled(void);
+uint64_t access_clock(void);
+void     access_begin(struct state* state);
+void     access_head(struct state* state, unsigned seq, const char* head);
+void     access_cut(struct state* state, unsigned seq);
+void     access_deferred(struct state* state, unsigned seq);
+void     access_done(struct state* state, unsigned seq, size_t bytes);
+void     access_close(void);
+void     access_print(FILE* file);
+
+#endif
@@ -0,0 +1,445 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file alloc.c                                                   */
+/*                                                                 */
+/* @brief Allocator used by liso for everything that lives on the  */
+/* request path: fsm buffers, paths, header copies, CGI env        */
+/* strings and file bodies.                                        */
+/*                                                                 */
+/* Production mode keeps a free list per size class in each thread */
+/* and spills/refills in batches from a shared list, so a steady   */
+/* request load never reaches malloc(). Debug mode forwards to     */
+/* malloc() under mcheck (or ASan) and keeps the same counters.    */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef LISO_DEBUG_ALLOC
+#ifndef __SANITIZE_ADDRESS__
+#include <mcheck.h>
+#endif
+#endif
+
+#include "alloc.h"
+#include "config.h"
+
+#define NCLASSES    32
+#define BIG_CLASS   0xFFFF
+#define ALLOC_MAGIC 0x4C49534Fu  /* "LISO" */
+#define SLAB_SIZE   (64*1024)    /* Small classes are carved from slabs */
+#define CACHE_MAX   64           /* Blocks a thread keeps per class     */
+#define CACHE_BYTES (1024*1024)  /* ...but no more than this many bytes  */
+#define BATCH       32           /* Blocks moved to/from the shared list */
+
+/* Size classes: powers of two with a 1.5x step in between. fsm_cold
+   (~16.7 KB) lands in the 24 KB class; file bodies up to 1 MB are pooled. */
+static const size_t class_size[NCLASSES] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+  3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768, 49152, 65536,
+  98304, 131072, 196608, 262144, 393216, 524288, 786432, 1048576
+};
+
+/* Sits in front of every block handed out; keeps payload 16-aligned */
+typedef struct header {
+  uint32_t magic;
+  uint16_t cls;     // Index into class_size, or BIG_CLASS
+  uint16_t sub;     // enum mem_sub the block is charged to
+  size_t   size;    // Size requested by the caller
+  size_t*  acct;    // Per-connection counter to charge, or NULL
+  size_t   pad;
+} header;
+
+typedef struct block {
+  struct block* next;
+} block;
+
+typedef struct class_stats {
+  unsigned long allocs;    // liso_malloc calls served by this class
+  unsigned long frees;     // liso_free calls returned to this class
+  unsigned long sys;       // malloc() calls made to grow this class
+  unsigned long in_use;    // Blocks currently handed out
+  unsigned long peak;      // Highest in_use seen
+} class_stats;
+
+static class_stats stats[NCLASSES + 1];  // Last slot counts big blocks
+static size_t      bytes_in_use;
+static size_t      sub_bytes[MEM_NSUBS];
+
+static const char* sub_name[MEM_NSUBS] = {
+  "conn", "parse", "body", "cgi", "cache", "other"
+};
+
+#ifndef LISO_DEBUG_ALLOC
+
+/* Per-thread free lists */
+static __thread block* cache[NCLASSES];
+static __thread int    cache_len[NCLASSES];
+
+/* Shared free lists, filled by threads that free more than they use */
+static block*          shared[NCLASSES];
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#endif
+
+static void count(unsigned long* counter, long delta)
+{
+  __atomic_fetch_add(counter, delta, __ATOMIC_RELAXED);
+}
+
+static void count_alloc(int idx, size_t size)
+{
+  unsigned long used;
+
+  count(&stats[idx].allocs, 1);
+  used = __atomic_add_fetch(&stats[idx].in_use, 1, __ATOMIC_RELAXED);
+  if (used > stats[idx].peak)
+    stats[idx].peak = used;
+  __atomic_fetch_add(&bytes_in_use, size, __ATOMIC_RELAXED);
+}
+
+static void count_free(int idx, size_t size)
+{
+  count(&stats[idx].frees, 1);
+  __atomic_fetch_sub(&stats[idx].in_use, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&bytes_in_use, size, __ATOMIC_RELAXED);
+}
+
+/* Records who a block belongs to and charges it */
+static void* charge(header* hdr, size_t size, int sub, size_t* acct)
+{
+  hdr->magic = ALLOC_MAGIC;
+  hdr->size  = size;
+  hdr->sub   = sub;
+  hdr->acct  = acct;
+
+  __atomic_fetch_add(&sub_bytes[sub], size, __ATOMIC_RELAXED);
+  if (acct != NULL)
+    *acct += size;
+
+  return hdr + 1;
+}
+
+/* Undoes charge() for a block about to be freed */
+static header* uncharge(void* ptr)
+{
+  header* hdr = (header*)ptr - 1;
+
+  if (hdr->magic != ALLOC_MAGIC)
+  {
+    fprintf(stderr, "liso_free: bad pointer %p\n", ptr);
+    abort();
+  }
+
+  __atomic_fetch_sub(&sub_bytes[hdr->sub], hdr->size, __ATOMIC_RELAXED);
+  if (hdr->acct != NULL)
+    *hdr->acct -= hdr->size;
+
+  hdr->magic = 0;
+  return hdr;
+}
+
+/* Smallest class that fits size, or -1 if size is too big for a pool */
+static int size_class(size_t size)
+{
+  int lo = 0, hi = NCLASSES - 1;
+
+  if (size > class_size[NCLASSES - 1])
+    return -1;
+
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (class_size[mid] < size) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+#ifdef LISO_DEBUG_ALLOC
+
+#ifndef __SANITIZE_ADDRESS__
+static void mcheck_report(enum mcheck_status status)
+{
+  fprintf(stderr, "Heap corruption detected by mcheck (status %d).\n", status);
+  abort();
+}
+#endif
+
+void alloc_init(void)
+{
+#ifndef __SANITIZE_ADDRESS__
+  mcheck(&mcheck_report);
+#endif
+}
+
+void* liso_malloc_acct(size_t size, int sub, size_t* acct)
+{
+  int cls = size_class(size);
+  int idx = cls < 0 ? NCLASSES : cls;
+  header* hdr = malloc(sizeof(header) + size);
+
+  if (hdr == NULL)
+    return NULL;
+
+  hdr->cls   = cls < 0 ? BIG_CLASS : (uint16_t)cls;
+
+  count(&stats[idx].sys, 1);
+  count_alloc(idx, size);
+  return charge(hdr, size, sub, acct);
+}
+
+void liso_free(void* ptr)
+{
+  header* hdr; int idx;
+
+  if (ptr == NULL)
+    return;
+
+  hdr = uncharge(ptr);
+
+  idx = hdr->cls == BIG_CLASS ? NCLASSES : (int)hdr->cls;
+  count_free(idx, hdr->size);
+  free(hdr);
+}
+
+#else
+
+void alloc_init(void)
+{
+  /* Nothing to do; pools grow on demand */
+}
+
+/* Moves up to BATCH blocks from the shared list into this thread's cache,
+   carving a new slab (or one block, for big classes) if it is empty. */
+static void refill(int cls)
+{
+  size_t stride = sizeof(header) + class_size[cls];
+  int n = 0;
+
+  pthread_mutex_lock(&shared_lock);
+  while (shared[cls] != NULL && n < BATCH)
+  {
+    block* b = shared[cls];
+    shared[cls] = b->next;
+    b->next = cache[cls];
+    cache[cls] = b;
+    n++;
+  }
+  pthread_mutex_unlock(&shared_lock);
+
+  cache_len[cls] += n;
+  if (n > 0)
+    return;
+
+  /* Slabs are never returned; freed blocks go back on the lists */
+  size_t nblocks = stride >= SLAB_SIZE / 2 ? 1 : SLAB_SIZE / stride;
+  char* slab = malloc(stride * nblocks);
+
+  if (slab == NULL)
+    return;
+
+  count(&stats[cls].sys, 1);
+  for (size_t k = 0; k < nblocks; k++)
+  {
+    block* b = (block*)(slab + k * stride);
+    b->next = cache[cls];
+    cache[cls] = b;
+  }
+  cache_len[cls] += nblocks;
+}
+
+/* How many free blocks of cls a thread may hold on to */
+static int cache_cap(int cls)
+{
+  size_t cap = CACHE_BYTES / class_size[cls];
+
+  if (cap > CACHE_MAX) cap = CACHE_MAX;
+  if (cap < 2)         cap = 2;
+  return (int)cap;
+}
+
+/* Trims this thread's cache for cls to half its cap, handing the rest
+   to the shared list */
+static void spill(int cls)
+{
+  block* head = NULL; block* tail = NULL;
+  int n = cache_len[cls] - cache_cap(cls) / 2;
+
+  for (int k = 0; k < n; k++)
+  {
+    block* b = cache[cls];
+    cache[cls] = b->next;
+    b->next = head;
+    head = b;
+    if (tail == NULL) tail = b;
+  }
+  cache_len[cls] -= n;
+
+  pthread_mutex_lock(&shared_lock);
+  tail->next = shared[cls];
+  shared[cls] = head;
+  pthread_mutex_unlock(&shared_lock);
+}
+
+void* liso_malloc_acct(size_t size, int sub, size_t* acct)
+{
+  int cls = size_class(size);
+  header* hdr;
+
+  if (cls < 0)
+  {
+    /* Too large for a pool: a whole file body, most likely */
+    if ((hdr = malloc(sizeof(header) + size)) == NULL)
+      return NULL;
+    hdr->cls = BIG_CLASS;
+    count(&stats[NCLASSES].sys, 1);
+    count_alloc(NCLASSES, size);
+  }
+  else
+  {
+    if (cache[cls] == NULL)
+      refill(cls);
+    if (cache[cls] == NULL)
+      return NULL;
+
+    hdr = (header*)cache[cls];
+    cache[cls] = cache[cls]->next;
+    cache_len[cls]--;
+    hdr->cls = cls;
+    count_alloc(cls, size);
+  }
+
+  return charge(hdr, size, sub, acct);
+}
+
+void liso_free(void* ptr)
+{
+  header* hdr; block* b; int cls;
+
+  if (ptr == NULL)
+    return;
+
+  hdr = uncharge(ptr);
+
+  if (hdr->cls == BIG_CLASS)
+  {
+    count_free(NCLASSES, hdr->size);
+    free(hdr);
+    return;
+  }
+
+  cls = hdr->cls;
+  count_free(cls, hdr->size);
+
+  b = (block*)hdr;
+  b->next = cache[cls];
+  cache[cls] = b;
+
+  if (++cache_len[cls] > cache_cap(cls))
+    spill(cls);
+}
+
+#endif
+
+char* liso_strndup_acct(const char* s, size_t n, int sub, size_t* acct)
+{
+  size_t len = strnlen(s, n);
+  char* copy = liso_malloc_acct(len + 1, sub, acct);
+
+  if (copy == NULL)
+    return NULL;
+
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+/******************************************************************/
+/* @brief Prints per-class allocation counters. 'sys' is the      */
+/* number of times the class had to call malloc(); once the pools */
+/* are warm it should stop moving.                                */
+/******************************************************************/
+void alloc_stats(FILE* file)
+{
+  unsigned long allocs = 0, frees = 0, sys = 0;
+
+#ifdef LISO_DEBUG_ALLOC
+  fprintf(file, "Allocator: debug (malloc%s)\n",
+#ifdef __SANITIZE_ADDRESS__
+          " + asan"
+#else
+          " + mcheck"
+#endif
+          );
+#else
+  fprintf(file, "Allocator: size-class pools\n");
+#endif
+
+  fprintf(file, "%8s %12s %12s %8s %8s %8s\n",
+          "class", "allocs", "frees", "sys", "in_use", "peak");
+
+  for (int k = 0; k <= NCLASSES; k++)
+  {
+    class_stats* c = &stats[k];
+    if (c->allocs == 0)
+      continue;
+
+    if (k < NCLASSES)
+      fprintf(file, "%8zu ", class_size[k]);
+    else
+      fprintf(file, "%8s ", "big");
+
+    fprintf(file, "%12lu %12lu %8lu %8lu %8lu\n",
+            c->allocs, c->frees, c->sys, c->in_use, c->peak);
+
+    allocs += c->allocs; frees += c->frees; sys += c->sys;
+  }
+
+  fprintf(file, "%8s %12lu %12lu %8lu  bytes in use: %zu\n",
+          "total", allocs, frees, sys, bytes_in_use);
+
+  fprintf(file, "Memory by subsystem (budget %zu):", config.mem_budget);
+  for (int k = 0; k < MEM_NSUBS; k++)
+    fprintf(file, " %s=%zu", sub_name[k], sub_bytes[k]);
+  fprintf(file, "\n");
+  fflush(file);
+}
+
+/* Bytes currently charged to one subsystem */
+size_t mem_in_use(int sub)
+{
+  return __atomic_load_n(&sub_bytes[sub], __ATOMIC_RELAXED);
+}
+
+/* Bytes currently charged to all subsystems */
+size_t mem_total(void)
+{
+  return __atomic_load_n(&bytes_in_use, __ATOMIC_RELAXED);
+}
+
+/*****************************************************************/
+/* @brief Compares usage against the configured budget.          */
+/*                                                               */
+/* @retval MEM_OK    below the high watermark (or no budget)     */
+/* @retval MEM_NEAR  above the high watermark                    */
+/* @retval MEM_OVER  at or above the budget                      */
+/*****************************************************************/
+int mem_pressure(void)
+{
+  size_t used = mem_total();
+
+  if (config.mem_budget == 0)
+    return MEM_OK;
+  if (used >= config.mem_budget)
+    return MEM_OVER;
+  if (used >= config.mem_budget / 100 * config.mem_high_pct)
+    return MEM_NEAR;
+  return MEM_OK;
+}
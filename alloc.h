@@ -0,0 +1,47 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Build with -DLISO_DEBUG_ALLOC (make DEBUG_ALLOC=1 or make ASAN=1) to get
+   the debug allocator: plain malloc plus mcheck (or ASan) and counters.
+   The default production allocator serves requests from thread-aware
+   size-class pools and only calls malloc to grow a pool. */
+
+/* Subsystems that memory is charged to */
+enum mem_sub {
+  MEM_CONN,    // fsm cold buffers
+  MEM_PARSE,   // request line, header copies, paths
+  MEM_BODY,    // file bodies and POST bodies
+  MEM_CGI,     // CGI env strings and cgi slots
+  MEM_CACHE,   // CGI responses held by the micro-cache
+  MEM_OTHER,
+  MEM_NSUBS
+};
+
+/* Levels returned by mem_pressure() */
+#define MEM_OK    0   // Below the high watermark
+#define MEM_NEAR  1   // Above the high watermark: stop taking new work
+#define MEM_OVER  2   // At or above the budget: shed connections
+
+void  alloc_init(void);
+void* liso_malloc_acct(size_t size, int sub, size_t* acct);
+void  liso_free(void* ptr);
+char* liso_strndup_acct(const char* s, size_t n, int sub, size_t* acct);
+void  alloc_stats(FILE* file);
+
+size_t mem_in_use(int sub);
+size_t mem_total(void);
+int    mem_pressure(void);
+
+#define liso_malloc(size)     liso_malloc_acct(size, MEM_OTHER, NULL)
+#define liso_strndup(s, n)    liso_strndup_acct(s, n, MEM_OTHER, NULL)
+
+/* Charge an allocation to a connection's fsm as well as a subsystem */
+#define conn_malloc(state, sub, size) \
+  liso_malloc_acct(size, sub, &(state)->mem)
+#define conn_strndup(state, sub, s, n) \
+  liso_strndup_acct(s, n, sub, &(state)->mem)
+
+#endif
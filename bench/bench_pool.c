@@ -0,0 +1,182 @@
+/********************************************************************/
+/* @file bench_pool.c                                               */
+/*                                                                  */
+/* @brief Measures the cost of one event-loop pass over the         */
+/* connection table, comparing the old layout (parallel clientfd[]  */
+/* and fsm*[] arrays, hot fields after 16 KB of buffers) with the   */
+/* cache-aligned table in lisod.h.                                  */
+/*                                                                  */
+/* Reports ns, cache misses and dTLB misses per pass when           */
+/* perf_event_open is permitted.                                    */
+/*                                                                  */
+/* @usage: ./bench/bench_pool [connections] [passes] [% ready]      */
+/********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../lisod.h"
+
+/* The fsm as it was laid out before the hot/cold split */
+typedef struct legacy_state {
+  char request[BUF_SIZE];
+  char response[BUF_SIZE];
+  char* method; char* uri; char* version; char* header;
+  char* body; ssize_t body_size;
+  int end_idx; int resp_idx;
+  char* www; int conn; SSL* context;
+  char cli_ip[INET_ADDRSTRLEN];
+  int pipefds;
+  char* freebuf[FREE_SIZE];
+} legacy_fsm;
+
+static volatile long sink;
+
+static int perf_open(uint32_t type, uint64_t config)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size           = sizeof(attr);
+  attr.type           = type;
+  attr.config         = config;
+  attr.disabled       = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* One pass of check_clients() over the old parallel arrays */
+static void pass_legacy(int* clientfd, legacy_fsm** states, char* ready, int n)
+{
+  long acc = 0;
+  for (int i = 0; i < n; i++)
+  {
+    if (clientfd[i] <= 0) continue;
+    legacy_fsm* state = states[i];
+    if (state->pipefds > 0) continue;
+    if (ready[i])
+      acc += state->end_idx + state->conn + (state->context != NULL);
+  }
+  sink += acc;
+}
+
+/* One pass of check_clients() over the cache-aligned table */
+static void pass_table(fsm* states, char* ready, int n)
+{
+  long acc = 0;
+  for (int i = 0; i < n; i++)
+  {
+    fsm* state = &states[i];
+    if (state->fd <= 0) continue;
+    if (state->pipefds > 0) continue;
+    if (ready[i])
+      acc += state->end_idx + state->conn + (state->context != NULL);
+  }
+  sink += acc;
+}
+
+static void report(const char* name, int which, int* clientfd,
+                   legacy_fsm** lstates, fsm* states, char* ready,
+                   int n, int passes)
+{
+  int fds[2];
+  uint64_t counts[2] = {0, 0}, start, end;
+
+  fds[0] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  fds[1] = perf_open(PERF_TYPE_HW_CACHE,
+                     PERF_COUNT_HW_CACHE_DTLB |
+                     (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+  for (int k = 0; k < 2; k++)
+    if (fds[k] >= 0) { ioctl(fds[k], PERF_EVENT_IOC_RESET, 0);
+                       ioctl(fds[k], PERF_EVENT_IOC_ENABLE, 0); }
+
+  start = now_ns();
+  for (int p = 0; p < passes; p++)
+  {
+    if (which) pass_table(states, ready, n);
+    else       pass_legacy(clientfd, lstates, ready, n);
+  }
+  end = now_ns();
+
+  for (int k = 0; k < 2; k++)
+    if (fds[k] >= 0) { ioctl(fds[k], PERF_EVENT_IOC_DISABLE, 0);
+                       if (read(fds[k], &counts[k], sizeof(uint64_t)) < 0)
+                         counts[k] = 0;
+                       close(fds[k]); }
+
+  printf("%-8s %10.0f ns/pass", name, (double)(end - start) / passes);
+  if (fds[0] >= 0) printf(" %10.1f cache-misses/pass", (double)counts[0] / passes);
+  else             printf("        n/a cache-misses/pass");
+  if (fds[1] >= 0) printf(" %10.1f dTLB-misses/pass\n", (double)counts[1] / passes);
+  else             printf("        n/a dTLB-misses/pass\n");
+}
+
+int main(int argc, char* argv[])
+{
+  int n      = argc > 1 ? atoi(argv[1]) : 16384;
+  int passes = argc > 2 ? atoi(argv[2]) : 200;
+  int pct    = argc > 3 ? atoi(argv[3]) : 10;
+
+  int* clientfd        = malloc(n * sizeof(int));
+  legacy_fsm** lstates = malloc(n * sizeof(legacy_fsm*));
+  char* ready          = malloc(n);
+  fsm* states          = NULL;
+
+  if (posix_memalign((void**)&states, CACHE_LINE, n * sizeof(fsm)) != 0 ||
+      clientfd == NULL || lstates == NULL || ready == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    return EXIT_FAILURE;
+  }
+  memset(states, 0, n * sizeof(fsm));
+
+  srand(441);
+  for (int i = 0; i < n; i++)
+  {
+    clientfd[i] = i + 5;
+    lstates[i]  = calloc(1, sizeof(legacy_fsm));
+    if (lstates[i] == NULL)
+    {
+      fprintf(stderr, "Out of memory.\n");
+      return EXIT_FAILURE;
+    }
+    lstates[i]->pipefds = -1;
+    lstates[i]->conn    = 1;
+
+    states[i].fd      = i + 5;
+    states[i].pipefds = -1;
+    states[i].conn    = 1;
+
+    ready[i] = (rand() % 100) < pct;
+  }
+
+  printf("%d connections, %d passes, %d%% ready, sizeof(fsm) = %zu\n",
+         n, passes, pct, sizeof(fsm));
+
+  /* Warm up both layouts once */
+  pass_legacy(clientfd, lstates, ready, n);
+  pass_table(states, ready, n);
+
+  report("legacy", 0, clientfd, lstates, states, ready, n, passes);
+  report("table",  1, clientfd, lstates, states, ready, n, passes);
+
+  return EXIT_SUCCESS;
+}
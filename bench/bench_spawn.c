@@ -0,0 +1,133 @@
+/********************************************************************/
+/* @file bench_spawn.c                                              */
+/*                                                                  */
+/* @brief Measures CGI spawns per second as the server grows,       */
+/* comparing fork()+execve() (how exec_cgi() used to spawn) with    */
+/* posix_spawn() (how it spawns now). Before each round the parent  */
+/* allocates and touches a connection table plus cold buffers for   */
+/* that many connections, so fork() has their page tables to copy.  */
+/*                                                                  */
+/* Each spawn runs the program with stdin and stdout on pipes, like */
+/* a CGI request, and is waited for.                                */
+/*                                                                  */
+/* @usage: ./bench/bench_spawn [spawns] [program]                   */
+/********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "../lisod.h"
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int spawn_fork(char* prog, char** argv, char** envp)
+{
+  int in[2], out[2];
+  pid_t pid;
+
+  if (pipe(in) || pipe(out))
+    return -1;
+
+  if ((pid = fork()) == 0)
+  {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+    execve(prog, argv, envp);
+    _exit(127);
+  }
+
+  close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+  return pid > 0 ? waitpid(pid, NULL, 0) > 0 ? 0 : -1 : -1;
+}
+
+static int spawn_posix(char* prog, char** argv, char** envp)
+{
+  posix_spawn_file_actions_t actions;
+  int in[2], out[2], rc;
+  pid_t pid;
+
+  if (pipe(in) || pipe(out))
+    return -1;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addclose(&actions, in[1]);
+  posix_spawn_file_actions_addclose(&actions, out[0]);
+
+  rc = posix_spawn(&pid, prog, &actions, NULL, argv, envp);
+  posix_spawn_file_actions_destroy(&actions);
+
+  close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+  return rc == 0 && waitpid(pid, NULL, 0) > 0 ? 0 : -1;
+}
+
+static double rate(int (*spawn)(char*, char**, char**), char* prog, int n)
+{
+  char* argv[2] = {prog, NULL};
+  char* envp[2] = {"GATEWAY_INTERFACE=CGI/1.1", NULL};
+  uint64_t t0 = now_ns();
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (spawn(prog, argv, envp))
+    {
+      fprintf(stderr, "spawn failed\n");
+      exit(EXIT_FAILURE);
+    }
+
+  return n / ((now_ns() - t0) / 1e9);
+}
+
+int main(int argc, char* argv[])
+{
+  int spawns  = argc > 1 ? atoi(argv[1]) : 300;
+  char* prog  = argc > 2 ? argv[2] : "/bin/true";
+  int conns[] = {0, 1024, 4096, 16384, 65536};
+  size_t per  = sizeof(fsm) + sizeof(fsm_cold);
+  char* mem   = NULL;
+  size_t k;
+
+  printf("%8s %10s %14s %14s %8s\n", "conns", "RSS MB", "fork+exec/s",
+         "posix_spawn/s", "speedup");
+
+  for (k = 0; k < sizeof(conns) / sizeof(conns[0]); k++)
+  {
+    size_t bytes = conns[k] * per;
+    double f, p;
+
+    /* What the server would hold for that many connections */
+    free(mem);
+    mem = NULL;
+    if (bytes > 0)
+    {
+      if ((mem = malloc(bytes)) == NULL)
+      {
+        fprintf(stderr, "Out of memory.\n");
+        return EXIT_FAILURE;
+      }
+      memset(mem, 1, bytes);
+    }
+
+    f = rate(spawn_fork,  prog, spawns);
+    p = rate(spawn_posix, prog, spawns);
+
+    printf("%8d %10.1f %14.0f %14.0f %7.2fx\n", conns[k], bytes / 1048576.0,
+           f, p, p / f);
+  }
+
+  free(mem);
+  return EXIT_SUCCESS;
+}
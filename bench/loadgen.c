@@ -0,0 +1,985 @@
+/********************************************************************/
+/* @file loadgen.c                                                  */
+/*                                                                  */
+/* @brief HTTP and HTTPS load generator for lisod. Opens N          */
+/* connections spread over M threads, each thread driving its own   */
+/* with poll(), and reports throughput and latency percentiles as   */
+/* text and, with -j, as a line of JSON.                            */
+/*                                                                  */
+/* Closed loop (the default), every connection keeps -p requests in */
+/* flight and latency runs from when a request was issued. With -r, */
+/* requests are due at a fixed total rate whether or not the server */
+/* keeps up, and latency runs from when each was due: a request     */
+/* that had to wait for a free connection counts its wait, so a     */
+/* stall shows up in the percentiles instead of being hidden by the */
+/* requests that were never sent (coordinated omission).            */
+/*                                                                  */
+/* With -C every request goes on a new connection; with -s over     */
+/* TLS, and with -R the TLS session is resumed on reconnecting.     */
+/* With -A pct, that share of requests is cut off part way and the  */
+/* connection reset, as a client that goes away would (over TLS,    */
+/* as many again are reset in the middle of the handshake).         */
+/*                                                                  */
+/* @usage: ./bench/loadgen [-c conns] [-t threads] [-d seconds]     */
+/*         [-p depth] [-C] [-s [-R]] [-r rate] [-u uri[=weight]]... */
+/*         [-P body bytes] [-A pct] [-l label] [-j file] host:port  */
+/********************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define DEPTH_MAX  64          /* Requests in flight per connection      */
+#define URI_MAX    16          /* -u options                             */
+#define REQ_MAX    2048        /* Bytes of one request's head            */
+#define IN_SIZE    65536       /* Read buffer per connection             */
+#define BACKLOG    (1 << 20)   /* Open loop: due requests not yet sent   */
+
+/* Latency histogram: 8 buckets per power of two of ns, as metrics.c */
+#define SUB_BITS  3
+#define SUB       (1 << SUB_BITS)
+#define MAX_BITS  40
+#define BUCKETS   ((MAX_BITS - SUB_BITS + 1) * SUB)
+
+/* Connection states */
+enum { C_CLOSED, C_CONNECTING, C_HANDSHAKE, C_OPEN };
+
+/* Response parser states */
+enum { P_HEAD, P_BODY, P_CHUNK_SIZE, P_CHUNK_DATA, P_CHUNK_END, P_TRAILER,
+       P_UNTIL_CLOSE };
+
+typedef struct uri {
+  char  path[256];
+  int   weight;
+  int   post;          // POST with -P bytes, else GET
+} uri;
+
+typedef struct conn {
+  int      fd;
+  int      state;
+  SSL*     ssl;
+  SSL_SESSION* session;   // Kept for resuming (-R)
+  int      closing;       // The server closes after the response in flight
+  int      aborting;      // -A: reset it once the output is out (1) or
+                          // in the handshake (2)
+
+  /* Requests in flight, oldest first: when each was due */
+  uint64_t due[DEPTH_MAX];
+  int      head, inflight;
+
+  /* Output not yet written */
+  char*    out;
+  size_t   out_len, out_off, out_cap;
+
+  /* Response parsing */
+  char     in[IN_SIZE];
+  size_t   in_len;
+  int      pstate;
+  int      status;
+  uint64_t left;           // Body or chunk bytes still to come
+} conn;
+
+typedef struct stats {
+  uint64_t done;           // Responses complete
+  uint64_t bytes;          // Bytes read
+  uint64_t connects;
+  uint64_t handshakes, resumed;
+  uint64_t err_connect, err_io, err_parse, err_status;
+  uint64_t unfinished;     // In flight or due when time ran out
+  uint64_t dropped;        // Open loop: the backlog was full
+  uint64_t aborted;        // Connections reset on purpose (-A)
+  uint64_t max;
+  uint64_t bucket[BUCKETS];
+} stats;
+
+typedef struct worker {
+  pthread_t thread;
+  int       id;
+  int       nconns;
+  conn*     conns;
+  double    rate;          // Requests per second; 0 = closed loop
+  uint64_t* backlog;       // Due times, a ring
+  size_t    bl_head, bl_count;
+  uint64_t  rng;
+  stats     st;
+} worker;
+
+/* Options */
+static struct sockaddr_in target;
+static char     host_hdr[300];
+static int      nconns = 16, nthreads = 1, seconds = 10, depth = 1;
+static int      close_each, use_tls, resume, abort_pct;
+static double   rate;
+static uri      uris[URI_MAX];
+static int      nuris, weights;
+static size_t   post_bytes;
+static char*    post_body;
+static const char* label = "";
+static const char* json;
+static SSL_CTX* tls;
+
+static uint64_t start_ns, end_ns;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns)
+{
+  int e;
+
+  if (ns < SUB)
+    return ns;
+  if (ns >= (1ULL << MAX_BITS))
+    return BUCKETS - 1;
+  e = 63 - __builtin_clzll(ns);
+  return (e - SUB_BITS + 1) * SUB + (int)((ns >> (e - SUB_BITS)) - SUB);
+}
+
+static uint64_t bucket_top(int b)
+{
+  int e = b / SUB + SUB_BITS - 1;
+
+  if (b < SUB)
+    return b + 1;
+  return (uint64_t)(b % SUB + SUB + 1) << (e - SUB_BITS);
+}
+
+static uint64_t quantile(const stats* st, double q)
+{
+  uint64_t seen = 0, rank;
+  int b;
+
+  if (st->done == 0)
+    return 0;
+  rank = (uint64_t)(q * st->done);
+  if (rank >= st->done)
+    rank = st->done - 1;
+  for (b = 0; b < BUCKETS; b++)
+    if ((seen += st->bucket[b]) > rank)
+      break;
+  if (b == BUCKETS || bucket_top(b) > st->max)
+    return st->max;   // The top bucket's bound can be past the largest
+  return bucket_top(b);
+}
+
+static uint64_t xorshift(uint64_t* s)
+{
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return *s;
+}
+
+/*********************** Connections ***********************/
+
+static void conn_close(conn* c)
+{
+  SSL_SESSION* s;
+
+  if (c->ssl != NULL)
+  {
+    /* TLS 1.3 tickets come after the handshake, so the session to
+       resume with is taken once the connection is done with */
+    if (resume && (s = SSL_get1_session(c->ssl)) != NULL)
+    {
+      if (SSL_SESSION_is_resumable(s))
+      {
+        if (c->session != NULL)
+          SSL_SESSION_free(c->session);
+        c->session = s;
+      }
+      else
+        SSL_SESSION_free(s);
+    }
+    SSL_shutdown(c->ssl);   // Best effort; lets the session be resumed
+    SSL_free(c->ssl);
+    c->ssl = NULL;
+  }
+  if (c->fd >= 0)
+    close(c->fd);
+  c->fd       = -1;
+  c->state    = C_CLOSED;
+  c->closing  = 0;
+  c->aborting = 0;
+  c->out_len  = c->out_off = 0;
+  c->in_len   = 0;
+  c->pstate   = P_HEAD;
+}
+
+/* Drops a connection that failed, its requests with it */
+static void conn_fail(conn* c, uint64_t* counter)
+{
+  (*counter)++;
+  c->head     = 0;
+  c->inflight = 0;
+  conn_close(c);
+}
+
+/* Goes away without a word: an RST rather than a FIN, and no
+   close_notify. What was in flight is given up, not an error. */
+static void conn_reset(worker* w, conn* c)
+{
+  struct linger lg = { 1, 0 };
+
+  w->st.aborted++;
+  if (c->ssl != NULL)
+  {
+    SSL_free(c->ssl);
+    c->ssl = NULL;
+  }
+  setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  c->head     = 0;
+  c->inflight = 0;
+  conn_close(c);
+}
+
+static int conn_open(worker* w, conn* c)
+{
+  int one = 1;
+
+  if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+  {
+    w->st.err_connect++;
+    return -1;
+  }
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  w->st.connects++;
+  c->state = C_CONNECTING;
+  if (connect(c->fd, (struct sockaddr*)&target, sizeof(target)) == 0)
+    c->state = use_tls ? C_HANDSHAKE : C_OPEN;
+  else if (errno != EINPROGRESS)
+  {
+    conn_fail(c, &w->st.err_connect);
+    return -1;
+  }
+
+  if (use_tls)
+  {
+    c->ssl = SSL_new(tls);
+    SSL_set_fd(c->ssl, c->fd);
+    if (resume && c->session != NULL)
+      SSL_set_session(c->ssl, c->session);
+    if (abort_pct > 0 && (int)(xorshift(&w->rng) % 100) < abort_pct)
+      c->aborting = 2;
+  }
+  return 0;
+}
+
+/* Moves the handshake on; 1 once it is done */
+static int conn_handshake(worker* w, conn* c, short* events)
+{
+  int rc = SSL_connect(c->ssl);
+
+  if (rc == 1)
+  {
+    w->st.handshakes++;
+    if (SSL_session_reused(c->ssl))
+      w->st.resumed++;
+    c->state = C_OPEN;
+    return 1;
+  }
+
+  /* The ClientHello is out: hang up on the server mid-handshake */
+  if (c->aborting == 2 && SSL_get_error(c->ssl, rc) == SSL_ERROR_WANT_READ)
+  {
+    conn_reset(w, c);
+    return -1;
+  }
+
+  switch (SSL_get_error(c->ssl, rc))
+  {
+    case SSL_ERROR_WANT_READ:  *events = POLLIN;  return 0;
+    case SSL_ERROR_WANT_WRITE: *events = POLLOUT; return 0;
+  }
+  conn_fail(c, &w->st.err_connect);
+  return -1;
+}
+
+/* Appends one request to the connection's output */
+static void conn_request(worker* w, conn* c, uint64_t due)
+{
+  int pick = 0, n;
+  size_t start = c->out_len;
+  uint64_t r;
+  uri* u;
+
+  if (nuris > 1)
+  {
+    r = xorshift(&w->rng) % weights;
+    for (pick = 0; pick < nuris - 1 && r >= (uint64_t)uris[pick].weight;
+         pick++)
+      r -= uris[pick].weight;
+  }
+  u = &uris[pick];
+
+  if (c->out_cap - c->out_len < REQ_MAX + post_bytes)
+  {
+    c->out_cap = c->out_len + REQ_MAX + post_bytes;
+    c->out = realloc(c->out, c->out_cap);
+  }
+
+  n = snprintf(c->out + c->out_len, REQ_MAX,
+               "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\n"
+               "Connection: %s\r\n", u->post ? "POST" : "GET", u->path,
+               host_hdr, close_each ? "close" : "keep-alive");
+  if (u->post)
+    n += snprintf(c->out + c->out_len + n, REQ_MAX - n,
+                  "Content-Type: application/octet-stream\r\n"
+                  "Content-Length: %zu\r\n", post_bytes);
+  n += snprintf(c->out + c->out_len + n, REQ_MAX - n, "\r\n");
+  c->out_len += n;
+  if (u->post)
+  {
+    memcpy(c->out + c->out_len, post_body, post_bytes);
+    c->out_len += post_bytes;
+  }
+
+  /* -A: only part of it goes out, then the connection is reset */
+  if (abort_pct > 0 && (int)(xorshift(&w->rng) % 100) < abort_pct)
+  {
+    c->out_len  = start + 1 + xorshift(&w->rng) % (c->out_len - start - 1);
+    c->aborting = 1;
+    c->closing  = 1;
+    return;
+  }
+
+  c->due[(c->head + c->inflight) % DEPTH_MAX] = due;
+  c->inflight++;
+  if (close_each)
+    c->closing = 1;
+}
+
+static void record(worker* w, conn* c)
+{
+  uint64_t lat = now_ns() - c->due[c->head];
+
+  c->head = (c->head + 1) % DEPTH_MAX;
+  c->inflight--;
+
+  w->st.done++;
+  w->st.bucket[bucket_of(lat)]++;
+  if (lat > w->st.max)
+    w->st.max = lat;
+  if (c->status < 200 || c->status >= 400)
+    w->st.err_status++;
+}
+
+/* Finds the end of a line in in[from, len); its offset, or -1 */
+static long line_end(conn* c, size_t from)
+{
+  char* p = memmem(c->in + from, c->in_len - from, "\r\n", 2);
+  return p == NULL ? -1 : p - c->in;
+}
+
+/* Consumes whole responses from the read buffer. -1 if one is bad */
+static int parse(worker* w, conn* c)
+{
+  size_t off = 0, take;
+  char *end, *h, *cl;
+  long e;
+
+  while (off < c->in_len)
+  {
+    switch (c->pstate)
+    {
+      case P_HEAD:
+        if ((end = memmem(c->in + off, c->in_len - off, "\r\n\r\n", 4))
+            == NULL)
+        {
+          if (c->in_len - off == IN_SIZE)
+            return -1;   // Headers bigger than the buffer
+          goto more;
+        }
+        *end = '\0';
+        h = c->in + off;
+        if (strncmp(h, "HTTP/1.", 7) || h[8] != ' ')
+          return -1;
+        c->status = atoi(h + 9);
+        if ((cl = strcasestr(h, "\r\nTransfer-Encoding: chunked")) != NULL)
+          c->pstate = P_CHUNK_SIZE;
+        else if ((cl = strcasestr(h, "\r\nContent-Length:")) != NULL)
+        {
+          c->left   = strtoull(cl + 17, NULL, 10);
+          c->pstate = P_BODY;
+        }
+        else
+          c->pstate = P_UNTIL_CLOSE;
+        if (strcasestr(h, "\r\nConnection: close"))
+          c->closing = 1;
+        off = end + 4 - c->in;
+        if (c->pstate == P_BODY && c->left == 0)
+        {
+          c->pstate = P_HEAD;
+          record(w, c);
+        }
+        break;
+
+      case P_BODY:
+      case P_CHUNK_DATA:
+        take = c->in_len - off < c->left ? c->in_len - off : c->left;
+        off     += take;
+        c->left -= take;
+        if (c->left > 0)
+          break;
+        if (c->pstate == P_CHUNK_DATA)
+          c->pstate = P_CHUNK_END;
+        else
+        {
+          c->pstate = P_HEAD;
+          record(w, c);
+        }
+        break;
+
+      case P_CHUNK_SIZE:
+        if ((e = line_end(c, off)) < 0)
+          goto more;
+        c->left = strtoull(c->in + off, NULL, 16);
+        off     = e + 2;
+        c->pstate = c->left > 0 ? P_CHUNK_DATA : P_TRAILER;
+        break;
+
+      case P_CHUNK_END:
+        if (c->in_len - off < 2)
+          goto more;
+        off += 2;
+        c->pstate = P_CHUNK_SIZE;
+        break;
+
+      case P_TRAILER:
+        if ((e = line_end(c, off)) < 0)
+          goto more;
+        if ((size_t)e == off)   // The empty line
+        {
+          c->pstate = P_HEAD;
+          record(w, c);
+        }
+        off = e + 2;
+        break;
+
+      case P_UNTIL_CLOSE:
+        off = c->in_len;   // Ends at EOF
+        break;
+    }
+  }
+
+more:
+  memmove(c->in, c->in + off, c->in_len - off);
+  c->in_len -= off;
+  return 0;
+}
+
+static ssize_t conn_read(conn* c, char* buf, size_t len)
+{
+  ssize_t n;
+
+  if (c->ssl == NULL)
+    return read(c->fd, buf, len);
+
+  if ((n = SSL_read(c->ssl, buf, len)) > 0)
+    return n;
+  switch (SSL_get_error(c->ssl, n))
+  {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE: errno = EAGAIN; return -1;
+    case SSL_ERROR_ZERO_RETURN: return 0;
+  }
+  errno = EIO;
+  return -1;
+}
+
+static ssize_t conn_write(conn* c, const char* buf, size_t len)
+{
+  ssize_t n;
+
+  if (c->ssl == NULL)
+    return write(c->fd, buf, len);
+
+  if ((n = SSL_write(c->ssl, buf, len)) > 0)
+    return n;
+  switch (SSL_get_error(c->ssl, n))
+  {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE: errno = EAGAIN; return -1;
+  }
+  errno = EIO;
+  return -1;
+}
+
+/* Reads what there is; handles the responses and the close */
+static void conn_input(worker* w, conn* c)
+{
+  ssize_t n;
+
+  for (;;)
+  {
+    n = conn_read(c, c->in + c->in_len, IN_SIZE - c->in_len);
+    if (n > 0)
+    {
+      w->st.bytes += n;
+      c->in_len   += n;
+      if (parse(w, c))
+      {
+        conn_fail(c, &w->st.err_parse);
+        return;
+      }
+      continue;
+    }
+
+    if (n < 0 && errno == EAGAIN)
+      break;
+
+    /* EOF (or an error): it ends a close-delimited response */
+    if (n == 0 && c->pstate == P_UNTIL_CLOSE && c->inflight > 0)
+    {
+      c->pstate = P_HEAD;
+      record(w, c);
+    }
+    if (c->inflight > 0)
+      conn_fail(c, n == 0 ? &w->st.err_parse : &w->st.err_io);
+    else
+      conn_close(c);
+    return;
+  }
+
+  /* All answered on a connection the server is closing: go first */
+  if (c->closing && c->inflight == 0)
+    conn_close(c);
+}
+
+static void conn_output(worker* w, conn* c)
+{
+  ssize_t n;
+
+  while (c->out_off < c->out_len)
+  {
+    n = conn_write(c, c->out + c->out_off, c->out_len - c->out_off);
+    if (n < 0)
+    {
+      if (errno != EAGAIN)
+        conn_fail(c, &w->st.err_io);
+      return;
+    }
+    c->out_off += n;
+  }
+  c->out_off = c->out_len = 0;
+
+  if (c->aborting == 1)
+    conn_reset(w, c);
+}
+
+/*********************** Worker threads ***********************/
+
+/* Whether c can take another request now */
+static int has_room(conn* c)
+{
+  int max = close_each ? 1 : depth;
+  return !c->closing && c->inflight < max;
+}
+
+/* Hands requests out: in the open loop the due ones, oldest first,
+   to whichever connections have room; closed, one to every
+   connection with room */
+static void dispatch(worker* w, uint64_t now)
+{
+  int k;
+
+  for (k = 0; k < w->nconns; k++)
+  {
+    conn* c = &w->conns[k];
+
+    while (has_room(c))
+    {
+      uint64_t due = now;
+
+      if (w->rate > 0 && w->bl_count == 0)
+        return;
+      if (c->state == C_CLOSED && conn_open(w, c))
+        break;
+
+      if (w->rate > 0)
+      {
+        due = w->backlog[w->bl_head];
+        w->bl_head = (w->bl_head + 1) % BACKLOG;
+        w->bl_count--;
+      }
+      conn_request(w, c, due);
+    }
+  }
+}
+
+static void* run(void* arg)
+{
+  worker* w = arg;
+  struct pollfd* pfd = calloc(w->nconns, sizeof(struct pollfd));
+  double interval = w->rate > 0 ? 1e9 / w->rate : 0;
+  uint64_t sent = 0, now, next;
+  int k, timeout;
+
+  w->backlog = w->rate > 0 ? malloc(BACKLOG * sizeof(uint64_t)) : NULL;
+
+  while ((now = now_ns()) < end_ns)
+  {
+    /* Open loop: every request that has come due joins the backlog */
+    if (w->rate > 0)
+    {
+      while ((next = start_ns + (uint64_t)(sent * interval)) <= now)
+      {
+        if (w->bl_count < BACKLOG)
+        {
+          w->backlog[(w->bl_head + w->bl_count) % BACKLOG] = next;
+          w->bl_count++;
+        }
+        else
+          w->st.dropped++;
+        sent++;
+      }
+    }
+
+    dispatch(w, now);
+
+    for (k = 0; k < w->nconns; k++)
+    {
+      conn* c = &w->conns[k];
+
+      pfd[k].fd     = c->fd;
+      pfd[k].events = 0;
+      if (c->state == C_CONNECTING)
+        pfd[k].events = POLLOUT;
+      else if (c->state == C_HANDSHAKE)
+      {
+        if (conn_handshake(w, c, &pfd[k].events) < 0)
+          pfd[k].fd = -1;
+      }
+      if (c->state == C_OPEN)
+        pfd[k].events = POLLIN | (c->out_len > c->out_off ? POLLOUT : 0);
+    }
+
+    timeout = 100;
+    if (w->rate > 0)
+    {
+      next = start_ns + (uint64_t)(sent * interval);
+      timeout = next > now ? (int)((next - now) / 1000000) : 0;
+      if (timeout > 100)
+        timeout = 100;
+    }
+
+    if (poll(pfd, w->nconns, timeout) < 0 && errno != EINTR)
+      break;
+
+    for (k = 0; k < w->nconns; k++)
+    {
+      conn* c = &w->conns[k];
+
+      if (pfd[k].revents == 0 || c->fd != pfd[k].fd)
+        continue;
+
+      if (c->state == C_CONNECTING)
+      {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0)
+        {
+          conn_fail(c, &w->st.err_connect);
+          continue;
+        }
+        c->state = use_tls ? C_HANDSHAKE : C_OPEN;
+        continue;
+      }
+
+      if (c->state != C_OPEN)
+        continue;   // The handshake goes on next time round
+      if (pfd[k].revents & (POLLOUT | POLLERR | POLLHUP))
+        conn_output(w, c);
+      if (c->state == C_OPEN &&
+          (pfd[k].revents & (POLLIN | POLLERR | POLLHUP)))
+        conn_input(w, c);
+    }
+  }
+
+  /* Time is up: what is still in flight or due didn't make it */
+  for (k = 0; k < w->nconns; k++)
+  {
+    w->st.unfinished += w->conns[k].inflight;
+    conn_close(&w->conns[k]);
+    if (w->conns[k].session != NULL)
+      SSL_SESSION_free(w->conns[k].session);
+    free(w->conns[k].out);
+  }
+  w->st.unfinished += w->bl_count;
+
+  free(w->backlog);
+  free(pfd);
+  return NULL;
+}
+
+/*********************** Reporting ***********************/
+
+static void merge(stats* sum, const stats* st)
+{
+  int b;
+
+  sum->done        += st->done;
+  sum->bytes       += st->bytes;
+  sum->connects    += st->connects;
+  sum->handshakes  += st->handshakes;
+  sum->resumed     += st->resumed;
+  sum->err_connect += st->err_connect;
+  sum->err_io      += st->err_io;
+  sum->err_parse   += st->err_parse;
+  sum->err_status  += st->err_status;
+  sum->unfinished  += st->unfinished;
+  sum->dropped     += st->dropped;
+  sum->aborted     += st->aborted;
+  if (st->max > sum->max)
+    sum->max = st->max;
+  for (b = 0; b < BUCKETS; b++)
+    sum->bucket[b] += st->bucket[b];
+}
+
+static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char* qnames[] = { "p50", "p90", "p99", "p99.9" };
+
+static void report(const stats* st, double secs, const char* addr)
+{
+  FILE* f;
+  size_t k;
+
+  printf("%s%s%s, %d connections on %d threads, %.1f s, %s, depth %d, "
+         "%s%s", label, *label ? ": " : "", addr, nconns, nthreads, secs,
+         close_each ? "a connection per request" : "keep-alive",
+         close_each ? 1 : depth, use_tls ? "https" : "http",
+         use_tls && resume ? " (resumed)" : "");
+  if (rate > 0)
+    printf(", open loop at %.0f/s", rate);
+  printf("\n  requests  %llu (%.1f/s), %.2f MB/s read\n",
+         (unsigned long long)st->done, st->done / secs,
+         st->bytes / secs / 1048576.0);
+  printf("  latency  ");
+  for (k = 0; k < sizeof(qs) / sizeof(qs[0]); k++)
+    printf(" %s %.1fus", qnames[k], quantile(st, qs[k]) / 1e3);
+  printf(" max %.1fus\n", st->max / 1e3);
+  printf("  errors    connect %llu, io %llu, bad response %llu, "
+         "status >= 400 %llu, unfinished %llu",
+         (unsigned long long)st->err_connect, (unsigned long long)st->err_io,
+         (unsigned long long)st->err_parse,
+         (unsigned long long)st->err_status,
+         (unsigned long long)st->unfinished);
+  if (st->dropped > 0)
+    printf(", dropped %llu", (unsigned long long)st->dropped);
+  printf("\n  connects  %llu", (unsigned long long)st->connects);
+  if (use_tls)
+    printf(", handshakes %llu, resumed %llu",
+           (unsigned long long)st->handshakes,
+           (unsigned long long)st->resumed);
+  if (abort_pct > 0)
+    printf(", reset on purpose %llu", (unsigned long long)st->aborted);
+  printf("\n");
+
+  if (json == NULL)
+    return;
+  if ((f = strcmp(json, "-") ? fopen(json, "a") : stdout) == NULL)
+  {
+    perror(json);
+    return;
+  }
+  fprintf(f, "{\"label\":\"%s\",\"target\":\"%s\",\"connections\":%d,"
+          "\"threads\":%d,\"seconds\":%.3f,\"keepalive\":%s,\"depth\":%d,"
+          "\"tls\":%s,\"resume\":%s,\"rate\":%.0f,\"requests\":%llu,"
+          "\"rps\":%.1f,\"bytes\":%llu,\"latency_us\":{", label, addr,
+          nconns, nthreads, secs, close_each ? "false" : "true",
+          close_each ? 1 : depth, use_tls ? "true" : "false",
+          resume ? "true" : "false", rate, (unsigned long long)st->done,
+          st->done / secs, (unsigned long long)st->bytes);
+  for (k = 0; k < sizeof(qs) / sizeof(qs[0]); k++)
+    fprintf(f, "\"%s\":%.1f,", qnames[k], quantile(st, qs[k]) / 1e3);
+  fprintf(f, "\"max\":%.1f},\"errors\":{\"connect\":%llu,\"io\":%llu,"
+          "\"response\":%llu,\"status\":%llu,\"unfinished\":%llu,"
+          "\"dropped\":%llu},\"connects\":%llu,\"handshakes\":%llu,"
+          "\"resumed\":%llu,\"aborted\":%llu}\n", st->max / 1e3,
+          (unsigned long long)st->err_connect,
+          (unsigned long long)st->err_io,
+          (unsigned long long)st->err_parse,
+          (unsigned long long)st->err_status,
+          (unsigned long long)st->unfinished,
+          (unsigned long long)st->dropped,
+          (unsigned long long)st->connects,
+          (unsigned long long)st->handshakes,
+          (unsigned long long)st->resumed,
+          (unsigned long long)st->aborted);
+  if (f != stdout)
+    fclose(f);
+}
+
+/*********************** Setup ***********************/
+
+static void usage(const char* prog)
+{
+  fprintf(stderr, "usage: %s [-c conns] [-t threads] [-d seconds] "
+          "[-p depth] [-C] [-s [-R]]\n"
+          "          [-r rate] [-u uri[=weight]]... [-P body bytes] "
+          "[-A pct] [-l label] [-j file] host:port\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+static void add_uri(const char* arg)
+{
+  char* eq;
+
+  if (nuris == URI_MAX)
+  {
+    fprintf(stderr, "At most %d URIs.\n", URI_MAX);
+    exit(EXIT_FAILURE);
+  }
+  snprintf(uris[nuris].path, sizeof(uris[nuris].path), "%s", arg);
+  uris[nuris].weight = 1;
+  if ((eq = strrchr(uris[nuris].path, '=')) != NULL &&
+      strchr(eq, '/') == NULL && atoi(eq + 1) > 0)
+  {
+    uris[nuris].weight = atoi(eq + 1);
+    *eq = '\0';
+  }
+  nuris++;
+}
+
+static int resolve(const char* arg)
+{
+  char host[256], *colon;
+  struct addrinfo hints, *res;
+
+  snprintf(host, sizeof(host), "%s", arg);
+  if ((colon = strrchr(host, ':')) == NULL)
+    return -1;
+  *colon = '\0';
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+    return -1;
+  memcpy(&target, res->ai_addr, sizeof(target));
+  freeaddrinfo(res);
+  snprintf(host_hdr, sizeof(host_hdr), "%s", arg);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  worker* workers;
+  stats sum;
+  double secs;
+  int opt, k, c;
+
+  while ((opt = getopt(argc, argv, "c:t:d:p:CsRr:u:P:A:l:j:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'c': nconns     = atoi(optarg); break;
+      case 't': nthreads   = atoi(optarg); break;
+      case 'd': seconds    = atoi(optarg); break;
+      case 'p': depth      = atoi(optarg); break;
+      case 'C': close_each = 1; break;
+      case 's': use_tls    = 1; break;
+      case 'R': resume     = 1; break;
+      case 'r': rate       = atof(optarg); break;
+      case 'u': add_uri(optarg); break;
+      case 'P': post_bytes = strtoul(optarg, NULL, 10); break;
+      case 'A': abort_pct  = atoi(optarg); break;
+      case 'l': label      = optarg; break;
+      case 'j': json       = optarg; break;
+      default:  usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || resolve(argv[optind]))
+    usage(argv[0]);
+  if (nthreads < 1 || nconns < nthreads || seconds < 1 || depth < 1 ||
+      depth > DEPTH_MAX || abort_pct < 0 || abort_pct > 100)
+  {
+    fprintf(stderr, "Need 1 <= threads <= conns, 1 <= depth <= %d, and "
+            "0 <= pct <= 100.\n", DEPTH_MAX);
+    return EXIT_FAILURE;
+  }
+  if (nuris == 0)
+    add_uri("/");
+
+  /* URIs under /cgi/ are POSTed to when -P gives a body */
+  for (k = 0; k < nuris; k++)
+  {
+    weights += uris[k].weight;
+    uris[k].post = post_bytes > 0 && !strncmp(uris[k].path, "/cgi/", 5);
+  }
+  post_body = malloc(post_bytes + 1);
+  memset(post_body, 'x', post_bytes);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (use_tls)
+  {
+    SSL_library_init();
+    SSL_load_error_strings();
+    tls = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(tls, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_mode(tls, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(tls, SSL_SESS_CACHE_CLIENT);
+  }
+
+  workers = calloc(nthreads, sizeof(worker));
+  start_ns = now_ns();
+  end_ns   = start_ns + (uint64_t)seconds * 1000000000ull;
+
+  for (k = 0; k < nthreads; k++)
+  {
+    worker* w = &workers[k];
+
+    w->id     = k;
+    w->nconns = nconns / nthreads + (k < nconns % nthreads);
+    w->conns  = calloc(w->nconns, sizeof(conn));
+    w->rate   = rate / nthreads;
+    w->rng    = 0x9e3779b97f4a7c15ull * (k + 1);
+    for (c = 0; c < w->nconns; c++)
+      w->conns[c].fd = -1;
+    pthread_create(&w->thread, NULL, run, w);
+  }
+
+  memset(&sum, 0, sizeof(sum));
+  for (k = 0; k < nthreads; k++)
+  {
+    pthread_join(workers[k].thread, NULL);
+    merge(&sum, &workers[k].st);
+    free(workers[k].conns);
+  }
+  secs = (now_ns() - start_ns) / 1e9;
+
+  report(&sum, secs, argv[optind]);
+
+  free(workers);
+  free(post_body);
+  if (tls != NULL)
+    SSL_CTX_free(tls);
+  return sum.done > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
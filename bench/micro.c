@@ -0,0 +1,658 @@
+/********************************************************************/
+/* @file micro.c                                                    */
+/*                                                                  */
+/* @brief Microbenchmarks for the request-path primitives in        */
+/* engine.c and lisod.c, run over the captured requests in          */
+/* bench/corpus (a small request, a typical browser request and     */
+/* one with a huge cookie).                                         */
+/*                                                                  */
+/* Links the server's own objects, so it measures the code lisod    */
+/* ships. Reports per call:                                         */
+/*   ns/op      best of the repeats, less the cost of the harness   */
+/*              resetting the state between calls                   */
+/*   allocs/op  calls into the allocator (alloc.c)                  */
+/*   bytes/op   bytes moved by memcpy, memmove, the str*cpy/cat     */
+/*              family and sprintf; copies the compiler inlines     */
+/*              are not seen                                        */
+/*                                                                  */
+/* The last two come from -Wl,--wrap on those symbols (Makefile).   */
+/*                                                                  */
+/* @usage: ./bench/micro [-b baseline] [-s save] [-f filter]        */
+/*                       [-r repeats] [-m ms] [-c corpus] [-p cpu]  */
+/********************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dlfcn.h>
+
+#include "../lisod.h"
+#include "../engine.h"
+#include "../alloc.h"
+#include "../config.h"
+
+#define NAME_MAX_LEN 48
+#define MAX_RESULTS  128
+
+/* A request from the corpus, with CRLF line endings */
+typedef struct sample {
+  const char* name;
+  char   text[BUF_SIZE];
+  int    len;
+  char   uri[BUF_SIZE];    // The request-target
+  char   path[BUF_SIZE];   // ... up to any '?', as service() passes it on
+} sample;
+
+/* One benchmark. prepare() runs once before the timing, reset() after
+   every call to put the state back; finish() undoes prepare(). */
+typedef struct bench {
+  const char* name;
+  int   per_sample;   // Run over each corpus request, or just once
+  void  (*prepare)(fsm* state, sample* s);
+  void  (*run)(fsm* state, sample* s);
+  void  (*reset)(fsm* state, sample* s);
+  void  (*finish)(fsm* state, sample* s);
+} bench;
+
+typedef struct result {
+  char   name[NAME_MAX_LEN];
+  double ns;
+  double allocs;
+  double bytes;
+} result;
+
+static const char* corpus_names[] = { "small", "browser", "cookie" };
+#define NSAMPLES (int)(sizeof(corpus_names) / sizeof(corpus_names[0]))
+
+static sample samples[NSAMPLES];
+static char*  ENVP[26];
+static char*  held[FREE_SIZE];   // Parse results prepare() keeps
+static void*  (*libc_memmem)(const void*, size_t, const void*, size_t);
+static volatile long sink;
+
+/* Allocator calls and bytes copied, counted while counting is set */
+static int      counting;
+static uint64_t n_allocs, n_bytes;
+
+/******************** Wrapped symbols (--wrap) ********************/
+
+void* __real_liso_malloc_acct(size_t size, int sub, size_t* acct);
+char* __real_liso_strndup_acct(const char* s, size_t n, int sub, size_t* acct);
+void* __real_memcpy(void* dst, const void* src, size_t n);
+void* __real_memmove(void* dst, const void* src, size_t n);
+char* __real_strcpy(char* dst, const char* src);
+char* __real_strncpy(char* dst, const char* src, size_t n);
+char* __real_strcat(char* dst, const char* src);
+char* __real_strncat(char* dst, const char* src, size_t n);
+
+void* __wrap_liso_malloc_acct(size_t size, int sub, size_t* acct)
+{
+  n_allocs += counting;
+  return __real_liso_malloc_acct(size, sub, acct);
+}
+
+char* __wrap_liso_strndup_acct(const char* s, size_t n, int sub, size_t* acct)
+{
+  n_allocs += counting;   // Its copy is counted by memcpy
+  return __real_liso_strndup_acct(s, n, sub, acct);
+}
+
+void* __wrap_memcpy(void* dst, const void* src, size_t n)
+{
+  if (counting)
+    n_bytes += n;
+  return __real_memcpy(dst, src, n);
+}
+
+void* __wrap_memmove(void* dst, const void* src, size_t n)
+{
+  if (counting)
+    n_bytes += n;
+  return __real_memmove(dst, src, n);
+}
+
+char* __wrap_strcpy(char* dst, const char* src)
+{
+  if (counting)
+    n_bytes += strlen(src) + 1;
+  return __real_strcpy(dst, src);
+}
+
+char* __wrap_strncpy(char* dst, const char* src, size_t n)
+{
+  if (counting)
+    n_bytes += n;
+  return __real_strncpy(dst, src, n);
+}
+
+char* __wrap_strcat(char* dst, const char* src)
+{
+  if (counting)
+    n_bytes += strlen(src) + 1;
+  return __real_strcat(dst, src);
+}
+
+char* __wrap_strncat(char* dst, const char* src, size_t n)
+{
+  if (counting)
+    n_bytes += strnlen(src, n) + 1;
+  return __real_strncat(dst, src, n);
+}
+
+int __wrap_sprintf(char* dst, const char* fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsprintf(dst, fmt, ap);
+  va_end(ap);
+  if (counting && n >= 0)
+    n_bytes += n + 1;
+  return n;
+}
+
+int __wrap_snprintf(char* dst, size_t size, const char* fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(dst, size, fmt, ap);
+  va_end(ap);
+  if (counting && n >= 0 && size > 0)
+    n_bytes += ((size_t)n < size ? (size_t)n : size - 1) + 1;
+  return n;
+}
+
+/******************** Helpers ********************/
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Puts the sample in the request buffer, as if it had just come in */
+static void load(fsm* state, sample* s)
+{
+  memset(state->request, 0, BUF_SIZE);
+  memcpy(state->request, s->text, s->len);
+  state->end_idx = s->len;
+}
+
+/* Parses the sample and keeps the results out of freebuf, so the
+   benchmark's own allocations are all that reset() frees */
+static void parse(fsm* state, sample* s)
+{
+  load(state, s);
+  if (parse_line(state) != 0 || parse_headers(state) != 0)
+  {
+    fprintf(stderr, "%s: the corpus request does not parse.\n", s->name);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(held, state->cold->freebuf, sizeof(held));
+  memset(state->cold->freebuf, 0, sizeof(held));
+}
+
+static void unparse(fsm* state, sample* s)
+{
+  (void)s;
+  delfromfree(state->cold->freebuf, FREE_SIZE);
+  delfromfree(held, FREE_SIZE);
+  state->method = state->uri = state->version = state->header = NULL;
+}
+
+static void freeall(fsm* state, sample* s)
+{
+  (void)s;
+  delfromfree(state->cold->freebuf, FREE_SIZE);
+}
+
+static void nothing(fsm* state, sample* s)
+{
+  (void)state; (void)s;
+}
+
+/******************** The benchmarks ********************/
+
+static void run_parse_line(fsm* state, sample* s)
+{
+  (void)s;
+  sink += parse_line(state);
+}
+
+static void prep_parse_headers(fsm* state, sample* s)
+{
+  load(state, s);
+  state->method = "GET";
+}
+
+static void run_parse_headers(fsm* state, sample* s)
+{
+  (void)s;
+  sink += parse_headers(state);
+}
+
+/* relay_body() over a 4 KB POST body, framed by Content-Length or in
+   512-byte chunks, with no CGI to take it (cgi_in -1 drops it) */
+#define BODY_BYTES 4096
+#define CHUNK_BYTES 512
+
+static char body_length[BODY_BYTES];
+static char body_chunked[BODY_BYTES + (BODY_BYTES / CHUNK_BYTES + 1) * 16];
+static int  chunked_len;
+
+static void make_bodies(void)
+{
+  int off = 0;
+
+  memset(body_length, 'x', sizeof(body_length));
+  for (int i = 0; i < BODY_BYTES / CHUNK_BYTES; i++)
+  {
+    off += sprintf(body_chunked + off, "%x\r\n", CHUNK_BYTES);
+    memset(body_chunked + off, 'x', CHUNK_BYTES);
+    off += CHUNK_BYTES;
+    off += sprintf(body_chunked + off, "\r\n");
+  }
+  off += sprintf(body_chunked + off, "0\r\n\r\n");
+  chunked_len = off;
+}
+
+static void reset_length(fsm* state, sample* s)
+{
+  (void)s;
+  memcpy(state->request, body_length, BODY_BYTES);
+  state->end_idx    = BODY_BYTES;
+  state->cgi_in     = -1;
+  state->body_size  = BODY_BYTES;
+  state->body_left  = BODY_BYTES;
+  state->body_state = BODY_LENGTH;
+}
+
+static void reset_chunked(fsm* state, sample* s)
+{
+  (void)s;
+  memcpy(state->request, body_chunked, chunked_len);
+  state->end_idx    = chunked_len;
+  state->cgi_in     = -1;
+  state->body_size  = 0;
+  state->body_state = BODY_CHUNK_SIZE;
+}
+
+static void run_relay_body(fsm* state, sample* s)
+{
+  (void)s;
+  sink += relay_body(state);
+}
+
+/* resetbuf() with a second, small request pipelined behind the first */
+static void reset_pipelined(fsm* state, sample* s)
+{
+  memcpy(state->request, s->text, s->len);
+  memcpy(state->request + s->len, samples[0].text, samples[0].len);
+  state->end_idx = s->len + samples[0].len;
+}
+
+static void run_resetbuf(fsm* state, sample* s)
+{
+  (void)s;
+  sink += resetbuf(state);
+}
+
+static void run_mimetype(fsm* state, sample* s)
+{
+  char type[BUF_SIZE];
+
+  (void)state;
+  sink += mimetype(s->uri, strlen(s->uri), type);
+}
+
+static void run_search_hit(fsm* state, sample* s)
+{
+  (void)s;
+  sink += search_hdr(state, "Host: ", strlen("Host: ")) != NULL;
+}
+
+static void run_search_miss(fsm* state, sample* s)
+{
+  (void)s;
+  sink += search_hdr(state, "Accept-Charset: ",
+                     strlen("Accept-Charset: ")) != NULL;
+}
+
+static void run_genenv(fsm* state, sample* s)
+{
+  genenv(ENVP, state, s->path, 0);
+}
+
+
+/* memmem() as parse_line() uses it, engine.c's own against libc's */
+static void run_memmem(fsm* state, sample* s)
+{
+  (void)state;
+  sink += (char*)memmem(s->text, s->len, "\r\n\r\n", 4) - s->text;
+}
+
+static void run_memmem_libc(fsm* state, sample* s)
+{
+  (void)state;
+  sink += (char*)libc_memmem(s->text, s->len, "\r\n\r\n", 4) - s->text;
+}
+
+static void run_client_error(fsm* state, sample* s)
+{
+  (void)s;
+  client_error(state, 404);
+}
+
+static void reset_response(fsm* state, sample* s)
+{
+  (void)s;
+  state->resp_idx = 0;
+}
+
+static bench benches[] = {
+  { "parse_line",      1, load,               run_parse_line,    freeall,        nothing },
+  { "parse_headers",   1, prep_parse_headers, run_parse_headers, freeall,        nothing },
+  { "relay_body/length",  0, reset_length,    run_relay_body,    reset_length,   nothing },
+  { "relay_body/chunked", 0, reset_chunked,   run_relay_body,    reset_chunked,  nothing },
+  { "resetbuf",        1, reset_pipelined,    run_resetbuf,      reset_pipelined, nothing },
+  { "mimetype",        1, nothing,            run_mimetype,      nothing,        nothing },
+  { "search_hdr/hit",  1, parse,              run_search_hit,    nothing,        unparse },
+  { "search_hdr/miss", 1, parse,              run_search_miss,   nothing,        unparse },
+  { "genenv",          1, parse,              run_genenv,        freeall,        unparse },
+  { "memmem",          1, nothing,            run_memmem,        nothing,        nothing },
+  { "memmem/libc",     1, nothing,            run_memmem_libc,   nothing,        nothing },
+  { "client_error",    0, nothing,            run_client_error,  reset_response, nothing },
+};
+#define NBENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+/******************** Corpus ********************/
+
+/* Reads dir/name.http; the files are kept with LF line endings */
+static int load_sample(const char* dir, const char* name, sample* s)
+{
+  char file[BUF_SIZE];
+  char raw[BUF_SIZE];
+  FILE* f;
+  size_t n;
+  char* end;
+
+  snprintf(file, sizeof(file), "%s/%s.http", dir, name);
+  if ((f = fopen(file, "r")) == NULL)
+  {
+    perror(file);
+    return -1;
+  }
+  n = fread(raw, 1, sizeof(raw) - 1, f);
+  fclose(f);
+
+  s->name = name;
+  s->len  = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (raw[i] == '\n' && (i == 0 || raw[i - 1] != '\r'))
+      s->text[s->len++] = '\r';
+    s->text[s->len++] = raw[i];
+    if (s->len >= BUF_SIZE - 2)
+    {
+      fprintf(stderr, "%s: longer than a request buffer.\n", file);
+      return -1;
+    }
+  }
+  s->text[s->len] = '\0';
+
+  /* The request-target is the second token of the request line */
+  if (sscanf(s->text, "%*s %8191s", s->uri) != 1)
+  {
+    fprintf(stderr, "%s: no request line.\n", file);
+    return -1;
+  }
+  strcpy(s->path, s->uri);
+  if ((end = strchr(s->path, '?')) != NULL)
+    *end = '\0';
+  return 0;
+}
+
+/******************** Timing ********************/
+
+/* n calls with a reset after each, or (run NULL) just the resets */
+static uint64_t timed(bench* b, fsm* state, sample* s, long n, int calls)
+{
+  uint64_t start = now_ns();
+
+  if (calls)
+    for (long i = 0; i < n; i++)
+    {
+      b->run(state, s);
+      b->reset(state, s);
+    }
+  else
+    for (long i = 0; i < n; i++)
+      b->reset(state, s);
+
+  return now_ns() - start;
+}
+
+static void measure(bench* b, fsm* state, sample* s, int repeats, int ms,
+                    result* r)
+{
+  long n = 1;
+  double best = -1;
+
+  b->prepare(state, s);
+
+  /* What one call allocates and copies */
+  n_allocs = n_bytes = 0;
+  counting = 1;
+  b->run(state, s);
+  counting = 0;
+  b->reset(state, s);
+  r->allocs = (double)n_allocs;
+  r->bytes  = (double)n_bytes;
+
+  /* Enough calls to fill ms milliseconds */
+  while (timed(b, state, s, n, 1) < (uint64_t)ms * 1000000 / 4 && n < (1L << 30))
+    n *= 2;
+  n *= 4;
+
+  for (int k = 0; k < repeats; k++)
+  {
+    double with    = (double)timed(b, state, s, n, 1);
+    double without = (double)timed(b, state, s, n, 0);
+    double ns      = (with - without) / n;
+
+    if (best < 0 || ns < best)
+      best = ns;
+  }
+  r->ns = best > 0 ? best : 0;
+
+  b->finish(state, s);
+}
+
+/******************** Baselines ********************/
+
+static int load_baseline(const char* file, result* base, int max)
+{
+  FILE* f = fopen(file, "r");
+  char line[256];
+  int n = 0;
+
+  if (f == NULL)
+    return -1;
+
+  while (n < max && fgets(line, sizeof(line), f) != NULL)
+  {
+    if (line[0] == '#')
+      continue;
+    if (sscanf(line, "%47s %lf %lf %lf", base[n].name, &base[n].ns,
+               &base[n].allocs, &base[n].bytes) == 4)
+      n++;
+  }
+  fclose(f);
+  return n;
+}
+
+static result* find(result* base, int n, const char* name)
+{
+  for (int i = 0; i < n; i++)
+    if (!strcmp(base[i].name, name))
+      return &base[i];
+  return NULL;
+}
+
+static void usage(const char* prog)
+{
+  fprintf(stderr, "usage: %s [-b baseline] [-s save] [-f filter] [-r repeats]"
+          " [-m ms] [-c corpus] [-p cpu]\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+  const char* corpus = "bench/corpus";
+  const char* basefile = NULL; const char* savefile = NULL;
+  const char* filter = NULL;
+  int repeats = 5, ms = 20, cpu = -1;
+  result results[MAX_RESULTS]; result base[MAX_RESULTS];
+  int nresults = 0, nbase = 0;
+  fsm* state = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:s:f:r:m:c:p:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'b': basefile = optarg; break;
+      case 's': savefile = optarg; break;
+      case 'f': filter   = optarg; break;
+      case 'r': repeats  = atoi(optarg); break;
+      case 'm': ms       = atoi(optarg); break;
+      case 'c': corpus   = optarg; break;
+      case 'p': cpu      = atoi(optarg); break;
+      default:  usage(argv[0]);
+    }
+  }
+  if (repeats < 1 || ms < 1)
+    usage(argv[0]);
+
+  /* One CPU, so the repeats see the same caches and clock */
+  if (cpu >= 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+      perror("sched_setaffinity");
+  }
+
+  config_load();
+  alloc_init();
+  cgi_env_init();
+  make_bodies();
+
+  if ((libc_memmem = dlsym(RTLD_NEXT, "memmem")) == NULL)
+  {
+    fprintf(stderr, "libc's memmem not found: %s\n", dlerror());
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < NSAMPLES; i++)
+    if (load_sample(corpus, corpus_names[i], &samples[i]) < 0)
+      return EXIT_FAILURE;
+
+  if (posix_memalign((void**)&state, CACHE_LINE, sizeof(fsm)) != 0)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    return EXIT_FAILURE;
+  }
+  memset(state, 0, sizeof(fsm));
+  if ((state->cold = calloc(1, sizeof(fsm_cold))) == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    return EXIT_FAILURE;
+  }
+  state->request  = state->cold->request;
+  state->response = state->cold->response;
+  state->www      = "www";
+  state->fd       = -1;
+  state->pipefds  = -1;
+  state->body_fd  = -1;
+  state->cgi_in   = -1;
+  state->conn     = 1;
+  strcpy(state->cold->cli_ip, "127.0.0.1");
+
+  if (basefile != NULL && (nbase = load_baseline(basefile, base, MAX_RESULTS)) < 0)
+  {
+    printf("No baseline in %s yet; save one with -s %s\n\n", basefile, basefile);
+    nbase = 0;
+  }
+
+  printf("%-28s %10s %10s %10s", "benchmark", "ns/op", "allocs/op", "bytes/op");
+  if (nbase > 0)
+    printf(" %9s %7s %7s", "ns", "allocs", "bytes");
+  printf("\n");
+
+  for (int b = 0; b < NBENCHES; b++)
+  {
+    for (int i = 0; i < (benches[b].per_sample ? NSAMPLES : 1); i++)
+    {
+      result* r = &results[nresults];
+      result* old;
+
+      if (benches[b].per_sample)
+        snprintf(r->name, sizeof(r->name), "%s/%s", benches[b].name,
+                 samples[i].name);
+      else
+        snprintf(r->name, sizeof(r->name), "%s", benches[b].name);
+
+      if (filter != NULL && strstr(r->name, filter) == NULL)
+        continue;
+
+      measure(&benches[b], state, &samples[i], repeats, ms, r);
+      nresults++;
+
+      printf("%-28s %10.1f %10.0f %10.0f", r->name, r->ns, r->allocs, r->bytes);
+      if ((old = find(base, nbase, r->name)) != NULL)
+      {
+        if (old->ns > 0)
+          printf(" %+8.1f%%", 100.0 * (r->ns - old->ns) / old->ns);
+        else
+          printf(" %9s", "-");
+        printf(" %+7.0f %+7.0f", r->allocs - old->allocs, r->bytes - old->bytes);
+      }
+      else if (nbase > 0)
+        printf(" %9s", "new");
+      printf("\n");
+      fflush(stdout);
+    }
+  }
+
+  if (savefile != NULL)
+  {
+    FILE* f = fopen(savefile, "w");
+
+    if (f == NULL)
+    {
+      perror(savefile);
+      return EXIT_FAILURE;
+    }
+    fprintf(f, "# name ns/op allocs/op bytes/op\n");
+    for (int i = 0; i < nresults; i++)
+      fprintf(f, "%s %.1f %.0f %.0f\n", results[i].name, results[i].ns,
+              results[i].allocs, results[i].bytes);
+    fclose(f);
+    printf("\nSaved %d results to %s\n", nresults, savefile);
+  }
+
+  (void)sink;
+  return EXIT_SUCCESS;
+}
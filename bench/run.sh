@@ -0,0 +1,111 @@
+#!/bin/sh
+#
+# @file   bench/run.sh
+# @author Fadhil Abubaker
+#
+# make bench: starts lisod on a generated www fixture and runs the
+# standard load scenarios against it on localhost with bench/loadgen.
+# Results go to stdout, and one line of JSON per scenario to
+# $BENCH_JSON (bench/results.json). It exits non-zero if a scenario
+# completed no requests.
+#
+# BENCH_SECONDS   seconds per scenario (5)
+# BENCH_CONNS     connections (32)
+# BENCH_THREADS   loadgen threads (2)
+# BENCH_RATE      requests per second for the open-loop run (5000)
+# BENCH_HTTP, BENCH_HTTPS  ports lisod listens on (18180, 18543)
+
+SECONDS_EACH=${BENCH_SECONDS:-5}
+CONNS=${BENCH_CONNS:-32}
+THREADS=${BENCH_THREADS:-2}
+RATE=${BENCH_RATE:-5000}
+HTTP=${BENCH_HTTP:-18180}
+HTTPS=${BENCH_HTTPS:-18543}
+JSON=${BENCH_JSON:-bench/results.json}
+
+FIX=$(mktemp -d "${TMPDIR:-/tmp}/lisod-bench.XXXXXX") || exit 1
+LISOD_PID=
+
+finish() {
+  [ -n "$LISOD_PID" ] && kill -INT "$LISOD_PID" 2>/dev/null
+  rm -rf "$FIX"
+}
+trap finish EXIT INT TERM
+
+# The fixture: a typical page, a tiny file, a large one, and a script
+mkdir -p "$FIX/www"
+awk 'BEGIN { print "<html><head><title>lisod</title></head><body>";
+             for (i = 0; i < 60; i++)
+               print "<p>The quick brown fox jumps over the lazy dog.</p>";
+             print "</body></html>" }' > "$FIX/www/index.html"
+printf 'ok\n' > "$FIX/www/small.txt"
+head -c 1048576 /dev/zero > "$FIX/www/big.bin"
+cat > "$FIX/cgi.sh" <<'EOF'
+#!/bin/sh
+[ -n "$CONTENT_LENGTH" ] && head -c "$CONTENT_LENGTH" > /dev/null
+printf 'Content-Type: text/plain\r\n\r\nhello from cgi\n'
+EOF
+chmod +x "$FIX/cgi.sh"
+
+if ! openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+     -keyout "$FIX/bench.key" -out "$FIX/bench.crt" >/dev/null 2>&1; then
+  echo "openssl could not make a certificate for the fixture" >&2
+  exit 1
+fi
+
+./lisod "$HTTP" "$HTTPS" "$FIX/lisod.log" "$FIX/lisod.lock" "$FIX/www" \
+  "$FIX/cgi.sh" "$FIX/bench.key" "$FIX/bench.crt" >"$FIX/lisod.out" 2>&1 &
+LISOD_PID=$!
+
+# Wait for it to listen
+i=0
+until ./bench/loadgen -c 1 -d 1 -u /small.txt "127.0.0.1:$HTTP" \
+      >/dev/null 2>&1; do
+  i=$((i + 1))
+  if [ $i -ge 20 ] || ! kill -0 "$LISOD_PID" 2>/dev/null; then
+    echo "lisod did not start:" >&2
+    cat "$FIX/lisod.out" >&2
+    exit 1
+  fi
+  sleep 0.2
+done
+
+: > "$JSON"
+FAILED=0
+
+run() {
+  name=$1
+  shift
+  if ! kill -0 "$LISOD_PID" 2>/dev/null; then
+    echo "$name: skipped, lisod is gone" >&2
+    FAILED=1
+    return
+  fi
+  ./bench/loadgen -d "$SECONDS_EACH" -t "$THREADS" -l "$name" -j "$JSON" \
+    "$@" || FAILED=1
+  # A scenario that got nothing through measured nothing
+  if tail -1 "$JSON" | grep -q '"requests":0,'; then
+    echo "$name: FAILED, no request completed" >&2
+    FAILED=1
+  fi
+  echo
+}
+
+H=127.0.0.1:$HTTP
+S=127.0.0.1:$HTTPS
+
+run static-keepalive   -c "$CONNS" -u /index.html "$H"
+run static-pipelined   -c "$CONNS" -p 8 -u /index.html "$H"
+run static-close       -c "$CONNS" -C -u /index.html "$H"
+run static-large       -c "$CONNS" -u /big.bin "$H"
+run static-mix         -c "$CONNS" -u /index.html=8 -u /small.txt=4 \
+                       -u /big.bin=1 "$H"
+run cgi-mix            -c "$CONNS" -u /index.html=9 -u /cgi/bench=1 \
+                       -P 256 "$H"
+run static-open-loop   -c "$CONNS" -r "$RATE" -u /index.html "$H"
+run https-keepalive    -c "$CONNS" -s -u /index.html "$S"
+run https-close        -c "$CONNS" -s -C -u /index.html "$S"
+run https-resumed      -c "$CONNS" -s -C -R -u /index.html "$S"
+
+echo "Results: $JSON"
+exit $FAILED
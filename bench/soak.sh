@@ -0,0 +1,265 @@
+#!/bin/sh
+#
+# @file   bench/soak.sh
+# @author Fadhil Abubaker
+#
+# make soak: drives lisod for hours with mixed traffic and fails if
+# its memory, descriptors or live allocations trend upward.
+#
+# The traffic runs concurrently for the whole soak, each stream at a
+# fixed rate with bench/loadgen: static files over keep-alive, CGI GETs,
+# POSTs to a CGI, HTTPS a connection per request with resumption, and
+# clients that reset their connection part way through a request or a
+# TLS handshake (loadgen -A).
+#
+# Every SOAK_INTERVAL seconds it samples lisod's RSS and open
+# descriptors from /proc/<pid>, and the allocator's live blocks and
+# bytes in use from the stats SIGUSR1 writes to the log. The samples
+# go to $SOAK_CSV (bench/soak.csv). Once the warm-up is over, a
+# least-squares line is fitted to each series. The soak fails if that
+# line grows by more than the series' slack, plus twice the scatter of
+# the samples about it, over the run; if lisod exits; if it holds
+# more descriptors once idle than before the traffic started; or if a
+# stream completed no requests, or failed more than it completed (from
+# loadgen -j): a soak whose traffic never got through proves nothing.
+#
+# SOAK_SECONDS    length of the traffic (7200)
+# SOAK_INTERVAL   seconds between samples (30)
+# SOAK_WARMUP     % of the samples left out of the fit (25)
+# SOAK_RATE       requests per second per static stream; the ones that
+#                 run the CGI or a TLS handshake per request get a
+#                 quarter of it (200)
+# SOAK_RSS_SLACK  KB of RSS growth allowed (2048)
+# SOAK_FD_SLACK   descriptors of growth allowed (2)
+# SOAK_ALLOC_SLACK  live allocations of growth allowed (256)
+# SOAK_BYTES_SLACK  bytes in use of growth allowed (262144)
+# SOAK_HTTP, SOAK_HTTPS  ports lisod listens on (18280, 18643)
+
+DURATION=${SOAK_SECONDS:-7200}
+INTERVAL=${SOAK_INTERVAL:-30}
+WARMUP=${SOAK_WARMUP:-25}
+RATE=${SOAK_RATE:-200}
+RSS_SLACK=${SOAK_RSS_SLACK:-2048}
+FD_SLACK=${SOAK_FD_SLACK:-2}
+ALLOC_SLACK=${SOAK_ALLOC_SLACK:-256}
+BYTES_SLACK=${SOAK_BYTES_SLACK:-262144}
+HTTP=${SOAK_HTTP:-18280}
+HTTPS=${SOAK_HTTPS:-18643}
+CSV=${SOAK_CSV:-bench/soak.csv}
+
+FIX=$(mktemp -d "${TMPDIR:-/tmp}/lisod-soak.XXXXXX") || exit 1
+LISOD_PID=
+LOADS=
+NLOADS=0
+
+finish() {
+  for pid in $LOADS; do kill "$pid" 2>/dev/null; done
+  [ -n "$LISOD_PID" ] && kill -INT "$LISOD_PID" 2>/dev/null
+  rm -rf "$FIX"
+}
+trap finish EXIT INT TERM
+
+# The fixture: a page, a tiny file, a large one, and a script that
+# reads its body
+mkdir -p "$FIX/www"
+awk 'BEGIN { print "<html><head><title>lisod</title></head><body>";
+             for (i = 0; i < 60; i++)
+               print "<p>The quick brown fox jumps over the lazy dog.</p>";
+             print "</body></html>" }' > "$FIX/www/index.html"
+printf 'ok\n' > "$FIX/www/small.txt"
+head -c 262144 /dev/zero > "$FIX/www/big.bin"
+cat > "$FIX/cgi.sh" <<'EOF'
+#!/bin/sh
+[ -n "$CONTENT_LENGTH" ] && head -c "$CONTENT_LENGTH" > /dev/null
+printf 'Content-Type: text/plain\r\n\r\nhello from cgi %s\n' "$QUERY_STRING"
+EOF
+chmod +x "$FIX/cgi.sh"
+
+if ! openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+     -keyout "$FIX/soak.key" -out "$FIX/soak.crt" >/dev/null 2>&1; then
+  echo "openssl could not make a certificate for the fixture" >&2
+  exit 1
+fi
+
+./lisod "$HTTP" "$HTTPS" "$FIX/lisod.log" "$FIX/lisod.lock" "$FIX/www" \
+  "$FIX/cgi.sh" "$FIX/soak.key" "$FIX/soak.crt" >"$FIX/lisod.out" 2>&1 &
+LISOD_PID=$!
+
+# Wait for it to listen
+i=0
+until ./bench/loadgen -c 1 -d 1 -u /small.txt "127.0.0.1:$HTTP" \
+      >/dev/null 2>&1; do
+  i=$((i + 1))
+  if [ $i -ge 20 ] || ! kill -0 "$LISOD_PID" 2>/dev/null; then
+    echo "lisod did not start:" >&2
+    cat "$FIX/lisod.out" >&2
+    exit 1
+  fi
+  sleep 0.2
+done
+
+START=$(date +%s)
+
+# One sample: seconds in, RSS (KB), descriptors, live allocations and
+# bytes in use. 1 if lisod is gone.
+sample() {
+  kill -0 "$LISOD_PID" 2>/dev/null || return 1
+  kill -USR1 "$LISOD_PID"
+  sleep 1
+  rss=$(awk '/^VmRSS:/ { print $2 }' "/proc/$LISOD_PID/status" 2>/dev/null)
+  fds=$(ls "/proc/$LISOD_PID/fd" 2>/dev/null | wc -l)
+  alloc=$(awk '$1 == "total" { live = $2 - $3; bytes = $NF }
+               END { print live, bytes }' "$FIX/lisod.log")
+  [ -n "$rss" ] || return 1
+  echo "$(( $(date +%s) - START )),$rss,$fds,${alloc% *},${alloc#* }"
+}
+
+echo "time_s,rss_kb,fds,live_allocs,bytes_in_use" > "$CSV"
+if ! IDLE=$(sample); then
+  echo "lisod exited before the traffic started" >&2
+  exit 1
+fi
+echo "$IDLE" >> "$CSV"
+
+H=127.0.0.1:$HTTP
+S=127.0.0.1:$HTTPS
+
+CGI_RATE=$((RATE / 4 > 0 ? RATE / 4 : 1))
+
+load() {
+  r=$1
+  shift
+  ./bench/loadgen -d "$DURATION" -r "$r" -j "$FIX/loadgen.json" "$@" \
+    >> "$FIX/loadgen.out" 2>&1 &
+  LOADS="$LOADS $!"
+  NLOADS=$((NLOADS + 1))
+}
+
+load "$RATE"     -l static    -c 8 -u /index.html=8 -u /small.txt=4 \
+                              -u /big.bin=1 "$H"
+load "$CGI_RATE" -l cgi-get   -c 4 -u /cgi/soak?a=1=3 -u /index.html=1 "$H"
+load "$CGI_RATE" -l cgi-post  -c 4 -u /cgi/soak=1 -P 4096 "$H"
+load "$CGI_RATE" -l https     -c 4 -s -C -R -u /index.html "$S"
+load "$CGI_RATE" -l reset     -c 4 -A 50 -u /index.html -u /cgi/soak \
+                              -P 8192 "$H"
+load "$CGI_RATE" -l tls-reset -c 4 -s -A 50 -u /index.html "$S"
+TRAFFIC=$(date +%s)
+
+echo "Soaking lisod (pid $LISOD_PID) for ${DURATION}s, sampling every" \
+     "${INTERVAL}s into $CSV"
+echo "$IDLE" | awk -F, '{ printf "  idle: rss %d KB, %d fds, %d live" \
+                          " allocations, %d bytes in use\n", $2, $3, $4, $5 }'
+
+# Only samples taken under load go into the fit
+DIED=0
+END=$((TRAFFIC + DURATION))
+while [ $(( $(date +%s) + INTERVAL + 1 )) -lt "$END" ]; do
+  sleep "$INTERVAL"
+  if ! line=$(sample); then
+    DIED=1
+    break
+  fi
+  echo "$line" >> "$CSV"
+  echo "$line" | awk -F, '{ printf "  %6ds: rss %d KB, %d fds, %d live" \
+                            " allocations, %d bytes in use\n",
+                            $1, $2, $3, $4, $5 }'
+done
+
+for pid in $LOADS; do wait "$pid"; done
+LOADS=
+
+if [ $DIED -eq 0 ]; then
+  sleep 5   # Let CGIs finish and keep-alive connections close
+  if ! AFTER=$(sample); then
+    DIED=1
+  fi
+fi
+
+echo
+cat "$FIX/loadgen.out"
+
+if [ $DIED -ne 0 ]; then
+  echo "FAIL: lisod exited during the soak:" >&2
+  tail -20 "$FIX/lisod.out" >&2
+  exit 1
+fi
+
+# Each stream's outcome: errors are the requests that failed, not the
+# ones cut short on purpose (-A) or still out when the run ended
+touch "$FIX/loadgen.json"
+STREAMS=$(awk -v nloads="$NLOADS" '
+  function field(name,   m) {
+    if (!match($0, "\"" name "\":[0-9]+"))
+      return 0
+    m = substr($0, RSTART, RLENGTH)
+    sub(/.*:/, "", m)
+    return m + 0
+  }
+  {
+    match($0, /"label":"[^"]*"/)
+    label = substr($0, RSTART + 9, RLENGTH - 10)
+    done  = field("requests")
+    errs  = field("connect") + field("io") + field("response") + field("status")
+    bad   = done == 0 || errs > done
+    failed += bad
+    printf "%-13s %12d requests, %d failed  %s\n", label, done, errs,
+           bad ? "BROKEN" : "ok"
+  }
+  END {
+    if (NR < nloads) {
+      printf "%-13s %d of %d streams reported  BROKEN\n", "loadgen", NR,
+             nloads
+      failed++
+    }
+    print failed + 0
+  }' "$FIX/loadgen.json")
+BROKEN=$(echo "$STREAMS" | tail -1)
+echo "$STREAMS" | sed '$d'
+
+# The fit, over the samples under load after the warm-up
+awk -F, -v warmup="$WARMUP" -v rss="$RSS_SLACK" -v fd="$FD_SLACK" \
+    -v alloc="$ALLOC_SLACK" -v bytes="$BYTES_SLACK" \
+    -v idle="$IDLE" -v after="$AFTER" -v broken="$BROKEN" '
+  BEGIN  { n = 0 }
+  NR > 2 { t[n] = $1; for (k = 2; k <= 5; k++) v[k, n] = $k; n++ }
+  END {
+    split("rss_kb fds live_allocs bytes_in_use", name, " ")
+    slack[2] = rss; slack[3] = fd; slack[4] = alloc; slack[5] = bytes
+    first = int(n * warmup / 100)
+    if (n - first < 3) {
+      printf "Too few samples to fit (%d after the warm-up); run longer " \
+             "or sample more often\n", n - first
+      exit 1
+    }
+    failed = 0
+    for (k = 2; k <= 5; k++) {
+      st = sv = stt = stv = 0; m = n - first
+      for (i = first; i < n; i++) {
+        st += t[i]; sv += v[k, i]; stt += t[i] * t[i]; stv += t[i] * v[k, i]
+      }
+      slope  = (m * stv - st * sv) / (m * stt - st * st)
+      growth = slope * (t[n - 1] - t[first])
+
+      # Samples under load scatter with the requests in flight
+      ss = 0
+      for (i = first; i < n; i++) {
+        r = v[k, i] - (sv / m + slope * (t[i] - st / m))
+        ss += r * r
+      }
+      noise  = sqrt(ss / (m - 2))
+      bad    = growth > slack[k] + 2 * noise
+      failed += bad
+      printf "%-13s %12.0f -> %12.0f  fitted growth %+12.1f  " \
+             "(slack %d, noise %.1f)  %s\n", name[k - 1], v[k, first],
+             v[k, n - 1], growth, slack[k], noise, bad ? "GROWING" : "ok"
+    }
+    split(idle, i0, ","); split(after, i1, ",")
+    printf "%-13s %12d -> %12d  idle, before and after the traffic  %s\n",
+           "fds", i0[3], i1[3], (i1[3] - i0[3] > fd) ? "LEAKED" : "ok"
+    failed += (i1[3] - i0[3] > fd)
+    printf "%-13s %12d -> %12d  idle, before and after the traffic\n",
+           "live_allocs", i0[4], i1[4]
+    failed += broken
+    print failed ? "FAIL" : "PASS"
+    exit failed ? 1 : 0
+  }' "$CSV"
@@ -0,0 +1,593 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file cgi.c                                                     */
+/*                                                                 */
+/* @brief CGI process admission and lifecycle. At most             */
+/* LISO_CGI_MAX scripts run at once; requests beyond that wait,    */
+/* in the order they came, for a running one to exit, and get a    */
+/* 503 if that takes longer than LISO_CGI_WAIT ms (or at once if   */
+/* LISO_CGI_QUEUE are already waiting). Each script is watched     */
+/* through a pidfd in the select set, so its exit is seen by the   */
+/* event loop like any other event, and one still running after    */
+/* LISO_CGI_TIMEOUT seconds is killed. SIGCHLD is blocked and read */
+/* from a signalfd: children are reaped in the loop, not in a      */
+/* signal handler, and select() is never interrupted by them.      */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+
+#include "cgi.h"
+#include "flight.h"
+#include "engine.h"
+#include "fcgi.h"
+#include "zygote.h"
+#include "alloc.h"
+#include "config.h"
+#include "logger.h"
+#include "metrics.h"
+#include "scoreboard.h"
+#include "probes.h"
+#include "util.h"
+
+extern FILE* logfile;
+extern char* cgipath;
+
+cgi_counters cgi_stats;
+
+static pool*     cpool;
+static int       sigfd = -1;   /* SIGCHLD, read in the event loop */
+static int       live;         /* Scripts running */
+
+static cgi_wait* waitq;        /* Ring of config.cgi_queue entries */
+static int       wait_head;
+static int       wait_count;
+static int       admitting;    /* admit() is on the stack */
+static uint64_t  run_start[MAX_CLIENTS]; /* metrics_clock() at spawn, or
+                                            trace_clock() */
+
+/* A pidfd on pid, or -1 where the kernel has none */
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+/* Signals a script through its pidfd, which can't hit a recycled pid
+   (the zygote reaps its children, so we never know when one is gone).
+   Only our own children, unreaped until cgi_reap(), go by pid */
+static void signal_pid(pid_t pid, int pidfd, int sig)
+{
+#ifdef SYS_pidfd_send_signal
+  if (pidfd >= 0)
+  {
+    syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+    return;
+  }
+#endif
+  if (pid > 0)
+    kill(pid, sig);
+}
+
+static void signal_cgi(fsm* cgi, int sig)
+{
+  signal_pid(cgi->pid, cgi->pidfd, sig);
+}
+
+/*******************************************************************/
+/* @brief Blocks SIGCHLD in favour of a signalfd in p's select set */
+/* and sizes the wait queue. Call before anything is forked that   */
+/* shouldn't inherit the blocked mask.                             */
+/*                                                                 */
+/* @retval 0 on success, -1 on failure                             */
+/*******************************************************************/
+int cgi_init(pool* p)
+{
+  sigset_t mask;
+
+  cpool = p;
+
+  if (config.cgi_queue > 0 &&
+      (waitq = liso_malloc(config.cgi_queue * sizeof(cgi_wait))) == NULL)
+    return -1;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1 ||
+      (sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+    return -1;
+
+  FD_SET(sigfd, &p->masterfds);
+  if (sigfd > p->maxfd)
+    p->maxfd = sigfd;
+
+  return 0;
+}
+
+/*****************************************************************/
+/* @brief Starts the script with in_fd and out_fd as its stdin   */
+/* and stdout. With a zygote, it forks the child, and *pidfd is  */
+/* the zygote's pidfd on it; otherwise *pidfd is -1 and it is    */
+/* started with posix_spawn(), which glibc implements with       */
+/* clone(CLONE_VM|CLONE_VFORK): the child runs on our memory     */
+/* until it exec's, instead of fork() copying page tables that   */
+/* grow with the connection table.                               */
+/*                                                               */
+/* @retval 0 on success, -1 on failure                           */
+/*****************************************************************/
+static int spawn(char** envp, int in_fd, int out_fd, pid_t* pid,
+                 int* pidfd)
+{
+  char* argv[2] = {cgipath, NULL};
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t sigdef, none;
+  uint64_t started = metrics_clock();
+  metrics_hw hw;
+  int rc;
+
+  metrics_hw_start(&hw);
+  *pidfd = -1;
+  if (zygote_enabled() && zygote_spawn(envp, in_fd, out_fd, pid, pidfd) == 0)
+  {
+    metrics_since(METRIC_CGI_SPAWN, started);
+    metrics_hw_since(METRIC_CGI_SPAWN, &hw);
+    return 0;
+  }
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+
+  /* We ignore SIGPIPE and block SIGCHLD; the script shouldn't */
+  posix_spawnattr_init(&attr);
+  sigemptyset(&sigdef);
+  sigaddset(&sigdef, SIGPIPE);
+  sigemptyset(&none);
+  posix_spawnattr_setsigdefault(&attr, &sigdef);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+                           POSIX_SPAWN_SETSIGMASK);
+
+  rc = posix_spawn(pid, cgipath, &actions, &attr, argv, envp);
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  metrics_since(METRIC_CGI_SPAWN, started);
+  metrics_hw_since(METRIC_CGI_SPAWN, &hw);
+
+  if (rc != 0)
+  {
+    errno = rc;
+    execve_error_handler();
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Starts watching a script that was just started for cgi slot cgi,
+   through the pidfd spawn() gave, or one opened on our own child;
+   spawned is the trace_clock() from before it was started */
+static void track(fsm* cgi, pid_t pid, int pidfd, uint64_t spawned)
+{
+  cgi->pid         = pid;
+  cgi->pidfd       = pidfd >= 0 ? pidfd : open_pidfd(pid);
+  cgi->timed_out   = 0;
+  cgi->last_active = time(NULL);   // Its run time counts from here
+  run_start[cgi - cpool->states] =
+    metrics_enabled() ? metrics_clock() : trace_clock();
+  if (trace_on(cgi, cgi->seq))
+    trace_emit(TRACE_CGI_SPAWN, cgi->cold->id, cgi->seq, spawned, pid);
+
+  if (cgi->pidfd >= 0)
+  {
+    FD_SET(cgi->pidfd, &cpool->masterfds);
+    if (cgi->pidfd > cpool->maxfd)
+      cpool->maxfd = cgi->pidfd;
+  }
+
+  live++;
+  cgi_stats.started++;
+  scoreboard_update(cpool, cgi - cpool->states);
+  PROBE3(cgi_spawn, cgi->cold->id, pid, cgi - cpool->states);
+}
+
+/* Packs envp into one NUL separated allocation */
+char* cgi_pack_env(char** envp, size_t* len)
+{
+  size_t n = 0;
+  char* env;
+  int k;
+
+  for (k = 0; envp[k] != NULL; k++)
+    n += strlen(envp[k]) + 1;
+
+  if ((env = liso_malloc_acct(n, MEM_CGI, NULL)) == NULL)
+    return NULL;
+
+  for (*len = 0, k = 0; envp[k] != NULL; k++)
+  {
+    strcpy(env + *len, envp[k]);
+    *len += strlen(envp[k]) + 1;
+  }
+
+  return env;
+}
+
+/*******************************************************************/
+/* @brief Takes on a CGI request: the script is started now if     */
+/* fewer than LISO_CGI_MAX are running and nobody is waiting,      */
+/* otherwise the request joins the wait queue. Either way it gets  */
+/* a cgi slot (add_cgi()) that relays the output once there is     */
+/* any. state->pipefds holds the read end of the stdout pipe.      */
+/* A detached run (a micro-cache refresh, answering nobody) is     */
+/* only started if there is a place for it now.                    */
+/*                                                                 */
+/* @param state     The client                                     */
+/* @param envp      The CGI environment, NULL terminated           */
+/* @param in_fd     Read end of the stdin pipe, becomes its stdin  */
+/* @param out_fd    Write end of the stdout pipe, becomes stdout   */
+/* @param detached  1 to run it for the micro-cache only           */
+/*                                                                 */
+/* @retval 0    started or queued; in_fd and out_fd are taken      */
+/* @retval 503  too many waiting already (detached: no place)      */
+/* @retval 500  no slot, or the script could not be started        */
+/* On failure the three pipe ends are closed.                      */
+/*******************************************************************/
+int cgi_begin(fsm* state, char** envp, int in_fd, int out_fd, int detached)
+{
+  int i, start, rc = 500;
+  char* env = NULL;
+  size_t env_len = 0;
+  uint64_t spawned = trace_clock();
+  pid_t pid;
+  int pidfd = -1;
+  cgi_wait* w;
+
+  start = config.cgi_max <= 0 || (live < config.cgi_max && wait_count == 0);
+
+  if (!start && detached)
+  {
+    rc = 503;
+    goto failed;
+  }
+
+  if (!start && wait_count >= config.cgi_queue)
+  {
+    cgi_stats.rejected++;
+    log_error("Too many CGI requests waiting", logfile);
+    rc = 503;
+    goto failed;
+  }
+
+  if (start)
+  {
+    if (spawn(envp, in_fd, out_fd, &pid, &pidfd))
+      goto failed;
+  }
+  else if ((env = cgi_pack_env(envp, &env_len)) == NULL)
+    goto failed;
+
+  if ((i = add_cgi(state->fd, state, cpool, detached)) < 0)
+  {
+    if (start)
+    {
+      signal_pid(pid, pidfd, SIGKILL);
+      if (pidfd >= 0)
+        close(pidfd);
+    }
+    liso_free(env);
+    goto failed;
+  }
+
+  if (start)
+  {
+    track(&cpool->states[i], pid, pidfd, spawned);
+    close(in_fd);
+    close(out_fd);
+    return 0;
+  }
+
+  w = &waitq[(wait_head + wait_count) % config.cgi_queue];
+  w->slot     = i;
+  w->in_fd    = in_fd;
+  w->out_fd   = out_fd;
+  w->env      = env;
+  w->env_len  = env_len;
+  w->deadline = (long long)(mono_ns() / 1000000) + config.cgi_wait_ms;
+  wait_count++;
+  cgi_stats.queued++;
+  return 0;
+
+failed:
+  close(in_fd);
+  close(out_fd);
+  close(state->pipefds);
+  state->pipefds = -1;
+  return rc;
+}
+
+/* Lets go of a queue entry's pipe ends and environment */
+static void drop_wait(cgi_wait* w)
+{
+  close(w->in_fd);
+  close(w->out_fd);
+  liso_free(w->env);
+  w->slot = -1;
+}
+
+/***************************************************************/
+/* @brief Ends a waiting request without starting it: a 503 if */
+/* it is still wanted, then its cgi slot goes.                 */
+/***************************************************************/
+static void refuse(pool* p, cgi_wait* w, int error)
+{
+  int i = w->slot, j;
+  fsm* cgi = &p->states[i];
+  unsigned seq = cgi->seq;
+
+  drop_wait(w);
+
+  j = cgi_owner(p, i);
+  if (error)
+    flight_fail(p, i, error);   // Its waiters get the same answer
+  rm_cgi(cgi->pipefds, p, error ? "CGI request waited too long" :
+         "CGI client went away", i);
+
+  if (j >= 0 && error)
+  {
+    resp_fail(p, j, seq, error);
+    if (p->states[j].fd >= 0)
+      flush_client(p, j);
+  }
+}
+
+/* Starts the request at the head of the queue */
+static void start(pool* p, cgi_wait* w)
+{
+  char* envp[ZYGOTE_MAX_ENV + 1];
+  fsm* cgi = &p->states[w->slot];
+  uint64_t spawned = trace_clock();
+  char* e;
+  pid_t pid;
+  int n, pidfd;
+
+  if (!cgi_wanted(p, w->slot))
+  {
+    refuse(p, w, 0);
+    return;
+  }
+
+  for (e = w->env, n = 0; e < w->env + w->env_len && n < ZYGOTE_MAX_ENV;
+       e += strlen(e) + 1)
+    envp[n++] = e;
+  envp[n] = NULL;
+
+  if (spawn(envp, w->in_fd, w->out_fd, &pid, &pidfd))
+  {
+    refuse(p, w, 500);
+    return;
+  }
+
+  track(cgi, pid, pidfd, spawned);
+  drop_wait(w);
+}
+
+/* Starts waiting requests while there is room for them */
+static void admit(pool* p)
+{
+  cgi_wait w;
+
+  if (admitting)
+    return;
+  admitting = 1;
+
+  while (wait_count > 0 && live < config.cgi_max)
+  {
+    w = waitq[wait_head];
+    wait_head = (wait_head + 1) % config.cgi_queue;
+    wait_count--;
+
+    if (w.slot >= 0)
+      start(p, &w);
+  }
+
+  admitting = 0;
+}
+
+/* Stops counting cgi slot i's script as running */
+static void untrack(pool* p, int i)
+{
+  fsm* cgi = &p->states[i];
+
+  if (cgi->pidfd >= 0)
+  {
+    FD_CLR(cgi->pidfd, &p->masterfds);
+    FD_CLR(cgi->pidfd, &p->readfds);
+    close(cgi->pidfd);
+    cgi->pidfd = -1;
+  }
+
+  if (cgi->pid > 0)
+  {
+    PROBE3(cgi_exit, cgi->cold->id, cgi->pid, cgi->timed_out);
+    metrics_since(METRIC_CGI_RUN, run_start[i]);
+    if (trace_on(cgi, cgi->seq))
+      trace_emit(TRACE_CGI_RUN, cgi->cold->id, cgi->seq, run_start[i],
+                 cgi->pid);
+    cgi->pid = 0;
+    live--;
+    scoreboard_update(p, i);
+    admit(p);
+  }
+}
+
+/*************************************************************/
+/* @brief cgi slot i's pidfd is readable: the script exited. */
+/* Its output may still be in the pipe; the slot stays until */
+/* that has been relayed.                                    */
+/*************************************************************/
+void cgi_exited(pool* p, int i)
+{
+  untrack(p, i);
+}
+
+/* Kills a script whose output nobody will read */
+void cgi_abandon(fsm* cgi)
+{
+  if (cgi->pid > 0)
+    signal_cgi(cgi, SIGKILL);
+}
+
+/******************************************************************/
+/* @brief Called as cgi slot i is removed (rm_cgi()): it leaves   */
+/* the wait queue if it was still waiting, and its script stops   */
+/* counting against LISO_CGI_MAX.                                 */
+/******************************************************************/
+void cgi_end(pool* p, int i)
+{
+  int k;
+
+  for (k = 0; k < wait_count; k++)
+    if (waitq[(wait_head + k) % config.cgi_queue].slot == i)
+      drop_wait(&waitq[(wait_head + k) % config.cgi_queue]);
+
+  untrack(p, i);
+}
+
+/******************************************************************/
+/* @brief Reaps children if SIGCHLD came in on the signalfd,      */
+/* logging any that failed. Each pid is handed to fcgi_reaped()   */
+/* while it is still known to be the child that exited, so a      */
+/* FastCGI worker is matched by its pid and not by a guess.       */
+/******************************************************************/
+void cgi_reap(pool* p)
+{
+  struct signalfd_siginfo si;
+  char log_buf[LOG_SIZE];
+  int status;
+  pid_t pid;
+
+  if (sigfd < 0 || !FD_ISSET(sigfd, &p->readfds))
+    return;
+  p->nready--;
+
+  while (read(sigfd, &si, sizeof(si)) == sizeof(si))
+    ;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+  {
+    if (fcgi_enabled())
+      fcgi_reaped(pid);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      continue;
+
+    if (WIFSIGNALED(status))
+      sprintf(log_buf, "Child %d killed by signal %d", (int)pid,
+              WTERMSIG(status));
+    else
+      sprintf(log_buf, "Child %d exited with status %d", (int)pid,
+              WEXITSTATUS(status));
+    log_error(log_buf, logfile);
+  }
+}
+
+/*****************************************************************/
+/* @brief Once per pass: waiting requests past their deadline    */
+/* get a 503, and scripts running past LISO_CGI_TIMEOUT are       */
+/* killed (relay_cgi() answers 504, or cuts the response short).  */
+/* Requests whose client went away are dropped from the queue,    */
+/* and their scripts killed, so they don't hold a place.          */
+/*****************************************************************/
+void cgi_tick(pool* p)
+{
+  long long now = (long long)(mono_ns() / 1000000);
+  time_t t = time(NULL);
+  cgi_wait* w; cgi_wait head;
+  fsm* cgi;
+  int i, k;
+
+  for (k = 0; k < wait_count; k++)
+  {
+    w = &waitq[(wait_head + k) % config.cgi_queue];
+    if (w->slot >= 0 && !cgi_wanted(p, w->slot))
+      refuse(p, w, 0);
+  }
+
+  /* Everybody waits as long, so the oldest expire first */
+  while (wait_count > 0 && (waitq[wait_head].slot < 0 ||
+                            waitq[wait_head].deadline <= now))
+  {
+    head = waitq[wait_head];
+    wait_head = (wait_head + 1) % config.cgi_queue;
+    wait_count--;
+
+    if (head.slot >= 0)
+    {
+      cgi_stats.expired++;
+      refuse(p, &head, 503);
+    }
+  }
+
+  if (live == 0)
+    return;
+
+  for (i = 0; i <= p->maxi; i++)
+  {
+    cgi = &p->states[i];
+    if (cgi->fd < 0 || cgi->pipefds <= 0 || cgi->pid <= 0 || cgi->timed_out)
+      continue;
+
+    if (!cgi_wanted(p, i))
+      signal_cgi(cgi, SIGKILL);   // Its pipe closes; relay_cgi() cleans up
+    else if (config.cgi_timeout > 0 &&
+             t - cgi->last_active >= config.cgi_timeout)
+    {
+      cgi->timed_out = 1;
+      signal_cgi(cgi, SIGKILL);
+      cgi_stats.timeouts++;
+      log_error("CGI ran too long, killed it", logfile);
+    }
+  }
+}
+
+/* Milliseconds until cgi_tick() has something to do, -1 if never */
+long cgi_wakeup(void)
+{
+  long long left;
+
+  if (wait_count > 0)
+  {
+    left = waitq[wait_head].deadline - (long long)(mono_ns() / 1000000);
+    return left > 0 ? (long)left : 0;
+  }
+
+  return live > 0 ? 1000 : -1;
+}
+
+void cgi_print(FILE* file)
+{
+  fprintf(file, "CGI: %lu started, %lu queued, %lu rejected, %lu expired, "
+          "%lu timed out; %d running, %d waiting\n", cgi_stats.started,
+          cgi_stats.queued, cgi_stats.rejected, cgi_stats.expired,
+          cgi_stats.timeouts, live, wait_count);
+  fflush(file);
+}
@@ -0,0 +1,41 @@
+#ifndef CGI_H
+#define CGI_H
+
+#include <stdio.h>
+
+#include "lisod.h"
+
+/* A request waiting for a CGI process to free up. The pipes already
+   exist, so a POST body is relayed into stdin while it waits. */
+typedef struct cgi_wait {
+  int       slot;      // cgi slot answering it; -1 once dropped
+  int       in_fd;     // Read end of its stdin pipe, for the child
+  int       out_fd;    // Write end of its stdout pipe, for the child
+  char*     env;       // Environment, NUL separated
+  size_t    env_len;
+  long long deadline;  // Monotonic ms after which it gets a 503
+} cgi_wait;
+
+typedef struct cgi_counters {
+  unsigned long started;    // Scripts started
+  unsigned long queued;     // ... that had to wait for a place
+  unsigned long rejected;   // Turned away with 503, queue full
+  unsigned long expired;    // Turned away with 503, waited too long
+  unsigned long timeouts;   // Killed for running too long
+} cgi_counters;
+
+extern cgi_counters cgi_stats;
+
+int  cgi_init(pool* p);
+char* cgi_pack_env(char** envp, size_t* len);
+int  cgi_begin(fsm* state, char** envp, int in_fd, int out_fd,
+                int detached);
+void cgi_exited(pool* p, int i);
+void cgi_abandon(fsm* cgi);
+void cgi_end(pool* p, int i);
+void cgi_reap(pool* p);
+void cgi_tick(pool* p);
+long cgi_wakeup(void);
+void cgi_print(FILE* file);
+
+#endif
@@ -0,0 +1,146 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file config.c                                                  */
+/*                                                                 */
+/* @brief Loads liso's runtime tunables from LISO_* environment    */
+/* variables, falling back to defaults.                            */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+
+config_t config = {
+  .mem_budget   = 256 * 1024 * 1024,
+  .mem_high_pct = 90,
+  .sched_reqs   = 4,
+  .sched_bytes  = 256 * 1024,
+  .cgi_max      = 32,
+  .cgi_queue    = 64,
+  .cgi_wait_ms  = 5000,
+  .cgi_timeout  = 60,
+  .cache_size   = 16 * 1024 * 1024,
+  .cache_stale  = 10,
+  .coalesce_max = 128,
+  .coalesce_wait_ms = 10000,
+  .plugin_threads = 4,
+  .plugin_body  = 1024 * 1024,
+  .access_log_size = 64 * 1024 * 1024,
+};
+
+/*******************************************************/
+/* @brief Reads a size such as 512K, 64M or 2G from an */
+/* environment variable into *val, if it is set.       */
+/*******************************************************/
+static void env_size(const char* name, size_t* val)
+{
+  char* end; char* str = getenv(name);
+  unsigned long long n;
+
+  if (str == NULL || *str == '\0')
+    return;
+
+  n = strtoull(str, &end, 10);
+
+  switch (*end)
+  {
+    case 'g': case 'G': n *= 1024;  /* fall through */
+    case 'm': case 'M': n *= 1024;  /* fall through */
+    case 'k': case 'K': n *= 1024; end++; break;
+  }
+
+  if (*end != '\0')
+  {
+    fprintf(stderr, "Ignoring bad value for %s: %s\n", name, str);
+    return;
+  }
+
+  *val = (size_t)n;
+}
+
+/* Reads a string from an environment variable into *val, if set */
+static void env_str(const char* name, char** val)
+{
+  char* str = getenv(name);
+
+  if (str != NULL && *str != '\0')
+    *val = str;
+}
+
+/* Reads an integer from an environment variable into *val, if set */
+static void env_int(const char* name, int* val)
+{
+  char* end; char* str = getenv(name);
+  long n;
+
+  if (str == NULL || *str == '\0')
+    return;
+
+  n = strtol(str, &end, 10);
+
+  if (*end != '\0')
+  {
+    fprintf(stderr, "Ignoring bad value for %s: %s\n", name, str);
+    return;
+  }
+
+  *val = (int)n;
+}
+
+void config_load(void)
+{
+  env_size("LISO_MEM_BUDGET", &config.mem_budget);
+  env_int ("LISO_MEM_HIGH",   &config.mem_high_pct);
+  env_int ("LISO_SCHED_REQS", &config.sched_reqs);
+  env_size("LISO_SCHED_BYTES", &config.sched_bytes);
+  env_int ("LISO_FCGI_WORKERS", &config.fcgi_workers);
+  env_int ("LISO_FCGI_CONNS", &config.fcgi_conns);
+  env_str ("LISO_FCGI_ADDR",  &config.fcgi_addr);
+  env_int ("LISO_CGI_ZYGOTE", &config.cgi_zygote);
+  env_str ("LISO_CGI_PRELOAD", &config.cgi_preload);
+  env_int ("LISO_CGI_MAX",    &config.cgi_max);
+  env_int ("LISO_CGI_QUEUE",  &config.cgi_queue);
+  env_int ("LISO_CGI_WAIT",   &config.cgi_wait_ms);
+  env_int ("LISO_CGI_TIMEOUT", &config.cgi_timeout);
+  env_size("LISO_CACHE_SIZE", &config.cache_size);
+  env_int ("LISO_CACHE_TTL",  &config.cache_ttl);
+  env_int ("LISO_CACHE_STALE", &config.cache_stale);
+  env_str ("LISO_CACHE_VARY", &config.cache_vary);
+  env_int ("LISO_COALESCE_MAX", &config.coalesce_max);
+  env_int ("LISO_COALESCE_WAIT", &config.coalesce_wait_ms);
+  env_str ("LISO_PLUGINS",    &config.plugins);
+  env_int ("LISO_PLUGIN_THREADS", &config.plugin_threads);
+  env_size("LISO_PLUGIN_BODY", &config.plugin_body);
+  env_str ("LISO_ACCESS_LOG", &config.access_log);
+  env_size("LISO_ACCESS_LOG_SIZE", &config.access_log_size);
+  env_str ("LISO_METRICS_URI", &config.metrics_uri);
+  env_str ("LISO_SCOREBOARD", &config.scoreboard);
+  env_int ("LISO_TRACE_SAMPLE", &config.trace_sample);
+  env_str ("LISO_TRACE_HEADER", &config.trace_header);
+  env_str ("LISO_TRACE_FILE", &config.trace_file);
+  env_str ("LISO_TRACE_URI",  &config.trace_uri);
+
+  if (config.mem_high_pct <= 0 || config.mem_high_pct > 100)
+    config.mem_high_pct = 90;
+  if (config.sched_reqs <= 0)
+    config.sched_reqs = 1;
+  if (config.cgi_max <= 0 || config.cgi_queue < 0)
+    config.cgi_queue = 0;
+  if (config.cache_stale < 0)
+    config.cache_stale = 0;
+  if (config.coalesce_max < 0)
+    config.coalesce_max = 0;
+  if (config.plugin_threads < 0)
+    config.plugin_threads = 0;
+  if (config.trace_sample < 0)
+    config.trace_sample = 0;
+  if (config.access_log_size < 64 * 1024)
+    config.access_log_size = 64 * 1024;
+  if (config.access_log_size > 0xffff0000)   // Offsets in it are 32-bit
+    config.access_log_size = 0xffff0000;
+}
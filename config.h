@@ -0,0 +1,45 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+/* Runtime tunables. Everything has a default and can be overridden
+   through a LISO_* environment variable; see readme.txt. */
+typedef struct config {
+  size_t mem_budget;    // LISO_MEM_BUDGET: bytes, 0 = unbounded
+  int    mem_high_pct;  // LISO_MEM_HIGH: % of budget that counts as near
+  int    sched_reqs;    // LISO_SCHED_REQS: requests per client per pass
+  size_t sched_bytes;   // LISO_SCHED_BYTES: bytes per client per pass
+  int    fcgi_workers;  // LISO_FCGI_WORKERS: FastCGI workers to spawn
+  int    fcgi_conns;    // LISO_FCGI_CONNS: connections to the workers
+  char*  fcgi_addr;     // LISO_FCGI_ADDR: /unix/path or host:port
+  int    cgi_zygote;    // LISO_CGI_ZYGOTE: 1 = spawn CGI from a zygote
+  char*  cgi_preload;   // LISO_CGI_PRELOAD: .so the zygote preloads
+  int    cgi_max;       // LISO_CGI_MAX: scripts running at once, 0 = any
+  int    cgi_queue;     // LISO_CGI_QUEUE: requests waiting for a place
+  int    cgi_wait_ms;   // LISO_CGI_WAIT: ms one may wait before a 503
+  int    cgi_timeout;   // LISO_CGI_TIMEOUT: seconds a script may run
+  size_t cache_size;    // LISO_CACHE_SIZE: bytes of CGI responses, 0 = off
+  int    cache_ttl;     // LISO_CACHE_TTL: seconds, without a max-age
+  int    cache_stale;   // LISO_CACHE_STALE: seconds served while refreshing
+  char*  cache_vary;    // LISO_CACHE_VARY: request headers in the key
+  int    coalesce_max;  // LISO_COALESCE_MAX: waiters per CGI run, 0 = off
+  int    coalesce_wait_ms; // LISO_COALESCE_WAIT: ms one waits before a 504
+  char*  plugins;       // LISO_PLUGINS: prefix=handler.so,...
+  int    plugin_threads; // LISO_PLUGIN_THREADS: workers for blocking ones
+  size_t plugin_body;   // LISO_PLUGIN_BODY: largest body a handler takes
+  char*  access_log;    // LISO_ACCESS_LOG: binary access log file
+  size_t access_log_size; // LISO_ACCESS_LOG_SIZE: bytes before rotating
+  char*  metrics_uri;   // LISO_METRICS_URI: where metrics are served, or off
+  char*  scoreboard;    // LISO_SCOREBOARD: file lisotop reads, or off
+  int    trace_sample;  // LISO_TRACE_SAMPLE: trace 1 request in N, 0 = off
+  char*  trace_header;  // LISO_TRACE_HEADER: trace requests carrying it
+  char*  trace_file;    // LISO_TRACE_FILE: where SIGUSR2 writes the trace
+  char*  trace_uri;     // LISO_TRACE_URI: where the trace is served, or off
+} config_t;
+
+extern config_t config;
+
+void config_load(void);
+
+#endif
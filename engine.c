@@ -10,19 +10,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #include "engine.h"
+#include "alloc.h"
+#include "fcgi.h"
+#include "cgi.h"
+#include "mcache.h"
+#include "flight.h"
+#include "plugin.h"
+#include "metrics.h"
+#include "probes.h"
 
 #define FREE_SIZE 40
+#define CHUNK_LINE_MAX 1024   /* Longest chunk-size or trailer line */
 
 extern short listen_port;
 extern short https_port;
-extern char* cgipath;
+
+static char server_port_env[2][24];  /* SERVER_PORT for http, https */
 
 
 /**********************************************************/
@@ -59,37 +71,37 @@ int parse_line(fsm* state)
 
   /* Copy request line */
   length = (size_t)(CRLF - state->request);
-  tmpbuf = strndup(state->request,length); // Remember to free here.
+  tmpbuf = conn_strndup(state, MEM_PARSE, state->request,length); // Remember to free here.
 
   /* Tokenize the line */
   method = strtok(tmpbuf," ");
 
   if (method == NULL)
-  {free(tmpbuf); return 400;}
+  {liso_free(tmpbuf); return 400;}
 
   /* Check if correct method */
   if (strncmp(method,"GET",strlen("GET")) && strncmp(method,"HEAD",strlen("HEAD"))
       && strncmp(method, "POST", strlen("POST")))
-  {free(tmpbuf); return 501;}
+  {liso_free(tmpbuf); return 501;}
 
   if((uri = strtok(NULL," ")) == NULL)
-  {free(tmpbuf); return 400;}
+  {liso_free(tmpbuf); return 400;}
 
   if((version = strtok(NULL, " ")) == NULL)
-  {free(tmpbuf); return 400;}
+  {liso_free(tmpbuf); return 400;}
 
   if(strncmp(version,"HTTP/1.1",strlen("HTTP/1.1")))
-  {free(tmpbuf); return 505;}
+  {liso_free(tmpbuf); return 505;}
 
   /* If there's one more token, malformed request */
   if(strtok(NULL," ") != NULL)
-  {free(tmpbuf); return 400;}
+  {liso_free(tmpbuf); return 400;}
 
   /* These are all malloced by strdup, so it is safe */
   state->method = method;
   state->uri = uri;
   state->version = version;
-  addtofree(state->freebuf, tmpbuf, FREE_SIZE);
+  addtofree(state->cold->freebuf, tmpbuf, FREE_SIZE);
 
   return 0;
 }
@@ -109,7 +121,7 @@ int parse_headers(fsm* state)
   char* CRLF; char* tmpbuf; char* body_size;
   char* hdr_start;
 
-  size_t length;
+  size_t length, hdr_len;
 
   CRLF = memmem(state->request, state->end_idx, "\r\n\r\n", strlen("\r\n\r\n"));
 
@@ -135,80 +147,240 @@ int parse_headers(fsm* state)
 
   hdr_start += 2; // Go to the header line
 
-  state->header = strndup(hdr_start, (size_t)(CRLF+4 - hdr_start));
-  addtofree(state->freebuf, state->header, FREE_SIZE);
+  state->header = conn_strndup(state, MEM_PARSE, hdr_start,
+                               (size_t)(CRLF+4 - hdr_start));
+  addtofree(state->cold->freebuf, state->header, FREE_SIZE);
+
+  state->body_state = BODY_DONE;
 
   if(strncmp(state->method,"POST",strlen("POST")))
   {
     return 0;
   }
 
-  /* Now extract Content-Length: if POST */
+  /* Now, if POST, find out how the body is framed. Only the header
+     block is searched; the body itself may already be buffered. */
+  hdr_len = (size_t)(CRLF + 2 - state->request);
+
+  if(memmem(state->request, hdr_len, "Transfer-Encoding: chunked\r\n",
+            strlen("Transfer-Encoding: chunked\r\n")) != NULL)
+  {
+    state->body_size  = 0;
+    state->body_state = BODY_CHUNK_SIZE;
+    return 0;
+  }
 
-  tmpbuf = memmem(state->request, state->end_idx, "Content-Length:",
+  tmpbuf = memmem(state->request, hdr_len, "Content-Length:",
                   strlen("Content-Length:"));
 
   if(tmpbuf == NULL)
     return 411;
 
-  CRLF = memmem(tmpbuf, state->end_idx, "\r\n", strlen("\r\n"));
+  CRLF = memmem(tmpbuf, hdr_len - (size_t)(tmpbuf - state->request),
+                "\r\n", strlen("\r\n"));
   length = (size_t)(CRLF - tmpbuf);
-  tmpbuf = strndup(tmpbuf, length); // Free this guy please.
+  tmpbuf = conn_strndup(state, MEM_PARSE, tmpbuf, length); // Free this guy please.
 
   if(strtok(tmpbuf," ") == NULL)
-  {free(tmpbuf); return 411;}
+  {liso_free(tmpbuf); return 411;}
 
   if((body_size = strtok(NULL, " ")) == NULL)
-  {free(tmpbuf); return 411;}
+  {liso_free(tmpbuf); return 411;}
 
   /* Check for valid Content-Length */
   if(!validsize(body_size))
-  {free(tmpbuf); return 411;}
+  {liso_free(tmpbuf); return 411;}
 
   /* If there's one more token, malformed request */
   if(strtok(NULL," ") != NULL)
-  {free(tmpbuf); return 400;}
+  {liso_free(tmpbuf); return 400;}
+
+  state->body_size = (ssize_t)strtoll(body_size, NULL, 10);
+  liso_free(tmpbuf);
 
-  state->body_size = (size_t)atoi(body_size);
-  free(tmpbuf);
+  /* The body is relayed to the CGI as it arrives */
+  state->body_left  = state->body_size;
+  state->body_state = state->body_size > 0 ? BODY_LENGTH : BODY_DONE;
 
   return 0;
 }
 
 
-/**************************************************/
-/* @brief parses the body and stores it in state. */
-/* If the full body has not been read yet, stash  */
-/* whatever has been received.                    */
-/*                                                */
-/* @retval  0    if successful                    */
-/* @retval -1    if incomplete body               */
-/* @retval 400   if malformed                     */
-/**************************************************/
-int parse_body(fsm* state)
+/****************************************************************/
+/* @brief Hands a piece of the request body to the CGI: written */
+/* to its stdin pipe, sent as FastCGI STDIN, or dropped if the  */
+/* script is gone.                                              */
+/*                                                              */
+/* @returns bytes taken, 0 if the pipe (or the FastCGI worker's */
+/*          connection) is full                                 */
+/****************************************************************/
+static size_t body_write(fsm* state, char* data, size_t len)
 {
-  char* CRLF; char* body;
+  ssize_t n;
 
-  /* CRLF should be here */
-  CRLF = memmem(state->request, state->end_idx, "\r\n\r\n", strlen("\r\n\r\n"));
+  if (state->cgi_in == CGI_IN_FCGI)
+  {
+    if ((n = fcgi_stdin(state, data, len)) >= 0)
+      return (size_t)n;
+    state->cgi_in = -1;   // The request is gone; drop the rest
+    return len;
+  }
 
-  if(CRLF == NULL)
-    return 400;
+  if (state->cgi_in == CGI_IN_PLUGIN)
+  {
+    if (plugin_body(state, data, len))
+      state->cgi_in = -1;
+    return len;
+  }
 
-  /* Check if there's a body to begin with */
-  if(CRLF + 4 == state->request + state->end_idx)
-    return -1;
+  if (state->cgi_in < 0)
+    return len;
+
+  if ((n = write(state->cgi_in, data, len)) >= 0)
+    return (size_t)n;
 
-  body = CRLF + 4;
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+    return 0;
+
+  /* The script exited without reading it all (EPIPE) */
+  close(state->cgi_in);
+  state->cgi_in = -1;
+  return len;
+}
+
+/* Parses a chunk-size line (hex digits, then extensions we ignore).
+   Returns the size, or -1 if malformed. */
+static ssize_t chunk_size(char* line, size_t len)
+{
+  ssize_t size = 0;
+  size_t k;
+  int d;
 
-  /* Check if the body is complete */
-  if(body + (int) state->body_size > state->request + state->end_idx)
+  for (k = 0; k < len && k < 15; k++)
+  {
+    d = line[k];
+    if (d >= '0' && d <= '9')      d -= '0';
+    else if (d >= 'a' && d <= 'f') d -= 'a' - 10;
+    else if (d >= 'A' && d <= 'F') d -= 'A' - 10;
+    else break;
+    size = size * 16 + d;
+  }
+
+  if (k == 0 || (k < len && line[k] != ';' && line[k] != ' ' &&
+                 line[k] != '\t'))
     return -1;
+  return size;
+}
 
-  state->body = strndup(body, state->body_size);
-  addtofree(state->freebuf, state->body, FREE_SIZE);
+/*******************************************************************/
+/* @brief Relays the request body at the front of the buffer to    */
+/* the CGI, as much of it as the CGI takes, decoding chunked       */
+/* bodies on the way. What was relayed is removed from the buffer; */
+/* once the body is complete the CGI's stdin is closed and the     */
+/* buffer holds the next request, if any.                          */
+/*                                                                 */
+/* @retval  0    the whole body has been relayed                   */
+/* @retval -1    more of the body has to come from the client      */
+/* @retval  1    the CGI's stdin is full; retry when it drains     */
+/* @retval 400   malformed chunked body                            */
+/*******************************************************************/
+int relay_body(fsm* state)
+{
+  char* buf = state->request;
+  size_t off = 0, len = (size_t)state->end_idx, n;
+  ssize_t size;
+  char* eol;
+  int rc = -1;
 
-  return 0;
+  while (state->body_state != BODY_DONE && rc == -1)
+  {
+    switch (state->body_state)
+    {
+      case BODY_LENGTH:
+      case BODY_CHUNK:
+        if (off == len)
+          goto out;
+        n = len - off < (size_t)state->body_left ? len - off :
+            (size_t)state->body_left;
+        if ((n = body_write(state, buf + off, n)) == 0)
+        {
+          rc = 1;
+          break;
+        }
+        off += n;
+        state->body_left -= n;
+        if (state->body_left == 0)
+          state->body_state = state->body_state == BODY_LENGTH ?
+                              BODY_DONE : BODY_CHUNK_END;
+        break;
+
+      case BODY_CHUNK_SIZE:
+        if ((eol = memmem(buf + off, len - off, "\r\n", 2)) == NULL)
+        {
+          if (len - off >= CHUNK_LINE_MAX)
+            rc = 400;
+          goto out;
+        }
+        if ((size = chunk_size(buf + off, eol - (buf + off))) < 0)
+        {
+          rc = 400;
+          goto out;
+        }
+        off = eol + 2 - buf;
+        state->body_left  = size;
+        state->body_state = size > 0 ? BODY_CHUNK : BODY_TRAILER;
+        break;
+
+      case BODY_CHUNK_END:
+        if (len - off < 2)
+          goto out;
+        if (buf[off] != '\r' || buf[off + 1] != '\n')
+        {
+          rc = 400;
+          goto out;
+        }
+        off += 2;
+        state->body_state = BODY_CHUNK_SIZE;
+        break;
+
+      case BODY_TRAILER:
+        if ((eol = memmem(buf + off, len - off, "\r\n", 2)) == NULL)
+        {
+          if (len - off >= CHUNK_LINE_MAX)
+            rc = 400;
+          goto out;
+        }
+        if (eol == buf + off)
+          state->body_state = BODY_DONE;   // The blank line
+        off = eol + 2 - buf;
+        break;
+    }
+  }
+
+out:
+  /* Drop what was relayed; the rest moves to the front */
+  memmove(buf, buf + off, len - off);
+  memset(buf + len - off, 0, off);
+  state->end_idx = (int)(len - off);
+
+  /* What a FastCGI worker was given this pass goes out as one run of
+     STDIN records, with the end of the stream if the body is done */
+  if (state->cgi_in == CGI_IN_FCGI &&
+      fcgi_stdin_flush(state, rc == -1 && state->body_state == BODY_DONE))
+    state->cgi_in = -1;   // The request failed; the rest is dropped
+
+  if (rc == -1 && state->body_state == BODY_DONE)
+  {
+    PROBE2(body_done, state->cold->id, state->body_size);
+    if (state->cgi_in == CGI_IN_PLUGIN)
+      plugin_body(state, NULL, 0);
+    else if (state->cgi_in >= 0)
+      close(state->cgi_in);
+    state->cgi_in = -1;
+    rc = 0;
+  }
+
+  return rc;
 }
 
 /*
@@ -234,6 +406,8 @@ int store_request(char* buf, int size, fsm* state)
 /* @retval  0  success                                               */
 /* @retval 500 internal server error                                 */
 /* @retval 404 File not found                                        */
+/* @retval 503 too many CGI requests waiting                         */
+/* @retval 413 a plugin's request body is too large                  */
 /*********************************************************************/
 int service(fsm* state)
 {
@@ -243,10 +417,27 @@ int service(fsm* state)
   char timestr[200] = {0}; char type[40] = {0};
   char* response = state->response;
   char* cgi = NULL; char* query = NULL;
-  FILE *file;
-
-  int pathlength = strlen(state->uri) + strlen(state->www) + strlen("/") + 1;
-  char* path = malloc(pathlength);
+  int rc;
+  int pathlength;
+  char* path;
+  uint64_t started;
+  metrics_hw hw;
+
+  /* Under a plugin's prefix: it answers, not the file system */
+  if ((rc = plugin_serve(state)) >= 0)
+    return rc;
+
+  /* The metrics page, for a local client */
+  if ((rc = metrics_serve(state)) >= 0)
+    return rc;
+
+  /* The request trace, likewise */
+  if ((rc = trace_serve(state)) >= 0)
+    return rc;
+
+  pathlength = strlen(state->uri) + strlen(state->www) + strlen("/") +
+               strlen("index.html") + 1;
+  path = conn_malloc(state, MEM_PARSE, pathlength);
   memset(path,0,pathlength);
 
   if(!strncmp(state->uri, "/", strlen("/")) && strlen(state->uri) == 1)
@@ -289,12 +480,14 @@ int service(fsm* state)
 
   if (Date == NULL)
   {
+    liso_free(path);
     return 500;
   }
 
   /* Grab Date of message */
   if(strftime(timestr, 200, "%a, %d %b %Y %H:%M:%S %Z" ,Date) == 0)
   {
+    liso_free(path);
     return 500;
   }
 
@@ -307,24 +500,24 @@ int service(fsm* state)
       /* To CGI or not to CGI */
       if(cgi != NULL)
       {
-        if(exec_cgi(state, path, 0))
-          return 500;
+        if((rc = exec_cgi(state, path, 0)))
+        {liso_free(path); return rc < 0 ? 500 : rc;}
       }
       else
       {
-        /* Check if file exists */
-        if(stat(path, &meta) == -1)
+        /* Check if file exists; only regular files can be sent */
+        if(stat(path, &meta) == -1 || !S_ISREG(meta.st_mode))
         {
+          liso_free(path);
           return 404;
         }
 
-        /* Open uri specified by client and save it in state*/
-        file = fopen(path,"r");
-        state->body = malloc(meta.st_size); // free here brah
+        /* The body is queued as the file itself: sendfile() over
+           HTTP, read into TLS records over HTTPS, never buffered */
+        if((state->body_fd = open(path, O_RDONLY)) == -1)
+        {liso_free(path); return 404;}
+        state->body = NULL;
         state->body_size = meta.st_size;
-        fread(state->body,1,state->body_size,file);
-        fclose(file);
-        addtofree(state->freebuf, state->body, FREE_SIZE);
       }
     }
     else // HEAD
@@ -335,6 +528,8 @@ int service(fsm* state)
 
     if(cgi == NULL)
     {
+      started = metrics_clock();
+      metrics_hw_start(&hw);
       sprintf(response, "HTTP/1.1 200 OK\r\n");
       sprintf(response, "%sDate: %s\r\n", response, timestr);
       sprintf(response, "%sServer: Liso/1.0\r\n", response);
@@ -354,22 +549,25 @@ int service(fsm* state)
       memset(timestr, 0, 200);
       if(strftime(timestr, 200, "%a, %d %b %Y %H:%M:%S %Z" , Modified) == 0)
       {
+        liso_free(path);
         return 500;
       }
 
       sprintf(response, "%sLast-Modified: %s\r\n\r\n", response, timestr);
+      metrics_since(METRIC_HEAD_GEN, started);
+      metrics_hw_since(METRIC_HEAD_GEN, &hw);
     }
 
     state->resp_idx = (int)strlen(response);
   }
   else // We got a POST over here.
   {
-    if(exec_cgi(state, path, 1))
-      return 500;
+    if((rc = exec_cgi(state, path, 1)))
+    {liso_free(path); return rc < 0 ? 500 : rc;}
     state->resp_idx = (int)strlen(response);
   }
 
-  free(path);
+  liso_free(path);
   return 0;
 }
 
@@ -439,9 +637,10 @@ int mimetype(char* file, size_t len, char* type)
 
 int validsize(char* body_size)
 {
-  int size = atoi(body_size);
+  char* end;
+  long long size = strtoll(body_size, &end, 10);
 
-  if(size < 0)
+  if(size < 0 || end == body_size || *end != '\0')
     return 0;
   else
     return 1;
@@ -456,7 +655,7 @@ int validsize(char* body_size)
 /*****************************************************************/
 int resetbuf(fsm* state)
 {
-  char* CRLF; char* next; char* buf = state->request;
+  char* CRLF; char* buf = state->request;
   int end = state->end_idx;
   size_t length;
 
@@ -466,38 +665,19 @@ int resetbuf(fsm* state)
   if (CRLF == NULL)
     return -1;
 
-  if(strncmp(state->method, "POST", strlen("POST")))
-  {
-    /* length of the 1st request including CRLF */
-    length = (size_t)(strlen("\r\n\r\n") + CRLF - buf);
-  }
-  else
-  {
-    /* length of the 1st request including CRLF + body */
-    length = (size_t)(strlen("\r\n\r\n") + CRLF + state->body_size - buf);
-  }
-
-  if(length >= 8192)
-  {
-    /* buf was full, just memset */
-    memset(buf, 0, BUF_SIZE);
-    return 0;
-  }
-
-  if(strncmp(state->method, "POST", strlen("POST")))
-      next = CRLF + 4;
-  else
-    next = CRLF + 4 + state->body_size;
+  /* length of the 1st request including CRLF. A POST body is not
+     part of it; relay_body() takes that off the front afterwards. */
+  length = (size_t)(strlen("\r\n\r\n") + CRLF - buf);
 
   /* Copy remaining requests to start of buf */
-  memcpy(buf,next,BUF_SIZE-length);
+  memmove(buf, buf + length, end - length);
 
   /* Zero out the rest of the buf */
-  memset(buf+(BUF_SIZE-length),0,length);
+  memset(buf + (end - length), 0, length);
 
   /* I <3 this function */
 
-  return strlen(buf);
+  return end - length;
 }
 
 
@@ -508,7 +688,11 @@ void clean_state(fsm* state)
 {
   memset(state->response, 0, BUF_SIZE);
 
-  delfromfree(state->freebuf, FREE_SIZE);
+  delfromfree(state->cold->freebuf, FREE_SIZE);
+
+  if(state->body_fd >= 0)
+    close(state->body_fd);
+  state->body_fd = -1;
 
   state->method = NULL;
   state->uri = NULL;
@@ -519,6 +703,7 @@ void clean_state(fsm* state)
   state->body_size = 0;
 
   state->resp_idx = 0;
+  state->deferred = 0;
 }
 
 /*
@@ -528,100 +713,130 @@ void clean_state(fsm* state)
   @param        filename  The CGI file to be executed
   @param        flag      0 -> GET; 1 -> POST
 
-  @returns      -1 -> error; 0 -> success;
+  A GET may be answered from the micro-cache instead (mcache.c): then
+  the head and body are in state as for a static file. One identical
+  to a GET whose script is still to answer waits on that script's
+  output rather than running it again (flight.c).
+
+  @returns      -1 -> error; 0 -> success (the answer comes later,
+                unless the cache gave it); 503 -> too many CGI
+                requests waiting already
 */
 int exec_cgi(fsm* state, char* filename, int flag)
 {
-  pid_t pid;
   int stdin_pipe[2];
   int stdout_pipe[2];
 
   char* ENVP[26] = {0}; // NULL terminate
-  char* ARGV[ 2] = {cgipath, NULL};
+  int i, rc = -1, cached = MC_SKIP;
+
+  /* A cached response answers a GET without running anything; a stale
+     one is refreshed by a run nobody waits for */
+  if (!flag && !fcgi_enabled() &&
+      (cached = mcache_lookup(state, &state->fill)) == MC_HIT)
+    return 0;
 
   genenv(ENVP, state, filename, flag);
 
+  /* A persistent FastCGI worker answers instead of a new process */
+  if (fcgi_enabled())
+  {
+    rc = fcgi_begin(state, ENVP, flag);
+    if (rc == 0)
+      state->deferred = 1;
+    if (rc == 0 && flag && state->body_state != BODY_DONE)
+      state->cgi_in = CGI_IN_FCGI;   // The body follows as STDIN
+    return rc;
+  }
+
+  /* An identical GET whose script hasn't answered yet answers this
+     one too; otherwise others may join this one's run (flight.c) */
+  if (!flag && cached != MC_REFRESH &&
+      flight_join(state, ENVP, &state->flight))
+  {
+    if (state->fill != NULL)
+      mcache_abort(state->fill);
+    state->fill     = NULL;
+    state->deferred = 1;
+    return 0;
+  }
+
   /*************** BEGIN PIPE **************/
-  /* 0 can be read from, 1 can be written to */
+  /* 0 can be read from, 1 can be written to. Close-on-exec, so the
+     child keeps only the ends that become its stdin and stdout */
   if (pipe(stdin_pipe) < 0)
   {
     fprintf(stderr, "Error piping for stdin.\n");
-    return -1;
-   }
+    goto failed;
+  }
 
   if (pipe(stdout_pipe) < 0)
   {
+    close(stdin_pipe[0]);
+    close(stdin_pipe[1]);
     fprintf(stderr, "Error piping for stdout.\n");
-    return -1;
-   }
+    goto failed;
+  }
+
+  for (i = 0; i < 2; i++)
+  {
+    fcntl(stdin_pipe[i],  F_SETFD, FD_CLOEXEC);
+    fcntl(stdout_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
   /*************** END PIPE **************/
 
-  /*************** BEGIN FORK **************/
-  pid = fork();
-  /* not good */
-  if (pid < 0)
+  /* Its output is relayed as select() finds it (relay_cgi()) */
+  fcntl(stdout_pipe[0], F_SETFL, fcntl(stdout_pipe[0], F_GETFL) | O_NONBLOCK);
+  state->pipefds = stdout_pipe[0];
+
+  /* Started now, or once there is room for it (cgi.c) */
+  if ((rc = cgi_begin(state, ENVP, stdin_pipe[0], stdout_pipe[1],
+                      cached == MC_REFRESH)) != 0)
   {
-    fprintf(stderr, "Something really bad happened when fork()ing.\n");
-    return -1;
+    close(stdin_pipe[1]);
+    goto failed;
   }
 
-  /* child, setup environment, execve  */
-  if (pid == 0)
+  /* The stale copy is the answer; the run only refreshes it */
+  if (cached == MC_REFRESH)
   {
-     /*************** BEGIN EXECVE ****************/
-    close(stdout_pipe[0]);
     close(stdin_pipe[1]);
-    dup2(stdout_pipe[1], fileno(stdout));
-    dup2(stdin_pipe[0], fileno(stdin));
-    /* you should probably do something with stderr */
+    return 0;
+  }
+  state->deferred = 1;
 
-    /* pretty much no matter what, if it returns bad things happened... */
-    if (execve(cgipath, ARGV, ENVP))
-    {
-      execve_error_handler();
-      fprintf(stderr, "Error executing execve syscall.\n");
-      exit(1);
-    }
-    /*************** END EXECVE ****************/
+  /* The body, if any, is relayed as it arrives (relay_body()) */
+  if (flag && state->body_state != BODY_DONE)
+  {
+    fcntl(stdin_pipe[1], F_SETFL, fcntl(stdin_pipe[1], F_GETFL) | O_NONBLOCK);
+    state->cgi_in = stdin_pipe[1];
   }
+  else
+    close(stdin_pipe[1]);
+
+  return 0;
+
+failed:
+  if (state->fill != NULL)
+    mcache_abort(state->fill);
+  state->fill = NULL;
+  flight_abort(state->flight);
+  state->flight = NULL;
+  return cached == MC_REFRESH ? 0 : rc;
+}
 
-   if (pid > 0)
-   {
-     fprintf(stdout, "Parent: Heading to select() loop.\n");
-     close(stdout_pipe[1]);
-     close(stdin_pipe[0]);
-
-     if(!strncmp(state->method,"POST",strlen("POST")))
-     {
-       if (write(stdin_pipe[1], state->body, state->body_size) < 0)
-       {
-         fprintf(stderr, "Error writing to spawned CGI program.\n");
-         return -1;
-       }
-     }
-
-     fprintf(stderr,"Wrote successfully\n");
-     fprintf(stderr,"Wrote: %s\n", state->body);
-
-     close(stdin_pipe[1]); /* finished writing to spawn */
-     int verbose = 0;
-     if(verbose) {
-     int readret;
-     char buf[BUF_SIZE];
-     while((readret = read(stdout_pipe[0], buf, BUF_SIZE-1)) > 0)
-     {
-       buf[readret] = '\0'; /* nul-terminate string */
-       fprintf(stdout, "Got from CGI: %s\n", buf);
-     }
-     }
-   }
-   /*************** END FORK **************/
-
-   /* Save the output file descriptor of the CGI process
-      to read from later */
-   state->pipefds = stdout_pipe[0];
-   return 0;
- }
+/*************************************************************/
+/* @brief Builds the CGI environment entries that only depend */
+/* on the server, once at startup. The rest of the invariant  */
+/* entries (GATEWAY_INTERFACE, SERVER_NAME, ...) are literals. */
+/*************************************************************/
+void cgi_env_init(void)
+{
+  snprintf(server_port_env[0], sizeof(server_port_env[0]),
+           "SERVER_PORT=%hd", listen_port);
+  snprintf(server_port_env[1], sizeof(server_port_env[1]),
+           "SERVER_PORT=%hd", https_port);
+}
 
 /***************************************************************/
 /* @brief Generates environment variables and feeds it to ENVP */
@@ -636,10 +851,15 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
   if(cgi != NULL && strlen(cgi) == 1) // Is the '?' at the end of the URI?
     cgi = NULL;
 
-  if(flag)
+  if(flag && state->body_state == BODY_CHUNK_SIZE)
+  {// Chunked POST: the length isn't known, the script reads to EOF
+    ENVP[0] = "CONTENT_LENGTH=";
+  }
+  else if(flag)
   {// POST
-    ENVP[0] = malloc(strlen("CONTENT_LENGTH=") + 20);
+    ENVP[0] = conn_malloc(state, MEM_CGI, strlen("CONTENT_LENGTH=") + 20);
     memset(ENVP[0], 0, strlen("CONTENT_LENGTH=") + 20);
+    addtofree(state->cold->freebuf, ENVP[0], FREE_SIZE);
     snprintf(ENVP[0], strlen("CONTENT_LENGTH=") + 20, "CONTENT_LENGTH=%ld", state->body_size);
   }
   else     // GET
@@ -658,9 +878,9 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
         ENVP[1] = "CONTENT_TYPE=";
 
       n = (size_t)(CRLF - tmp);
-      ENVP[1] = malloc(strlen("CONTENT_TYPE=") + n + 1);
+      ENVP[1] = conn_malloc(state, MEM_CGI, strlen("CONTENT_TYPE=") + n + 1);
       memset(ENVP[1], 0, strlen("CONTENT_TYPE=") + n + 1);
-      addtofree(state->freebuf, ENVP[1], FREE_SIZE);
+      addtofree(state->cold->freebuf, ENVP[1], FREE_SIZE);
 
       snprintf(ENVP[1], strlen("CONTENT_TYPE=") + n + 1, "CONTENT_TYPE=%s", tmp);
     }
@@ -672,27 +892,24 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
 
   ENVP[2] = "GATEWAY_INTERFACE=CGI/1.1";
 
-  /* QUERY-STRING */
-  if(cgi == NULL) // POST
+  /* QUERY-STRING. Only from the URI; a POST body is the script's stdin */
+  if(cgi == NULL)
   {
-    ENVP[3] = malloc(strlen("QUERY_STRING=") + state->body_size + 1);
-    memset(ENVP[3], 0, strlen("QUERY_STRING=") + state->body_size + 1);
-    addtofree(state->freebuf, ENVP[3], FREE_SIZE);
-    sprintf(ENVP[3], "QUERY_STRING=%s", state->body);
+    ENVP[3] = "QUERY_STRING=";
   }
-  else            // GET
+  else
   {
-    ENVP[3] = malloc(strlen("QUERY_STRING=") + strlen(cgi+1) + 1);
+    ENVP[3] = conn_malloc(state, MEM_CGI, strlen("QUERY_STRING=") + strlen(cgi+1) + 1);
     memset(ENVP[3], 0, strlen("QUERY_STRING=") + strlen(cgi+1) + 1);
-    addtofree(state->freebuf, ENVP[3], FREE_SIZE);
+    addtofree(state->cold->freebuf, ENVP[3], FREE_SIZE);
     sprintf(ENVP[3], "QUERY_STRING=%s", cgi+1);
   }
 
   /* REMOTE_ADDR */
-  ENVP[4] = malloc(strlen("REMOTE_ADDR=") + strlen(state->cli_ip) + 1);
-  memset(ENVP[4], 0, strlen("REMOTE_ADDR=") + strlen(state->cli_ip) + 1);
-  addtofree(state->freebuf, ENVP[4], FREE_SIZE);
-  sprintf(ENVP[4], "REMOTE_ADDR=%s", state->cli_ip);
+  ENVP[4] = conn_malloc(state, MEM_CGI, strlen("REMOTE_ADDR=") + strlen(state->cold->cli_ip) + 1);
+  memset(ENVP[4], 0, strlen("REMOTE_ADDR=") + strlen(state->cold->cli_ip) + 1);
+  addtofree(state->cold->freebuf, ENVP[4], FREE_SIZE);
+  sprintf(ENVP[4], "REMOTE_ADDR=%s", state->cold->cli_ip);
 
   /* REMOTE_HOST */
   ENVP[5] = "REMOTE_HOST=";
@@ -722,9 +939,9 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
     else
     {
       n = (size_t)(CRLF - tmp);
-      ENVP[8] = malloc(strlen("HOST_NAME=") + n + 1);
+      ENVP[8] = conn_malloc(state, MEM_CGI, strlen("HOST_NAME=") + n + 1);
       memset(ENVP[8], 0, strlen("HOST_NAME=") + n + 1);
-      addtofree(state->freebuf, ENVP[8], FREE_SIZE);
+      addtofree(state->cold->freebuf, ENVP[8], FREE_SIZE);
 
       snprintf(ENVP[8], strlen("HOST_NAME=") + n + 1, "HOST_NAME=%s", tmp);
     }
@@ -733,14 +950,10 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
     ENVP[8] = "HOST_NAME=";
 
   /* SERVER_PORT */
-  ENVP[9] = malloc(strlen("SERVER_PORT=") + 7); // Max digits in short
-  memset(ENVP[9], 0, strlen("SERVER_PORT=") + 7);
-  addtofree(state->freebuf, ENVP[9], FREE_SIZE);
-
   if(state->context == NULL) // http port
-    sprintf(ENVP[9], "SERVER_PORT=%hd", listen_port);
+    ENVP[9] = server_port_env[0];
   else                       // https port
-    sprintf(ENVP[9], "SERVER_PORT=%hd", https_port);
+    ENVP[9] = server_port_env[1];
 
   /* Server details */
   ENVP[10] = "SERVER_PROTOCOL=HTTP/1.1";
@@ -760,9 +973,9 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
     else
     {
       n = (size_t)(CRLF - tmp);
-      ENVP[12] = malloc(strlen("HTTP_ACCEPT=") + n + 1);
+      ENVP[12] = conn_malloc(state, MEM_CGI, strlen("HTTP_ACCEPT=") + n + 1);
       memset(ENVP[12], 0, strlen("HTTP_ACCEPT=") + n + 1);
-      addtofree(state->freebuf, ENVP[12], FREE_SIZE);
+      addtofree(state->cold->freebuf, ENVP[12], FREE_SIZE);
 
       snprintf(ENVP[12], strlen("HTTP_ACCEPT=") + n + 1, "HTTP_ACCEPT=%s", tmp);
     }
@@ -784,9 +997,9 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
     else
     {
       n = (size_t)(CRLF - tmp);
-      ENVP[13] = malloc(strlen("HTTP_REFERER=") + n + 1);
+      ENVP[13] = conn_malloc(state, MEM_CGI, strlen("HTTP_REFERER=") + n + 1);
       memset(ENVP[13], 0, strlen("HTTP_REFERER=") + n + 1);
-      addtofree(state->freebuf, ENVP[13], FREE_SIZE);
+      addtofree(state->cold->freebuf, ENVP[13], FREE_SIZE);
 
       snprintf(ENVP[13], strlen("HTTP_REFERER=") + n + 1, "HTTP_REFERER=%s", tmp);
     }
@@ -808,9 +1021,9 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
     else
     {
       n = (size_t)(CRLF - tmp);
-      ENVP[14] = malloc(strlen("HTTP_ACCEPT_ENCODING=") + n + 1);
+      ENVP[14] = conn_malloc(state, MEM_CGI, strlen("HTTP_ACCEPT_ENCODING=") + n + 1);
       memset(ENVP[14], 0, strlen("HTTP_ACCEPT_ENCODING=") + n + 1);
-      addtofree(state->freebuf, ENVP[14], FREE_SIZE);
+      addtofree(state->cold->freebuf, ENVP[14], FREE_SIZE);
 
       snprintf(ENVP[14], strlen("HTTP_ACCEPT_ENCODING=") + n + 1, "HTTP_ACCEPT_ENCODING=%s", tmp);
     }
@@ -832,9 +1045,9 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
     else
     {
       n = (size_t)(CRLF - tmp);
-      ENVP[15] = malloc(strlen("HTTP_ACCEPT_LANGUAGE=") + n + 1);
+      ENVP[15] = conn_malloc(state, MEM_CGI, strlen("HTTP_ACCEPT_LANGUAGE=") + n + 1);
       memset(ENVP[15], 0, strlen("HTTP_ACCEPT_LANGUAGE=") + n + 1);
-      addtofree(state->freebuf, ENVP[15], FREE_SIZE);
+      addtofree(state->cold->freebuf, ENVP[15], FREE_SIZE);
 
       snprintf(ENVP[15], strlen("HTTP_ACCEPT_LANGUAGE=") + n + 1, "HTTP_ACCEPT_LANGUAGE=%s", tmp);
     }
@@ -856,9 +1069,9 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
     else
     {
       n = (size_t)(CRLF - tmp);
-      ENVP[16] = malloc(strlen("HTTP_ACCEPT_CHARSET=") + n + 1);
+      ENVP[16] = conn_malloc(state, MEM_CGI, strlen("HTTP_ACCEPT_CHARSET=") + n + 1);
       memset(ENVP[16], 0, strlen("HTTP_ACCEPT_CHARSET=") + n + 1);
-      addtofree(state->freebuf, ENVP[16], FREE_SIZE);
+      addtofree(state->cold->freebuf, ENVP[16], FREE_SIZE);
 
       snprintf(ENVP[16], strlen("HTTP_ACCEPT_CHARSET=") + n + 1, "HTTP_ACCEPT_CHARSET=%s", tmp);
     }
@@ -880,9 +1093,9 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
     else
     {
       n = (size_t)(CRLF - tmp);
-      ENVP[17] = malloc(strlen("HTTP_COOKIE=") + n + 1);
+      ENVP[17] = conn_malloc(state, MEM_CGI, strlen("HTTP_COOKIE=") + n + 1);
       memset(ENVP[17], 0, strlen("HTTP_COOKIE=") + n + 1);
-      addtofree(state->freebuf, ENVP[17], FREE_SIZE);
+      addtofree(state->cold->freebuf, ENVP[17], FREE_SIZE);
 
       snprintf(ENVP[17], strlen("HTTP_COOKIE=") + n + 1, "HTTP_COOKIE=%s", tmp);
     }
@@ -904,9 +1117,9 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
     else
     {
       n = (size_t)(CRLF - tmp);
-      ENVP[18] = malloc(strlen("HTTP_USER_AGENT=") + n + 1);
+      ENVP[18] = conn_malloc(state, MEM_CGI, strlen("HTTP_USER_AGENT=") + n + 1);
       memset(ENVP[18], 0, strlen("HTTP_USER_AGENT=") + n + 1);
-      addtofree(state->freebuf, ENVP[18], FREE_SIZE);
+      addtofree(state->cold->freebuf, ENVP[18], FREE_SIZE);
 
       snprintf(ENVP[18], strlen("HTTP_USER_AGENT=") + n + 1, "HTTP_USER_AGENT=%s", tmp);
     }
@@ -934,9 +1147,9 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
     else
     {
       n = (size_t)(CRLF - tmp);
-      ENVP[20] = malloc(strlen("HTTP_HOST=") + n + 1);
+      ENVP[20] = conn_malloc(state, MEM_CGI, strlen("HTTP_HOST=") + n + 1);
       memset(ENVP[20], 0, strlen("HTTP_HOST=") + n + 1);
-      addtofree(state->freebuf, ENVP[20], FREE_SIZE);
+      addtofree(state->cold->freebuf, ENVP[20], FREE_SIZE);
 
       snprintf(ENVP[20], strlen("HTTP_HOST=") + n + 1, "HTTP_HOST=%s", tmp);
     }
@@ -947,27 +1160,164 @@ void genenv(char** ENVP, fsm* state, char* filename, int flag)
   /* What's left: */
 
   /* REQUEST_URI */
-  ENVP[22] = malloc(strlen("REQUEST_URI=") + strlen(filename) + 1);
+  ENVP[22] = conn_malloc(state, MEM_CGI, strlen("REQUEST_URI=") + strlen(filename) + 1);
   memset(ENVP[22], 0, strlen("REQUEST_URI=") + strlen(filename) + 1);
+  addtofree(state->cold->freebuf, ENVP[22], FREE_SIZE);
   sprintf(ENVP[22], "REQUEST_URI=%s", filename);
 
   /* PATH_INFO (change) */
-  ENVP[21] = malloc(strlen("PATH_INFO=") + strlen(filename) + 1);
+  ENVP[21] = conn_malloc(state, MEM_CGI, strlen("PATH_INFO=") + strlen(filename) + 1);
   memset(ENVP[21], 0, strlen("PATH_INFO=") + strlen(filename) + 1);
+  addtofree(state->cold->freebuf, ENVP[21], FREE_SIZE);
   sprintf(ENVP[21], "PATH_INFO=%s", filename+4);
 
   ENVP[23] = "SERVER_SOFTWARE=Liso1.0";
 }
 
 
-/******************************************************/
-/* @brief searches headers for a particular field and */
-/*        returns a ptr to its value.                 */
-/*                                                    */
-/* @param state       The state of the client         */
-/* @param hdr         The string in question          */
-/* @param n           The length of hdr               */
-/******************************************************/
+/* An NPH script's own head: with a Content-Length and nothing that
+   closes the connection (HTTP/1.0, Connection: close or a transfer
+   coding we'd have to follow), the connection outlives it */
+static int nph_framing(char* hdrs, size_t len)
+{
+  char* line; char* eol;
+  size_t llen;
+  int framing = FRAME_CLOSE;
+
+  if (len < 8 || strncmp(hdrs, "HTTP/1.1", 8))
+    return FRAME_CLOSE;
+
+  for (line = hdrs; line < hdrs + len; line = eol + 1)
+  {
+    if ((eol = memchr(line, '\n', hdrs + len - line)) == NULL)
+      break;
+    llen = eol - line;
+
+    if ((llen >= 18 && !strncasecmp(line, "Transfer-Encoding:", 18)) ||
+        (llen >= 11 && !strncasecmp(line, "Connection:", 11) &&
+         memmem(line, llen, "close", 5) != NULL))
+      return FRAME_CLOSE;
+    if (llen >= 15 && !strncasecmp(line, "Content-Length:", 15))
+      framing = FRAME_LENGTH;
+  }
+
+  return framing;
+}
+
+/******************************************************************/
+/* @brief Turns the header block a CGI script printed into the    */
+/* head of an HTTP response. Status: sets the status line         */
+/* (Location: alone means a redirect); Connection: and            */
+/* Transfer-Encoding: are ours to decide, everything else is      */
+/* passed on. Without a Content-Length, a body for a keep-alive   */
+/* client is sent chunked. Output that already starts with a      */
+/* status line (an NPH script) is copied as is.                   */
+/*                                                                */
+/* @param hdrs     The script's headers, including the blank line */
+/* @param len      Length of hdrs                                 */
+/* @param out      Buffer of BUF_SIZE bytes for the HTTP head     */
+/* @param keep     1 if the client asked for keep-alive           */
+/* @param framing  Set to how the body is delimited (FRAME_*)     */
+/*                                                                */
+/* @returns length of the head in out, -1 if it does not fit      */
+/******************************************************************/
+int cgi_head(char* hdrs, size_t len, char* out, int keep, int* framing)
+{
+  char status[64] = "200 OK";
+  char* line; char* eol; char* val;
+  size_t llen;
+  int n, w, pass, given = 0;
+
+  *framing = FRAME_CLOSE;
+
+  if (len >= 5 && !strncmp(hdrs, "HTTP/", 5))
+  {
+    if (len >= BUF_SIZE)
+      return -1;
+    memcpy(out, hdrs, len);
+    *framing = nph_framing(hdrs, len);
+    return (int)len;
+  }
+
+  /* First pass finds the status, second writes the other headers */
+  n = 0;
+  for (pass = 0; pass < 2; pass++)
+  {
+    if (pass == 1)
+      n = snprintf(out, BUF_SIZE, "HTTP/1.1 %s\r\nServer: Liso/1.0\r\n",
+                   status);
+
+    for (line = hdrs; line < hdrs + len; line = eol + 1)
+    {
+      if ((eol = memchr(line, '\n', hdrs + len - line)) == NULL)
+        break;
+      llen = eol - line;
+      if (llen > 0 && line[llen - 1] == '\r')
+        llen--;
+      if (llen == 0)
+        break;   // The blank line
+
+      if (llen > 7 && !strncasecmp(line, "Status:", 7))
+      {
+        for (val = line + 7; *val == ' ' && val < line + llen; val++)
+          ;
+        if (pass == 0)
+          given = snprintf(status, sizeof(status), "%.*s",
+                           (int)(line + llen - val), val);
+        continue;
+      }
+      if ((llen >= 11 && !strncasecmp(line, "Connection:", 11)) ||
+          (llen >= 18 && !strncasecmp(line, "Transfer-Encoding:", 18)))
+        continue;
+
+      if (pass == 0)
+      {
+        if (llen >= 9 && !strncasecmp(line, "Location:", 9) &&
+            !given)
+          strcpy(status, "302 Found");
+        continue;
+      }
+
+      if (llen >= 15 && !strncasecmp(line, "Content-Length:", 15))
+        *framing = FRAME_LENGTH;
+      if (n + llen + 2 >= BUF_SIZE)
+        return -1;
+      memcpy(out + n, line, llen);
+      memcpy(out + n + llen, "\r\n", 2);
+      n += llen + 2;
+    }
+  }
+
+  if (*framing == FRAME_CLOSE && keep)
+    *framing = FRAME_CHUNKED;
+
+  w = snprintf(out + n, BUF_SIZE - n, "%sConnection: %s\r\n\r\n",
+               *framing == FRAME_CHUNKED ? "Transfer-Encoding: chunked\r\n" : "",
+               keep ? "keep-alive" : "close");
+  if (w < 0 || n + w >= BUF_SIZE)
+    return -1;
+
+  return n + w;
+}
+
+/****************************************************************/
+/* @brief Frames len bytes of body, already placed CHUNK_HEAD   */
+/* bytes into buf, as one chunk. The size is written with       */
+/* leading zeros so the data never has to move; buf needs       */
+/* CHUNK_PAD bytes more than len.                               */
+/*                                                              */
+/* @returns the length of the chunk, from buf                   */
+/****************************************************************/
+size_t chunk_frame(char* buf, size_t len)
+{
+  char head[CHUNK_HEAD + 1];
+
+  snprintf(head, sizeof(head), "%08zx\r\n", len);
+  memcpy(buf, head, CHUNK_HEAD);
+  memcpy(buf + CHUNK_HEAD + len, "\r\n", 2);
+  return len + CHUNK_PAD;
+}
+
 char* search_hdr(fsm* state, char* hdr, int n)
 {
   char* CRLF;
@@ -997,12 +1347,29 @@ char* search_hdr(fsm* state, char* hdr, int n)
 /*********************************************************/
 int Recv(int fd, SSL* client_context, char* buf, int num)
 {
+  int n;
+
   if (client_context == NULL)
   {
     return recv(fd, buf, num, 0);
   }
 
-  return SSL_read(client_context, buf, num);
+  if ((n = SSL_read(client_context, buf, num)) > 0)
+    return n;
+
+  /* The socket is non-blocking: answer the way recv() would */
+  switch (SSL_get_error(client_context, n))
+  {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    default:
+      errno = EIO;
+      return -1;
+  }
 }
 
 /*********************************************************/
@@ -1023,6 +1390,72 @@ int Send(int fd, SSL* client_context, char* buf, int num)
   return SSL_write(client_context, buf, num);
 }
 
+/*********************************************************/
+/* @brief Answers a GET or HEAD of uri from a client on  */
+/* the loopback address with a page put() generates;    */
+/* the page goes in state as for a static file. The      */
+/* metrics and the trace are served this way.            */
+/*                                                       */
+/* @param uri    The page's URI; any query is ignored    */
+/* @param type   Its Content-Type                        */
+/* @param put    Writes the page to f; nonzero if it     */
+/*               could not                               */
+/*                                                       */
+/* @retval -1  not the page, or not a local client       */
+/* @retval  0  answered                                  */
+/* @retval 500 out of memory                             */
+/*********************************************************/
+int serve_page(fsm* state, const char* uri, const char* type,
+               int (*put)(FILE* f))
+{
+  size_t len = 0, ulen;
+  char date[64];
+  char* text = NULL;
+  FILE* f;
+  time_t t;
+  int n, failed;
+
+  ulen = strcspn(state->uri, "?");
+  if (ulen != strlen(uri) || strncmp(state->uri, uri, ulen) ||
+      strncmp(state->cold->cli_ip, "127.", 4) ||
+      (strcmp(state->method, "GET") && strcmp(state->method, "HEAD")))
+    return -1;
+
+  if ((f = open_memstream(&text, &len)) == NULL)
+    return 500;
+  failed = put(f);
+  fclose(f);
+  if (failed)
+  {
+    free(text);
+    return 500;
+  }
+
+  t = time(NULL);
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %Z", gmtime(&t));
+  n = snprintf(state->response, BUF_SIZE, "HTTP/1.1 200 OK\r\n"
+               "Date: %s\r\nServer: Liso/1.0\r\nConnection: %s\r\n"
+               "Content-Type: %s\r\nContent-Length: %zu\r\n\r\n", date,
+               state->conn ? "keep-alive" : "close", type, len);
+
+  state->resp_idx  = n;
+  state->body      = NULL;
+  state->body_size = 0;
+  if (!strcmp(state->method, "GET") && len > 0)
+  {
+    if ((state->body = conn_malloc(state, MEM_BODY, len)) == NULL)
+    {
+      free(text);
+      return 500;
+    }
+    memcpy(state->body, text, len);
+    state->body_size = len;
+    addtofree(state->cold->freebuf, state->body, FREE_SIZE);
+  }
+  free(text);
+  return 0;
+}
+
 void addtofree(char** freebuf, char* ptr, int bufsize)
 {
   for (int i = 0; i < bufsize; i++)
@@ -1043,12 +1476,25 @@ void delfromfree(char** freebuf, int bufsize)
   for (int i = 0; i < bufsize; i++)
   {
     if (freebuf[i] != NULL)
-      free(freebuf[i]);
+      liso_free(freebuf[i]);
     freebuf[i] = NULL;
   }
   return;
 }
 
+/* Forgets ptr without freeing it; someone else owns it now */
+void takefromfree(char** freebuf, char* ptr, int bufsize)
+{
+  for (int i = 0; i < bufsize; i++)
+  {
+    if (freebuf[i] == ptr)
+    {
+      freebuf[i] = NULL;
+      return;
+    }
+  }
+}
+
 /**********************************************************/
 /* @returns NULL If not needle not found; else pointer to */
 /* first occurrence of needle                             */
@@ -3,9 +3,29 @@
 
 #include "lisod.h"
 
+/* Where relay_body() is in a request body (fsm.body_state) */
+#define BODY_DONE       0   // No body, or all of it relayed
+#define BODY_LENGTH     1   // Content-Length: body_left bytes to go
+#define BODY_CHUNK_SIZE 2   // chunked: waiting for a chunk-size line
+#define BODY_CHUNK      3   // chunked: body_left bytes of chunk data to go
+#define BODY_CHUNK_END  4   // chunked: the CRLF after a chunk's data
+#define BODY_TRAILER    5   // chunked: trailer lines, up to a blank one
+
+#define CGI_IN_FCGI    -2   // fsm.cgi_in: the body goes to a FastCGI worker
+#define CGI_IN_PLUGIN  -3   // ... or to an in-process handler (plugin.c)
+
+/* How a CGI response body is delimited (cgi_head()) */
+#define FRAME_HEAD     -1   // cgi slot: the script's headers aren't all in
+#define FRAME_CLOSE     0   // closing the connection ends it
+#define FRAME_LENGTH    1   // the script sent a Content-Length
+#define FRAME_CHUNKED   2   // we send it with chunked encoding
+
+#define CHUNK_HEAD     10   // "%08x\r\n" in front of a chunk's data
+#define CHUNK_PAD      12   // ... and the CRLF after it
+
 int   parse_line(fsm* state);
 int   parse_headers(fsm* state);
-int   parse_body(fsm* state);
+int   relay_body(fsm* state);
 int   store_request(char* buf, int size, fsm* state);
 int   service(fsm* state);
 void* memmem(const void *haystack, size_t hlen,
@@ -18,13 +38,19 @@ int  validsize(char* body_size);
 
 int Recv(int fd, SSL* client_context, char* buf, int num);
 int Send(int fd, SSL* client_context, char* buf, int num);
+int serve_page(fsm* state, const char* uri, const char* type,
+               int (*put)(FILE* f));
 
 void addtofree   (char** freebuf, char* ptr, int bufsize);
 void delfromfree (char** freebuf, int bufsize);
+void takefromfree(char** freebuf, char* ptr, int bufsize);
 
 int   exec_cgi(fsm* state, char* filename, int flag);
+void  cgi_env_init(void);
 void  genenv(char** ENVP, fsm* state, char* filename, int flag);
 char* search_hdr(fsm* state, char* hdr, int n);
+int   cgi_head(char* hdrs, size_t len, char* out, int keep, int* framing);
+size_t chunk_frame(char* buf, size_t len);
 
 void execve_error_handler();
 #endif
@@ -0,0 +1,1360 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file fcgi.c                                                    */
+/*                                                                 */
+/* @brief FastCGI client. Instead of fork-exec'ing the CGI script  */
+/* for every request, liso keeps a few persistent connections to   */
+/* long-lived workers running the script, multiplexes requests on  */
+/* them and relays the records through the event loop. Workers are */
+/* either spawned and supervised by liso (LISO_FCGI_WORKERS) or    */
+/* run elsewhere (LISO_FCGI_ADDR).                                 */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+
+#include "fcgi.h"
+#include "engine.h"
+#include "alloc.h"
+#include "config.h"
+#include "logger.h"
+
+#define FCGI_IN_SIZE (FCGI_HEADER_LEN + FCGI_MAX_CONTENT + 255)
+
+/* A connection stops being read while one of its clients has this
+   much output queued; the worker then blocks on its socket. */
+#define FCGI_CLIENT_HIGH (256 * 1024)
+
+extern FILE* logfile;
+
+fcgi_counters fcgi_stats;
+
+static int       enabled;
+static pool*     fpool;
+static char*     fapp;                /* Script the workers run */
+
+static fcgi_conn conns[FCGI_MAX_CONNS];
+static int       nconns;
+
+static pid_t     workers[FCGI_MAX_WORKERS];
+static time_t    spawned[FCGI_MAX_WORKERS];
+static int       nworkers;
+static int       worker_fd = -1;      /* Socket the workers accept on */
+
+static struct sockaddr_storage addr;  /* Where the workers listen */
+static socklen_t addr_len;
+static char      sock_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static fcgi_req* wait_head;           /* Requests waiting for a slot */
+static fcgi_req* wait_tail;
+
+static char      stdin_buf[BUF_SIZE]; /* Body taken this pass */
+static size_t    stdin_len;
+static fcgi_req* stdin_cur;           /* ... and the request it is for */
+static int       nbroken;             /* Requests to fail on the next pass */
+
+static int  dispatch(fcgi_req* req);
+static void conn_close(fcgi_conn* c, char* why);
+
+/*************************************************************/
+/* @brief Writes one record with request id 0 (filled in by  */
+/* set_id() once the request is given a connection).         */
+/*                                                           */
+/* @returns number of bytes written to dst                   */
+/*************************************************************/
+static size_t put_record(char* dst, int type, const char* data, size_t len)
+{
+  dst[0] = FCGI_VERSION_1;
+  dst[1] = (char)type;
+  dst[2] = 0;
+  dst[3] = 0;
+  dst[4] = (char)((len >> 8) & 0xff);
+  dst[5] = (char)(len & 0xff);
+  dst[6] = 0;   // No padding
+  dst[7] = 0;
+
+  if (len > 0)
+    memcpy(dst + FCGI_HEADER_LEN, data, len);
+  return FCGI_HEADER_LEN + len;
+}
+
+/* Writes data as records of one type. Returns the bytes written. */
+static size_t put_records(char* dst, int type, const char* data, size_t len)
+{
+  size_t n = 0, chunk;
+
+  while (len > 0)
+  {
+    chunk = len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+    n    += put_record(dst + n, type, data, chunk);
+    data += chunk;
+    len  -= chunk;
+  }
+
+  return n;
+}
+
+/* Writes data as a stream of records of one type, ending with an
+   empty record. Returns the bytes written. */
+static size_t put_stream(char* dst, int type, const char* data, size_t len)
+{
+  size_t n = put_records(dst, type, data, len);
+
+  return n + put_record(dst + n, type, NULL, 0);
+}
+
+/* Size of a stream of len bytes once put_stream() has framed it */
+static size_t stream_size(size_t len)
+{
+  return len + FCGI_HEADER_LEN * (len / FCGI_MAX_CONTENT + 2);
+}
+
+/* Encodes one name-value pair; with dst NULL only measures it */
+static size_t put_pair(char* dst, const char* name, size_t nlen,
+                       const char* value, size_t vlen)
+{
+  size_t n = 0, len[2] = {nlen, vlen};
+  int k;
+
+  for (k = 0; k < 2; k++)
+  {
+    if (len[k] < 128)
+    {
+      if (dst) dst[n] = (char)len[k];
+      n += 1;
+    }
+    else
+    {
+      if (dst)
+      {
+        dst[n]     = (char)(((len[k] >> 24) & 0x7f) | 0x80);
+        dst[n + 1] = (char)((len[k] >> 16) & 0xff);
+        dst[n + 2] = (char)((len[k] >> 8) & 0xff);
+        dst[n + 3] = (char)(len[k] & 0xff);
+      }
+      n += 4;
+    }
+  }
+
+  if (dst)
+  {
+    memcpy(dst + n, name, nlen);
+    memcpy(dst + n + nlen, value, vlen);
+  }
+  return n + nlen + vlen;
+}
+
+/* Decodes one name-value length; returns bytes used, 0 if truncated */
+static size_t get_len(const unsigned char* src, size_t left, size_t* len)
+{
+  if (left < 1)
+    return 0;
+  if (!(src[0] & 0x80))
+  {
+    *len = src[0];
+    return 1;
+  }
+  if (left < 4)
+    return 0;
+  *len = ((size_t)(src[0] & 0x7f) << 24) | ((size_t)src[1] << 16) |
+         ((size_t)src[2] << 8) | src[3];
+  return 4;
+}
+
+/* Stamps a request id into every record header of an encoded request */
+static void set_id(char* records, size_t len, int id)
+{
+  size_t off = 0;
+  unsigned char* h;
+
+  while (off + FCGI_HEADER_LEN <= len)
+  {
+    h    = (unsigned char*)records + off;
+    h[2] = (unsigned char)((id >> 8) & 0xff);
+    h[3] = (unsigned char)(id & 0xff);
+    off += FCGI_HEADER_LEN + ((size_t)h[4] << 8 | h[5]) + h[6];
+  }
+}
+
+/****************************************************************/
+/* @brief Parses LISO_FCGI_ADDR (or the default socket path):   */
+/* "/path/to/socket" for a Unix socket, "host:port" for TCP.    */
+/*                                                              */
+/* @retval 0 on success, -1 if it could not be resolved         */
+/****************************************************************/
+static int parse_addr(char* spec)
+{
+  struct sockaddr_un* un = (struct sockaddr_un*)&addr;
+  struct addrinfo hints, *res;
+  char host[256] = {0};
+  char* colon;
+
+  memset(&addr, 0, sizeof(addr));
+
+  if (spec[0] == '/')
+  {
+    if (strlen(spec) >= sizeof(un->sun_path))
+      return -1;
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, spec);
+    addr_len = sizeof(struct sockaddr_un);
+    return 0;
+  }
+
+  if ((colon = strrchr(spec, ':')) == NULL ||
+      (size_t)(colon - spec) >= sizeof(host))
+    return -1;
+  strncpy(host, spec, colon - spec);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res) != 0)
+    return -1;
+
+  memcpy(&addr, res->ai_addr, res->ai_addrlen);
+  addr_len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+/*************************************************************/
+/* @brief Starts worker i: the script is exec'd with the     */
+/* listening socket on FCGI_LISTENSOCK_FILENO, as the        */
+/* FastCGI spec prescribes for server-managed applications.  */
+/*************************************************************/
+static void spawn_worker(int i)
+{
+  char* argv[2] = {fapp, NULL};
+  pid_t pid;
+  sigset_t none;
+  int fd;
+
+  spawned[i] = time(NULL);
+
+  if ((pid = fork()) < 0)
+  {
+    log_error("Unable to fork FastCGI worker", logfile);
+    return;
+  }
+
+  if (pid == 0)
+  {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);   // Don't outlive lisod
+    dup2(worker_fd, FCGI_LISTENSOCK_FILENO);
+    for (fd = 3; fd < getdtablesize(); fd++)
+      close(fd);   // Client sockets and listeners stay with lisod
+    signal(SIGPIPE, SIG_DFL);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);   // lisod blocks SIGCHLD
+    execv(fapp, argv);
+    execve_error_handler();
+    _exit(1);
+  }
+
+  workers[i] = pid;
+  fcgi_stats.spawns++;
+
+  log_info("Started FastCGI worker %d (pid %d)", i, (int)pid);
+}
+
+/****************************************************************/
+/* @brief Sets up the FastCGI backend if it is configured.      */
+/* With LISO_FCGI_WORKERS set, liso binds the worker socket and */
+/* spawns that many copies of app; otherwise it only connects   */
+/* to LISO_FCGI_ADDR. Connections are opened on first use.      */
+/*                                                              */
+/* @param app  The CGI script, run as the FastCGI application   */
+/* @param p    The pool whose select sets the connections join  */
+/*                                                              */
+/* @retval  0  ready, or FastCGI is not configured              */
+/* @retval -1  the worker socket could not be set up            */
+/****************************************************************/
+int fcgi_init(char* app, pool* p)
+{
+  int i, on = 1;
+
+  if (config.fcgi_workers <= 0 && config.fcgi_addr == NULL)
+    return 0;
+
+  fpool    = p;
+  fapp     = app;
+  nworkers = config.fcgi_workers < FCGI_MAX_WORKERS ?
+             config.fcgi_workers : FCGI_MAX_WORKERS;
+  nconns   = config.fcgi_conns > 0 ? config.fcgi_conns :
+             (nworkers > 0 ? nworkers : 4);
+  if (nconns > FCGI_MAX_CONNS)
+    nconns = FCGI_MAX_CONNS;
+
+  for (i = 0; i < nconns; i++)
+  {
+    memset(&conns[i], 0, sizeof(fcgi_conn));
+    conns[i].fd = -1;
+  }
+
+  if (config.fcgi_addr == NULL)
+    snprintf(sock_path, sizeof(sock_path), "/tmp/lisod-fcgi.%d.sock",
+             (int)getpid());
+
+  if (parse_addr(config.fcgi_addr ? config.fcgi_addr : sock_path))
+  {
+    log_error("Bad FastCGI address", logfile);
+    return -1;
+  }
+
+  if (nworkers > 0)
+  {
+    if (addr.ss_family == AF_UNIX)
+    {
+      strcpy(sock_path, ((struct sockaddr_un*)&addr)->sun_path);
+      unlink(sock_path);
+    }
+    else
+      sock_path[0] = '\0';
+
+    if ((worker_fd = socket(addr.ss_family, SOCK_STREAM, 0)) == -1 ||
+        setsockopt(worker_fd, SOL_SOCKET, SO_REUSEADDR, &on,
+                   sizeof(on)) == -1 ||
+        bind(worker_fd, (struct sockaddr*)&addr, addr_len) == -1 ||
+        listen(worker_fd, 128) == -1)
+    {
+      log_error("Unable to set up the FastCGI worker socket", logfile);
+      if (worker_fd >= 0) close(worker_fd);
+      worker_fd = -1;
+      return -1;
+    }
+    fcntl(worker_fd, F_SETFD, FD_CLOEXEC);
+
+    for (i = 0; i < nworkers; i++)
+      spawn_worker(i);
+  }
+
+  enabled = 1;
+  return 0;
+}
+
+int fcgi_enabled(void)
+{
+  return enabled;
+}
+
+/* A child was reaped (cgi_reap()); if it was a worker, its slot is
+   freed for fcgi_supervise() to fill */
+void fcgi_reaped(pid_t pid)
+{
+  char log_buf[LOG_SIZE] = {0};
+  int i;
+
+  for (i = 0; i < nworkers; i++)
+    if (workers[i] == pid)
+    {
+      sprintf(log_buf, "FastCGI worker %d (pid %d) exited", i, (int)pid);
+      log_error(log_buf, logfile);
+      workers[i] = 0;
+      return;
+    }
+}
+
+/*************************************************************/
+/* @brief Restarts workers that have exited. Called once per */
+/* pass of the event loop; a worker that keeps dying is      */
+/* restarted at most once a second.                          */
+/*************************************************************/
+void fcgi_supervise(void)
+{
+  int i;
+
+  for (i = 0; i < nworkers; i++)
+    if (workers[i] == 0 && time(NULL) > spawned[i])
+      spawn_worker(i);
+}
+
+/* Kills the workers and removes their socket; safe in a signal handler */
+void fcgi_stop(void)
+{
+  int i;
+
+  for (i = 0; i < nworkers; i++)
+    if (workers[i] > 0)
+      kill(workers[i], SIGTERM);
+
+  if (worker_fd >= 0 && sock_path[0] != '\0')
+    unlink(sock_path);
+}
+
+/* Whether a request's STDIN should wait: the records queued on its
+   connection, or held with it while it waits for one, pile up */
+static int stdin_full(fcgi_req* req)
+{
+  fcgi_conn* c;
+
+  if (req->conn < 0)
+    return req->records_len >= FCGI_CLIENT_HIGH;
+
+  c = &conns[req->conn];
+  return c->out.bytes >= FCGI_CLIENT_HIGH || c->out.count >= OUTQ_MAX / 2;
+}
+
+/* The body of a request that fcgi_stdin() held back may come again:
+   its client is serviced on the next pass */
+static void stdin_wake(fcgi_req* req)
+{
+  fsm* client = req->client;
+
+  if (!req->stdin_held || client == NULL || stdin_full(req))
+    return;
+
+  req->stdin_held = 0;
+  if (!client->sched_pending)
+  {
+    client->sched_pending = 1;
+    fpool->npending++;
+  }
+}
+
+/* Writes what a connection has queued; watches for writability if
+   the socket is full. Bodies held back for it may then come again. */
+static void conn_flush(fcgi_conn* c)
+{
+  int id;
+
+  switch (outq_flush(&c->out, c->fd, NULL))
+  {
+    case 1:
+      FD_SET(c->fd, &fpool->writers);
+      break;
+    case 0:
+      FD_CLR(c->fd, &fpool->writers);
+      break;
+    default:
+      conn_close(c, "Unable to write to FastCGI worker");
+      return;
+  }
+
+  for (id = 1; id <= FCGI_MAX_IDS; id++)
+    if (c->reqs[id] != NULL)
+      stdin_wake(c->reqs[id]);
+}
+
+/***************************************************************/
+/* @brief Opens a persistent connection to the workers and     */
+/* asks them whether they multiplex. Until they answer, one    */
+/* request at a time is sent on it.                            */
+/*                                                             */
+/* @retval 0 connected, -1 on error                            */
+/***************************************************************/
+static int conn_open(fcgi_conn* c)
+{
+  char query[64]; char rec[FCGI_HEADER_LEN + 64];
+  size_t n;
+  int fd;
+
+  if ((fd = socket(addr.ss_family, SOCK_STREAM, 0)) == -1)
+    return -1;
+
+  if (connect(fd, (struct sockaddr*)&addr, addr_len) == -1 ||
+      (c->in = liso_malloc_acct(FCGI_IN_SIZE, MEM_CGI, NULL)) == NULL)
+  {
+    close(fd);
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  c->fd       = fd;
+  c->in_len   = 0;
+  c->active   = 0;
+  c->max_reqs = 1;
+  outq_init(&c->out, NULL);
+  memset(c->reqs, 0, sizeof(c->reqs));
+  fcgi_stats.connects++;
+
+  n  = put_pair(query, "FCGI_MPXS_CONNS", 15, "", 0);
+  n += put_pair(query + n, "FCGI_MAX_REQS", 13, "", 0);
+  n  = put_record(rec, FCGI_GET_VALUES, query, n);
+  outq_copy(&c->out, rec, n);
+
+  FD_SET(fd, &fpool->masterfds);
+  if (fd > fpool->maxfd)
+    fpool->maxfd = fd;
+
+  FD_SET(fd, &fpool->writers);  // The query goes out with the first request
+  return 0;
+}
+
+/* Index of a client in the pool */
+static int slot(fsm* client)
+{
+  return (int)(client - fpool->states);
+}
+
+/**************************************************************/
+/* @brief Ends a request that won't complete: the client gets */
+/* a 502 if nothing was sent yet, or is closed mid-response.  */
+/**************************************************************/
+static void fail_req(fcgi_req* req)
+{
+  fsm* client = req->client;
+
+  req->client = NULL;
+  fcgi_stats.failed++;
+
+  if (client == NULL)
+    return;
+
+  client->cgi_pending--;
+  resp_fail(fpool, slot(client), req->seq, req->head_done ? 0 : 502);
+  if (client->fd >= 0)
+    flush_client(fpool, slot(client));
+}
+
+static void free_req(fcgi_req* req)
+{
+  liso_free(req->records);
+  liso_free(req->head);
+  liso_free(req->pend);
+  liso_free(req);
+}
+
+/* Closes a connection, failing whatever it had in flight */
+static void conn_close(fcgi_conn* c, char* why)
+{
+  fcgi_req* req;
+  int id;
+
+  log_error(why, logfile);
+
+  close(c->fd);
+  FD_CLR(c->fd, &fpool->masterfds);
+  FD_CLR(c->fd, &fpool->writers);
+  FD_CLR(c->fd, &fpool->readfds);
+  FD_CLR(c->fd, &fpool->writefds);
+  c->fd = -1;
+
+  outq_clear(&c->out);
+  liso_free(c->in);
+  c->in = NULL;
+  c->active = 0;
+
+  for (id = 1; id <= FCGI_MAX_IDS; id++)
+  {
+    if ((req = c->reqs[id]) == NULL)
+      continue;
+    c->reqs[id] = NULL;
+    fail_req(req);
+    free_req(req);
+  }
+}
+
+/*************************************************************/
+/* @brief Hands the next waiting requests to connections     */
+/* with room for them.                                       */
+/*************************************************************/
+static void drain_waiting(void)
+{
+  fcgi_req* req;
+
+  while ((req = wait_head) != NULL)
+  {
+    wait_head = req->next;
+    if (wait_head == NULL)
+      wait_tail = NULL;
+    req->next = NULL;
+
+    if (dispatch(req))
+    {
+      fail_req(req);
+      free_req(req);
+      continue;
+    }
+    if (req->conn < 0)
+      return;  // Went back on the queue; nothing has room
+    stdin_wake(req);
+  }
+}
+
+/****************************************************************/
+/* @brief Sends a request on the least busy connection with     */
+/* room for it, opening one if needed. With no room anywhere    */
+/* the request waits its turn on the queue.                     */
+/*                                                              */
+/* The records are only written here if the socket takes them   */
+/* right away; errors surface on the next pass, so this never   */
+/* touches the client while its requests are being serviced.    */
+/*                                                              */
+/* @retval  0 sent or queued                                    */
+/* @retval -1 no connection to the workers could be opened      */
+/****************************************************************/
+static int dispatch(fcgi_req* req)
+{
+  fcgi_conn* c = NULL;
+  int i, id, connected = 0;
+
+  for (i = 0; i < nconns; i++)
+  {
+    if (conns[i].fd < 0)
+      continue;
+    connected++;
+    if (conns[i].active < conns[i].max_reqs &&
+        (c == NULL || conns[i].active < c->active))
+      c = &conns[i];
+  }
+
+  /* Spread the load: an idle worker beats a busy one's spare slot */
+  for (i = 0; (c == NULL || c->active > 0) && i < nconns; i++)
+    if (conns[i].fd < 0 && conn_open(&conns[i]) == 0)
+    {
+      c = &conns[i];
+      connected++;
+    }
+
+  if (c == NULL)
+  {
+    if (connected == 0)
+      return -1;
+
+    req->conn = -1;
+    if (req->id < 0)
+    {
+      /* Taken off the front of the queue; it keeps its place */
+      req->next = wait_head;
+      wait_head = req;
+      if (wait_tail == NULL) wait_tail = req;
+    }
+    else
+    {
+      if (wait_tail) wait_tail->next = req;
+      else           wait_head = req;
+      wait_tail = req;
+      fcgi_stats.queued++;
+    }
+    req->id = -1;
+    return 0;
+  }
+
+  for (id = 1; id < FCGI_MAX_IDS && c->reqs[id] != NULL; id++)
+    ;
+
+  set_id(req->records, req->records_len, id);
+  if (outq_push(&c->out, req->records, req->records_len))
+    return -1;
+  req->records = NULL;
+
+  req->id      = id;
+  req->conn    = (int)(c - conns);
+  c->reqs[id]  = req;
+  c->active++;
+
+  if (outq_flush(&c->out, c->fd, NULL) != 0)
+    FD_SET(c->fd, &fpool->writers);
+  return 0;
+}
+
+/******************************************************************/
+/* @brief Hands a serviced CGI request to the FastCGI backend.    */
+/* The CGI environment becomes the PARAMS stream; a POST body     */
+/* follows as STDIN as it arrives (fcgi_stdin()). The response is */
+/* relayed to the client as the worker produces it.               */
+/*                                                                */
+/* @param state  The client whose request this is                 */
+/* @param ENVP   The CGI environment, NULL terminated             */
+/* @param flag   0 -> GET; 1 -> POST                              */
+/*                                                                */
+/* @retval 0 on success, -1 if the request could not be encoded   */
+/******************************************************************/
+int fcgi_begin(fsm* state, char** ENVP, int flag)
+{
+  fcgi_req* req;
+  char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+  char* params; char* eq; char* p;
+  size_t plen = 0, n;
+  int k;
+
+  for (k = 0; ENVP[k] != NULL; k++)
+    if ((eq = strchr(ENVP[k], '=')) != NULL)
+      plen += put_pair(NULL, ENVP[k], eq - ENVP[k], eq + 1, strlen(eq + 1));
+
+  if ((params = liso_malloc_acct(plen + 1, MEM_CGI, NULL)) == NULL)
+    return -1;
+
+  for (k = 0, n = 0; ENVP[k] != NULL; k++)
+    if ((eq = strchr(ENVP[k], '=')) != NULL)
+      n += put_pair(params + n, ENVP[k], eq - ENVP[k], eq + 1,
+                    strlen(eq + 1));
+
+  req = liso_malloc_acct(sizeof(fcgi_req), MEM_CGI, NULL);
+  if (req == NULL)
+  {
+    liso_free(params);
+    return -1;
+  }
+  memset(req, 0, sizeof(fcgi_req));
+
+  req->records_len = FCGI_HEADER_LEN + sizeof(begin) + stream_size(plen) +
+                     FCGI_HEADER_LEN;
+  if ((req->records = liso_malloc_acct(req->records_len, MEM_CGI,
+                                       NULL)) == NULL)
+  {
+    liso_free(params);
+    liso_free(req);
+    return -1;
+  }
+
+  p  = req->records;
+  p += put_record(p, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+  p += put_stream(p, FCGI_PARAMS, params, plen);
+  req->stdin_open = flag && state->body_state != BODY_DONE;
+  if (!req->stdin_open)
+    p += put_record(p, FCGI_STDIN, NULL, 0);   // No body
+  req->records_len = p - req->records;
+  liso_free(params);
+
+  req->client = state;
+  req->keep   = state->conn;
+  req->conn   = -1;
+  req->seq    = state->seq_next;
+  if (dispatch(req))
+  {
+    free_req(req);
+    return -1;
+  }
+
+  state->seq_next++;   // Its place among the client's responses
+  state->cgi_pending++;
+  fcgi_stats.requests++;
+  return 0;
+}
+
+/* The request whose body client is still streaming, if any */
+static fcgi_req* stdin_req(fsm* client)
+{
+  fcgi_req* req;
+  int i, id;
+
+  for (i = 0; i < nconns; i++)
+    for (id = 1; id <= FCGI_MAX_IDS; id++)
+      if ((req = conns[i].reqs[id]) != NULL && req->client == client &&
+          req->stdin_open)
+        return req;
+
+  for (req = wait_head; req != NULL; req = req->next)
+    if (req->client == client && req->stdin_open)
+      return req;
+
+  return NULL;
+}
+
+/* A request whose body could not be queued is failed on the next
+   pass (fail_broken()), out of the way of its client's servicing */
+static void stdin_broken(fcgi_req* req)
+{
+  req->stdin_open = 0;
+  req->broken     = 1;
+  nbroken++;
+}
+
+/*****************************************************************/
+/* @brief Takes the next piece of a request body. Pieces are     */
+/* gathered over a relay_body() pass and sent as one run of      */
+/* STDIN records by fcgi_stdin_flush() at its end.               */
+/*                                                               */
+/* @returns bytes taken, 0 if the worker is slow to take the     */
+/*          body (the client is serviced again once it drains),  */
+/*          -1 if the request is gone (its body is then dropped) */
+/*****************************************************************/
+ssize_t fcgi_stdin(fsm* client, char* data, size_t len)
+{
+  fcgi_req* req = stdin_len > 0 ? stdin_cur : stdin_req(client);
+
+  if (req == NULL)
+    return -1;
+
+  if (stdin_full(req))
+  {
+    req->stdin_held = 1;
+    return 0;
+  }
+
+  if (len > sizeof(stdin_buf) - stdin_len)
+    len = sizeof(stdin_buf) - stdin_len;
+  memcpy(stdin_buf + stdin_len, data, len);
+  stdin_len += len;
+  stdin_cur  = req;
+  return (ssize_t)len;
+}
+
+/*****************************************************************/
+/* @brief Sends the body fcgi_stdin() took this pass as STDIN    */
+/* records; with last set, ends the stream. A request still      */
+/* waiting for a connection keeps them behind its other records. */
+/* Like dispatch(), this only writes what the socket takes right */
+/* away, so the client is never touched from here: a request     */
+/* whose records can't be queued is aborted and answered 502 on  */
+/* the next pass.                                                */
+/*                                                               */
+/* @retval 0 on success, -1 if the request is gone or failed     */
+/*****************************************************************/
+int fcgi_stdin_flush(fsm* client, int last)
+{
+  fcgi_req* req = stdin_len > 0 ? stdin_cur : stdin_req(client);
+  size_t len = stdin_len;
+  fcgi_conn* c;
+  char* rec; char* grown;
+  size_t n;
+
+  stdin_len = 0;
+  stdin_cur = NULL;
+
+  if (req == NULL)
+    return -1;
+  if (len == 0 && !last)
+    return 0;
+
+  if ((rec = liso_malloc_acct(stream_size(len), MEM_CGI, NULL)) == NULL)
+  {
+    stdin_broken(req);
+    return -1;
+  }
+
+  n = put_records(rec, FCGI_STDIN, stdin_buf, len);
+  if (last)
+  {
+    n += put_record(rec + n, FCGI_STDIN, NULL, 0);
+    req->stdin_open = 0;
+  }
+
+  if (req->conn < 0)
+  {
+    grown = liso_malloc_acct(req->records_len + n, MEM_CGI, NULL);
+    if (grown == NULL)
+    {
+      liso_free(rec);
+      stdin_broken(req);
+      return -1;
+    }
+    memcpy(grown, req->records, req->records_len);
+    memcpy(grown + req->records_len, rec, n);
+    liso_free(req->records);
+    liso_free(rec);
+    req->records = grown;
+    req->records_len += n;
+    return 0;
+  }
+
+  c = &conns[req->conn];
+  set_id(rec, n, req->id);
+  if (outq_push(&c->out, rec, n))
+  {
+    liso_free(rec);
+    stdin_broken(req);
+    return -1;
+  }
+
+  if (outq_flush(&c->out, c->fd, NULL) != 0)
+    FD_SET(c->fd, &fpool->writers);
+  return 0;
+}
+
+/*************************************************************/
+/* @brief Called when responses a client had coming from the */
+/* backend will no longer be sent: the client went away, or  */
+/* an earlier response closes the connection (resp_cut()).   */
+/* Those in flight are aborted (their output is dropped      */
+/* until the worker ends them); those still waiting are      */
+/* simply forgotten.                                         */
+/*************************************************************/
+void fcgi_detach(fsm* client)
+{
+  fcgi_req* req; fcgi_req** link;
+  char rec[FCGI_HEADER_LEN];
+  fcgi_conn* c;
+  int i, id;
+
+  for (i = 0; i < nconns; i++)
+  {
+    c = &conns[i];
+    for (id = 1; id <= FCGI_MAX_IDS; id++)
+    {
+      if ((req = c->reqs[id]) == NULL || req->client != client ||
+          resp_live(client, req->seq))
+        continue;
+      req->client = NULL;
+      client->cgi_pending--;
+
+      if (c->fd < 0)
+        continue;
+      put_record(rec, FCGI_ABORT_REQUEST, NULL, 0);
+      set_id(rec, sizeof(rec), id);
+      if (outq_copy(&c->out, rec, sizeof(rec)) == 0)
+        FD_SET(c->fd, &fpool->writers);  // Sent on the next pass
+    }
+  }
+
+  for (link = &wait_head; (req = *link) != NULL; )
+  {
+    if (req->client != client || resp_live(client, req->seq))
+    {
+      link = &req->next;
+      continue;
+    }
+    *link = req->next;
+    client->cgi_pending--;
+    free_req(req);
+  }
+
+  for (wait_tail = wait_head; wait_tail && wait_tail->next; )
+    wait_tail = wait_tail->next;
+}
+
+/* Appends body bytes to req->pend, sized on first use for everything
+   that can still arrive this pass (and room to frame it as a chunk) */
+static int take_body(fcgi_req* req, char* data, size_t len, size_t room)
+{
+  if (req->pend == NULL)
+  {
+    if ((req->pend = liso_malloc_acct(room + CHUNK_PAD, MEM_CGI,
+                                      NULL)) == NULL)
+      return -1;
+    req->pend_len = req->framing == FRAME_CHUNKED ? CHUNK_HEAD : 0;
+    req->pend_cap = room + CHUNK_HEAD;
+  }
+
+  if (req->pend_len + len > req->pend_cap)
+    return -1;
+
+  memcpy(req->pend + req->pend_len, data, len);
+  req->pend_len += len;
+  return 0;
+}
+
+/*****************************************************************/
+/* @brief Takes STDOUT data for a request. The CGI header block  */
+/* is collected until the blank line and turned into an HTTP     */
+/* head (cgi_head()); everything after it is body, which is      */
+/* gathered into req->pend and queued on the client once the     */
+/* records read in this pass have been processed.                */
+/*                                                               */
+/* @param room  bytes left in the read buffer from this record   */
+/*              on; no more body than that can arrive this pass  */
+/*****************************************************************/
+static void take_stdout(fcgi_req* req, char* data, size_t len, size_t room)
+{
+  fsm* client = req->client;
+  char out[BUF_SIZE];
+  char* end; size_t copy, hlen, rest;
+  int n; outq* q;
+
+  if (client == NULL || len == 0)
+    return;
+
+  if (req->head_done)
+  {
+    if (take_body(req, data, len, room))
+      fail_req(req);
+    return;
+  }
+
+  if (req->head == NULL &&
+      (req->head = liso_malloc_acct(BUF_SIZE, MEM_CGI, NULL)) == NULL)
+  {
+    fail_req(req);
+    return;
+  }
+
+  copy = BUF_SIZE - req->head_len < len ? BUF_SIZE - req->head_len : len;
+  memcpy(req->head + req->head_len, data, copy);
+  req->head_len += copy;
+
+  if ((end = memmem(req->head, req->head_len, "\r\n\r\n", 4)) != NULL)
+    hlen = end + 4 - req->head;
+  else if ((end = memmem(req->head, req->head_len, "\n\n", 2)) != NULL)
+    hlen = end + 2 - req->head;
+  else
+  {
+    if (req->head_len == BUF_SIZE)
+      fail_req(req);   // Header block too long
+    return;            // Otherwise wait for the rest of it
+  }
+
+  if ((n = cgi_head(req->head, hlen, out, req->keep, &req->framing)) < 0 ||
+      (q = resp_queue(client, req->seq)) == NULL || outq_copy(q, out, n))
+  {
+    fail_req(req);
+    return;
+  }
+  req->head_done = 1;
+  resp_head(client, req->seq, out);
+
+  /* Whatever followed the blank line is body */
+  rest = req->head_len - hlen;
+  if ((rest > 0 &&
+       take_body(req, req->head + hlen, rest, room + BUF_SIZE)) ||
+      (copy < len &&
+       take_body(req, data + copy, len - copy, room + BUF_SIZE)))
+    fail_req(req);
+
+  liso_free(req->head);
+  req->head = NULL;
+  req->head_len = 0;
+}
+
+/*************************************************************/
+/* @brief Queues the body gathered for a request this pass   */
+/* on its client and writes it out.                          */
+/*************************************************************/
+static void push_pending(fcgi_req* req)
+{
+  fsm* client = req->client;
+  outq* q;
+
+  if (req->pend == NULL)
+    return;
+
+  if (req->framing == FRAME_CHUNKED)
+    req->pend_len = chunk_frame(req->pend, req->pend_len - CHUNK_HEAD);
+
+  if (client == NULL)
+  {
+    liso_free(req->pend);
+  }
+  else if ((q = resp_queue(client, req->seq)) == NULL ||
+           outq_push(q, req->pend, req->pend_len))
+  {
+    liso_free(req->pend);
+    req->pend = NULL;
+    fail_req(req);
+    return;
+  }
+
+  req->pend = NULL;
+  req->pend_len = req->pend_cap = 0;
+
+  if (client != NULL)
+    flush_client(fpool, slot(client));
+}
+
+/*************************************************************/
+/* @brief A worker ended a request: the response is complete */
+/* and the request id is free for the next one.              */
+/*************************************************************/
+static void end_req(fcgi_conn* c, int id)
+{
+  fcgi_req* req = c->reqs[id];
+  fsm* client; outq* q;
+
+  c->reqs[id] = NULL;
+  c->active--;
+
+  push_pending(req);
+
+  if ((client = req->client) != NULL)
+  {
+    if (!req->head_done ||
+        (req->framing == FRAME_CHUNKED &&
+         ((q = resp_queue(client, req->seq)) == NULL ||
+          outq_copy(q, "0\r\n\r\n", 5))))
+    {
+      fail_req(req);   // No headers, or no room for the last chunk
+    }
+    else
+    {
+      client->cgi_pending--;
+      /* Unframed, closing marks the end of the body */
+      if (req->framing == FRAME_CLOSE || !req->keep)
+        resp_cut(fpool, slot(client), req->seq);
+      resp_done(fpool, slot(client), req->seq);
+      flush_client(fpool, slot(client));
+    }
+  }
+
+  free_req(req);
+}
+
+/* Reads the worker's answer to our FCGI_GET_VALUES query */
+static void get_values(fcgi_conn* c, unsigned char* data, size_t len)
+{
+  size_t off = 0, n, m, nlen, vlen;
+  int mpxs = 0, max = FCGI_MAX_IDS;
+  char val[16];
+
+  while (off < len)
+  {
+    if ((n = get_len(data + off, len - off, &nlen)) == 0 ||
+        (m = get_len(data + off + n, len - off - n, &vlen)) == 0 ||
+        off + n + m + nlen + vlen > len)
+      break;
+    off += n + m;
+
+    memset(val, 0, sizeof(val));
+    memcpy(val, data + off + nlen, vlen < sizeof(val) - 1 ? vlen : sizeof(val) - 1);
+
+    if (nlen == 15 && !memcmp(data + off, "FCGI_MPXS_CONNS", 15))
+      mpxs = atoi(val);
+    else if (nlen == 13 && !memcmp(data + off, "FCGI_MAX_REQS", 13) &&
+             atoi(val) > 0)
+      max = atoi(val);
+
+    off += nlen + vlen;
+  }
+
+  c->max_reqs = mpxs ? (max < FCGI_MAX_IDS ? max : FCGI_MAX_IDS) : 1;
+}
+
+/* Handles one complete record from a worker */
+static void on_record(fcgi_conn* c, int type, int id, char* data,
+                      size_t len, size_t room)
+{
+  char log_buf[LOG_SIZE] = {0};
+  fcgi_req* req;
+
+  if (type == FCGI_GET_VALUES_RESULT && id == 0)
+  {
+    get_values(c, (unsigned char*)data, len);
+    return;
+  }
+
+  if (id < 1 || id > FCGI_MAX_IDS || (req = c->reqs[id]) == NULL)
+    return;   // Management records we don't use, or a stale id
+
+  switch (type)
+  {
+    case FCGI_STDOUT:
+      take_stdout(req, data, len, room);
+      break;
+    case FCGI_STDERR:
+      if (len > 0)
+      {
+        snprintf(log_buf, LOG_SIZE, "FastCGI: %.*s",
+                 (int)(len < LOG_SIZE - 16 ? len : LOG_SIZE - 16), data);
+        log_error(log_buf, logfile);
+      }
+      break;
+    case FCGI_END_REQUEST:
+      end_req(c, id);
+      break;
+  }
+}
+
+/***************************************************************/
+/* @brief Reads whatever a worker has sent and handles every   */
+/* complete record in it. STDOUT gathered for each request is  */
+/* queued on its client in one piece at the end.               */
+/***************************************************************/
+static void conn_read(fcgi_conn* c)
+{
+  unsigned char* h;
+  size_t off = 0, clen, total;
+  ssize_t n;
+  int id;
+
+  n = read(c->fd, c->in + c->in_len, FCGI_IN_SIZE - c->in_len);
+
+  if (n == 0)
+  {
+    conn_close(c, "FastCGI worker closed the connection");
+    return;
+  }
+  if (n < 0)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      conn_close(c, "Error reading from FastCGI worker");
+    return;
+  }
+  c->in_len += n;
+
+  while (c->in_len - off >= FCGI_HEADER_LEN)
+  {
+    h     = (unsigned char*)c->in + off;
+    clen  = (size_t)h[4] << 8 | h[5];
+    total = FCGI_HEADER_LEN + clen + h[6];
+
+    if (h[0] != FCGI_VERSION_1)
+    {
+      conn_close(c, "FastCGI protocol error");
+      return;
+    }
+    if (c->in_len - off < total)
+      break;
+
+    on_record(c, h[1], (int)h[2] << 8 | h[3], (char*)h + FCGI_HEADER_LEN,
+              clen, c->in_len - off);
+    off += total;
+  }
+
+  for (id = 1; id <= FCGI_MAX_IDS; id++)
+    if (c->reqs[id] != NULL)
+      push_pending(c->reqs[id]);
+
+  memmove(c->in, c->in + off, c->in_len - off);
+  c->in_len -= off;
+
+  drain_waiting();
+}
+
+/*************************************************************/
+/* @brief Takes connections out of the read set while one of */
+/* their clients has a lot of output still queued, so a slow */
+/* reader pushes back on the worker instead of making us     */
+/* buffer its whole response; and clients out of it while    */
+/* the worker is slow to take their request body.            */
+/*************************************************************/
+void fcgi_hold(pool* p)
+{
+  fcgi_req* req; fcgi_conn* c;
+  int i, id;
+
+  for (i = 0; i < nconns; i++)
+  {
+    if (conns[i].fd < 0)
+      continue;
+    for (id = 1; id <= FCGI_MAX_IDS; id++)
+      if ((req = conns[i].reqs[id]) != NULL && req->client != NULL &&
+          resp_bytes(req->client) >= FCGI_CLIENT_HIGH)
+      {
+        FD_CLR(conns[i].fd, &p->readfds);
+        break;
+      }
+  }
+
+  /* The same the other way: a client streaming a body stops being
+     read while the records already queued for it pile up */
+  for (i = 0; i < nconns; i++)
+  {
+    c = &conns[i];
+    if (c->fd < 0)
+      continue;
+    for (id = 1; id <= FCGI_MAX_IDS; id++)
+      if ((req = c->reqs[id]) != NULL && req->client != NULL &&
+          req->stdin_open && stdin_full(req))
+        FD_CLR(req->client->fd, &p->readfds);
+  }
+
+  for (req = wait_head; req != NULL; req = req->next)
+    if (req->client != NULL && req->stdin_open && stdin_full(req))
+      FD_CLR(req->client->fd, &p->readfds);
+}
+
+/*************************************************************/
+/* @brief Fails the requests whose body could not be queued  */
+/* (stdin_broken()): the worker is told to abort those it    */
+/* has, and each client gets a 502.                          */
+/*************************************************************/
+static void fail_broken(void)
+{
+  fcgi_req* req; fcgi_req** link; fcgi_req* failed = NULL;
+  char rec[FCGI_HEADER_LEN];
+  fcgi_conn* c;
+  int i, id;
+
+  nbroken = 0;
+
+  for (i = 0; i < nconns; i++)
+  {
+    c = &conns[i];
+    for (id = 1; c->fd >= 0 && id <= FCGI_MAX_IDS; id++)
+    {
+      if ((req = c->reqs[id]) == NULL || !req->broken)
+        continue;
+      req->broken = 0;
+      if (req->client == NULL)
+        continue;   // fcgi_detach() aborted it already
+
+      /* Its output is dropped until the worker ends it */
+      fail_req(req);
+      put_record(rec, FCGI_ABORT_REQUEST, NULL, 0);
+      set_id(rec, sizeof(rec), id);
+      if (outq_copy(&c->out, rec, sizeof(rec)))
+        conn_close(c, "Unable to abort a FastCGI request");
+      else
+        FD_SET(c->fd, &fpool->writers);
+    }
+  }
+
+  /* Taken off the queue first: failing one may detach a client,
+     which frees its other waiting requests */
+  for (link = &wait_head; (req = *link) != NULL; )
+  {
+    if (!req->broken)
+    {
+      link = &req->next;
+      continue;
+    }
+    *link = req->next;
+    req->next = failed;
+    failed = req;
+  }
+
+  for (wait_tail = wait_head; wait_tail && wait_tail->next; )
+    wait_tail = wait_tail->next;
+
+  while ((req = failed) != NULL)
+  {
+    failed = req->next;
+    fail_req(req);
+    free_req(req);
+  }
+}
+
+/* 0 if fcgi_check() has requests to fail, -1 if none */
+long fcgi_wakeup(void)
+{
+  return nbroken > 0 ? 0 : -1;
+}
+
+/*************************************************************/
+/* @brief Services the worker connections select() found     */
+/* ready: queued records are written, replies are relayed.   */
+/*************************************************************/
+void fcgi_check(pool* p)
+{
+  fcgi_conn* c;
+  int i;
+
+  if (nbroken > 0)
+    fail_broken();
+
+  for (i = 0; i < nconns && p->nready > 0; i++)
+  {
+    c = &conns[i];
+    if (c->fd < 0)
+      continue;
+
+    if (FD_ISSET(c->fd, &p->writefds))
+    {
+      p->nready--;
+      conn_flush(c);
+    }
+
+    if (c->fd >= 0 && FD_ISSET(c->fd, &p->readfds))
+    {
+      p->nready--;
+      conn_read(c);
+    }
+  }
+}
+
+void fcgi_print(FILE* file)
+{
+  if (!enabled)
+    return;
+
+  fprintf(file, "FastCGI: %lu requests, %lu queued, %lu failed, "
+          "%lu connects, %lu worker spawns\n", fcgi_stats.requests,
+          fcgi_stats.queued, fcgi_stats.failed, fcgi_stats.connects,
+          fcgi_stats.spawns);
+}
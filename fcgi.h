@@ -0,0 +1,92 @@
+#ifndef FCGI_H
+#define FCGI_H
+
+#include <sys/types.h>
+
+#include "lisod.h"
+#include "outq.h"
+
+/* FastCGI record types and constants (FastCGI spec 1.0) */
+#define FCGI_VERSION_1           1
+#define FCGI_HEADER_LEN          8
+#define FCGI_MAX_CONTENT         65535
+
+#define FCGI_BEGIN_REQUEST       1
+#define FCGI_ABORT_REQUEST       2
+#define FCGI_END_REQUEST         3
+#define FCGI_PARAMS              4
+#define FCGI_STDIN               5
+#define FCGI_STDOUT              6
+#define FCGI_STDERR              7
+#define FCGI_GET_VALUES          9
+#define FCGI_GET_VALUES_RESULT  10
+#define FCGI_UNKNOWN_TYPE       11
+
+#define FCGI_RESPONDER           1
+#define FCGI_KEEP_CONN           1
+#define FCGI_LISTENSOCK_FILENO   0
+
+#define FCGI_MAX_CONNS   64   /* Persistent connections to the workers  */
+#define FCGI_MAX_WORKERS 64   /* Worker processes lisod supervises      */
+#define FCGI_MAX_IDS     32   /* Requests in flight on one connection   */
+
+/* One request handed to the FastCGI backend. Its records are encoded
+   as soon as the request is serviced; the request id is filled in when
+   a connection picks it up. */
+typedef struct fcgi_req {
+  int     id;        // Request id on its connection; -1 while waiting
+  int     conn;      // Index of the connection carrying it, -1 if waiting
+  fsm*    client;    // Client being answered; NULL once it went away
+  int     keep;      // Client asked for keep-alive
+  unsigned seq;      // The client's response it produces (resp_queue())
+  int     stdin_open; // Body still being streamed as STDIN
+  int     stdin_held; // Its client was told to wait (fcgi_stdin())
+  int     broken;    // Its body could not be queued; fail it next pass
+  char*   records;   // BEGIN_REQUEST, PARAMS and STDIN so far, until sent
+  size_t  records_len;
+  char*   head;      // CGI header block collected from STDOUT so far
+  size_t  head_len;
+  int     head_done; // Header block translated and queued
+  int     framing;   // How the body is delimited (FRAME_*)
+  char*   pend;      // Body read this pass, not yet queued on the client
+  size_t  pend_len;
+  size_t  pend_cap;
+  struct fcgi_req* next;  // Wait queue link
+} fcgi_req;
+
+/* A persistent connection to a worker */
+typedef struct fcgi_conn {
+  int     fd;        // -1 when not connected
+  int     active;    // Requests in flight
+  int     max_reqs;  // 1 unless the worker reported FCGI_MPXS_CONNS
+  char*   in;        // Partial record read from the worker
+  size_t  in_len;
+  outq    out;       // Records waiting to be written to the worker
+  fcgi_req* reqs[FCGI_MAX_IDS + 1];  // In flight, by request id
+} fcgi_conn;
+
+typedef struct fcgi_counters {
+  unsigned long requests;   // Requests handed to the backend
+  unsigned long queued;     // ... that had to wait for a connection
+  unsigned long failed;     // ... answered with 502
+  unsigned long connects;   // Connections opened to the workers
+  unsigned long spawns;     // Worker processes started
+} fcgi_counters;
+
+extern fcgi_counters fcgi_stats;
+
+int  fcgi_init(char* app, pool* p);
+int  fcgi_enabled(void);
+int  fcgi_begin(fsm* state, char** ENVP, int flag);
+ssize_t fcgi_stdin(fsm* client, char* data, size_t len);
+int  fcgi_stdin_flush(fsm* client, int last);
+long fcgi_wakeup(void);
+void fcgi_hold(pool* p);
+void fcgi_check(pool* p);
+void fcgi_detach(fsm* client);
+void fcgi_reaped(pid_t pid);
+void fcgi_supervise(void);
+void fcgi_stop(void);
+void fcgi_print(FILE* file);
+
+#endif
@@ -0,0 +1,252 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file fcgi_echo.c                                               */
+/*                                                                 */
+/* @brief A stand-in FastCGI responder for trying out liso's       */
+/* FastCGI mode without a real application. It answers every       */
+/* request with the method, query string, its pid and whatever     */
+/* was posted; a query of "big=N" adds N bytes of filler, "nolen"  */
+/* leaves out the Content-Length. It multiplexes requests.         */
+/*                                                                 */
+/* Spawned by lisod (LISO_FCGI_WORKERS=n, ./fcgi_echo as the CGI   */
+/* path) it accepts on FCGI_LISTENSOCK_FILENO; run by hand it      */
+/* listens on the Unix socket named on its command line.           */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fcgi.h"
+
+#define MAX_IDS 64
+
+typedef struct req {
+  int    used;
+  char   method[16];
+  char   query[1024];
+  char*  in;        // STDIN so far
+  size_t in_len;
+} req;
+
+static req reqs[MAX_IDS];
+
+static int readn(int fd, unsigned char* buf, size_t n)
+{
+  ssize_t r; size_t got = 0;
+
+  while (got < n)
+  {
+    if ((r = read(fd, buf + got, n - got)) <= 0)
+      return -1;
+    got += r;
+  }
+  return 0;
+}
+
+static int writen(int fd, const char* buf, size_t n)
+{
+  ssize_t w;
+
+  while (n > 0)
+  {
+    if ((w = write(fd, buf, n)) <= 0)
+      return -1;
+    buf += w;
+    n   -= w;
+  }
+  return 0;
+}
+
+static int record(int fd, int type, int id, const char* data, size_t len)
+{
+  unsigned char h[FCGI_HEADER_LEN] = {FCGI_VERSION_1, type, id >> 8, id & 0xff,
+                                      len >> 8, len & 0xff, 0, 0};
+
+  if (writen(fd, (char*)h, sizeof(h)))
+    return -1;
+  return writen(fd, data, len);
+}
+
+/* Sends data as STDOUT records */
+static int out(int fd, int id, const char* data, size_t len)
+{
+  size_t chunk;
+
+  while (len > 0)
+  {
+    chunk = len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+    if (record(fd, FCGI_STDOUT, id, data, chunk))
+      return -1;
+    data += chunk;
+    len  -= chunk;
+  }
+  return 0;
+}
+
+static int end(int fd, int id)
+{
+  char body[8] = {0};
+
+  memset(&reqs[id], 0, sizeof(req));
+  return record(fd, FCGI_STDOUT, id, NULL, 0) ||
+         record(fd, FCGI_END_REQUEST, id, body, sizeof(body));
+}
+
+static size_t get_len(unsigned char* p, size_t* len)
+{
+  if (!(p[0] & 0x80))
+  {
+    *len = p[0];
+    return 1;
+  }
+  *len = ((size_t)(p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  return 4;
+}
+
+static void params(req* r, unsigned char* p, size_t len)
+{
+  unsigned char* stop = p + len;
+  size_t nlen, vlen;
+
+  while (p < stop)
+  {
+    p += get_len(p, &nlen);
+    p += get_len(p, &vlen);
+    if (nlen == 14 && !memcmp(p, "REQUEST_METHOD", 14))
+      snprintf(r->method, sizeof(r->method), "%.*s", (int)vlen, p + nlen);
+    if (nlen == 12 && !memcmp(p, "QUERY_STRING", 12))
+      snprintf(r->query, sizeof(r->query), "%.*s", (int)vlen, p + nlen);
+    p += nlen + vlen;
+  }
+}
+
+static int respond(int fd, int id)
+{
+  req* r = &reqs[id];
+  char head[256]; char body[2048];
+  char* q; size_t big = 0, blen;
+  int hlen, nolen;
+
+  if ((q = strstr(r->query, "big=")) != NULL)
+    big = strtoul(q + 4, NULL, 10);
+  nolen = strstr(r->query, "nolen") != NULL;
+
+  blen = snprintf(body, sizeof(body), "method=%s query=%s pid=%d posted=%zu\n",
+                  r->method, r->query, (int)getpid(), r->in_len);
+
+  if (nolen)
+    hlen = snprintf(head, sizeof(head),
+                    "Status: 200 OK\r\nContent-Type: text/plain\r\n\r\n");
+  else
+    hlen = snprintf(head, sizeof(head),
+                    "Status: 200 OK\r\nContent-Type: text/plain\r\n"
+                    "Content-Length: %zu\r\n\r\n", blen + r->in_len + big);
+
+  if (out(fd, id, head, hlen) || out(fd, id, body, blen) ||
+      out(fd, id, r->in, r->in_len))
+    return -1;
+
+  while (big > 0)
+  {
+    memset(body, 'x', sizeof(body));
+    blen = big < sizeof(body) ? big : sizeof(body);
+    if (out(fd, id, body, blen))
+      return -1;
+    big -= blen;
+  }
+
+  free(r->in);
+  return end(fd, id);
+}
+
+static void serve(int fd)
+{
+  unsigned char h[FCGI_HEADER_LEN];
+  unsigned char* data = malloc(FCGI_MAX_CONTENT + 256);
+  char vals[64];
+  size_t len; int id, type;
+
+  while (readn(fd, h, sizeof(h)) == 0)
+  {
+    type = h[1];
+    id   = h[2] << 8 | h[3];
+    len  = h[4] << 8 | h[5];
+    if (readn(fd, data, len + h[6]))
+      break;
+
+    if (type == FCGI_GET_VALUES)
+    {
+      memcpy(vals, "\x0f\x01" "FCGI_MPXS_CONNS" "1"
+                   "\x0d\x02" "FCGI_MAX_REQS" "16", 35);
+      record(fd, FCGI_GET_VALUES_RESULT, 0, vals, 35);
+      continue;
+    }
+
+    if (id <= 0 || id >= MAX_IDS)
+      continue;
+
+    switch (type)
+    {
+      case FCGI_BEGIN_REQUEST:
+        memset(&reqs[id], 0, sizeof(req));
+        reqs[id].used = 1;
+        break;
+      case FCGI_PARAMS:
+        params(&reqs[id], data, len);
+        break;
+      case FCGI_STDIN:
+        if (len == 0)
+        {
+          if (respond(fd, id))
+            goto done;
+          break;
+        }
+        reqs[id].in = realloc(reqs[id].in, reqs[id].in_len + len);
+        memcpy(reqs[id].in + reqs[id].in_len, data, len);
+        reqs[id].in_len += len;
+        break;
+      case FCGI_ABORT_REQUEST:
+        free(reqs[id].in);
+        end(fd, id);
+        break;
+    }
+  }
+
+done:
+  free(data);
+  close(fd);
+}
+
+int main(int argc, char* argv[])
+{
+  struct sockaddr_un addr;
+  int listen_fd = FCGI_LISTENSOCK_FILENO, fd;
+
+  if (argc == 2)
+  {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    unlink(argv[1]);
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 16) == -1)
+    {
+      perror("fcgi_echo");
+      return EXIT_FAILURE;
+    }
+  }
+
+  while ((fd = accept(listen_fd, NULL, NULL)) >= 0)
+    serve(fd);
+
+  perror("fcgi_echo: accept");
+  return EXIT_FAILURE;
+}
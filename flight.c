@@ -0,0 +1,608 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file flight.c                                                  */
+/*                                                                 */
+/* @brief Coalescing of identical CGI GETs. A GET whose key        */
+/* (mcache_key(): scheme, URI and query, LISO_CACHE_VARY headers)  */
+/* matches one whose script is starting or waiting to start joins  */
+/* it as a waiter instead of running the script again. When the    */
+/* script's header block comes in, every waiter gets its own head  */
+/* and, from then on, a copy of the output as it is relayed. Up to */
+/* LISO_COALESCE_MAX wait on one run (the next request starts a    */
+/* new one), and a waiter still without a head after              */
+/* LISO_COALESCE_WAIT ms gets a 504. Output that may not be shared */
+/* (mcache_shareable(): it sets a cookie, is private, ...) is not: */
+/* each waiter then runs the script on its own.                    */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "flight.h"
+#include "engine.h"
+#include "mcache.h"
+#include "cgi.h"
+#include "zygote.h"
+#include "alloc.h"
+#include "config.h"
+#include "util.h"
+
+#define FL_BUCKETS 256    /* Hash chains, a power of two */
+
+/* A waiter's output stops it being read while it has this much
+   queued; the run goes at the pace of the slowest waiter */
+#define FLIGHT_CLIENT_HIGH (256 * 1024)
+
+/* A request answered by another request's run */
+typedef struct flight_waiter {
+  int       slot;      // The client waiting
+  int       fd;        // Its fd, to tell it is the same client still
+  unsigned  seq;       // The response it waits on
+  int       conn;      // Keep-alive after that response
+  long long deadline;  // Monotonic ms after which it gets a 504
+  char*     env;       // Its own CGI environment, NUL separated, in
+  size_t    env_len;   // case the output can't be shared
+} flight_waiter;
+
+/* One run of the script, and the requests waiting on it */
+struct flight {
+  char*          key;       // mcache_key() of the request leading it
+  size_t         key_len;
+  unsigned       hash;
+  int            listed;    // In the table: identical GETs join it
+  int            streaming; // The head went out; waiters are answered
+  flight_waiter* wait;
+  int            nwait;
+  int            cap;
+  flight*        hnext;     // Hash chain
+  flight*        prev;      // Every flight, for flight_tick()
+  flight*        next;
+};
+
+flight_counters flight_stats;
+
+static pool*   fpool;
+static flight* buckets[FL_BUCKETS];
+static flight* flights;
+static int     nflights;
+
+void flight_init(pool* p)
+{
+  fpool = p;
+}
+
+/* Takes f out of the table; nobody else joins it */
+static void unlist(flight* f)
+{
+  flight** link = &buckets[f->hash & (FL_BUCKETS - 1)];
+
+  if (!f->listed)
+    return;
+
+  while (*link != f)
+    link = &(*link)->hnext;
+  *link = f->hnext;
+  f->listed = 0;
+}
+
+static void free_flight(flight* f)
+{
+  int k;
+
+  unlist(f);
+  if (f->prev != NULL) f->prev->next = f->next; else flights = f->next;
+  if (f->next != NULL) f->next->prev = f->prev;
+
+  for (k = 0; k < f->nwait; k++)
+    liso_free(f->wait[k].env);
+  liso_free(f->wait);
+  liso_free(f->key);
+  liso_free(f);
+  nflights--;
+}
+
+static flight* create(char* key, size_t len, unsigned hash)
+{
+  flight* f;
+
+  if ((f = liso_malloc_acct(sizeof(flight), MEM_CGI, NULL)) == NULL)
+    return NULL;
+
+  memset(f, 0, sizeof(flight));
+  if ((f->key = liso_malloc_acct(len, MEM_CGI, NULL)) == NULL)
+  {
+    liso_free(f);
+    return NULL;
+  }
+  memcpy(f->key, key, len);
+  f->key_len = len;
+  f->hash    = hash;
+  f->listed  = 1;
+
+  f->hnext = buckets[hash & (FL_BUCKETS - 1)];
+  buckets[hash & (FL_BUCKETS - 1)] = f;
+  f->next = flights;
+  if (flights != NULL)
+    flights->prev = f;
+  flights = f;
+
+  nflights++;
+  return f;
+}
+
+/* Makes room for one more waiter on f, up to LISO_COALESCE_MAX */
+static flight_waiter* add_waiter(flight* f)
+{
+  flight_waiter* wait;
+  int cap;
+
+  if (f->nwait == f->cap)
+  {
+    cap = f->cap ? f->cap * 2 : 8;
+    if (cap > config.coalesce_max)
+      cap = config.coalesce_max;
+    if ((wait = liso_malloc_acct(cap * sizeof(flight_waiter), MEM_CGI,
+                                 NULL)) == NULL)
+      return NULL;
+    if (f->nwait > 0)
+      memcpy(wait, f->wait, f->nwait * sizeof(flight_waiter));
+    liso_free(f->wait);
+    f->wait = wait;
+    f->cap  = cap;
+  }
+
+  return &f->wait[f->nwait++];
+}
+
+/*******************************************************************/
+/* @brief Joins a CGI GET to an identical one whose script hasn't  */
+/* answered yet, if there is one with room for another waiter.     */
+/* Otherwise the request may lead a run others can join.           */
+/*                                                                 */
+/* @param state  The client, with its request parsed               */
+/* @param envp   Its CGI environment, kept to run it on its own    */
+/* @param lead   Set to the flight its run leads (add_cgi() takes  */
+/*               it; flight_abort() if it doesn't start), or NULL  */
+/*                                                                 */
+/* @retval 1 joined: its response is coming, under a seq of its    */
+/*         own, from the other request's run                       */
+/* @retval 0 not joined: run it                                    */
+/*******************************************************************/
+int flight_join(fsm* state, char** envp, flight** lead)
+{
+  char key[BUF_SIZE];
+  flight_waiter* w;
+  flight* f;
+  unsigned hash;
+  char* env;
+  size_t env_len;
+  int n;
+
+  *lead = NULL;
+
+  if (config.coalesce_max <= 0 ||
+      (n = mcache_key(state, key, sizeof(key))) < 0)
+    return 0;
+
+  hash = fnv1a(key, n);
+  for (f = buckets[hash & (FL_BUCKETS - 1)]; f != NULL; f = f->hnext)
+    if (f->hash == hash && f->key_len == (size_t)n &&
+        !memcmp(f->key, key, n))
+      break;
+
+  if (f != NULL && f->nwait < config.coalesce_max &&
+      (env = cgi_pack_env(envp, &env_len)) != NULL)
+  {
+    if ((w = add_waiter(f)) == NULL)
+    {
+      liso_free(env);
+      return 0;
+    }
+
+    w->slot     = state - fpool->states;
+    w->fd       = state->fd;
+    w->seq      = state->seq_next++;  // Its turn
+    w->conn     = state->conn;
+    w->deadline = (long long)(mono_ns() / 1000000) +
+                  config.coalesce_wait_ms;
+    w->env      = env;
+    w->env_len  = env_len;
+
+    state->cgi_pending++;
+    flight_stats.joined++;
+    return 1;
+  }
+
+  /* Full: the next run takes the requests that come after */
+  if (f != NULL)
+    unlist(f);
+
+  *lead = create(key, n, hash);
+  return 0;
+}
+
+/* The run leading f never started */
+void flight_abort(flight* f)
+{
+  if (f != NULL)
+    free_flight(f);
+}
+
+/* Requests waiting on f's run besides its own */
+int flight_waiters(flight* f)
+{
+  return f != NULL ? f->nwait : 0;
+}
+
+/* 1 if the waiter's client is still there and wants its response */
+static int live(pool* p, flight_waiter* w)
+{
+  fsm* client = &p->states[w->slot];
+
+  return client->fd == w->fd && client->pipefds < 0 && client->cgi_pending &&
+         resp_live(client, w->seq);
+}
+
+/* The waiter no longer waits: its client can be shed again */
+static void let_go(pool* p, flight_waiter* w)
+{
+  fsm* client = &p->states[w->slot];
+
+  if (client->fd == w->fd && client->pipefds < 0 && client->cgi_pending)
+    client->cgi_pending--;
+  liso_free(w->env);
+  w->env = NULL;
+}
+
+/* Ends a waiter's response: an error if none of it went out (error
+   0: it did, and is cut short) */
+static void fail(pool* p, flight_waiter* w, int error)
+{
+  let_go(p, w);
+  resp_fail(p, w->slot, w->seq, error);
+  if (p->states[w->slot].fd >= 0)
+    flush_client(p, w->slot);
+}
+
+/******************************************************************/
+/* @brief Runs a waiter's request on its own, as if it had never  */
+/* joined: a cgi slot of its own answers the response it waits    */
+/* on, now or once there is a place (cgi_begin()).                */
+/*                                                                */
+/* @retval 0 on success, else the error to answer with            */
+/******************************************************************/
+static int run_alone(pool* p, flight_waiter* w)
+{
+  char* envp[ZYGOTE_MAX_ENV + 1];
+  fsm* client = &p->states[w->slot];
+  int in[2], out[2];
+  unsigned seq_next = client->seq_next;
+  int conn = client->conn;
+  char* e;
+  int k, n, rc;
+
+  for (e = w->env, n = 0; e < w->env + w->env_len && n < ZYGOTE_MAX_ENV;
+       e += strlen(e) + 1)
+    envp[n++] = e;
+  envp[n] = NULL;
+
+  if (pipe(in) < 0)
+    return 500;
+  if (pipe(out) < 0)
+  {
+    close(in[0]);
+    close(in[1]);
+    return 500;
+  }
+  for (k = 0; k < 2; k++)
+  {
+    fcntl(in[k],  F_SETFD, FD_CLOEXEC);
+    fcntl(out[k], F_SETFD, FD_CLOEXEC);
+  }
+  fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+
+  /* add_cgi() gives the slot the client's next seq and keep-alive;
+     this one answers the response the waiter holds instead. Its
+     cgi_pending passes to the slot */
+  client->pipefds  = out[0];
+  client->seq_next = w->seq;
+  client->conn     = w->conn;
+  client->cgi_pending--;
+
+  rc = cgi_begin(client, envp, in[0], out[1], 0);
+
+  client->seq_next = seq_next;
+  client->conn     = conn;
+  close(in[1]);   // A GET has no body
+
+  liso_free(w->env);
+  w->env = NULL;
+  flight_stats.alone++;
+  return rc;
+}
+
+/*******************************************************************/
+/* @brief The head of cgi slot i's output is in: each waiter gets  */
+/* one, with its own keep-alive, and whatever body came with it.   */
+/* If the response may not be shared, each runs on its own.        */
+/*                                                                 */
+/* @param out   The script's output so far                         */
+/* @param hlen  Length of its header block, blank line included    */
+/* @param len   Length of all of it                                */
+/*******************************************************************/
+void flight_head(pool* p, int i, char* out, size_t hlen, size_t len)
+{
+  fsm* cgi = &p->states[i];
+  flight* f = cgi->flight;
+  char head[BUF_SIZE];
+  int k, n, rc, framing, shared;
+  flight_waiter* w;
+  outq* q;
+
+  if (f == NULL)
+    return;
+
+  unlist(f);
+  f->streaming = 1;
+  shared = mcache_shareable(out, hlen);
+
+  for (k = n = 0; k < f->nwait; k++)
+  {
+    w = &f->wait[k];
+    if (!live(p, w))
+      let_go(p, w);
+    else if (!shared)
+    {
+      if ((rc = run_alone(p, w)) != 0)
+      {
+        resp_fail(p, w->slot, w->seq, rc);
+        if (p->states[w->slot].fd >= 0)
+          flush_client(p, w->slot);
+      }
+    }
+    else if ((q = resp_queue(&p->states[w->slot], w->seq)) == NULL ||
+             (rc = cgi_head(out, hlen, head, w->conn, &framing)) < 0 ||
+             outq_copy(q, head, rc) ||
+             queue_body(q, out + hlen, len - hlen, framing))
+      fail(p, w, 502);
+    else
+    {
+      resp_head(&p->states[w->slot], w->seq, head);
+      flush_client(p, w->slot);
+      f->wait[n++] = *w;
+    }
+  }
+  f->nwait = n;
+
+  /* Nobody to share with: the run is the leader's alone */
+  if (n == 0)
+  {
+    free_flight(f);
+    cgi->flight = NULL;
+  }
+}
+
+/* Relays len more bytes of cgi slot i's body to its waiters */
+void flight_body(pool* p, int i, char* data, size_t len)
+{
+  fsm* cgi = &p->states[i];
+  flight* f = cgi->flight;
+  flight_waiter* w;
+  outq* q;
+  int k, n;
+
+  if (f == NULL)
+    return;
+
+  for (k = n = 0; k < f->nwait; k++)
+  {
+    w = &f->wait[k];
+    if (!live(p, w))
+      let_go(p, w);
+    else if ((q = resp_queue(&p->states[w->slot], w->seq)) == NULL ||
+             queue_body(q, data, len, cgi->framing))
+      fail(p, w, 0);
+    else
+    {
+      flush_client(p, w->slot);
+      f->wait[n++] = *w;
+    }
+  }
+  f->nwait = n;
+}
+
+/* cgi slot i's script finished: each waiter's response is complete */
+void flight_done(pool* p, int i)
+{
+  fsm* cgi = &p->states[i];
+  flight* f = cgi->flight;
+  flight_waiter* w;
+  outq* q;
+  int k;
+
+  if (f == NULL)
+    return;
+
+  for (k = 0; k < f->nwait; k++)
+  {
+    w = &f->wait[k];
+    if (!live(p, w))
+    {
+      let_go(p, w);
+      continue;
+    }
+
+    if ((q = resp_queue(&p->states[w->slot], w->seq)) == NULL ||
+        (cgi->framing == FRAME_CHUNKED && outq_copy(q, "0\r\n\r\n", 5)))
+    {
+      fail(p, w, 0);
+      continue;
+    }
+
+    /* Unframed, closing marks the end of the body */
+    if (cgi->framing == FRAME_CLOSE || !w->conn)
+      resp_cut(p, w->slot, w->seq);
+    let_go(p, w);
+    resp_done(p, w->slot, w->seq);
+    flush_client(p, w->slot);
+  }
+
+  f->nwait = 0;
+  free_flight(f);
+  cgi->flight = NULL;
+}
+
+/*******************************************************************/
+/* @brief cgi slot i's run failed, or it is going (rm_cgi()): its  */
+/* waiters get error, or are cut short if output had started.      */
+/*******************************************************************/
+void flight_fail(pool* p, int i, int error)
+{
+  fsm* cgi = &p->states[i];
+  flight* f = cgi->flight;
+  int k;
+
+  if (f == NULL)
+    return;
+
+  for (k = 0; k < f->nwait; k++)
+  {
+    if (live(p, &f->wait[k]))
+      fail(p, &f->wait[k], f->streaming ? 0 : error);
+    else
+      let_go(p, &f->wait[k]);
+  }
+
+  f->nwait = 0;
+  free_flight(f);
+  cgi->flight = NULL;
+}
+
+/*******************************************************************/
+/* @brief cgi slot i's client went away: a waiter takes its place  */
+/* as the one it answers. Waiters have had the same output, so the */
+/* run carries on where it was.                                    */
+/*                                                                 */
+/* @returns the waiter's client slot, -1 if there is none          */
+/*******************************************************************/
+int flight_promote(pool* p, int i)
+{
+  fsm* cgi = &p->states[i];
+  flight* f = cgi->flight;
+  flight_waiter w;
+
+  while (f != NULL && f->nwait > 0)
+  {
+    w = f->wait[0];
+    memmove(f->wait, f->wait + 1, --f->nwait * sizeof(flight_waiter));
+
+    if (!live(p, &w))
+    {
+      let_go(p, &w);
+      continue;
+    }
+
+    liso_free(w.env);   // Its cgi_pending now counts the slot
+    cgi->owner   = w.slot;
+    cgi->fd      = w.fd;
+    cgi->seq     = w.seq;
+    cgi->conn    = w.conn;
+    cgi->context = p->states[w.slot].context;
+    return w.slot;
+  }
+
+  return -1;
+}
+
+/* 1 if any request waits on cgi slot i's run */
+int flight_wanted(pool* p, int i)
+{
+  flight* f = p->states[i].flight;
+  int k;
+
+  for (k = 0; f != NULL && k < f->nwait; k++)
+    if (live(p, &f->wait[k]))
+      return 1;
+  return 0;
+}
+
+/* 1 if a waiter on cgi slot i has too much of its output queued */
+int flight_behind(pool* p, int i)
+{
+  flight* f = p->states[i].flight;
+  int k;
+
+  for (k = 0; f != NULL && f->streaming && k < f->nwait; k++)
+    if (live(p, &f->wait[k]) &&
+        resp_bytes(&p->states[f->wait[k].slot]) >= FLIGHT_CLIENT_HIGH)
+      return 1;
+  return 0;
+}
+
+/*****************************************************************/
+/* @brief Once per pass: waiters whose client went away are let  */
+/* go, and those that have waited LISO_COALESCE_WAIT ms for a    */
+/* head get a 504.                                               */
+/*****************************************************************/
+void flight_tick(pool* p)
+{
+  long long now = (long long)(mono_ns() / 1000000);
+  flight_waiter* w;
+  flight* f;
+  int k, n;
+
+  for (f = flights; f != NULL; f = f->next)
+  {
+    if (f->streaming)
+      continue;
+
+    for (k = n = 0; k < f->nwait; k++)
+    {
+      w = &f->wait[k];
+      if (!live(p, w))
+        let_go(p, w);
+      else if (w->deadline <= now)
+      {
+        flight_stats.expired++;
+        fail(p, w, 504);
+      }
+      else
+        f->wait[n++] = *w;
+    }
+    f->nwait = n;
+  }
+}
+
+/* Milliseconds until flight_tick() has a waiter to expire, -1 if none */
+long flight_wakeup(void)
+{
+  long long next = -1, now = (long long)(mono_ns() / 1000000);
+  flight* f;
+
+  /* Everybody waits as long, so a flight's first waiter goes first */
+  for (f = flights; f != NULL; f = f->next)
+    if (!f->streaming && f->nwait > 0 &&
+        (next < 0 || f->wait[0].deadline < next))
+      next = f->wait[0].deadline;
+
+  if (next < 0)
+    return -1;
+  return next > now ? (long)(next - now) : 0;
+}
+
+void flight_print(FILE* file)
+{
+  if (config.coalesce_max <= 0)
+    return;
+
+  fprintf(file, "Coalescing: %lu joined, %lu expired, %lu ran alone; "
+          "%d in flight\n", flight_stats.joined, flight_stats.expired,
+          flight_stats.alone, nflights);
+  fflush(file);
+}
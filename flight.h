@@ -0,0 +1,33 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdio.h>
+
+#include "lisod.h"
+
+typedef struct flight flight;
+
+typedef struct flight_counters {
+  unsigned long joined;     // Requests answered by another request's run
+  unsigned long expired;    // Waiters given a 504, the head too slow
+  unsigned long alone;      // Waiters run on their own: not shareable
+} flight_counters;
+
+extern flight_counters flight_stats;
+
+void flight_init(pool* p);
+int  flight_join(fsm* state, char** envp, flight** lead);
+void flight_abort(flight* f);
+int  flight_waiters(flight* f);
+void flight_head(pool* p, int i, char* out, size_t hlen, size_t len);
+void flight_body(pool* p, int i, char* data, size_t len);
+void flight_done(pool* p, int i);
+void flight_fail(pool* p, int i, int error);
+int  flight_promote(pool* p, int i);
+int  flight_wanted(pool* p, int i);
+int  flight_behind(pool* p, int i);
+void flight_tick(pool* p);
+long flight_wakeup(void);
+void flight_print(FILE* file);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef LISO_PLUGIN_H
+#define LISO_PLUGIN_H
+
+/* The in-process handler ABI. A plugin is a shared object exporting a
+   liso_plugin named liso_plugin_entry (LISO_PLUGIN_SYMBOL); lisod
+   loads it at startup and hands it the requests under the URI prefix
+   it is registered on (LISO_PLUGINS, see readme.txt). Plugins include
+   only this header and link against nothing of lisod's. */
+
+#include <stddef.h>
+
+#define LISO_PLUGIN_ABI      1
+#define LISO_PLUGIN_SYMBOL   "liso_plugin_entry"
+
+/* liso_plugin.flags */
+#define LISO_PLUGIN_BLOCKING 1   /* handle() may block: run it on a worker
+                                    thread, not on the event loop */
+
+/* The request, valid until handle() returns */
+typedef struct liso_request {
+  const char* method;       /* "GET", "HEAD" or "POST"                  */
+  const char* uri;          /* As requested, query string included      */
+  const char* prefix;       /* The prefix the handler is registered on  */
+  const char* path;         /* The URI past the prefix, without query   */
+  const char* query;        /* After the '?', or ""                     */
+  const char* remote_addr;  /* The client's IP address                  */
+  int         https;        /* 1 if it came in over HTTPS               */
+  size_t      content_length; /* Bytes of body; all of it is in before  */
+                              /* handle() is called                     */
+
+  /* The value of header name (case insensitive, without the colon),
+     not NUL terminated; *len is its length. NULL if there is none */
+  const char* (*header)(struct liso_request* req, const char* name,
+                        size_t* len);
+
+  /* Reads up to len more bytes of the body into buf; 0 at its end */
+  size_t (*read)(struct liso_request* req, void* buf, size_t len);
+
+  void* host;               /* lisod's; don't touch */
+} liso_request;
+
+/* Where the response goes. It is sent, with a Content-Length, once
+   handle() returns */
+typedef struct liso_response {
+  /* Sets the status code; 200 unless set */
+  void (*status)(struct liso_response* resp, int code);
+
+  /* Adds a header line. Date, Server, Connection and Content-Length
+     are lisod's own. Returns 0, or -1 if it doesn't fit */
+  int  (*header)(struct liso_response* resp, const char* name,
+                 const char* value);
+
+  /* Appends len bytes to the body. Returns 0, or -1 out of memory */
+  int  (*write)(struct liso_response* resp, const void* data, size_t len);
+
+  void* host;               /* lisod's; don't touch */
+} liso_response;
+
+typedef struct liso_plugin {
+  int         abi;          /* LISO_PLUGIN_ABI                          */
+  const char* name;
+  int         flags;        /* LISO_PLUGIN_BLOCKING, or 0               */
+
+  /* Called once at startup for each prefix it is registered on; *data
+     is passed to handle(). Optional. Returns 0, or -1 to refuse */
+  int (*init)(const char* prefix, void** data);
+
+  /* Answers one request through resp. Returns 0, or -1 to have a 500
+     sent instead of whatever was written. A handler without
+     LISO_PLUGIN_BLOCKING runs on the event loop and must not block; a
+     blocking one may run on several threads at once */
+  int (*handle)(void* data, liso_request* req, liso_response* resp);
+} liso_plugin;
+
+#endif
@@ -19,11 +19,11 @@
 
 /* YOLO M8s */
 
-#include <mcheck.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <signal.h>
 #include <errno.h>
 #include <stdio.h>
@@ -36,6 +36,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 
 
@@ -47,6 +48,27 @@
 #include "lisod.h"
 #include "logger.h"
 #include "engine.h"
+#include "alloc.h"
+#include "config.h"
+#include "outq.h"
+#include "fcgi.h"
+#include "zygote.h"
+#include "cgi.h"
+#include "mcache.h"
+#include "flight.h"
+#include "plugin.h"
+#include "metrics.h"
+#include "scoreboard.h"
+#include "probes.h"
+
+/* A CGI's output stops being read while its client has this much
+   queued (on HTTP, while anything is queued: it is spliced) */
+#define CGI_CLIENT_HIGH (256 * 1024)
+#define CGI_READ_SIZE   (64 * 1024)   /* Read per pass on HTTPS */
+
+/* The event loop only reads the first line of each fsm */
+_Static_assert(offsetof(fsm, method) == CACHE_LINE,
+               "hot fsm fields must fit in one cache line");
 
 /** Global vars **/
 FILE* logfile;   /* Legitimate use of globals, I swear! */
@@ -56,18 +78,33 @@ char* cgipath;
 short listen_port;
 short https_port;
 
+volatile sig_atomic_t dump_stats = 0;    /* Set by SIGUSR1 */
+volatile sig_atomic_t dump_trace = 0;    /* Set by SIGUSR2 */
+volatile sig_atomic_t shut_down  = 0;    /* Set by SIGINT */
+
+/* Connections accepted; the last one's is the id add_client() gives it
+   (and the probes know it by) */
+static unsigned long conn_ids = 0;
+
 /** Prototypes **/
 
 int  close_socket(int sock);
 void init_pool(int listenfd, int https_fd, pool *p);
 void add_client(int client_fd, char* wwwfolder, SSL* client_context, pool *p);
 void check_clients(pool *p);
+void serve_requests(pool* p, int i);
+int  queue_response(pool* p, int i);
+void relay_cgi(pool* p, int i);
 void cleanup(int sig);
-void sigchld_handler(int sig);
+void sigint_handler(int sig);
+void sigusr1_handler(int sig);
+void sigusr2_handler(int sig);
+void sighup_handler(int sig);
+void throttle(pool* p, int listen_fd, int https_fd);
+void hold_clients(pool* p);
 int daemonize(char* lock_file);
 
 /** Definitions **/
-void no_op(enum mcheck_status status) {status = status;}
 
 int main(int argc, char* argv[])
 {
@@ -80,14 +117,19 @@ int main(int argc, char* argv[])
     return EXIT_FAILURE;
   }
 
-  mcheck(&no_op);
+  config_load();
+  alloc_init();
 
   /* Ignore SIGPIPE */
   /* Handle SIGINT to cleanup after liso */
-  /* Install SIGCHLD handler to reap children */
+  /* SIGUSR1 dumps allocator statistics to the log */
+  /* SIGUSR2 writes out the request trace */
+  /* SIGHUP reopens the log, after it was rotated */
   signal(SIGPIPE, SIG_IGN);
-  signal(SIGINT,  cleanup);
-  signal(SIGCHLD, sigchld_handler);
+  signal(SIGINT,  sigint_handler);
+  signal(SIGUSR1, sigusr1_handler);
+  signal(SIGUSR2, sigusr2_handler);
+  signal(SIGHUP,  sighup_handler);
 
   /* Parse cmdline args */
   listen_port       = atoi(argv[1]);
@@ -99,18 +141,30 @@ int main(int argc, char* argv[])
   char* privatekey  = argv[7];
   char* certfile    = argv[8];
 
+  /* CGI environment entries that never change */
+  cgi_env_init();
+
+  /* Fork the CGI zygote while we are still small */
+  if (zygote_start(cgipath))
+  {
+    fprintf(stderr, "Unable to start the CGI zygote.\n");
+    return EXIT_FAILURE;
+  }
+
   /* Various buffers for read/write */
   char log_buf[LOG_SIZE]            = {0};
-  char hostname[LOG_SIZE]           = {0};
   char cli_ip[INET_ADDRSTRLEN]      = {0};
+#if LISO_LOG_LEVEL >= LOG_DEBUG
+  char hostname[LOG_SIZE]           = {0};
   char port[10]                     = {0};
+#endif
 
   int                 listen_fd, https_fd, client_fd;
   socklen_t           cli_size;
   struct sockaddr_in  serv_addr, https_addr, cli_addr;
-  pool *pool =        malloc(sizeof(struct pool));
+  pool *pool =        NULL;
   struct timeval      tv;
-  tv.tv_sec = 5;
+  long                wait_ms, cgi_ms;
 
   /* SSL variables */
   SSL     *client_context = NULL;
@@ -123,12 +177,19 @@ int main(int argc, char* argv[])
   SSL_library_init();
   SSL_load_error_strings();
 
-  /* we want to use TLSv1 only */
-  if ((ssl_context = SSL_CTX_new(TLSv1_server_method())) == NULL)
+  /* TLS 1.2 and up: what clients offer at OpenSSL's default security
+     level */
+  if ((ssl_context = SSL_CTX_new(TLS_server_method())) == NULL)
   {
     fprintf(stderr, "Error creating SSL context.\n");
     return EXIT_FAILURE;
   }
+  SSL_CTX_set_min_proto_version(ssl_context, TLS1_2_VERSION);
+
+  /* Client sockets are non-blocking: a write the socket can't take is
+     retried from the output queue, whose buffer may have moved */
+  SSL_CTX_set_mode(ssl_context, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
   /* register private key */
   if (SSL_CTX_use_PrivateKey_file(ssl_context, privatekey,
@@ -148,6 +209,10 @@ int main(int argc, char* argv[])
     return EXIT_FAILURE;
   }
 
+  /* The connection table must start on a cache line */
+  if(posix_memalign((void**)&pool, CACHE_LINE, sizeof(struct pool)) != 0)
+    pool = NULL;
+
   if(pool == NULL)
   {
     log_error("Malloc error! Exiting!", logfile);
@@ -175,6 +240,9 @@ int main(int argc, char* argv[])
   https_addr.sin_port         = htons(https_port);
   https_addr.sin_addr.s_addr  = INADDR_ANY;
 
+  fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+  fcntl(https_fd,  F_SETFD, FD_CLOEXEC);
+
   /* Set sockopt so that ports can be resued */
   int enable = -1;
   if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable,
@@ -214,6 +282,69 @@ int main(int argc, char* argv[])
   /* Initialize our pool of fds */
   init_pool(listen_fd, https_fd, pool);
 
+  /* Children are reaped from the event loop (cgi.c) */
+  flight_init(pool);
+  if (cgi_init(pool))
+  {
+    fprintf(stderr, "Unable to watch for CGI processes.\n");
+    close_socket(https_fd);
+    close_socket(listen_fd);
+    SSL_CTX_free(ssl_context);
+    log_close(logfile);
+    return EXIT_FAILURE;
+  }
+
+  /* Start the FastCGI workers, if configured */
+  if (fcgi_init(cgipath, pool))
+  {
+    close_socket(https_fd);
+    close_socket(listen_fd);
+    SSL_CTX_free(ssl_context);
+    log_close(logfile);
+    return EXIT_FAILURE;
+  }
+
+  /* Load the in-process handlers, if configured */
+  if (plugin_init(pool))
+  {
+    fcgi_stop();
+    close_socket(https_fd);
+    close_socket(listen_fd);
+    SSL_CTX_free(ssl_context);
+    log_close(logfile);
+    return EXIT_FAILURE;
+  }
+
+  /* Start the binary access log, if configured */
+  if (access_init())
+  {
+    fcgi_stop();
+    close_socket(https_fd);
+    close_socket(listen_fd);
+    SSL_CTX_free(ssl_context);
+    log_close(logfile);
+    return EXIT_FAILURE;
+  }
+
+  /* Count and time requests, if LISO_METRICS_URI asks for them */
+  if (metrics_init())
+    log_error("Unable to start metrics", logfile);
+
+  /* Publish each connection's state, if LISO_SCOREBOARD asks for it */
+  if (scoreboard_init())
+    log_error("Unable to create the scoreboard", logfile);
+
+  /* Trace some requests, if LISO_TRACE_SAMPLE or LISO_TRACE_HEADER
+     asks for it */
+  if (trace_init())
+    log_error("Unable to start tracing", logfile);
+
+  /* Every child that lives on is forked by now: the log can have its
+     flusher thread */
+  if (log_start())
+    log_error("Unable to start the log flusher, logging synchronously",
+              logfile);
+
   /******** END INIT *********/
 
   /******* BEGIN SERVER CODE ******/
@@ -223,10 +354,32 @@ int main(int argc, char* argv[])
   {
     /* Block until there are file descriptors ready */
     pool->readfds = pool->masterfds;
-    pool->writefds = pool->masterfds;
+    pool->writefds = pool->writers;
+
+    /* Close to the memory budget: stop taking on new work */
+    if (mem_pressure() != MEM_OK)
+      throttle(pool, listen_fd, https_fd);
+
+    /* Clients with pipelined requests left over, or with output still
+       queued, aren't read from; and we must not sleep while requests
+       are pending, or past a CGI deadline */
+    wait_ms = pool->npending > 0 ? 0 : 5000;
+    if ((cgi_ms = cgi_wakeup()) >= 0 && cgi_ms < wait_ms)
+      wait_ms = cgi_ms;
+    if ((cgi_ms = flight_wakeup()) >= 0 && cgi_ms < wait_ms)
+      wait_ms = cgi_ms;
+    if ((cgi_ms = plugin_wakeup()) >= 0 && cgi_ms < wait_ms)
+      wait_ms = cgi_ms;
+    if (fcgi_enabled() && (cgi_ms = fcgi_wakeup()) >= 0 && cgi_ms < wait_ms)
+      wait_ms = cgi_ms;
+    tv.tv_sec  = wait_ms / 1000;
+    tv.tv_usec = (wait_ms % 1000) * 1000;
+    hold_clients(pool);
+    if (fcgi_enabled())
+      fcgi_hold(pool);
 
     if((pool->nready = select(pool->maxfd+1, &pool->readfds, &pool->writefds,
-                              NULL, &tv)) == -1)
+                              NULL, &tv)) == -1 && errno != EINTR)
     {
       close_socket(listen_fd);
       memset(log_buf, 0, LOG_SIZE);
@@ -236,6 +389,44 @@ int main(int argc, char* argv[])
       return EXIT_FAILURE;
     }
 
+    if (shut_down)
+      cleanup(SIGINT);
+
+    if (dump_stats)
+    {
+      dump_stats = 0;
+      alloc_stats(logfile);
+      log_print(logfile);
+      access_print(logfile);
+      metrics_print(logfile);
+      trace_print(logfile);
+      outq_print(logfile);
+      fcgi_print(logfile);
+      cgi_print(logfile);
+      mcache_print(logfile);
+      flight_print(logfile);
+      plugin_print(logfile);
+    }
+
+    if (dump_trace)
+    {
+      dump_trace = 0;
+      trace_write();
+    }
+
+    /* Interrupted by a signal, nothing is ready */
+    if (pool->nready == -1)
+      continue;
+
+    /* Reap children, restarting FastCGI workers that exited; then
+       expire CGI requests that waited too long or ran too long */
+    cgi_reap(pool);
+    if (fcgi_enabled())
+      fcgi_supervise();
+    cgi_tick(pool);
+    flight_tick(pool);
+    plugin_reap(pool);
+
     /* Is the http port having clients ? */
     if (FD_ISSET(listen_fd, &pool->readfds))
     {
@@ -248,17 +439,24 @@ int main(int argc, char* argv[])
         log_close(logfile);
         return EXIT_FAILURE;
       }
+      conn_ids++;
+      PROBE3(accept, conn_ids, client_fd, 0);
 
       /* Log client data */
+#if LISO_LOG_LEVEL >= LOG_DEBUG
       getnameinfo((struct sockaddr *) &cli_addr, cli_size,
-                  hostname, LOG_SIZE, port, 10, 0);
-      memset(log_buf, 0, LOG_SIZE);
-      sprintf(log_buf,
-              "We have a new client: Say hi to %s:%s.", hostname, port);
-      log_error(log_buf, logfile);
+                  hostname, LOG_SIZE, port, 10,
+                  NI_NUMERICHOST | NI_NUMERICSERV);
+      log_debug("We have a new client: Say hi to %s:%s.", hostname, port);
+#endif
 
       inet_ntop(AF_INET, &(cli_addr.sin_addr), cli_ip, INET_ADDRSTRLEN);
 
+      /* Writes go through the output queue, which handles short writes */
+      fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+      fcntl(client_fd, F_SETFD, FD_CLOEXEC);   // Not for CGI children
+
+      metrics_accepted(0);
       add_client(client_fd, cli_ip, NULL, pool);
     }
 
@@ -275,6 +473,13 @@ int main(int argc, char* argv[])
         log_close(logfile);
         return EXIT_FAILURE;
       }
+      conn_ids++;
+      PROBE3(accept, conn_ids, client_fd, 1);
+
+      /* The handshake is carried on by check_clients(), as the socket
+         is ready for it; no client can hold up the rest */
+      fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+      fcntl(client_fd, F_SETFD, FD_CLOEXEC);   // Not for CGI children
 
       /************ WRAP SOCKET WITH SSL ************/
       if ((client_context = SSL_new(ssl_context)) == NULL)
@@ -293,27 +498,26 @@ int main(int argc, char* argv[])
         fprintf(stderr, "Error creating client SSL context.\n");
         return EXIT_FAILURE;
       }
-
-      if (SSL_accept(client_context) <= 0)
-      {
-        close(https_fd);
-        SSL_free(client_context);
-        SSL_CTX_free(ssl_context);
-        fprintf(stderr, "Error accepting (handshake) client SSL context.\n");
-        return EXIT_FAILURE;
-      }
+      SSL_set_accept_state(client_context);
       /************ END WRAP SOCKET WITH SSL ************/
 
+      inet_ntop(AF_INET, &(cli_addr.sin_addr), cli_ip, INET_ADDRSTRLEN);
+
       /* Log client data */
+#if LISO_LOG_LEVEL >= LOG_DEBUG
       getnameinfo((struct sockaddr *) &cli_addr, cli_size,
-                  hostname, LOG_SIZE, port, 10, 0);
-      memset(log_buf, 0, LOG_SIZE);
-      sprintf(log_buf,
-              "We have a new SSL client: Say hi to %s:%s.", hostname, port);
-      log_error(log_buf, logfile);
-      add_client(client_fd, wwwfolder, client_context, pool);
+                  hostname, LOG_SIZE, port, 10,
+                  NI_NUMERICHOST | NI_NUMERICSERV);
+      log_debug("We have a new SSL client: Say hi to %s:%s.", hostname,
+                port);
+#endif
+      add_client(client_fd, cli_ip, client_context, pool);
     }
 
+    /* Relay records to and from the FastCGI workers */
+    if (fcgi_enabled())
+      fcgi_check(pool);
+
     /* Read and respond to each client requests */
     check_clients(pool);
   }
@@ -338,11 +542,15 @@ int close_socket(int sock)
  */
 void init_pool(int listenfd, int https_fd, pool *p)
 {
+  int i;
   p->maxi = -1;
+  p->rr = 0;
+  p->npending = 0;
+  FD_ZERO(&p->writers);
 
-  memset(p->clientfd, -1, FD_SETSIZE*sizeof(int)); // No clients at the moment.
-  //memset(p->data,      0, FD_SETSIZE*BUF_SIZE*sizeof(char)); // No data yet.
-  memset(p->states,    0, FD_SETSIZE*sizeof(fsm*)); // NULL out the fsms.
+  memset(p->states, 0, MAX_CLIENTS*sizeof(fsm)); // Zero out the fsms.
+  for (i = 0; i < MAX_CLIENTS; i++)
+    p->states[i].fd = -1;   // No clients at the moment.
 
   /* Initailly, listenfd and https_fd are the only members of the read set */
   p->maxfd = https_fd;
@@ -359,16 +567,59 @@ void init_pool(int listenfd, int https_fd, pool *p)
  */
 void add_client(int client_fd, char* cli_ip, SSL* client_context, pool *p)
 {
-  int i; fsm* state;
+  int i; fsm* state; fsm_cold* cold;
 
   p->nready--;
 
-  /* Create a fsm for this client */
-  state = malloc(sizeof(struct state));
+  for (i = 0; i < MAX_CLIENTS; i++)  /* Find an available slot */
+    if(p->states[i].fd < 0)
+      break;
+
+  /* Cold data (buffers, client ip) lives outside the table */
+  cold = NULL;
+  if (i < MAX_CLIENTS)
+  {
+    p->states[i].mem = 0;
+    cold = conn_malloc(&p->states[i], MEM_CONN, sizeof(struct state_cold));
+  }
+
+  if (i == MAX_CLIENTS || cold == NULL)   /* There are no empty slots */
+  {
+    char response[BUF_SIZE] = {0};
+    fsm tmp = {.response = response, .resp_idx = 0};
+
+    client_error(&tmp, 503);
+    send(client_fd, tmp.response, tmp.resp_idx, 0);
+    log_error("Too many clients! Closing client socket...", logfile);
+    close_socket(client_fd);
+    if (client_context != NULL)
+      SSL_free(client_context);
+    liso_free(cold);
+    return;
+  }
+
+  state = &p->states[i];
 
   /* Create initial values for fsm */
-  memset(state->request,  0, BUF_SIZE);
-  memset(state->response, 0, BUF_SIZE);
+  memset(cold->request,  0, BUF_SIZE);
+  memset(cold->response, 0, BUF_SIZE);
+  strncpy(cold->cli_ip, cli_ip, INET_ADDRSTRLEN);
+  cold->id = conn_ids;
+  memset(cold->freebuf, 0, FREE_SIZE*sizeof(char*));
+  memset(cold->held, 0, sizeof(cold->held));
+  cold->held_done = 0;
+  memset(cold->acc, 0, sizeof(cold->acc));
+  memset(cold->started, 0, sizeof(cold->started));
+  cold->req_start = 0;
+  cold->tls_start = client_context != NULL ? metrics_clock() : 0;
+  cold->out_base  = 0;
+  cold->traced    = 0;
+  memset(cold->trace_parse, 0, sizeof(cold->trace_parse));
+
+  state->cold       = cold;
+  state->request    = cold->request;
+  state->response   = cold->response;
+
   state->method     = NULL;
   state->uri        = NULL;
   state->version    = NULL;
@@ -382,56 +633,90 @@ void add_client(int client_fd, char* cli_ip, SSL* client_context, pool *p)
   state->www            = wwwfolder;
   state->conn           = 1;
   state->context = client_context;
-  strncpy(state->cli_ip, cli_ip, INET_ADDRSTRLEN);
 
   state->pipefds    = -1;
+  state->body_fd    = -1;
+  state->cgi_in     = -1;
+  state->body_state = BODY_DONE;
+  state->body_left  = 0;
+  state->owner      = -1;
+  state->framing    = FRAME_CLOSE;
+  state->pid        = 0;
+  state->pidfd      = -1;
+  state->timed_out  = 0;
+  state->fill       = NULL;
+  state->flight     = NULL;
+
+  state->last_active = time(NULL);
+  state->cgi_pending = 0;
+  state->deferred = 0;
+  state->sched_pending = 0;
+  state->closing = 0;
+  state->handshake = client_context != NULL;
+  state->seq_next = 0;
+  state->seq_out = 0;
+  outq_init(&cold->out, &state->mem);
+
+  /* Add fsm to pool */
+  state->fd = client_fd;
+
+  /* Add the descriptor to the master set */
+  FD_SET(client_fd, &p->masterfds);
+
+  /* Update max descriptor and max index */
+  if (client_fd > p->maxfd)
+    p->maxfd = client_fd;
+  if (i > p->maxi)
+    p->maxi = i;
+
+  scoreboard_open(p, i, -1);
+}
 
-  memset(state->freebuf, 0, FREE_SIZE*sizeof(char*));
-
-  for (i = 0; i < FD_SETSIZE; i++)  /* Find an available slot */
-  {
-    if(p->clientfd[i] < 0) {   /* Found one free slot */
-      p->clientfd[i] = client_fd;
-
-      /* Add the descriptor to the master set */
-      FD_SET(client_fd, &p->masterfds);
-
-      /* Add fsm to pool */
-      p->states[i] = state;
+/*
+  Makes a copy of the client's fsm struct, to relay a CGI's output.
+  A detached one answers nobody: it only refreshes the micro-cache
+  entry state->fill. A run others wait on takes state->flight with
+  it. Returns the cgi slot's index, or -1 if there is
+  none.
+ */
+int add_cgi(int client_fd, fsm* state, pool* p, int detached)
+{
+  int i; fsm* cgi; fsm_cold* cold;
 
-      /* Update max descriptor and max index */
-      if (client_fd > p->maxfd)
-        p->maxfd = client_fd;
-      if (i > p->maxi)
-        p->maxi = i;
+  for (i = 0; i < MAX_CLIENTS; i++)  /* Find an available slot */
+    if(p->states[i].fd < 0)
       break;
-    }
-  }
 
-  if (i == FD_SETSIZE)   /* There are no empty slots */
+  /* Create a fsm for this cgi process */
+  cold = NULL;
+  if (i < MAX_CLIENTS)
   {
-    client_error(state, 503);
-    send(client_fd, state->response, state->resp_idx, 0);
-    log_error("Too many clients! Closing client socket...", logfile);
-    close_socket(client_fd);
-    free(state);
+    p->states[i].mem = 0;
+    cold = conn_malloc(&p->states[i], MEM_CGI, sizeof(struct state_cold));
   }
-}
 
-/*
-  Makes a copy of the client's fsm struct.
- */
-int add_cgi(int client_fd, fsm* state, pool* p)
-{
-  int i; fsm* cgi;
+  if (i == MAX_CLIENTS || cold == NULL)   /* There are no empty slots */
+  {
+    liso_free(cold);
+    return -1;
+  }
 
-  /* Create a fsm for this cgi process */
-  cgi = malloc(sizeof(struct state));
+  cgi = &p->states[i];
 
   /* Create initial values for fsm */
-  memset(cgi->request,  0, BUF_SIZE);
-  memset(cgi->response, 0, BUF_SIZE);
-  strncpy(cgi->response, state->response, state->resp_idx);
+  memset(cold->request,  0, BUF_SIZE);
+  memset(cold->response, 0, BUF_SIZE);
+  strncpy(cold->response, state->response, state->resp_idx);
+  cold->id = state->cold->id;
+  strncpy(cold->cli_ip, state->cold->cli_ip, INET_ADDRSTRLEN);
+  memset(cold->freebuf, 0, FREE_SIZE*sizeof(char*));
+  memset(cold->held, 0, sizeof(cold->held));
+  cold->held_done = 0;
+  cold->traced = state->cold->traced;   // Its response is traced if ours is
+
+  cgi->cold       = cold;
+  cgi->request    = cold->request;
+  cgi->response   = cold->response;
 
   cgi->method     = NULL;
   cgi->uri        = NULL;
@@ -444,43 +729,109 @@ int add_cgi(int client_fd, fsm* state, pool* p)
   cgi->resp_idx   = state->resp_idx;
 
   cgi->www            = wwwfolder;
-  cgi->conn           = 1;
+  cgi->conn           = state->conn;  // Whether the response may keep it
   cgi->context        = state->context;
   // Save the client fd to write cgi data back to..
+  cgi->fd             = client_fd;
   cgi->pipefds        = state->pipefds;
+  cgi->body_fd        = -1;
+  cgi->cgi_in         = -1;   // The client slot relays the body
+  cgi->body_state     = BODY_DONE;
+  cgi->body_left      = 0;
+  cgi->owner          = detached ? -1 : (int)(state - p->states);
+  cgi->framing        = FRAME_HEAD;
+  cgi->pid            = 0;    // cgi.c starts it, now or later
+  cgi->pidfd          = -1;
+  cgi->timed_out      = 0;
+  cgi->fill           = state->fill;
+  state->fill         = NULL;
+  cgi->flight         = state->flight;
+  state->flight       = NULL;
+
+  cgi->last_active    = time(NULL);
+  cgi->cgi_pending    = 0;
+  cgi->deferred       = 0;
+  cgi->sched_pending  = 0;
+  cgi->closing        = 0;
+  cgi->seq            = detached ? 0 : state->seq_next++;  // Its turn
+  cgi->seq_next       = 0;
+  cgi->seq_out        = 0;
+  outq_init(&cold->out, &cgi->mem);
+
+  /* Add the descriptor to the master set */
+  FD_SET(state->pipefds, &p->masterfds);
+
+  /* Update max descriptor and max index */
+  if (state->pipefds > p->maxfd)
+    p->maxfd = state->pipefds;
+  if (i > p->maxi)
+    p->maxi = i;
 
-  memset(cgi->freebuf, 0, FREE_SIZE*sizeof(char*));
-
-  for (i = 0; i < FD_SETSIZE; i++)  /* Find an available slot */
-  {
-    if(p->clientfd[i] < 0) {   /* Found one free slot */
-      p->clientfd[i] = client_fd;
+  state->pipefds = -1;
+  if (!detached)
+    state->cgi_pending++;
+  scoreboard_open(p, i, state - p->states);
+  return i;
+}
 
-      /* Add the descriptor to the master set */
-      FD_SET(state->pipefds, &p->masterfds);
+/* Takes an HTTPS client's handshake as far as its socket allows; once
+   it is done the client is served like any other */
+static void tls_handshake(pool* p, int i)
+{
+  fsm* state = &p->states[i];
+  int rc;
 
-      /* Add fsm to pool */
-      p->states[i] = cgi;
+  scoreboard_handshake(1);
+  rc = SSL_accept(state->context);
+  scoreboard_handshake(0);
 
-      /* Update max descriptor and max index */
-      if (state->pipefds > p->maxfd)
-        p->maxfd = state->pipefds;
-      if (i > p->maxi)
-        p->maxi = i;
-      break;
-    }
+  if (rc > 0)
+  {
+    state->handshake = 0;
+    FD_CLR(state->fd, &p->writers);
+    metrics_since(METRIC_TLS, state->cold->tls_start);
+    metrics_accepted(1);
+    PROBE2(tls_done, state->cold->id, state->fd);
+    state->last_active = time(NULL);
+    return;
   }
 
-  if (i == FD_SETSIZE)   /* There are no empty slots */
+  switch (SSL_get_error(state->context, rc))
   {
-    client_error(state, 500);
-    Send(client_fd, state->context, state->response, state->resp_idx);
-    free(cgi);
-    return -1;
+    case SSL_ERROR_WANT_READ:
+      FD_CLR(state->fd, &p->writers);
+      break;
+    case SSL_ERROR_WANT_WRITE:
+      FD_SET(state->fd, &p->writers);
+      break;
+    default:
+      /* The client hung up or spoke no protocol we do: only its
+         connection goes, not the server */
+      log_error("TLS handshake failed, client dropped.", logfile);
+      rm_client(state->fd, p, "TLS handshake failed", i);
   }
+}
 
-  state->pipefds = -1;
-  return 0;
+/* Whether requests are timed: for the access log, the metrics or the
+   trace */
+static int timing(void)
+{
+  return access_enabled() || metrics_enabled() || trace_enabled();
+}
+
+/* The request response seq_next answers is in (or has failed to
+   parse): it started when its first byte did */
+static void take_on(fsm* state)
+{
+  fsm_cold* cold = state->cold;
+
+  if (!timing())
+    return;
+
+  cold->started[state->seq_next % RESP_MAX] =
+    cold->req_start ? cold->req_start : access_clock();
+  cold->req_start = 0;   // The next request's starts when it comes
+  cold->traced &= ~(1u << (state->seq_next % RESP_MAX));  // trace_begin()
 }
 
 /*********************************************************************/
@@ -490,192 +841,123 @@ int add_cgi(int client_fd, fsm* state, pool* p)
 /* writing, reads a request. Never blocks for a                      */
 /* single user.                                                      */
 /*                                                                   */
+/* Each pass starts one slot further along the table, and a client   */
+/* only gets serve_requests()'s budget per pass; whatever it has     */
+/* left pipelined is picked up on a later pass, round-robin.         */
+/*                                                                   */
 /* @param p The pool of clients to iterate through.                  */
 /*********************************************************************/
 void check_clients(pool *p)
 {
-  int i, client_fd, cgi_fd, n, error;
+  int i, k, nslots, client_fd, n;
   fsm* state;
-  char buf[BUF_SIZE] = {0}; char log_buf[LOG_SIZE] = {0};
+  char buf[BUF_SIZE] = {0};
 
   memset(buf,0,BUF_SIZE);
 
+  nslots = p->maxi + 1;
+
   /* Iterate through all clients, and read their data */
-  for(i = 0; (i <= p->maxi) && (p->nready > 0); i++)
+  for(k = 0; (k < nslots) && (p->nready > 0 || p->npending > 0); k++)
   {
-    if((client_fd = p->clientfd[i]) <= 0)
+    i         = (p->rr + k) % nslots;
+    state     = &p->states[i];
+    if((client_fd = state->fd) <= 0)
       continue;
-    state     = p->states[i];
-    cgi_fd    = state->pipefds;
+
+    /* A CGI process exited; its output may still be in the pipe */
+    if (state->pidfd >= 0 && FD_ISSET(state->pidfd, &p->readfds))
+    {
+      p->nready--;
+      cgi_exited(p, i);
+    }
 
     /* Check first for a CGI process to be read from, if any */
     if (client_fd > 0 && state->pipefds > 0 &&
         FD_ISSET(state->pipefds, &p->readfds))
     {
-      cgi_fd = state->pipefds;
-      /* Check if cgi process is ready to be read */
-      if(cgi_fd > 0 && FD_ISSET(cgi_fd, &p->readfds))
+      p->nready--;
+      if (trace_on(state, state->seq))
       {
-        /* receive bytes from the cgi process */
-        n = read(cgi_fd, buf, BUF_SIZE);
+        /* The slot may be gone once relay_cgi() returns */
+        unsigned long id = state->cold->id;
+        unsigned seq = state->seq;
+        uint64_t started = trace_clock();
 
-        fprintf(stderr,"%s", buf);
+        relay_cgi(p, i);
+        trace_emit(TRACE_CGI_RELAY, id, seq, started, 0);
+      }
+      else
+        relay_cgi(p, i);
+      continue;
+    }
 
-        /* We received some bytes, store em*/
-        if(n >= 1)
-        {
-          store_request(buf, n, state);
-        }
+    if(state->pipefds > 0) continue; // This is a CGI fd, do not let it go below
 
-        /* CGI process performed orderly shutdown */
-        if(n == 0)
-        {
-          if(Send(client_fd, state->context, state->request, state->end_idx)
-             != state->end_idx)
-          {
-            rm_client(client_fd, p, "CGI process failed", i);
-          }
-          /* Done with CGI, remove cgifd from select */
-          rm_cgi(cgi_fd, p, "CGI iz dun", i);
-        }
+    /* The CGI can take more of the request body */
+    if (state->cgi_in >= 0 && FD_ISSET(state->cgi_in, &p->writefds))
+    {
+      p->nready--;
+      FD_CLR(state->cgi_in, &p->writers);
+      serve_requests(p, i);
+      continue;
+    }
 
-        /* Error reading from CGI process */
-        if(n == -1)
-        {
-          rm_client(client_fd, p, "CGI process failed", i);
-        }
+    /* An HTTPS client still shaking hands */
+    if (state->handshake)
+    {
+      if (FD_ISSET(client_fd, &p->readfds) ||
+          FD_ISSET(client_fd, &p->writefds))
+      {
+        p->nready--;
+        tls_handshake(p, i);
       }
       continue;
     }
 
-    if(state->pipefds > 0) continue; // This is a CGI fd, do not let it go below
+    /* Output that didn't fit last time can go now */
+    if (FD_ISSET(client_fd, &p->writefds))
+    {
+      p->nready--;
+      if (flush_client(p, i) == 0 && !FD_ISSET(client_fd, &p->writers) &&
+          state->end_idx > 0)
+        serve_requests(p, i);  // Resume requests held back by the output
+      continue;
+    }
+
+    /* Still waiting on output; don't take on more until it drains */
+    if (FD_ISSET(client_fd, &p->writers))
+      continue;
+
+    /* Requests left over from an earlier pass go before reading more */
+    if (p->npending > 0 && state->sched_pending)
+    {
+      state->sched_pending = 0;
+      p->npending--;
+      serve_requests(p, i);
+      continue;
+    }
 
     /* If a descriptor is ready to be read, read a line from it */
     if (client_fd > 0 && FD_ISSET(client_fd, &p->readfds))
     {
       p->nready--;
 
-      state = p->states[i];
-
-      /* Recv bytes from the client */
-      n = Recv(client_fd, state->context, buf, BUF_SIZE);
+      /* Recv bytes from the client, as many as the buffer has room for */
+      n = Recv(client_fd, state->context, buf, BUF_SIZE - state->end_idx);
 
       /* We have received bytes, send for parsing. */
       if (n >= 1)
       {
+        if (state->end_idx == 0 && timing())
+          state->cold->req_start = access_clock();
+        metrics_received(n);
         store_request(buf, n, state);
+        scoreboard_received(p, i, n);
+        state->last_active = time(NULL);
+        memset(buf,0,BUF_SIZE);
 
-        /* The loop that keeps servicing pipelined request */
-        do{
-          /* First, parse method, URI and version. */
-          if(state->method == NULL)
-          {
-            /* Malformed Request */
-            if((error = parse_line(state)) != 0 && error != -1)
-            {
-              client_error(state, error);
-              if (Send(client_fd, state->context, state->response, state->resp_idx)
-                  != state->resp_idx)
-              {
-                rm_client(client_fd, p, "Unable to write to client", i);
-                break;
-              }
-              rm_client(client_fd, p, "HTTP error", i);
-              break;
-            }
-
-            /* Incomplete request, save and continue to next client */
-            if(error == -1) break;
-          }
-
-          /* Then, parse headers. */
-          if(state->header == NULL && state->method != NULL)
-          {
-            if((error = parse_headers(state)) != 0)
-            {
-              client_error(state, error);
-              if (Send(client_fd, state->context, state->response, state->resp_idx) !=
-                  state->resp_idx)
-              {
-                rm_client(client_fd, p, "Unable to write to client", i);
-                break;
-              }
-              rm_client(client_fd, p, "HTTP error", i);
-              break;
-            }
-          }
-
-          /* If POST, parse the body */
-          if(!strncmp(state->method, "POST", strlen("POST")) &&
-             state->body == NULL)
-          {
-            if((error = parse_body(state)) != 0 && error != -1)
-            {
-              client_error(state, error);
-              if (Send(client_fd, state->context, state->response, state->resp_idx) !=
-                  state->resp_idx)
-              {
-                rm_client(client_fd, p, "Unable to write to client", i);
-                break;
-              }
-              rm_client(client_fd, p, "HTTP error", i);
-              break;
-            }
-
-            /* Incomplete request, save and continue to next client */
-            if(error == -1) break;
-          }
-
-          /* If everything has been parsed, write to client */
-          if(state->method != NULL && state->header != NULL)
-          {
-            if ((error = service(state)) != 0)
-            {
-              client_error(state, error);
-              if (Send(client_fd, state->context, state->response, state->resp_idx) !=
-                  state->resp_idx)
-              {
-                rm_client(client_fd, p, "Unable to write to client", i);
-                break;
-              }
-              rm_client(client_fd, p, "HTTP error", i);
-              break;
-            }
-
-            /* if POST/GET CGI */
-            if(state->pipefds > 0)
-            {
-              if(add_cgi(client_fd, state, p))
-              {
-                rm_client(client_fd, p, "Too many processes", i);
-                break;
-              }
-            }
-            /* Regular GET/HEAD */
-            else if (Send(client_fd, state->context, state->response, state->resp_idx)
-                != state->resp_idx ||
-                Send(client_fd, state->context, state->body, state->body_size)
-                != state->body_size)
-            {
-              rm_client(client_fd, p, "Unable to write to client", i);
-              break;
-            }
-
-            else
-            {
-              memset(log_buf,0,LOG_SIZE);
-              sprintf(log_buf,"Sent %d bytes of data!",
-                      state->resp_idx+(int)state->body_size);
-              log_error(log_buf,logfile);
-            }
-            memset(buf,0,BUF_SIZE);
-          }
-
-          /* Finished serving one request, reset buffer */
-          state->end_idx = resetbuf(state);
-          clean_state(state);
-          if(!state->conn) rm_client(client_fd, p, "Connection: close", i);
-        } while(error == 0 && state->conn);
+        serve_requests(p, i);
         continue;
       }
 
@@ -686,12 +968,828 @@ void check_clients(pool *p)
       }
 
       /* Error with recv */
-      if (n == -1)
+      if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
       {
         rm_client(client_fd, p, "Error reading from client socket", i);
       }
     } // End of client read check
   } // End of client loop.
+
+  /* Next pass starts with the following slot */
+  p->rr = nslots > 0 ? (p->rr + 1) % nslots : 0;
+}
+
+/************************************************************************/
+/* @brief Services the requests pipelined in a client's buffer, up to   */
+/* the per-pass budget (config.sched_reqs requests or                   */
+/* config.sched_bytes bytes queued). If the budget runs out with data   */
+/* still buffered, the client is marked pending and resumed on a later  */
+/* pass instead of starving everyone behind it.                         */
+/*                                                                      */
+/* Responses are queued on the connection and flushed together once    */
+/* the loop is done.                                                    */
+/*                                                                      */
+/* @param p  The pool of clients                                        */
+/* @param i  The index of the client in the pool                        */
+/************************************************************************/
+void serve_requests(pool* p, int i)
+{
+  fsm* state = &p->states[i];
+  int client_fd = state->fd;
+  int error, served = 0;
+  ssize_t sent = 0;
+  uint64_t started, traced;
+  metrics_hw hw;
+  unsigned seq;
+
+  /* The loop that keeps servicing pipelined request */
+  do{
+    /* Out of budget for this pass; come back to the rest later */
+    if(served >= config.sched_reqs || (size_t)sent >= config.sched_bytes ||
+       state->cold->out.count > OUTQ_MAX - 4)
+    {
+      if(state->end_idx > 0 && !state->sched_pending)
+      {
+        state->sched_pending = 1;
+        p->npending++;
+      }
+      break;
+    }
+
+    /* The body of a POST goes to its CGI before the next request */
+    if(state->body_state != BODY_DONE)
+    {
+      started = metrics_clock();
+      traced  = trace_clock();
+      error = relay_body(state);
+      metrics_since(METRIC_BODY, started);
+
+      /* Whatever the body went to may have given up on the client */
+      if(state->fd < 0 || state->cold == NULL)
+        return;
+
+      if(trace_on(state, state->seq_next - 1))
+        trace_emit(TRACE_BODY, state->cold->id, state->seq_next - 1, traced,
+                   error);
+
+      if(error == 400)
+      {
+        rm_client(client_fd, p, "Malformed chunked request body", i);
+        return;
+      }
+
+      /* The CGI isn't keeping up; wait until its stdin drains (a
+         FastCGI worker's connection schedules the client itself) */
+      if(error == 1 && state->cgi_in >= 0)
+      {
+        FD_SET(state->cgi_in, &p->writers);
+        if(state->cgi_in > p->maxfd)
+          p->maxfd = state->cgi_in;
+      }
+
+      if(error != 0 || !state->conn) break;
+    }
+
+    /* Nothing more is answered on a connection that is closing, and
+       no more is taken on than can be held in order (release()) */
+    if(state->closing || state->seq_next - state->seq_out >= RESP_MAX)
+      break;
+
+    /* First, parse method, URI and version. */
+    if(state->method == NULL)
+    {
+      /* Malformed Request */
+      started = metrics_clock();
+      traced  = trace_clock();
+      metrics_hw_start(&hw);
+      error = parse_line(state);
+      if(error != -1)
+      {
+        metrics_since(METRIC_PARSE_LINE, started);
+        metrics_hw_since(METRIC_PARSE_LINE, &hw);
+      }
+      if(error == 0)
+      {
+        PROBE4(request_line, state->cold->id, state->seq_next,
+               state->method, state->uri);
+        trace_parsed(state, TRACE_PARSE_LINE, traced);
+      }
+
+      if(error != 0 && error != -1)
+      {
+        take_on(state);
+        reply_error(p, i, error);
+        break;
+      }
+
+      /* Incomplete request, save and continue to next client. A full
+         buffer without the end of the headers won't ever parse. */
+      if(error == -1)
+      {
+        if(state->end_idx == BUF_SIZE)
+        {
+          take_on(state);
+          reply_error(p, i, 400);
+        }
+        break;
+      }
+    }
+
+    /* Then, parse headers. */
+    if(state->header == NULL && state->method != NULL)
+    {
+      started = metrics_clock();
+      traced  = trace_clock();
+      metrics_hw_start(&hw);
+      error = parse_headers(state);
+      metrics_since(METRIC_PARSE_HDRS, started);
+      metrics_hw_since(METRIC_PARSE_HDRS, &hw);
+      if(error == 0)
+      {
+        PROBE3(headers, state->cold->id, state->seq_next,
+               state->body_state == BODY_DONE ? 0 :
+               state->body_state == BODY_LENGTH ? state->body_size : -1);
+        trace_parsed(state, TRACE_PARSE_HDRS, traced);
+      }
+
+      if(error != 0)
+      {
+        take_on(state);
+        reply_error(p, i, error);
+        break;
+      }
+    }
+
+    /* If everything has been parsed, write to client */
+    if(state->method != NULL && state->header != NULL)
+    {
+      take_on(state);
+      if (access_enabled())
+        access_begin(state);
+      trace_begin(state);
+      scoreboard_request(p, i);
+
+      started = metrics_clock();
+      traced  = trace_clock();
+      seq     = state->seq_next;
+      PROBE3(service_enter, state->cold->id, state->seq_next, state->uri);
+      metrics_hw_start(&hw);
+      error = service(state);
+      metrics_hw_since(METRIC_SERVICE, &hw);
+      PROBE4(service_exit, state->cold->id, state->seq_next, error,
+             state->deferred ? -1 : state->body_size);
+      metrics_since(METRIC_SERVICE, started);
+      if (trace_on(state, seq))
+        trace_emit(TRACE_SERVICE, state->cold->id, seq, traced, error);
+
+      if (error != 0)
+      {
+        reply_error(p, i, error);
+        break;
+      }
+
+      /* CGI or FastCGI: the reply is relayed when it comes */
+      if (state->deferred)
+      {
+        if (access_enabled())
+          access_deferred(state, state->seq_next - 1);
+        log_debug("%s", plugin_routed(state) ? "Request handed to plugin" :
+                  fcgi_enabled() ? "Request handed to FastCGI worker" :
+                  "Request handed to CGI");
+      }
+      /* Regular GET/HEAD */
+      else if (queue_response(p, i))
+      {
+        rm_client(client_fd, p, "Unable to queue response", i);
+        return;
+      }
+
+      else
+        log_debug("Sent %d bytes of data!",
+                  state->resp_idx + (int)state->body_size);
+
+      served++;
+      sent += state->resp_idx + state->body_size;
+    }
+
+    /* Finished serving one request, reset buffer */
+    state->end_idx = resetbuf(state);
+    if (state->end_idx > 0 && timing())
+      state->cold->req_start = access_clock();   // The next one is in
+    clean_state(state);
+    state->last_active = time(NULL);
+    if(!state->conn) state->closing = 1;
+  } while(error == 0 && (state->conn || state->body_state != BODY_DONE));
+
+  if(state->fd < 0)
+    return;   // Removed above
+
+  /* One write for everything this pass produced */
+  if(flush_client(p, i) == 0 && FD_ISSET(client_fd, &p->writers) &&
+     state->sched_pending)
+  {
+    /* Blocked on output; the writable event resumes it instead */
+    state->sched_pending = 0;
+    p->npending--;
+  }
+}
+
+/*************************************************************/
+/* @brief Moves a serviced static response onto the output   */
+/* queue: the headers are copied, the body is handed over.   */
+/*                                                           */
+/* @retval  0 queued                                         */
+/* @retval -1 queue full or out of memory                    */
+/*************************************************************/
+int queue_response(pool* p, int i)
+{
+  fsm* state = &p->states[i];
+  unsigned seq = state->seq_next++;
+  outq* q;
+
+  if ((q = resp_queue(state, seq)) == NULL ||
+      outq_copy(q, state->response, state->resp_idx))
+    return -1;
+  resp_head(state, seq, state->response);
+
+  /* An empty file has nothing to send; clean_state() closes it */
+  if (state->body_fd >= 0 && state->body_size > 0)
+  {
+    if (outq_file(q, state->body_fd, state->body_size))
+      return -1;
+    state->body_fd = -1;  // The queue closes it now
+  }
+  else if (state->body != NULL && state->body_size > 0)
+  {
+    if (outq_push(q, state->body, state->body_size))
+      return -1;
+    takefromfree(state->cold->freebuf, state->body, FREE_SIZE);
+  }
+
+  resp_done(p, i, seq);
+  return 0;
+}
+
+/**************************************************************/
+/* @brief Queues an error response and closes the connection  */
+/* once it (and anything queued before it) has been written.  */
+/**************************************************************/
+void reply_error(pool* p, int i, int error)
+{
+  fsm* state = &p->states[i];
+
+  resp_fail(p, i, state->seq_next++, error);
+}
+
+/*******************************************************************/
+/* @brief Returns the queue response seq is written to: the        */
+/* connection's output queue if it is the one going out now,       */
+/* otherwise a queue of its own that holds it until its turn.      */
+/* Responses are numbered from state->seq_next as they are taken   */
+/* on, so pipelined requests are answered in order however long    */
+/* each takes to produce.                                          */
+/*                                                                 */
+/* @retval NULL out of memory                                      */
+/*******************************************************************/
+outq* resp_queue(fsm* state, unsigned seq)
+{
+  outq** held = &state->cold->held[seq % RESP_MAX];
+
+  if (*held == NULL && seq == state->seq_out)
+    return &state->cold->out;
+
+  if (*held == NULL)
+  {
+    if ((*held = conn_malloc(state, MEM_CONN, sizeof(outq))) == NULL)
+      return NULL;
+    outq_init(*held, &state->mem);
+  }
+
+  return *held;
+}
+
+/* Whether response seq is still to be sent (see resp_cut()) */
+int resp_live(fsm* state, unsigned seq)
+{
+  return seq - state->seq_out < state->seq_next - state->seq_out;
+}
+
+/* Bytes queued on a connection, held responses included */
+size_t resp_bytes(fsm* state)
+{
+  size_t bytes = state->cold->out.bytes;
+  int k;
+
+  for (k = 0; k < RESP_MAX; k++)
+    if (state->cold->held[k] != NULL)
+      bytes += state->cold->held[k]->bytes;
+
+  return bytes;
+}
+
+/* Bytes queued for response seq that aren't on its access note yet:
+   all of them if it is held, those queued since its turn came if it
+   is going out */
+static size_t resp_queued(fsm* state, unsigned seq)
+{
+  fsm_cold* cold = state->cold;
+  outq* held = cold->held[seq % RESP_MAX];
+  size_t bytes = held != NULL ? held->queued : 0;
+
+  if (seq == state->seq_out)
+    bytes += cold->out.queued - cold->out_base;
+  return bytes;
+}
+
+/* Drops the held responses from seq on; none of them will be sent */
+static void drop_held(fsm* state, unsigned seq)
+{
+  fsm_cold* cold = state->cold;
+  unsigned k;
+
+  for (; seq != state->seq_next; seq++)
+  {
+    k = seq % RESP_MAX;
+    if (cold->held[k] != NULL)
+    {
+      outq_clear(cold->held[k]);
+      liso_free(cold->held[k]);
+      cold->held[k] = NULL;
+    }
+    cold->held_done &= ~(1u << k);
+  }
+}
+
+/*****************************************************************/
+/* @brief Moves held responses onto the output queue, in order,  */
+/* for as long as the one in front is complete. The first one    */
+/* still being produced writes straight to the queue from then   */
+/* on; a queue too full to take everything is topped up again by */
+/* flush_client().                                               */
+/*****************************************************************/
+static void release(pool* p, int i)
+{
+  fsm* state = &p->states[i];
+  fsm_cold* cold = state->cold;
+  int full = state->seq_next - state->seq_out >= RESP_MAX;
+  unsigned k;
+
+  while (state->seq_out != state->seq_next)
+  {
+    k = state->seq_out % RESP_MAX;
+    if (cold->held[k] != NULL)
+    {
+      if (outq_move(&cold->out, cold->held[k]))
+        return;
+      cold->acc[k].bytes += cold->held[k]->queued;
+      liso_free(cold->held[k]);
+      cold->held[k] = NULL;
+    }
+
+    if (!(cold->held_done & (1u << k)))
+      break;
+    cold->held_done &= ~(1u << k);
+    state->seq_out++;
+    cold->out_base = cold->out.queued;   // What is queued now is its
+  }
+
+  /* Requests left waiting for a free sequence number can go now */
+  if (full && state->seq_next - state->seq_out < RESP_MAX &&
+      state->end_idx > 0 && !state->sched_pending)
+  {
+    state->sched_pending = 1;
+    p->npending++;
+  }
+}
+
+/* Marks response seq complete, sending it (and whatever was held
+   behind it) if every response before it has been */
+void resp_done(pool* p, int i, unsigned seq)
+{
+  fsm* state = &p->states[i];
+
+  if (!resp_live(state, seq))
+    return;
+
+  outq_stats.responses++;
+  PROBE3(response_queued, state->cold->id, seq, resp_queued(state, seq));
+  if (access_enabled())
+    access_done(state, seq, resp_queued(state, seq));
+  trace_done(state, seq, resp_queued(state, seq));
+  state->cold->held_done |= 1u << (seq % RESP_MAX);
+  release(p, i);
+}
+
+/********************************************************************/
+/* @brief Nothing after response seq will be sent: the connection   */
+/* closes once it is out. Used when a response is delimited by the  */
+/* close, or fails; responses held behind it are dropped, and the   */
+/* CGI or FastCGI requests producing them let go.                   */
+/********************************************************************/
+void resp_cut(pool* p, int i, unsigned seq)
+{
+  fsm* state = &p->states[i];
+
+  drop_held(state, seq + 1);
+  state->seq_next = seq + 1;
+  state->closing  = 1;
+  state->conn     = 0;
+
+  if (state->cgi_pending && fcgi_enabled())
+    fcgi_detach(state);
+}
+
+/***************************************************************/
+/* @brief Response seq's head was just queued: the access log   */
+/* and the metrics take its status, and the time it came at.    */
+/***************************************************************/
+void resp_head(fsm* state, unsigned seq, const char* head)
+{
+  PROBE3(response_head, state->cold->id, seq, head);
+  if (access_enabled())
+    access_head(state, seq, head);
+  if (metrics_enabled())
+    metrics_head(state->cold->started[seq % RESP_MAX], head);
+  if (trace_on(state, seq))
+    trace_emit(TRACE_HEAD, state->cold->id, seq, trace_clock(),
+               strtoul(head + 9, NULL, 10));   // "HTTP/1.1 200"
+}
+
+/******************************************************************/
+/* @brief Ends response seq early, answering with error if none   */
+/* of it was sent yet (error 0: it was, and is cut off). Either   */
+/* way the connection closes after it.                            */
+/******************************************************************/
+void resp_fail(pool* p, int i, unsigned seq, int error)
+{
+  fsm* state = &p->states[i];
+  outq* q;
+
+  if (!resp_live(state, seq))
+    return;
+
+  if (error)
+  {
+    client_error(state, error);
+    if ((q = resp_queue(state, seq)) == NULL ||
+        outq_copy(q, state->response, state->resp_idx))
+    {
+      rm_client(state->fd, p, "Unable to write to client", i);
+      return;
+    }
+    resp_head(state, seq, state->response);
+  }
+  else if (access_enabled())
+    access_cut(state, seq);
+
+  resp_cut(p, i, seq);
+  resp_done(p, i, seq);
+}
+
+/****************************************************************/
+/* @brief Writes a client's queued output.                      */
+/*                                                              */
+/* @retval  0 the client is still open (check p->writers to see */
+/*            whether output is still pending)                  */
+/* @retval -1 the client was removed                            */
+/****************************************************************/
+int flush_client(pool* p, int i)
+{
+  fsm* state = &p->states[i];
+  int client_fd = state->fd;
+  unsigned long written = outq_stats.bytes;
+  uint64_t started = trace_clock(), timed = metrics_clock();
+  metrics_hw hw;
+  unsigned seq;
+  int rc;
+
+  /* For the trace: the response being written, seq_out if it has
+     started on out, else the last one to have gone onto it */
+  seq = state->seq_out;
+  if (state->cold->out.queued == state->cold->out_base)
+    seq--;
+
+  /* Responses that didn't fit behind the queue go once it drains */
+  metrics_hw_start(&hw);
+  while ((rc = outq_flush(&state->cold->out, client_fd,
+                          state->context)) == 0 &&
+         state->cold->held[state->seq_out % RESP_MAX] != NULL)
+    release(p, i);
+  if (outq_stats.bytes > written)
+  {
+    metrics_since(METRIC_WRITE, timed);
+    metrics_hw_since(METRIC_WRITE, &hw);
+  }
+
+  if (outq_stats.bytes > written && trace_on(state, seq))
+    trace_emit(TRACE_FLUSH, state->cold->id, seq, started,
+               outq_stats.bytes - written);
+
+  if (rc == 1)
+  {
+    FD_SET(client_fd, &p->writers);
+    scoreboard_sent(p, i, outq_stats.bytes - written);
+    PROBE3(response_flushed, state->cold->id, outq_stats.bytes - written,
+           state->cold->out.bytes);
+    return 0;
+  }
+
+  FD_CLR(client_fd, &p->writers);
+  scoreboard_sent(p, i, outq_stats.bytes - written);
+  PROBE3(response_flushed, state->cold->id, outq_stats.bytes - written,
+         state->cold->out.bytes);
+
+  if (rc == -1)
+  {
+    rm_client(client_fd, p, "Unable to write to client", i);
+    return -1;
+  }
+
+  /* Close once the last response is out, unless one is still coming */
+  if (state->closing && state->seq_out == state->seq_next)
+  {
+    rm_client(client_fd, p, "Connection: close", i);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Returns the slot of the client cgi slot i is answering, or -1 if
+   the client is gone */
+int cgi_owner(pool* p, int i)
+{
+  fsm* cgi = &p->states[i];
+  fsm* client;
+
+  if (cgi->owner < 0)
+    return -1;
+
+  client = &p->states[cgi->owner];
+  if (client->fd == cgi->fd && client->pipefds < 0 && client->cgi_pending)
+    return cgi->owner;
+
+  return -1;
+}
+
+/* 1 if cgi slot i's output is still wanted: its client (or one that
+   joined it) is waiting for the response, or it is filling the
+   micro-cache */
+int cgi_wanted(pool* p, int i)
+{
+  fsm* cgi = &p->states[i];
+  int j;
+
+  if (cgi->fill != NULL || flight_wanted(p, i))
+    return 1;
+
+  return (j = cgi_owner(p, i)) >= 0 && resp_live(&p->states[j], cgi->seq);
+}
+
+/* Stops filling the micro-cache from cgi slot i */
+static void drop_fill(fsm* cgi)
+{
+  if (cgi->fill != NULL)
+    mcache_abort(cgi->fill);
+  cgi->fill = NULL;
+}
+
+/******************************************************************/
+/* @brief Reads a detached CGI, run only to refresh a stale       */
+/* micro-cache entry, into the entry; stores it at EOF.           */
+/******************************************************************/
+static void refresh_cgi(pool* p, int i)
+{
+  fsm* cgi = &p->states[i];
+  char buf[CGI_READ_SIZE];
+  int n;
+
+  if ((n = read(cgi->pipefds, buf, sizeof(buf))) == -1 &&
+      (errno == EAGAIN || errno == EINTR))
+    return;
+
+  if (n > 0 && mcache_take(cgi->fill, buf, n) == 0)
+    return;
+
+  /* EOF: a timed out run is cut short, so only keep a whole one */
+  if (n == 0 && !cgi->timed_out)
+  {
+    mcache_store(cgi->fill);
+    cgi->fill = NULL;
+  }
+  cgi_abandon(cgi);
+  rm_cgi(cgi->pipefds, p, "CGI refreshed the cache", i);
+}
+
+/* Queues a copy of len bytes of CGI output, as one chunk if the
+   response is chunked. Same return values as outq_push */
+int queue_body(outq* q, char* data, size_t len, int framing)
+{
+  size_t off = framing == FRAME_CHUNKED ? CHUNK_HEAD : 0;
+  char* buf;
+
+  if (len == 0)
+    return 0;
+
+  if ((buf = liso_malloc_acct(len + CHUNK_PAD, MEM_BODY, q->acct)) == NULL)
+    return -1;
+
+  memcpy(buf + off, data, len);
+  if (outq_push(q, buf, off ? chunk_frame(buf, len) : len))
+  {
+    liso_free(buf);
+    return -1;
+  }
+  return 0;
+}
+
+/*******************************************************************/
+/* @brief Relays what a CGI script wrote to its client as it       */
+/* arrives. The header block is collected in the cgi slot's buffer */
+/* and turned into an HTTP head (cgi_head()); after that, output   */
+/* is queued on the client as it comes, spliced straight from the  */
+/* pipe on HTTP and read in on HTTPS, framed as chunks when the    */
+/* script gave no Content-Length. hold_clients() stops reading the */
+/* pipe while the client is behind. Output that fills a            */
+/* micro-cache entry is read in rather than spliced, and a copy is */
+/* kept (mcache.c); so is output identical requests wait on, which */
+/* each of them gets a copy of (flight.c).                         */
+/*                                                                 */
+/* @param p  The pool of clients                                   */
+/* @param i  The index of the cgi slot                             */
+/*******************************************************************/
+void relay_cgi(pool* p, int i)
+{
+  fsm* cgi = &p->states[i];
+  int cgi_fd = cgi->pipefds;
+  unsigned seq = cgi->seq;
+  int j, k, n, avail = 0, framing, error;
+  char head[BUF_SIZE];
+  char* end; char* buf;
+  size_t hlen, off;
+  fsm* client; outq* q;
+
+  if (cgi->owner < 0 && cgi->fill != NULL)
+  {
+    refresh_cgi(p, i);
+    return;
+  }
+
+  /* Its client went away: one that joined it takes its place */
+  if (((j = cgi_owner(p, i)) < 0 || !resp_live(&p->states[j], seq)) &&
+      (k = flight_promote(p, i)) >= 0)
+  {
+    if (j >= 0)
+      p->states[j].cgi_pending--;
+    j   = k;
+    seq = cgi->seq;
+  }
+
+  if (j < 0 || !resp_live(&p->states[j], seq))
+  {
+    /* Nobody to answer, but the micro-cache still wants it: carry
+       on detached, with the header block so far */
+    if (cgi->fill != NULL && (cgi->framing != FRAME_HEAD ||
+                              !mcache_take(cgi->fill, cgi->request,
+                                           cgi->end_idx)))
+    {
+      if (j >= 0)
+        p->states[j].cgi_pending--;
+      cgi->owner = -1;
+      flight_fail(p, i, 502);   // Nobody joins a run answering nobody
+      refresh_cgi(p, i);
+      return;
+    }
+    cgi_abandon(cgi);
+    rm_cgi(cgi_fd, p, "CGI client went away", i);
+    return;
+  }
+  client = &p->states[j];
+  if ((q = resp_queue(client, seq)) == NULL)
+    goto failed;
+
+  /* First the header block */
+  if (cgi->framing == FRAME_HEAD)
+  {
+    n = read(cgi_fd, cgi->request + cgi->end_idx, BUF_SIZE - cgi->end_idx);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+      return;
+    if (n == -1)
+      goto failed;
+    cgi->end_idx += n;
+
+    if ((end = memmem(cgi->request, cgi->end_idx, "\r\n\r\n", 4)) != NULL)
+      hlen = end + 4 - cgi->request;
+    else if ((end = memmem(cgi->request, cgi->end_idx, "\n\n", 2)) != NULL)
+      hlen = end + 2 - cgi->request;
+    else if (n == 0 || cgi->end_idx == BUF_SIZE)
+      goto failed;   // No header block
+    else
+      return;        // Wait for the rest of it
+
+    if ((n = cgi_head(cgi->request, hlen, head, cgi->conn, &framing)) < 0 ||
+        outq_copy(q, head, n))
+      goto failed;
+    cgi->framing = framing;
+    resp_head(client, seq, head);
+
+    /* Keep a copy for the micro-cache, if it may be cached */
+    if (cgi->fill != NULL && (mcache_ttl(cgi->request, hlen) < 0 ||
+                              mcache_take(cgi->fill, cgi->request,
+                                          cgi->end_idx)))
+      drop_fill(cgi);
+
+    /* Whatever followed the blank line is body */
+    if (queue_body(q, cgi->request + hlen, cgi->end_idx - hlen, framing))
+      goto failed;
+    flight_head(p, i, cgi->request, hlen, cgi->end_idx);
+    memset(cgi->request, 0, BUF_SIZE);
+    cgi->end_idx = 0;
+
+    flush_client(p, j);
+    return;
+  }
+
+  /* Then the body, as much as there is */
+  if (ioctl(cgi_fd, FIONREAD, &avail) == -1)
+    goto failed;
+
+  if (avail == 0)
+  {
+    /* Readable with nothing in it: the script is done */
+    if ((n = read(cgi_fd, head, BUF_SIZE)) == 0)
+      goto done;
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+      return;
+    if (n == -1 || queue_body(q, head, n, cgi->framing))
+      goto failed;
+    if (cgi->fill != NULL && mcache_take(cgi->fill, head, n))
+      drop_fill(cgi);
+    flight_body(p, i, head, n);
+  }
+  else if (client->context == NULL && q == &client->cold->out &&
+           cgi->fill == NULL && flight_waiters(cgi->flight) == 0)
+  {
+    /* Room for the chunk around it, or wait for the queue to drain */
+    if (q->count > OUTQ_MAX - 3)
+      return;
+    if (cgi->framing == FRAME_CHUNKED &&
+        outq_copy(q, head, snprintf(head, BUF_SIZE, "%x\r\n", avail)))
+      goto failed;
+    if (outq_pipe(q, cgi_fd, avail))
+      goto failed;
+    if (cgi->framing == FRAME_CHUNKED && outq_copy(q, "\r\n", 2))
+      goto failed;
+  }
+  else
+  {
+    n   = avail < CGI_READ_SIZE ? avail : CGI_READ_SIZE;
+    off = cgi->framing == FRAME_CHUNKED ? CHUNK_HEAD : 0;
+    if ((buf = liso_malloc_acct(n + CHUNK_PAD, MEM_BODY, q->acct)) == NULL)
+      goto failed;
+    if ((n = read(cgi_fd, buf + off, n)) <= 0 ||
+        outq_push(q, buf, off ? chunk_frame(buf, n) : (size_t)n))
+    {
+      liso_free(buf);
+      goto failed;
+    }
+    if (cgi->fill != NULL && mcache_take(cgi->fill, buf + off, n))
+      drop_fill(cgi);
+    flight_body(p, i, buf + off, n);
+  }
+
+  flush_client(p, j);
+  return;
+
+done:
+  /* Killed for running too long: what came is not the whole answer */
+  if (cgi->timed_out)
+    goto failed;
+  if (cgi->fill != NULL)
+    mcache_store(cgi->fill);
+  cgi->fill = NULL;
+  if (cgi->framing == FRAME_CHUNKED && outq_copy(q, "0\r\n\r\n", 5))
+    goto failed;
+  /* Unframed, closing marks the end of the body */
+  if (cgi->framing == FRAME_CLOSE || !cgi->conn)
+    resp_cut(p, j, seq);
+  flight_done(p, i);
+  rm_cgi(cgi_fd, p, "CGI iz dun", i);
+  resp_done(p, j, seq);
+  flush_client(p, j);
+  return;
+
+failed:
+  /* A 502 (504 if it ran too long) if nothing was sent yet; otherwise
+     cut the response short */
+  framing = cgi->framing;
+  error   = cgi->timed_out ? 504 : 502;
+  cgi_abandon(cgi);
+  flight_fail(p, i, framing == FRAME_HEAD ? error : 0);
+  rm_cgi(cgi_fd, p, "CGI process failed", i);
+  resp_fail(p, j, seq, framing == FRAME_HEAD ? error : 0);
+  if (client->fd >= 0)
+    flush_client(p, j);
 }
 
 /********************************************************************/
@@ -705,14 +1803,29 @@ void check_clients(pool *p)
 /********************************************************************/
 void rm_cgi(int cgi_fd, pool* p, char* logmsg, int i)
 {
-  fsm* state = p->states[i];
-  delfromfree(state->freebuf, FREE_SIZE);
-  free(state);
+  int j;
+  fsm* state = &p->states[i];
+
+  /* The client this cgi was answering can be shed again */
+  if ((j = cgi_owner(p, i)) >= 0)
+    p->states[j].cgi_pending--;
+
+  /* Its script no longer counts against LISO_CGI_MAX */
+  cgi_end(p, i);
+  drop_fill(state);
+  flight_fail(p, i, state->framing == FRAME_HEAD ? 502 : 0);
+
+  delfromfree(state->cold->freebuf, FREE_SIZE);
+  liso_free(state->cold);
+  state->cold = NULL;
 
   close(cgi_fd);
   FD_CLR(cgi_fd, &p->masterfds);
-  p->clientfd[i] = -1;
-  log_error(logmsg, logfile);
+  state->fd = -1;
+  state->pipefds = -1;
+  state->owner = -1;
+  scoreboard_close(i);
+  log_debug("%s", logmsg);
 }
 
 
@@ -728,17 +1841,158 @@ void rm_cgi(int cgi_fd, pool* p, char* logmsg, int i)
 void rm_client(int client_fd, pool* p, char* logmsg, int i)
 {
   /* Sanitize memory */
-  fsm* state = p->states[i];
-  if(state->context != NULL) SSL_free(state->context);
-  delfromfree(state->freebuf, FREE_SIZE);
-  free(state);
+  fsm* state = &p->states[i];
+  unsigned seq;
+  PROBE3(close, state->cold->id, state->seq_next, logmsg);
+  if(state->context != NULL)
+  {
+    /* close_notify: without it the client may not resume the session */
+    if(!state->handshake) SSL_shutdown(state->context);
+    SSL_free(state->context);
+  }
+  delfromfree(state->cold->freebuf, FREE_SIZE);
+  if(state->body_fd >= 0) close(state->body_fd);
+  state->body_fd = -1;
+  if(state->sched_pending) p->npending--;
+  state->sched_pending = 0;
+  if(state->cgi_in >= 0)
+  {
+    close(state->cgi_in);   // The CGI sees the body end early
+    FD_CLR(state->cgi_in, &p->writers);
+    FD_CLR(state->cgi_in, &p->writefds);
+  }
+  else if(state->cgi_in == CGI_IN_PLUGIN)
+    plugin_detach(state);   // Its body won't come now
+  state->cgi_in = -1;
+  state->body_state = BODY_DONE;
+  for(seq = state->seq_out; seq != state->seq_next; seq++)
+  {
+    if(access_enabled())
+    {
+      access_cut(state, seq);   // Logged as far as it got
+      access_done(state, seq, resp_queued(state, seq));
+    }
+    trace_done(state, seq, resp_queued(state, seq));
+  }
+  drop_held(state, state->seq_out);   // No response is live any more
+  state->seq_next = state->seq_out;
+  if(state->cgi_pending && fcgi_enabled())
+    fcgi_detach(state);   // Its FastCGI requests have no one to answer
+  state->cgi_pending = 0;
+  outq_clear(&state->cold->out);
+  liso_free(state->cold);
+  state->cold = NULL;
 
   close_socket(client_fd);
   FD_CLR(client_fd, &p->masterfds);
-  p->clientfd[i] = -1;
-  log_error(logmsg, logfile);
+  FD_CLR(client_fd, &p->writers);
+  FD_CLR(client_fd, &p->writefds);
+  state->fd = -1;
+  scoreboard_close(i);
+  log_debug("%s", logmsg);
+}
+
+
+/**********************************************************************/
+/* @brief Called when memory is near the budget. Stops accepting and  */
+/* stops reading from clients that have no request in progress, so   */
+/* only work already started can allocate. Over the budget, idle      */
+/* keep-alive connections are shed, least recently active first.      */
+/*                                                                    */
+/* @param p          The pool whose readfds are about to be selected  */
+/* @param listen_fd  The HTTP listening socket                        */
+/* @param https_fd   The HTTPS listening socket                       */
+/**********************************************************************/
+void throttle(pool* p, int listen_fd, int https_fd)
+{
+  int i, oldest; fsm* state;
+  char log_buf[LOG_SIZE] = {0};
+
+  FD_CLR(listen_fd, &p->readfds);
+  FD_CLR(https_fd,  &p->readfds);
+
+  /* Cached responses are the cheapest memory to give back */
+  mcache_flush();
+
+  /* Shed idle connections until we are back under the budget */
+  while (mem_pressure() == MEM_OVER)
+  {
+    oldest = -1;
+    for (i = 0; i <= p->maxi; i++)
+    {
+      state = &p->states[i];
+      if (state->fd < 0 || state->pipefds > 0 || state->cgi_pending ||
+          state->end_idx > 0 || FD_ISSET(state->fd, &p->writers))
+        continue;
+      if (oldest < 0 || state->last_active < p->states[oldest].last_active)
+        oldest = i;
+    }
+
+    if (oldest < 0)
+      break;
+
+    sprintf(log_buf, "Over memory budget (%zu bytes), shedding idle "
+            "connection holding %zu bytes", mem_total(),
+            p->states[oldest].mem);
+    log_error(log_buf, logfile);
+    FD_CLR(p->states[oldest].fd, &p->readfds);
+    rm_client(p->states[oldest].fd, p, "Connection shed", oldest);
+  }
+
+  /* Don't read new requests; let the ones in flight finish */
+  for (i = 0; i <= p->maxi; i++)
+  {
+    state = &p->states[i];
+    if (state->fd >= 0 && state->pipefds < 0 && state->end_idx == 0 &&
+        state->body_state == BODY_DONE)
+      FD_CLR(state->fd, &p->readfds);
+  }
 }
 
+/******************************************************************/
+/* @brief Takes clients with leftover pipelined requests, a full  */
+/* request buffer or unwritten output out of the read set; they   */
+/* get serviced from their buffers, or wait for the socket (or    */
+/* the CGI taking their request body) to drain, first. CGI pipes  */
+/* are held while their client has output waiting.               */
+/******************************************************************/
+void hold_clients(pool* p)
+{
+  int i, j; fsm* state; fsm* client; outq* q;
+
+  for (i = 0; i <= p->maxi; i++)
+  {
+    state = &p->states[i];
+    if (state->fd < 0)
+      continue;
+
+    /* Don't read a CGI before its response's turn, or faster than
+       its client takes the output. One others wait on is read as
+       fast as the slowest of them takes it, turn or not: a waiter's
+       turn may be waiting on it */
+    if (state->pipefds > 0)
+    {
+      j = cgi_owner(p, i);
+      if (flight_waiters(state->flight) > 0)
+      {
+        if (flight_behind(p, i) ||
+            (j >= 0 && resp_bytes(&p->states[j]) >= CGI_CLIENT_HIGH))
+          FD_CLR(state->pipefds, &p->readfds);
+      }
+      else if (j >= 0 && resp_live(client = &p->states[j], state->seq) &&
+               (state->seq != client->seq_out ||
+                client->cold->held[state->seq % RESP_MAX] != NULL ||
+                (q = &client->cold->out)->bytes >= CGI_CLIENT_HIGH ||
+                (client->context == NULL && q->bytes > 0)))
+        FD_CLR(state->pipefds, &p->readfds);
+      continue;
+    }
+
+    if (FD_ISSET(state->fd, &p->writers) || state->end_idx == BUF_SIZE ||
+        (p->npending > 0 && state->sched_pending))
+      FD_CLR(state->fd, &p->readfds);
+  }
+}
 
 /************************************************************/
 /* @brief  Writes an error message into the state provided. */
@@ -764,6 +2018,10 @@ void client_error(fsm* state, int error)
       errnum    = "411";
       errormsg  = "Length Required";
       break;
+    case 413:
+      errnum    = "413";
+      errormsg  = "Payload Too Large";
+      break;
     case 500:
       errnum    = "500";
       errormsg  = "Internal Server Error";
@@ -772,10 +2030,18 @@ void client_error(fsm* state, int error)
       errnum    = "501";
       errormsg  = "Not Implemented";
       break;
+    case 502:
+      errnum    = "502";
+      errormsg  = "Bad Gateway";
+      break;
     case 503:
       errnum    = "503";
       errormsg  = "Service Unavailable";
       break;
+    case 504:
+      errnum    = "504";
+      errormsg  = "Gateway Timeout";
+      break;
     case 505:
       errnum    = "505";
       errormsg  = "HTTP Version Not Supported";
@@ -808,27 +2074,59 @@ void cleanup(int sig)
   int appease_compiler = sig;
   appease_compiler += 2;
 
-  log_error("Received SIGINT. Goodbye, cruel world.", logfile);
+  log_info("Received SIGINT. Goodbye, cruel world.");
+  alloc_stats(logfile);
+  log_print(logfile);
+  access_print(logfile);
+  metrics_print(logfile);
+  trace_print(logfile);
+  outq_print(logfile);
+  fcgi_print(logfile);
+  cgi_print(logfile);
+  mcache_print(logfile);
+  flight_print(logfile);
+  plugin_print(logfile);
+  fcgi_stop();
+  access_close();
+  scoreboard_exit();
   log_close(logfile);
 
   fprintf(stderr, "\nThank you for flying Liso. See ya!\n");
   exit(1);
 }
 
-void
-sigchld_handler(int sig)
+/* Shutting down isn't safe from a signal handler: the event loop does
+   it (cleanup()) once select() returns */
+void sigint_handler(int sig)
 {
-  pid_t pid; int status;
   int appease_compiler = 0;
   appease_compiler += sig;
 
-  while((pid = waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0)
-  {
-    /* Child terminated because of a
-     * signal that was not caught. */
-    fprintf(stderr, "Child reaped\n");
-  }
-  return;
+  shut_down = 1;
+}
+
+void sigusr1_handler(int sig)
+{
+  int appease_compiler = 0;
+  appease_compiler += sig;
+
+  dump_stats = 1;
+}
+
+void sigusr2_handler(int sig)
+{
+  int appease_compiler = 0;
+  appease_compiler += sig;
+
+  dump_trace = 1;
+}
+
+void sighup_handler(int sig)
+{
+  int appease_compiler = 0;
+  appease_compiler += sig;
+
+  log_reopen();
 }
 
 int daemonize(char* lock_file)
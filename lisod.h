@@ -2,17 +2,72 @@
 #define LISOD_H
 
 #include <sys/select.h>
+#include <sys/types.h>
 #include <openssl/ssl.h>
 #include <netinet/in.h>
+#include <time.h>
+
+#include "outq.h"
+#include "access.h"
+#include "trace.h"
 
 #define BUF_SIZE  8192
 #define LOG_SIZE  1024
 #define FREE_SIZE 40
 
-typedef struct state {
+#define CACHE_LINE 64
+#define RESP_MAX   8   /* Responses a connection can have in flight */
+#define MAX_CLIENTS FD_SETSIZE
+
+/* Cold per-connection data. Only touched while a request is actually being
+   parsed or answered, so it lives behind a pointer in the fsm. */
+typedef struct state_cold {
   char request[BUF_SIZE]; // arr of chars containing the text of the request.
   char response[BUF_SIZE]; // arr of chars containing response to client.
 
+  unsigned long id;   // Connection id (cgi slots: their client's)
+  char  cli_ip[INET_ADDRSTRLEN];   // Store the IP in string form
+  char* freebuf[FREE_SIZE];   // Hold ptrs to any buffer that needs freeing
+
+  outq  out;   // Responses waiting to be written
+
+  /* Responses ready (or started) before their turn, by seq % RESP_MAX;
+     moved onto out once every response before them has been */
+  outq*    held[RESP_MAX];
+  unsigned held_done;     // Bit per held[] slot: that response is complete
+
+  /* Access log (access.c) and metrics (metrics.c): the responses in
+     flight, by seq % RESP_MAX. Times are access_clock() */
+  access_note acc[RESP_MAX];
+  uint64_t    started[RESP_MAX]; // When its request's first byte came in
+  uint64_t    req_start;  // When the next request's first byte came in
+  uint64_t    tls_start;  // metrics_clock() when the TLS handshake began
+  size_t      out_base;   // out.queued when seq_out's turn came
+
+  /* Request tracing (trace.c): the responses traced, a bit each by
+     seq % RESP_MAX, with their URIs; and the parse spans of the next
+     request, until it is known whether it is traced */
+  unsigned    traced;
+  uint64_t    trace_parse[4];
+  char        trace_uri[RESP_MAX][TRACE_NOTE];
+} fsm_cold;
+
+/* Hot per-connection data. The first cache line holds everything the event
+   loop reads on every pass; the second holds the parse results. */
+typedef struct state {
+  int   fd;      // client fd (owning client fd for a cgi slot); -1 if free
+  int   pipefds; //  file descriptor of script  to be added to select
+  int   end_idx; // used to mark end of data in buffer
+  int   resp_idx; // used to mark end of response buffer
+  int   conn;    // 1 = keep-alive; 0 = close
+  int   body_fd; // file being streamed as the body; -1 if body is in memory
+  SSL*  context; // NULL, if HTTP, else valid ptr.
+
+  char* request;  // points into cold->request
+  char* response; // points into cold->response
+  fsm_cold* cold; // buffers, client ip, freebuf
+  char* www;      // The www folder
+
   char* method; // index into method
   char* uri;    // index into uri
   char* version; // you get the idea
@@ -21,20 +76,35 @@ typedef struct state {
   char* body;  // alloc memory for body to send
   ssize_t body_size; // size of body to send
 
-  int end_idx; // used to mark end of data in buffer
-  int resp_idx; // used to mark end of response buffer
-
-  char* www;       // The www folder
-  int   conn;      // 1 = keep-alive; 0 = close
-  SSL*  context;   // NULL, if HTTP, else valid ptr.
-  char  cli_ip[INET_ADDRSTRLEN];   // Store the IP in string form
-
-  int   pipefds;           //  file descriptor of script  to be added to select
-  char* freebuf[FREE_SIZE];   // Hold ptrs to any buffer that needs freeing
-
-  // In case of a client having a cgi
-
-} fsm;
+  /* Request body being relayed to a CGI as it arrives (relay_body()) */
+  int     cgi_in;      // CGI's stdin pipe, CGI_IN_FCGI, or -1 to drop it
+  int     body_state;  // BODY_DONE once the whole body has been relayed
+  ssize_t body_left;   // bytes left in the body, or in the current chunk
+
+  /* CGI slots: relaying the script's output (relay_cgi()) */
+  int     owner;       // slot of the client being answered
+  int     framing;     // FRAME_HEAD until the script's headers are in
+  pid_t   pid;         // script running; 0 while it waits, or once it exits
+  int     pidfd;       // pidfd watching it, in the select set; -1 if none
+  int     timed_out;   // killed for running past LISO_CGI_TIMEOUT
+  struct mc_entry* fill; // micro-cache entry its output fills, or NULL
+  struct flight* flight; // identical requests its output answers too
+
+  /* Bookkeeping, touched once per request */
+  size_t mem;          // bytes allocated on behalf of this connection
+  time_t last_active;  // last time a request arrived or was answered
+  int    cgi_pending;  // cgi slots / FastCGI requests still answering
+  int    deferred;     // request was handed off; the answer comes later
+  int    sched_pending; // 1 if pipelined requests were left for a later pass
+  int    closing;      // 1 = close once the output queue drains
+  int    handshake;    // 1 while an HTTPS client's TLS handshake goes on
+
+  /* Responses go out in the order requests came in (resp_queue()) */
+  unsigned seq_next;   // Sequence number the next response gets
+  unsigned seq_out;    // Response now being written; later ones are held
+  unsigned seq;        // cgi slots: the response being produced
+
+} __attribute__((aligned(CACHE_LINE))) fsm;
 
 typedef struct pool {
   int maxfd;         /* Largest descriptor in the master set */
@@ -42,18 +112,33 @@ typedef struct pool {
   fd_set masterfds;  /* Set containing all active descriptors */
   fd_set readfds;    /* Subset of descriptors ready for reading */
   fd_set writefds;   /* Subset of descriptors ready for writing */
+  fd_set writers;    /* Clients with output waiting on the socket */
 
   int nready;        /* Number of ready descriptors from select */
-  int maxi;          /* Max index of clientfd array             */
+  int maxi;          /* Max index of states array               */
+  int rr;            /* Slot check_clients() starts from this pass */
+  int npending;      /* Clients with sched_pending set          */
 
-  int clientfd[FD_SETSIZE];   /* Array of active client descriptors */
-  fsm* states[FD_SETSIZE]; /* Array of states for each client */
-  // char data[FD_SETSIZE][BUF_SIZE];   /* Array that contains data from client */
+  /* Connection table, one cache-aligned fsm per slot; fd < 0 when free */
+  fsm states[MAX_CLIENTS] __attribute__((aligned(CACHE_LINE)));
 
 } pool;
 
+int  flush_client(pool* p, int i);
+void reply_error(pool* p, int i, int error);
+outq* resp_queue(fsm* state, unsigned seq);
+int  resp_live(fsm* state, unsigned seq);
+void resp_done(pool* p, int i, unsigned seq);
+void resp_fail(pool* p, int i, unsigned seq, int error);
+void resp_cut(pool* p, int i, unsigned seq);
+void resp_head(fsm* state, unsigned seq, const char* head);
+size_t resp_bytes(fsm* state);
+int  queue_body(outq* q, char* data, size_t len, int framing);
 void rm_client(int client_fd, pool* p, char* logmsg, int i);
 void rm_cgi(int cgi_fd, pool* p, char* logmsg, int i);
+int  add_cgi(int client_fd, fsm* state, pool* p, int detached);
+int  cgi_owner(pool* p, int i);
+int  cgi_wanted(pool* p, int i);
 void client_error(fsm* state, int error);
 void cleanup(int sig);
 
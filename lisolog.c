@@ -0,0 +1,241 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file lisolog.c                                                 */
+/*                                                                 */
+/* @brief Decodes binary access logs (LISO_ACCESS_LOG, format in   */
+/* access.h) to text, CSV or JSON lines on stdout, one line per    */
+/* response, in the order they were logged. A file still being     */
+/* written to can be read: it ends at the first empty record.      */
+/*                                                                 */
+/* lisolog [-f text|csv|json] file...                              */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "access.h"
+
+enum { TEXT, CSV, JSON };
+
+static const char* methods[] = { "-", "GET", "HEAD", "POST" };
+
+/* The URI of rec, if its access_uri is in the file; NULL if not */
+static const access_uri* uri_of(const char* map, size_t size,
+                                const access_rec* rec)
+{
+  const access_uri* u;
+
+  if (rec->uri_off < sizeof(access_hdr) ||
+      rec->uri_off + sizeof(access_uri) > size)
+    return NULL;
+
+  u = (const access_uri*)(map + rec->uri_off);
+  if (u->kind != ACCESS_KIND_URI || u->hash != rec->uri_hash ||
+      rec->uri_off + sizeof(access_uri) + u->len > size)
+    return NULL;
+  return u;
+}
+
+/* Prints the URI quoted for format (as is, for text) */
+static void put_uri(const access_uri* u, const access_rec* rec, int format)
+{
+  const char* s;
+  int k;
+
+  if (u == NULL && rec->uri_len == 0)
+  {
+    fputs(format == TEXT ? "-" : format == CSV ? "" : "null", stdout);
+    return;   // The request didn't parse
+  }
+  if (u == NULL)
+  {
+    /* Only the hash is left of it */
+    printf(format == TEXT ? "#%016llx" : "\"#%016llx\"",
+           (unsigned long long)rec->uri_hash);
+    return;
+  }
+
+  if (format != TEXT)
+    putchar('"');
+  for (k = 0, s = u->text; k < u->len; k++, s++)
+  {
+    if (format == CSV && *s == '"')
+      fputs("\"\"", stdout);
+    else if (format == JSON && (*s == '"' || *s == '\\'))
+      printf("\\%c", *s);
+    else if ((unsigned char)*s < 0x20 || *s == 0x7f)
+      printf(format == JSON ? "\\u%04x" : "%%%02X", (unsigned char)*s);
+    else
+      putchar(*s);
+  }
+  if (u->len < rec->uri_len)
+    fputs("...", stdout);   // Kept cut short
+  if (format != TEXT)
+    putchar('"');
+}
+
+static void put_rec(const access_rec* rec, const access_uri* u, int format)
+{
+  char when[64], ip[INET_ADDRSTRLEN];
+  const char* method;
+  struct in_addr addr;
+  struct tm tm;
+  time_t sec;
+
+  sec = rec->time_us / 1000000;
+  gmtime_r(&sec, &tm);
+  strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+  addr.s_addr = rec->addr;
+  inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+  method = rec->method < sizeof(methods) / sizeof(methods[0]) ?
+           methods[rec->method] : "-";
+
+  switch (format)
+  {
+    case TEXT:
+      printf("%s.%06uZ %s %s ", when, (unsigned)(rec->time_us % 1000000),
+             ip, method);
+      put_uri(u, rec, format);
+      printf(" %u %llu %u/%u/%uus%s%s%s%s\n", rec->status,
+             (unsigned long long)rec->bytes, rec->read_us, rec->handle_us,
+             rec->body_us, rec->flags & ACCESS_TLS ? " tls" : "",
+             rec->flags & ACCESS_DEFERRED ? " deferred" : "",
+             rec->flags & ACCESS_CUT ? " cut" : "",
+             rec->flags & ACCESS_CLOSE ? " close" : "");
+      break;
+
+    case CSV:
+      printf("%s.%06uZ,%s,%s,", when, (unsigned)(rec->time_us % 1000000),
+             ip, method);
+      put_uri(u, rec, format);
+      printf(",%u,%llu,%u,%u,%u,%d,%d,%d,%d\n", rec->status,
+             (unsigned long long)rec->bytes, rec->read_us, rec->handle_us,
+             rec->body_us, !!(rec->flags & ACCESS_TLS),
+             !!(rec->flags & ACCESS_DEFERRED), !!(rec->flags & ACCESS_CUT),
+             !!(rec->flags & ACCESS_CLOSE));
+      break;
+
+    case JSON:
+      printf("{\"time\":\"%s.%06uZ\",\"ip\":\"%s\",\"method\":\"%s\","
+             "\"uri\":", when, (unsigned)(rec->time_us % 1000000), ip,
+             method);
+      put_uri(u, rec, format);
+      printf(",\"status\":%u,\"bytes\":%llu,\"read_us\":%u,"
+             "\"handle_us\":%u,\"body_us\":%u,\"tls\":%s,\"deferred\":%s,"
+             "\"cut\":%s,\"close\":%s}\n", rec->status,
+             (unsigned long long)rec->bytes, rec->read_us, rec->handle_us,
+             rec->body_us, rec->flags & ACCESS_TLS ? "true" : "false",
+             rec->flags & ACCESS_DEFERRED ? "true" : "false",
+             rec->flags & ACCESS_CUT ? "true" : "false",
+             rec->flags & ACCESS_CLOSE ? "true" : "false");
+      break;
+  }
+}
+
+/* Decodes one file. Returns 0, or -1 if it isn't an access log */
+static int decode(const char* name, int format)
+{
+  const access_hdr* hdr;
+  const access_rec* rec;
+  const access_uri* u;
+  struct stat st;
+  size_t off, size;
+  char* map;
+  int fd;
+
+  if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+  {
+    perror(name);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  size = st.st_size;
+  if (size < sizeof(access_hdr) ||
+      (map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+  {
+    fprintf(stderr, "%s: not an access log\n", name);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  hdr = (const access_hdr*)map;
+  if (memcmp(hdr->magic, ACCESS_MAGIC, 8) || hdr->version != ACCESS_VERSION ||
+      hdr->rec_size != ACCESS_REC)
+  {
+    fprintf(stderr, "%s: not an access log (or another version)\n", name);
+    munmap(map, size);
+    return -1;
+  }
+
+  for (off = sizeof(access_hdr); off + ACCESS_REC <= size; )
+  {
+    rec = (const access_rec*)(map + off);
+    if (rec->kind == ACCESS_KIND_REQ)
+    {
+      put_rec(rec, uri_of(map, size, rec), format);
+      off += ACCESS_REC;
+    }
+    else if (rec->kind == ACCESS_KIND_URI)
+    {
+      u = (const access_uri*)rec;
+      if (u->size < ACCESS_REC || u->size % ACCESS_REC)
+        break;   // Torn
+      off += u->size;
+    }
+    else
+      break;   // The end of what was written
+  }
+
+  munmap(map, size);
+  return 0;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: lisolog [-f text|csv|json] file...\n");
+  exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+  int c, rc = 0, format = TEXT;
+
+  while ((c = getopt(argc, argv, "f:")) != -1)
+  {
+    if (c != 'f')
+      usage();
+    if (!strcmp(optarg, "text"))
+      format = TEXT;
+    else if (!strcmp(optarg, "csv"))
+      format = CSV;
+    else if (!strcmp(optarg, "json"))
+      format = JSON;
+    else
+      usage();
+  }
+  if (optind >= argc)
+    usage();
+
+  if (format == CSV)
+    printf("time,ip,method,uri,status,bytes,read_us,handle_us,body_us,"
+           "tls,deferred,cut,close\n");
+
+  for (; optind < argc; optind++)
+    if (decode(argv[optind], format))
+      rc = 1;
+
+  return rc;
+}
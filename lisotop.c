@@ -0,0 +1,308 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file lisotop.c                                                 */
+/*                                                                 */
+/* @brief Shows what lisod's connections are doing right now, from */
+/* its scoreboard (LISO_SCOREBOARD, format in scoreboard.h): each  */
+/* connection's phase and how long it has been in it, its age,     */
+/* client, bytes and current URI, and each CGI run with its pid.   */
+/* Connections longest in their phase come first, so slow clients  */
+/* and stuck scripts float to the top. The file is only read, so   */
+/* watching never slows the server down.                           */
+/*                                                                 */
+/* lisotop [-b] [-a] [-d seconds] [-n count] file                  */
+/*   -b  print one screen after another instead of redrawing       */
+/*   -a  include idle keep-alive connections                       */
+/*   -d  seconds between screens (default 1)                       */
+/*   -n  stop after count screens                                  */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+
+#include "scoreboard.h"
+
+#define TRIES 100   /* Reads of a slot before giving up on it */
+
+static const char* phases[SB_PHASES] = {
+  "idle", "headers", "body", "service", "backend", "writing",
+  "cgi-queued", "cgi-running", "cgi-draining"
+};
+
+static const char* methods[] = { "-", "GET", "HEAD", "POST" };
+
+/* A slot as copied out, with its index */
+typedef struct row {
+  int     slot;
+  sb_slot s;
+} row;
+
+static uint64_t now_us(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**********************************************************************/
+/* @brief Copies len bytes at src, guarded by the seqlock *seq, into  */
+/* dst: the copy is only taken if no write was open across it.        */
+/*                                                                    */
+/* @retval 0 on success, -1 if the writer kept it busy                */
+/**********************************************************************/
+static int read_locked(const uint32_t* seq, void* dst, const void* src,
+                       size_t len)
+{
+  uint32_t before;
+  int k;
+
+  for (k = 0; k < TRIES; k++)
+  {
+    if ((before = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+      continue;
+    memcpy(dst, src, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before)
+      return 0;
+  }
+  return -1;
+}
+
+/* Formats a span of microseconds as 850ms, 12.3s, 4m05s or 2h10m */
+static const char* span(uint64_t from, uint64_t to, char* buf, size_t len)
+{
+  uint64_t us = to > from ? to - from : 0;
+
+  if (us < 1000000)
+    snprintf(buf, len, "%llums", (unsigned long long)(us / 1000));
+  else if (us < 60000000)
+    snprintf(buf, len, "%.1fs", us / 1e6);
+  else if (us < 3600000000ULL)
+    snprintf(buf, len, "%um%02us", (unsigned)(us / 60000000),
+             (unsigned)(us / 1000000 % 60));
+  else
+    snprintf(buf, len, "%uh%02um", (unsigned)(us / 3600000000ULL),
+             (unsigned)(us / 60000000 % 60));
+  return buf;
+}
+
+/* Formats a byte count as 512, 12K, 3.4M or 1.2G */
+static const char* bytes(uint64_t n, char* buf, size_t len)
+{
+  if (n < 10000)
+    snprintf(buf, len, "%llu", (unsigned long long)n);
+  else if (n < 10000 * 1024ULL)
+    snprintf(buf, len, "%lluK", (unsigned long long)(n / 1024));
+  else if (n < 10000 * 1024ULL * 1024)
+    snprintf(buf, len, "%.1fM", n / 1048576.0);
+  else
+    snprintf(buf, len, "%.1fG", n / 1073741824.0);
+  return buf;
+}
+
+/* Longest in its phase first */
+static int by_phase_age(const void* a, const void* b)
+{
+  uint64_t x = ((const row*)a)->s.phase_us;
+  uint64_t y = ((const row*)b)->s.phase_us;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Prints one screen. Returns -1 once lisod is gone */
+static int show(const char* map, int all, int width)
+{
+  const sb_hdr* hdr = (const sb_hdr*)map;
+  const sb_slot* slots = (const sb_slot*)(map + sizeof(sb_hdr));
+  static row* rows;
+  sb_hdr h;
+  uint64_t now = now_us();
+  unsigned i, n, counts[SB_PHASES] = {0}, busy = 0, clients = 0, cgis = 0;
+  char age[16], in_phase[16], in[16], out[16], ip[INET_ADDRSTRLEN];
+  char pid[16], owner[16];
+  struct in_addr addr;
+  const row* r;
+  int k, room, len;
+
+  if (read_locked(&hdr->seq, &h, hdr, sizeof(h)) || h.pid == 0 ||
+      (kill(h.pid, 0) == -1 && errno == ESRCH))
+    return -1;
+
+  if (rows == NULL && (rows = calloc(h.slots, sizeof(row))) == NULL)
+    return -1;
+
+  /* Take the slots first, print after, so the screen is one moment */
+  for (i = 0, n = 0; i < h.slots; i++)
+  {
+    if (__atomic_load_n(&slots[i].kind, __ATOMIC_RELAXED) == SB_FREE)
+      continue;
+    if (read_locked(&slots[i].seq, &rows[n].s, &slots[i], sizeof(sb_slot)))
+    {
+      busy++;
+      continue;
+    }
+    if (rows[n].s.kind == SB_FREE || rows[n].s.phase >= SB_PHASES)
+      continue;
+
+    counts[rows[n].s.phase]++;
+    if (rows[n].s.kind == SB_CGI)
+      cgis++;
+    else
+      clients++;
+    if (!all && rows[n].s.phase == SB_IDLE)
+      continue;
+    rows[n].slot = i;
+    n++;
+  }
+  qsort(rows, n, sizeof(row), by_phase_age);
+
+  printf("lisod %d, up %s, %llu accepted; %u connections, %u CGI runs",
+         h.pid, span(h.started_us, now, age, sizeof(age)),
+         (unsigned long long)h.accepted, clients, cgis);
+  if (busy)
+    printf(", %u slots too busy to read", busy);
+  putchar('\n');
+  for (k = 0; k < SB_PHASES; k++)
+    if (counts[k])
+      printf(" %s %u", phases[k], counts[k]);
+  putchar('\n');
+  if (h.handshake_us)
+    printf("Event loop in a TLS handshake for %s\n",
+           span(h.handshake_us, now, age, sizeof(age)));
+  putchar('\n');
+
+  printf("%5s %-12s %7s %7s %-15s %3s %5s %6s %6s %7s %5s %-4s %s\n",
+         "SLOT", "PHASE", "TIME", "AGE", "CLIENT", "TLS", "REQS", "IN",
+         "OUT", "PID", "FOR", "METH", "URI");
+
+  for (r = rows; r < rows + n; r++)
+  {
+    addr.s_addr = r->s.addr;
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    snprintf(pid, sizeof(pid), "%d", (int)r->s.pid);
+    snprintf(owner, sizeof(owner), "%d", (int)r->s.owner);
+
+    /* CGI runs show the pid and the client slot they answer */
+    room = printf("%5d %-12s %7s %7s %-15s %3s %5u %6s %6s %7s %5s %-4s ",
+                  r->slot, phases[r->s.phase],
+                  span(r->s.phase_us, now, in_phase, sizeof(in_phase)),
+                  span(r->s.open_us, now, age, sizeof(age)), ip,
+                  r->s.flags & SB_TLS ? "yes" : "", r->s.requests,
+                  bytes(r->s.bytes_in, in, sizeof(in)),
+                  bytes(r->s.bytes_out, out, sizeof(out)),
+                  r->s.kind == SB_CGI ? pid : "-",
+                  r->s.kind == SB_CGI && r->s.owner >= 0 ? owner : "-",
+                  r->s.method < 4 ? methods[r->s.method] : "-");
+
+    /* The URI gets what is left of the line */
+    len = r->s.uri_len > SB_URI_MAX ? SB_URI_MAX : r->s.uri_len;
+    if (width > 0 && len > width - room)
+      len = width - room > 0 ? width - room : 0;
+    for (k = 0; k < len; k++)
+      putchar((unsigned char)r->s.uri[k] < 0x20 ? '?' : r->s.uri[k]);
+    putchar('\n');
+  }
+
+  fflush(stdout);
+  return 0;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: lisotop [-b] [-a] [-d seconds] [-n count] "
+          "scoreboard\n");
+  exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+  int c, fd, batch = 0, all = 0, width = 0;
+  long count = -1;
+  double delay = 1;
+  struct stat st;
+  struct winsize ws;
+  struct timespec pause;
+  const sb_hdr* hdr;
+  char* map;
+
+  while ((c = getopt(argc, argv, "bad:n:")) != -1)
+  {
+    switch (c)
+    {
+      case 'b': batch = 1; break;
+      case 'a': all = 1; break;
+      case 'd': delay = atof(optarg); break;
+      case 'n': count = atol(optarg); break;
+      default: usage();
+    }
+  }
+  if (optind != argc - 1 || delay <= 0)
+    usage();
+
+  if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+  {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  if ((size_t)st.st_size < sizeof(sb_hdr) ||
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+      == MAP_FAILED)
+  {
+    fprintf(stderr, "%s: not a scoreboard\n", argv[optind]);
+    return 1;
+  }
+  close(fd);
+
+  hdr = (const sb_hdr*)map;
+  if (memcmp(hdr->magic, SB_MAGIC, 8) || hdr->version != SB_VERSION ||
+      hdr->slot_size != SB_SLOT ||
+      sizeof(sb_hdr) + (size_t)hdr->slots * SB_SLOT > (size_t)st.st_size)
+  {
+    fprintf(stderr, "%s: not a scoreboard (or another version)\n",
+            argv[optind]);
+    return 1;
+  }
+
+  if (!batch && isatty(STDOUT_FILENO) &&
+      ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)
+    width = ws.ws_col;
+
+  pause.tv_sec  = (time_t)delay;
+  pause.tv_nsec = (long)((delay - pause.tv_sec) * 1e9);
+
+  while (count != 0)
+  {
+    if (!batch)
+      fputs("\033[H\033[2J", stdout);   // Home and clear
+    if (show(map, all, width))
+    {
+      fprintf(stderr, "lisod is not running\n");
+      return 1;
+    }
+    if (count > 0 && --count == 0)
+      break;
+    if (batch)
+      putchar('\n');
+    while (nanosleep(&pause, &pause) == -1 && errno == EINTR)
+      ;
+    pause.tv_sec  = (time_t)delay;
+    pause.tv_nsec = (long)((delay - pause.tv_sec) * 1e9);
+  }
+
+  return 0;
+}
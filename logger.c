@@ -5,21 +5,85 @@
 /* @brief Logger module to be used with liso. Outputs logging data */
 /* to a specified file while handling errors.                      */
 /*                                                                 */
+/* Records don't touch the file on the thread that logs them. Each */
+/* thread formats its records into a ring of its own, and a        */
+/* flusher thread writes whatever the rings hold with one writev() */
+/* every LOG_FLUSH_MS, or sooner once a ring is half full. A full  */
+/* ring drops the record and counts it rather than wait. SIGHUP    */
+/* has the flusher reopen the file by name, for log rotation.      */
+/*                                                                 */
 /* @author Fadhil Abubaker                                         */
 /*                                                                 */
 /*******************************************************************/
 
+#define _GNU_SOURCE   /* dup3() */
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "logger.h"
 
+#define LOG_SLOTS    512   /* Records a thread's ring holds (power of 2) */
+#define LOG_SLOT     512   /* Bytes a record may take, timestamp and all */
+#define LOG_IOV      256   /* Records written per writev()               */
+#define LOG_FLUSH_MS 20    /* How long a record may wait in its ring     */
+
+typedef struct log_slot {
+  size_t len;
+  char   data[LOG_SLOT];
+} log_slot;
+
+/* One thread's records. head is only written by that thread, tail
+   only by the flusher; each on a cache line of its own */
+typedef struct log_ring {
+  unsigned long head;   // Next slot to fill
+  char          pad1[64 - sizeof(unsigned long)];
+  unsigned long tail;   // Next slot to write out
+  char          pad2[64 - sizeof(unsigned long)];
+  unsigned long taken;  // Flusher: up to here is in the writev()
+  struct log_ring* next;
+  log_slot      slots[LOG_SLOTS];
+} log_ring;
+
+/* The time, formatted, as of the last record this thread logged */
+typedef struct log_stamp {
+  time_t sec;
+  long   ms;
+  size_t len;
+  char   text[48];
+} log_stamp;
+
+log_counters log_stats;
+
+static __thread log_ring*  ring;    /* This thread's */
+static __thread log_stamp  stamp;
+
+static log_ring*       rings;       /* Every thread's, newest first */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int   log_fd = -1;           /* fileno() of the log's FILE      */
+static char* log_path;              /* To reopen it by                 */
+static int   wake_fd = -1;          /* eventfd the flusher polls       */
+static int   started;               /* Flusher running                 */
+static int   stopping;              /* log_close(): flusher, stop      */
+static volatile sig_atomic_t reopen;
+static unsigned long dropped;       /* Atomic: any thread counts them  */
+static unsigned long dropped_told;  /* Dropped records reported so far */
+
 FILE* log_open(char* filename)
 {
   FILE* file = fopen(filename,"w+");
@@ -30,11 +94,216 @@ FILE* log_open(char* filename)
     exit(1);
   }
 
+  /* CGI children have no business with the log */
+  fcntl(fileno(file), F_SETFD, FD_CLOEXEC);
+
+  log_fd = fileno(file);
+  if ((log_path = realpath(filename, NULL)) == NULL)
+    log_path = strdup(filename);
+
   return file;
 }
 
+/* Makes the current second's text, then patches in the millisecond:
+   localtime() at most once a second, not once a record */
+static void make_stamp(void)
+{
+  struct timespec now;
+  struct tm tm;
+  char year[8];
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+  if (now.tv_sec != stamp.sec || stamp.len == 0)
+  {
+    localtime_r(&now.tv_sec, &tm);
+    strftime(stamp.text, sizeof(stamp.text), "%a %b %e %H:%M:%S.000", &tm);
+    strftime(year, sizeof(year), " %Y\n", &tm);
+    stamp.len = strlen(stamp.text);
+    memcpy(stamp.text + stamp.len, year, strlen(year) + 1);
+    stamp.len += strlen(year);
+    stamp.sec = now.tv_sec;
+    stamp.ms  = -1;
+  }
+
+  if (now.tv_nsec / 1000000 != stamp.ms)
+  {
+    stamp.ms = now.tv_nsec / 1000000;
+    stamp.text[20] = '0' + stamp.ms / 100;   // "Www Mmm dd hh:mm:ss.mmm"
+    stamp.text[21] = '0' + stamp.ms / 10 % 10;
+    stamp.text[22] = '0' + stamp.ms % 10;
+  }
+}
+
+/* Has the flusher look at the rings now. Async-signal-safe */
+static void wake(void)
+{
+  uint64_t one = 1;
+
+  if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0)
+    return;   // Its counter is full: it is woken already
+}
+
+/* This thread's ring, made on its first record */
+static log_ring* my_ring(void)
+{
+  if (ring != NULL)
+    return ring;
+
+  if ((ring = calloc(1, sizeof(log_ring))) == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&rings_lock);
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+  return ring;
+}
+
+/* Says how many records were lost, once there are new ones. Flusher
+   only, flush_lock held */
+static void tell_dropped(void)
+{
+  unsigned long n = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+  char line[128];
+  int len;
+
+  log_stats.dropped = n;
+  if (n == dropped_told)
+    return;
+
+  len = snprintf(line, sizeof(line), "Logging: %lu records dropped, the "
+                 "ring was full \n \n", n - dropped_told);
+  if (write(log_fd, line, len) < 0)
+    return;
+  dropped_told = n;
+}
+
+/* Writes out everything in the rings, LOG_IOV records at a time.
+   flush_lock held */
+static void drain(void)
+{
+  struct iovec iov[LOG_IOV];
+  unsigned long head;
+  log_ring* r;
+  int n;
+
+  do
+  {
+    n = 0;
+    pthread_mutex_lock(&rings_lock);
+    for (r = rings; r != NULL; r = r->next)
+    {
+      head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+      for (r->taken = r->tail; r->taken != head && n < LOG_IOV; r->taken++)
+      {
+        iov[n].iov_base = r->slots[r->taken & (LOG_SLOTS - 1)].data;
+        iov[n].iov_len  = r->slots[r->taken & (LOG_SLOTS - 1)].len;
+        n++;
+      }
+    }
+
+    if (n > 0)
+    {
+      if (writev(log_fd, iov, n) >= 0)
+        log_stats.records += n;
+      log_stats.batches++;
+
+      /* The slots are the threads' again */
+      for (r = rings; r != NULL; r = r->next)
+        __atomic_store_n(&r->tail, r->taken, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&rings_lock);
+  } while (n == LOG_IOV);
+
+  tell_dropped();
+}
+
+/* The log file was moved away (rotated): open a new one by the same
+   name in place of the old descriptor, which the FILE shares */
+static void do_reopen(void)
+{
+  int fd;
+
+  reopen = 0;
+  if ((fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                 0644)) < 0)
+    return;
+
+  dup3(fd, log_fd, O_CLOEXEC);
+  close(fd);
+  log_stats.reopens++;
+}
+
+static void* flusher(void* arg)
+{
+  struct pollfd pfd = {.fd = wake_fd, .events = POLLIN};
+  uint64_t n;
+
+  (void)arg;
+  for (;;)
+  {
+    if (poll(&pfd, 1, LOG_FLUSH_MS) > 0 && read(wake_fd, &n, sizeof(n)) < 0)
+      n = 0;
+
+    pthread_mutex_lock(&flush_lock);
+    if (stopping)
+    {
+      pthread_mutex_unlock(&flush_lock);
+      break;
+    }
+    drain();
+    if (reopen)
+      do_reopen();
+    pthread_mutex_unlock(&flush_lock);
+  }
+
+  return NULL;
+}
+
+/*******************************************************************/
+/* @brief Starts the flusher thread. Until it runs (and if it      */
+/* can't be started), records are written out as they are logged. */
+/* Call it after forking long-lived children (the zygote), so     */
+/* they never copy a process with a thread in it.                  */
+/*                                                                 */
+/* @retval 0 on success, -1 on failure                             */
+/*******************************************************************/
+int log_start(void)
+{
+  sigset_t all, old;
+  pthread_t tid;
+  int rc;
+
+  if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    return -1;
+
+  /* Signals are the event loop's */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  rc = pthread_create(&tid, NULL, flusher, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (rc != 0)
+  {
+    close(wake_fd);
+    wake_fd = -1;
+    return -1;
+  }
+
+  pthread_detach(tid);
+  started = 1;
+  return 0;
+}
+
 int log_close(FILE* file)
 {
+  /* Whatever is still in the rings goes out first */
+  pthread_mutex_lock(&flush_lock);
+  stopping = 1;
+  drain();
+  pthread_mutex_unlock(&flush_lock);
+
   fprintf(file, "Closing log...\n");
 
   if(fclose(file) != 0)
@@ -46,12 +315,85 @@ int log_close(FILE* file)
   return EXIT_SUCCESS;
 }
 
-int log_error(char* error, FILE* file)
+/*******************************************************************/
+/* @brief Logs a record: the time, then fmt. Only formats it into  */
+/* this thread's ring; the flusher writes it out.                  */
+/*                                                                 */
+/* @param level  LOG_ERROR, LOG_INFO or LOG_DEBUG (log_info() and  */
+/*               log_debug() compile out above LISO_LOG_LEVEL)     */
+/*                                                                 */
+/* @retval 0 on success, -1 if the ring is full and it was dropped */
+/*******************************************************************/
+int log_write(int level, const char* fmt, ...)
 {
-  time_t now;
-  time(&now);
+  unsigned long head, tail;
+  log_slot* slot;
+  log_ring* r;
+  va_list ap;
+  int n;
+
+  (void)level;
+  if ((r = my_ring()) == NULL)
+  {
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  head = r->head;
+  tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  if (head - tail == LOG_SLOTS)
+  {
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  /* Room is kept for the " \n \n" after it */
+  slot = &r->slots[head & (LOG_SLOTS - 1)];
+  make_stamp();
+  memcpy(slot->data, stamp.text, stamp.len);
+  va_start(ap, fmt);
+  n = vsnprintf(slot->data + stamp.len, LOG_SLOT - stamp.len - 4, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    n = 0;
+  else if ((size_t)n > LOG_SLOT - stamp.len - 5)
+    n = LOG_SLOT - stamp.len - 5;   // Cut short
+  memcpy(slot->data + stamp.len + n, " \n \n", 4);
+  slot->len = stamp.len + n + 4;
+
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+  if (!started)
+  {
+    pthread_mutex_lock(&flush_lock);
+    drain();
+    pthread_mutex_unlock(&flush_lock);
+  }
+  else if (head + 1 - tail == LOG_SLOTS / 2)
+    wake();
+
+  return 0;
+}
 
-  fprintf(file, "%s%s \n \n", ctime(&now), error);
+int log_error(char* error, FILE* file)
+{
+  (void)file;   // There is the one log
+  log_write(LOG_ERROR, "%s", error);
 
   return EXIT_SUCCESS;
 }
+
+/* SIGHUP: the flusher reopens the log by name. Async-signal-safe */
+void log_reopen(void)
+{
+  reopen = 1;
+  wake();
+}
+
+void log_print(FILE* file)
+{
+  fprintf(file, "Logging: %lu records in %lu writes, %lu dropped, "
+          "%lu reopens\n", log_stats.records, log_stats.batches,
+          __atomic_load_n(&dropped, __ATOMIC_RELAXED), log_stats.reopens);
+  fflush(file);
+}
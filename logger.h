@@ -1,7 +1,55 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdio.h>
+
 #define BUF_SIZE 8192
 
+/* Log levels. Records above LISO_LOG_LEVEL aren't compiled in (their
+   arguments are still type checked): build with make LOG_LEVEL=1 to
+   drop the per-request chatter */
+#define LOG_ERROR 0   // Something failed
+#define LOG_INFO  1   // Startup, shutdown, things worth knowing
+#define LOG_DEBUG 2   // Per connection and per request
+
+#ifndef LISO_LOG_LEVEL
+#define LISO_LOG_LEVEL LOG_DEBUG
+#endif
+
+#if LISO_LOG_LEVEL >= LOG_INFO
+#define log_info(...)  log_write(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...) \
+  do { if (0) log_write(LOG_INFO, __VA_ARGS__); } while (0)
+#endif
+
+#if LISO_LOG_LEVEL >= LOG_DEBUG
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) \
+  do { if (0) log_write(LOG_DEBUG, __VA_ARGS__); } while (0)
+#endif
+
+typedef struct log_counters {
+  unsigned long records;   // Written to the file
+  unsigned long dropped;   // Lost to a full ring
+  unsigned long batches;   // writev() calls they took
+  unsigned long reopens;   // SIGHUPs acted on
+} log_counters;
+
 FILE* log_open(char* filename);
 
+int log_start(void);
+
 int log_close(FILE* file);
 
 int log_error(char* error, FILE* file);
+
+int log_write(int level, const char* fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+void log_reopen(void);
+
+void log_print(FILE* file);
+
+#endif
@@ -0,0 +1,633 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file mcache.c                                                  */
+/*                                                                 */
+/* @brief Micro-cache for CGI GET responses. A script's output is  */
+/* kept, keyed on the scheme, the URI with its query string and    */
+/* the values of the request headers in LISO_CACHE_VARY, for as    */
+/* long as its Cache-Control: max-age says (LISO_CACHE_TTL seconds */
+/* if it says nothing; no-store, no-cache and private keep it out  */
+/* of the cache). An entry past its age is still served, for up to */
+/* LISO_CACHE_STALE seconds, while one detached run of the script  */
+/* refreshes it. Entries are dropped least recently used first to  */
+/* stay under LISO_CACHE_SIZE bytes.                               */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "mcache.h"
+#include "engine.h"
+#include "alloc.h"
+#include "config.h"
+#include "util.h"
+
+#define MC_BUCKETS 1024   /* Hash chains, a power of two */
+
+/* One cached response, or a placeholder for one being fetched */
+struct mc_entry {
+  char*     key;       // Scheme and URI, then each LISO_CACHE_VARY value
+  size_t    key_len;
+  unsigned  hash;
+  char*     data;      // The script's output: header block, then the body
+  size_t    len;       // NULL/0 while nothing is cached yet
+  size_t    hlen;      // Length of the header block, blank line included
+  time_t    expires;   // Fresh until then
+  time_t    stale;     // May be served, while being refreshed, until then
+  char*     fill;      // Output collected from the run filling it
+  size_t    fill_len;
+  size_t    fill_cap;
+  int       filling;   // A script is running to fill it; not evicted
+  mc_entry* hnext;     // Hash chain
+  mc_entry* prev;      // LRU list, most recently used first
+  mc_entry* next;
+};
+
+mcache_counters mcache_stats;
+
+static mc_entry* buckets[MC_BUCKETS];
+static mc_entry* lru_head;
+static mc_entry* lru_tail;
+static size_t    used;      /* Bytes of entries, keys and responses */
+static int       nentries;
+
+int mcache_enabled(void)
+{
+  return config.cache_size > 0;
+}
+
+/* Largest response worth keeping */
+static size_t max_entry(void)
+{
+  return config.cache_size / 16;
+}
+
+/* Finds the end of the header line at line, before end. Returns the
+   '\n', or NULL if there is none; *llen is the length without CRLF */
+static char* line_end(char* line, char* end, size_t* llen)
+{
+  char* eol = memchr(line, '\n', end - line);
+
+  if (eol == NULL)
+    return NULL;
+  *llen = eol - line;
+  if (*llen > 0 && line[*llen - 1] == '\r')
+    (*llen)--;
+  return eol;
+}
+
+/* 1 if the request header name (n bytes) is listed in LISO_CACHE_VARY */
+static int in_vary(const char* name, size_t n)
+{
+  const char* tok = config.cache_vary;
+  size_t tlen;
+
+  while (tok != NULL && *tok != '\0')
+  {
+    tok += strspn(tok, ", ");
+    tlen = strcspn(tok, ", ");
+    if (tlen == n && !strncasecmp(tok, name, n))
+      return 1;
+    tok += tlen;
+  }
+  return 0;
+}
+
+/*******************************************************************/
+/* @brief Builds the cache key for a request into key: the scheme  */
+/* and URI, then each LISO_CACHE_VARY header's value, each ended   */
+/* by a NUL.                                                       */
+/*                                                                 */
+/* @returns the key's length, -1 if it does not fit in cap bytes   */
+/*******************************************************************/
+static int make_key(fsm* state, char* key, size_t cap)
+{
+  const char* tok = config.cache_vary;
+  char hdr[64];
+  char* val; char* crlf;
+  size_t tlen, vlen;
+  int n;
+
+  n = snprintf(key, cap, "%s%s", state->context ? "https:" : "http:",
+               state->uri) + 1;
+  if ((size_t)n > cap)
+    return -1;
+
+  while (tok != NULL && *tok != '\0')
+  {
+    tok += strspn(tok, ", ");
+    if ((tlen = strcspn(tok, ", ")) == 0)
+      break;
+    if (tlen + 2 > sizeof(hdr))
+      return -1;
+    snprintf(hdr, sizeof(hdr), "%.*s:", (int)tlen, tok);
+    tok += tlen;
+
+    vlen = 0;
+    if ((val = search_hdr(state, hdr, (int)tlen + 1)) != NULL &&
+        (crlf = strstr(val, "\r\n")) != NULL)
+    {
+      val += strspn(val, " ");
+      vlen = crlf > val ? (size_t)(crlf - val) : 0;
+    }
+
+    if ((size_t)n + vlen + 1 > cap)
+      return -1;
+    if (vlen > 0)
+      memcpy(key + n, val, vlen);
+    key[n + vlen] = '\0';
+    n += vlen + 1;
+  }
+
+  return n;
+}
+
+static mc_entry* find(char* key, size_t len, unsigned hash)
+{
+  mc_entry* e;
+
+  for (e = buckets[hash & (MC_BUCKETS - 1)]; e != NULL; e = e->hnext)
+    if (e->hash == hash && e->key_len == len && !memcmp(e->key, key, len))
+      return e;
+  return NULL;
+}
+
+/* Moves e to the front of the LRU list */
+static void touch(mc_entry* e)
+{
+  if (e == lru_head)
+    return;
+
+  if (e->prev != NULL) e->prev->next = e->next;
+  if (e->next != NULL) e->next->prev = e->prev;
+  if (e == lru_tail)   lru_tail = e->prev;
+
+  e->prev = NULL;
+  e->next = lru_head;
+  if (lru_head != NULL)
+    lru_head->prev = e;
+  lru_head = e;
+  if (lru_tail == NULL)
+    lru_tail = e;
+}
+
+/* Lets go of e's cached response, keeping the entry */
+static void drop_data(mc_entry* e)
+{
+  used -= e->len;
+  liso_free(e->data);
+  e->data = NULL;
+  e->len  = 0;
+  e->hlen = 0;
+}
+
+static void drop_fill(mc_entry* e)
+{
+  liso_free(e->fill);
+  e->fill     = NULL;
+  e->fill_len = 0;
+  e->fill_cap = 0;
+  e->filling  = 0;
+}
+
+static void remove_entry(mc_entry* e)
+{
+  mc_entry** link = &buckets[e->hash & (MC_BUCKETS - 1)];
+
+  while (*link != e)
+    link = &(*link)->hnext;
+  *link = e->hnext;
+
+  if (e->prev != NULL) e->prev->next = e->next; else lru_head = e->next;
+  if (e->next != NULL) e->next->prev = e->prev; else lru_tail = e->prev;
+
+  drop_data(e);
+  drop_fill(e);
+  used -= sizeof(mc_entry) + e->key_len;
+  liso_free(e->key);
+  liso_free(e);
+  nentries--;
+}
+
+/* Evicts least recently used entries until need more bytes fit.
+   Entries being filled stay. Returns -1 if they can't be made to fit */
+static int make_room(size_t need)
+{
+  mc_entry* e = lru_tail;
+  mc_entry* prev;
+
+  while (used + need > config.cache_size && e != NULL)
+  {
+    prev = e->prev;
+    if (!e->filling)
+    {
+      remove_entry(e);
+      mcache_stats.evictions++;
+    }
+    e = prev;
+  }
+
+  return used + need > config.cache_size ? -1 : 0;
+}
+
+static mc_entry* create(char* key, size_t len, unsigned hash)
+{
+  mc_entry* e;
+
+  if (make_room(sizeof(mc_entry) + len) ||
+      (e = liso_malloc_acct(sizeof(mc_entry), MEM_CACHE, NULL)) == NULL)
+    return NULL;
+
+  memset(e, 0, sizeof(mc_entry));
+  if ((e->key = liso_malloc_acct(len, MEM_CACHE, NULL)) == NULL)
+  {
+    liso_free(e);
+    return NULL;
+  }
+  memcpy(e->key, key, len);
+  e->key_len = len;
+  e->hash    = hash;
+
+  e->hnext = buckets[hash & (MC_BUCKETS - 1)];
+  buckets[hash & (MC_BUCKETS - 1)] = e;
+  touch(e);
+
+  used += sizeof(mc_entry) + len;
+  nentries++;
+  return e;
+}
+
+/*****************************************************************/
+/* @brief Answers a request from e: the head goes in the state's */
+/* response buffer and a copy of the body in state->body, as for */
+/* a static file (queue_response()).                             */
+/*                                                               */
+/* @retval 0 on success, -1 out of memory                        */
+/*****************************************************************/
+static int answer(fsm* state, mc_entry* e)
+{
+  size_t blen = e->len - e->hlen;
+  char* body = NULL;
+  int n, framing;
+
+  if ((n = cgi_head(e->data, e->hlen, state->response, state->conn,
+                    &framing)) < 0)
+    return -1;
+
+  if (blen > 0)
+  {
+    if ((body = conn_malloc(state, MEM_BODY, blen)) == NULL)
+      return -1;
+    memcpy(body, e->data + e->hlen, blen);
+    addtofree(state->cold->freebuf, body, FREE_SIZE);
+  }
+
+  state->response[n] = '\0';
+  state->body        = body;
+  state->body_size   = blen;
+  return 0;
+}
+
+/*******************************************************************/
+/* @brief Builds the key under which a CGI GET's response can be   */
+/* shared with other requests: cached, or handed to identical      */
+/* requests while it runs (flight.c). Requests carrying            */
+/* credentials (Authorization:, or Cookie: when it isn't part of   */
+/* the key) get none.                                              */
+/*                                                                 */
+/* @returns the key's length, -1 if the response is its own        */
+/*******************************************************************/
+int mcache_key(fsm* state, char* key, size_t cap)
+{
+  if (search_hdr(state, "Authorization:", 14) != NULL ||
+      (search_hdr(state, "Cookie:", 7) != NULL && !in_vary("Cookie", 6)))
+    return -1;
+
+  return make_key(state, key, cap);
+}
+
+/*******************************************************************/
+/* @brief Looks a CGI GET up in the cache. A fresh entry answers   */
+/* it; so does a stale one, but the first request to find it stale */
+/* is also told to refresh it. Otherwise the request is told to    */
+/* fill the entry, unless another run is filling it already.       */
+/* Requests without a key (mcache_key()) bypass the cache.         */
+/*                                                                 */
+/* @param state  The client, with its request parsed               */
+/* @param fill   Set to the entry to pass to mcache_take() and     */
+/*               mcache_store() (or mcache_abort()) for MC_FILL    */
+/*               and MC_REFRESH; NULL otherwise                    */
+/*                                                                 */
+/* @returns MC_HIT, MC_REFRESH (both answered), MC_FILL or MC_SKIP */
+/*******************************************************************/
+int mcache_lookup(fsm* state, mc_entry** fill)
+{
+  char key[BUF_SIZE];
+  time_t now = time(NULL);
+  mc_entry* e;
+  unsigned hash;
+  int n;
+
+  *fill = NULL;
+
+  if (!mcache_enabled() || (n = mcache_key(state, key, sizeof(key))) < 0)
+    return MC_SKIP;
+
+  hash = fnv1a(key, n);
+  e    = find(key, n, hash);
+
+  if (e != NULL && e->data != NULL && now < e->stale)
+  {
+    if (answer(state, e))
+      return MC_SKIP;   // Out of memory: just run it
+    touch(e);
+    if (now < e->expires)
+    {
+      mcache_stats.hits++;
+      return MC_HIT;
+    }
+
+    mcache_stats.stale++;
+    if (e->filling)
+      return MC_HIT;   // Being refreshed already
+    e->filling = 1;
+    *fill = e;
+    return MC_REFRESH;
+  }
+
+  if (e != NULL && e->filling)
+    return MC_SKIP;
+
+  if (e != NULL)
+    drop_data(e);   // Too stale to serve
+  else if ((e = create(key, n, hash)) == NULL)
+    return MC_SKIP;
+
+  mcache_stats.misses++;
+  e->filling = 1;
+  *fill = e;
+  return MC_FILL;
+}
+
+/*******************************************************************/
+/* @brief Whether a response with this CGI header block may answer */
+/* other requests with the same key: not if it sets a cookie, says */
+/* no-store, no-cache or private, or Varies on a header that isn't */
+/* part of the key.                                                */
+/*                                                                 */
+/* @retval 1 if it may, 0 if it is for its own request only        */
+/*******************************************************************/
+int mcache_shareable(char* hdrs, size_t len)
+{
+  char* end = hdrs + len;
+  char* line; char* eol; char* tok;
+  size_t llen, tlen;
+
+  for (line = hdrs; (eol = line_end(line, end, &llen)) != NULL && llen > 0;
+       line = eol + 1)
+  {
+    if (llen >= 11 && !strncasecmp(line, "Set-Cookie:", 11))
+      return 0;
+
+    if (llen >= 14 && !strncasecmp(line, "Cache-Control:", 14))
+      for (tok = line + 14; tok < line + llen; tok += tlen)
+      {
+        tok += strspn(tok, ", ");
+        if (tok >= line + llen)
+          break;
+        tlen = strcspn(tok, ", \r\n");
+        if ((tlen == 8 && !strncasecmp(tok, "no-store", 8)) ||
+            (tlen == 8 && !strncasecmp(tok, "no-cache", 8)) ||
+            (tlen == 7 && !strncasecmp(tok, "private", 7)))
+          return 0;
+      }
+
+    if (llen >= 5 && !strncasecmp(line, "Vary:", 5))
+      for (tok = line + 5; tok < line + llen; tok += tlen)
+      {
+        tok += strspn(tok, ", ");
+        if (tok >= line + llen)
+          break;
+        tlen = strcspn(tok, ", \r\n");
+        if (!in_vary(tok, tlen))
+          return 0;   // "*" included
+      }
+  }
+
+  return 1;
+}
+
+/********************************************************************/
+/* @brief How long a response with this CGI header block may be     */
+/* cached: its Cache-Control s-maxage or max-age, else              */
+/* LISO_CACHE_TTL. Only a plain 200 that may be shared is kept; one */
+/* that redirects is not, and neither is NPH output.                */
+/*                                                                  */
+/* @returns seconds, or -1 if it must not be cached                 */
+/********************************************************************/
+static int ttl_of(char* hdrs, size_t len)
+{
+  char* end = hdrs + len;
+  char* line; char* eol; char* tok; char* val;
+  size_t llen, tlen;
+  int max_age = -1, s_maxage = -1, ttl;
+
+  if ((len >= 5 && !strncmp(hdrs, "HTTP/", 5)) ||
+      !mcache_shareable(hdrs, len))
+    return -1;
+
+  for (line = hdrs; (eol = line_end(line, end, &llen)) != NULL && llen > 0;
+       line = eol + 1)
+  {
+    if (llen >= 9 && !strncasecmp(line, "Location:", 9))
+      return -1;
+
+    if (llen >= 7 && !strncasecmp(line, "Status:", 7))
+    {
+      for (val = line + 7; val < line + llen && *val == ' '; val++)
+        ;
+      if (line + llen - val < 3 || strncmp(val, "200", 3))
+        return -1;
+    }
+
+    if (llen >= 14 && !strncasecmp(line, "Cache-Control:", 14))
+      for (tok = line + 14; tok < line + llen; tok += tlen)
+      {
+        tok += strspn(tok, ", ");
+        if (tok >= line + llen)
+          break;
+        tlen = strcspn(tok, ", \r\n");
+        if (tlen > 8 && !strncasecmp(tok, "max-age=", 8))
+          max_age = atoi(tok + 8);
+        if (tlen > 9 && !strncasecmp(tok, "s-maxage=", 9))
+          s_maxage = atoi(tok + 9);
+      }
+  }
+
+  ttl = s_maxage >= 0 ? s_maxage : max_age >= 0 ? max_age : config.cache_ttl;
+  return ttl > 0 ? ttl : -1;
+}
+
+/* ttl_of(), counting the responses that can't be cached */
+int mcache_ttl(char* hdrs, size_t len)
+{
+  int ttl = ttl_of(hdrs, len);
+
+  if (ttl < 0)
+    mcache_stats.uncachable++;
+  return ttl;
+}
+
+/*******************************************************************/
+/* @brief Adds len bytes of the script's output, header block      */
+/* first, to the entry being filled.                               */
+/*                                                                 */
+/* @retval 0 on success, -1 if the response is too big to cache or */
+/* out of memory; the caller gives up on it with mcache_abort()    */
+/*******************************************************************/
+int mcache_take(mc_entry* e, char* data, size_t len)
+{
+  size_t cap;
+  char* buf;
+
+  if (e->fill_len + len > max_entry())
+    return -1;
+
+  if (e->fill_len + len > e->fill_cap)
+  {
+    cap = e->fill_cap ? e->fill_cap * 2 : 4096;
+    while (cap < e->fill_len + len)
+      cap *= 2;
+    if ((buf = liso_malloc_acct(cap, MEM_CACHE, NULL)) == NULL)
+      return -1;
+    memcpy(buf, e->fill, e->fill_len);
+    liso_free(e->fill);
+    e->fill     = buf;
+    e->fill_cap = cap;
+  }
+
+  memcpy(e->fill + e->fill_len, data, len);
+  e->fill_len += len;
+  return 0;
+}
+
+/*********************************************************************/
+/* @brief The script filling e finished: its output becomes the      */
+/* entry, if it may be cached. A Content-Length is added if the      */
+/* script didn't send one, so hits are never chunked; a response     */
+/* whose body doesn't match its Content-Length is not kept.          */
+/*********************************************************************/
+void mcache_store(mc_entry* e)
+{
+  char* end; char* line; char* eol; char* data;
+  size_t hlen, blen, llen, len, k;
+  long clen = -1;
+  int ttl;
+
+  if ((end = memmem(e->fill, e->fill_len, "\r\n\r\n", 4)) != NULL)
+    hlen = end + 4 - e->fill;
+  else if ((end = memmem(e->fill, e->fill_len, "\n\n", 2)) != NULL)
+    hlen = end + 2 - e->fill;
+  else
+    goto uncachable;
+
+  blen = e->fill_len - hlen;
+  if ((ttl = mcache_ttl(e->fill, hlen)) < 0)
+  {
+    remove_entry(e);   // Counted by mcache_ttl()
+    return;
+  }
+  if (mem_pressure() != MEM_OK)
+    goto uncachable;
+
+  /* The header lines, CRLF terminated, then a Content-Length */
+  len = 0;
+  for (line = e->fill; (eol = line_end(line, e->fill + hlen, &llen)) &&
+       llen > 0; line = eol + 1)
+  {
+    if (llen >= 15 && !strncasecmp(line, "Content-Length:", 15))
+      clen = atol(line + 15);
+    len += llen + 2;
+  }
+  if (clen >= 0 && (size_t)clen != blen)
+    goto uncachable;   // Cut short, or more than it said
+
+  len += (clen < 0 ? 40 : 0) + 2 + blen;
+
+  drop_data(e);
+  if (make_room(len) ||
+      (data = liso_malloc_acct(len, MEM_CACHE, NULL)) == NULL)
+    goto uncachable;
+
+  for (k = 0, line = e->fill; (eol = line_end(line, e->fill + hlen, &llen)) &&
+       llen > 0; line = eol + 1)
+  {
+    memcpy(data + k, line, llen);
+    memcpy(data + k + llen, "\r\n", 2);
+    k += llen + 2;
+  }
+  if (clen < 0)
+    k += snprintf(data + k, 40, "Content-Length: %zu\r\n", blen);
+  memcpy(data + k, "\r\n", 2);
+  k += 2;
+  memcpy(data + k, e->fill + hlen, blen);
+
+  e->data    = data;
+  e->hlen    = k;
+  e->len     = k + blen;
+  e->expires = time(NULL) + ttl;
+  e->stale   = e->expires + config.cache_stale;
+  used += e->len;
+
+  drop_fill(e);
+  mcache_stats.stores++;
+  return;
+
+uncachable:
+  mcache_stats.uncachable++;
+  remove_entry(e);
+}
+
+/* The script filling e failed, or its output can't be kept. A stale
+   response stays, to be refreshed by a later request */
+void mcache_abort(mc_entry* e)
+{
+  drop_fill(e);
+  if (e->data == NULL)
+    remove_entry(e);
+}
+
+/* Drops everything not being filled; called near the memory budget */
+void mcache_flush(void)
+{
+  mc_entry* e = lru_head;
+  mc_entry* next;
+
+  for (; e != NULL; e = next)
+  {
+    next = e->next;
+    if (!e->filling)
+      remove_entry(e);
+    else
+      drop_data(e);
+  }
+}
+
+void mcache_print(FILE* file)
+{
+  if (!mcache_enabled())
+    return;
+
+  fprintf(file, "Cache: %lu hits, %lu stale, %lu misses, %lu stored, "
+          "%lu uncachable, %lu evicted; %d entries, %zu bytes\n",
+          mcache_stats.hits, mcache_stats.stale, mcache_stats.misses,
+          mcache_stats.stores, mcache_stats.uncachable,
+          mcache_stats.evictions, nentries, used);
+  fflush(file);
+}
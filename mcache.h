@@ -0,0 +1,38 @@
+#ifndef MCACHE_H
+#define MCACHE_H
+
+#include <stdio.h>
+
+#include "lisod.h"
+
+/* What mcache_lookup() made of a request */
+#define MC_SKIP     0   // Not cacheable, or being fetched already: run it
+#define MC_HIT      1   // Answered from the cache
+#define MC_FILL     2   // Not cached: run it and fill the entry it returned
+#define MC_REFRESH  3   // Answered stale: run it detached to refresh the entry
+
+typedef struct mc_entry mc_entry;
+
+typedef struct mcache_counters {
+  unsigned long hits;       // Answered fresh from the cache
+  unsigned long stale;      // Answered stale while a refresh ran
+  unsigned long misses;     // Cacheable, but ran the script
+  unsigned long stores;     // Responses stored
+  unsigned long uncachable; // Script output the cache could not keep
+  unsigned long evictions;  // Entries dropped to make room
+} mcache_counters;
+
+extern mcache_counters mcache_stats;
+
+int  mcache_enabled(void);
+int  mcache_key(fsm* state, char* key, size_t cap);
+int  mcache_shareable(char* hdrs, size_t len);
+int  mcache_lookup(fsm* state, mc_entry** fill);
+int  mcache_ttl(char* hdrs, size_t len);
+int  mcache_take(mc_entry* e, char* data, size_t len);
+void mcache_store(mc_entry* e);
+void mcache_abort(mc_entry* e);
+void mcache_flush(void);
+void mcache_print(FILE* file);
+
+#endif
@@ -0,0 +1,534 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file metrics.c                                                 */
+/*                                                                 */
+/* @brief Counters and latency histograms, served in Prometheus    */
+/* text format on LISO_METRICS_URI to clients on the loopback      */
+/* address. Each thread records into a shard of its own with plain */
+/* stores, so recording takes no lock and no atomic instruction;   */
+/* the shards are summed when the page is asked for. Histograms    */
+/* are log-linear (HDR style): 8 buckets per power of two of       */
+/* nanoseconds, so a value is off by at most 12.5%. They are       */
+/* exported with a bucket per power of two, and with quantiles     */
+/* taken from the fine buckets.                                    */
+/*                                                                 */
+/* Built with make PERF_COUNTERS=1, some phases are also counted   */
+/* in hardware: each thread opens a perf_event_open() group of     */
+/* cycles, instructions, cache misses and branch misses on itself, */
+/* read before and after the phase, and the differences are summed */
+/* per phase in its shard.                                         */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#define _GNU_SOURCE   /* open_memstream() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef LISO_PERF_COUNTERS
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "metrics.h"
+#include "lisod.h"
+#include "outq.h"
+#include "engine.h"
+#include "alloc.h"
+#include "config.h"
+#include "logger.h"
+#include "util.h"
+
+#define SUB_BITS  3                     /* 8 buckets per power of two  */
+#define SUB       (1 << SUB_BITS)
+#define MAX_BITS  40                    /* 2^40 ns, about 18 minutes   */
+#define BUCKETS   ((MAX_BITS - SUB_BITS + 1) * SUB)
+#define LE_FIRST  10                    /* Exported le from 2^10 ns    */
+#define LE_LAST   36                    /* ... to 2^36 ns (68 s)       */
+
+typedef struct hist {
+  uint64_t count;             // Merged only: the buckets summed
+  uint64_t sum;               // Nanoseconds
+  uint64_t bucket[BUCKETS];
+} hist;
+
+/* One thread's numbers. Only that thread writes them */
+typedef struct shard {
+  hist     phase[METRIC_PHASES];
+  uint64_t accepted[2];       // HTTP, HTTPS
+  uint64_t bytes_in;
+  uint64_t codes[METRIC_CODES];
+#ifdef LISO_PERF_COUNTERS
+  uint64_t hw[METRIC_PHASES][METRIC_HW_EVENTS];
+  uint64_t hw_count[METRIC_PHASES];   // Phases counted
+#endif
+  struct shard* next;
+} shard;
+
+static const char* phase_names[METRIC_PHASES] = {
+  "tls_handshake", "parse_line", "parse_headers", "body", "service",
+  "ttfb", "cgi_spawn", "cgi_run", "plugin", "head_gen", "write"
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+#ifdef LISO_PERF_COUNTERS
+extern FILE* logfile;
+
+static const char* hw_names[METRIC_HW_EVENTS] = {
+  "cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+static const uint64_t hw_config[METRIC_HW_EVENTS] = {
+  PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static __thread int hw_fds[METRIC_HW_EVENTS];
+static __thread int hw_state;   /* 0 untried, 1 open, -1 unavailable */
+static int          hw_user;    /* Kernel time isn't counted */
+#endif
+
+static int             enabled;
+static __thread shard* mine;
+static shard*          shards;    /* Every thread's, newest first */
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Adds n to a counter only this thread writes; readers on other
+   threads see the old value or the new one, never half of each */
+static inline void bump(uint64_t* c, uint64_t n)
+{
+  __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+static inline uint64_t peek(const uint64_t* c)
+{
+  return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+/* This thread's shard, made on its first record */
+static shard* my_shard(void)
+{
+  if (mine != NULL)
+    return mine;
+
+  if ((mine = calloc(1, sizeof(shard))) == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&shards_lock);
+  mine->next = shards;
+  shards = mine;
+  pthread_mutex_unlock(&shards_lock);
+  return mine;
+}
+
+/* The bucket ns falls in: exact below SUB, then SUB per power of 2 */
+static int bucket_of(uint64_t ns)
+{
+  int e;
+
+  if (ns < SUB)
+    return ns;
+  if (ns >= (1ULL << MAX_BITS))
+    return BUCKETS - 1;
+
+  e = 63 - __builtin_clzll(ns);
+  return (e - SUB_BITS + 1) * SUB + (int)((ns >> (e - SUB_BITS)) - SUB);
+}
+
+/* One past the largest value bucket b holds */
+static uint64_t bucket_top(int b)
+{
+  int e = b / SUB + SUB_BITS - 1;
+
+  if (b < SUB)
+    return b + 1;
+  return (uint64_t)(b % SUB + SUB + 1) << (e - SUB_BITS);
+}
+
+/*******************************************************************/
+/* @brief Turns metrics on if LISO_METRICS_URI names a page for    */
+/* them. Off, recording costs a test and nothing is timed.         */
+/*******************************************************************/
+int metrics_init(void)
+{
+  if (config.metrics_uri == NULL || config.metrics_uri[0] != '/')
+    return 0;
+
+  enabled = 1;
+  return my_shard() == NULL ? -1 : 0;
+}
+
+int metrics_enabled(void)
+{
+  return enabled;
+}
+
+/* Monotonic nanoseconds, or 0 with metrics off: pass it back to
+   metrics_since() when the phase ends */
+uint64_t metrics_clock(void)
+{
+  return enabled ? mono_ns() : 0;
+}
+
+/* Records ns nanoseconds spent in phase */
+void metrics_time(int phase, uint64_t ns)
+{
+  shard* s;
+  hist* h;
+
+  if (!enabled || (s = my_shard()) == NULL)
+    return;
+
+  h = &s->phase[phase];
+  bump(&h->bucket[bucket_of(ns)], 1);
+  bump(&h->sum, ns);
+}
+
+/* Records the time since start (from metrics_clock()) in phase */
+void metrics_since(int phase, uint64_t start)
+{
+  if (start != 0)
+    metrics_time(phase, metrics_clock() - start);
+}
+
+#ifdef LISO_PERF_COUNTERS
+/* Opens this thread's counter group, cycles leading; kernel time is
+   left out if exclude_kernel. -1 (with nothing open) if refused */
+static int hw_group(int exclude_kernel)
+{
+  struct perf_event_attr attr;
+  int k;
+
+  for (k = 0; k < METRIC_HW_EVENTS; k++)
+  {
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = hw_config[k];
+    attr.read_format    = PERF_FORMAT_GROUP;
+    attr.disabled       = k == 0;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv     = 1;
+
+    hw_fds[k] = syscall(SYS_perf_event_open, &attr, 0, -1,
+                        k == 0 ? -1 : hw_fds[0], PERF_FLAG_FD_CLOEXEC);
+    if (hw_fds[k] < 0)
+    {
+      while (k-- > 0)
+        close(hw_fds[k]);
+      return -1;
+    }
+  }
+
+  ioctl(hw_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return 0;
+}
+
+/* Whether this thread has its counters, opening them the first time.
+   Counting kernel time too needs perf_event_paranoid <= 1 */
+static int hw_ready(void)
+{
+  static int warned;
+  char log_buf[LOG_SIZE];
+
+  if (hw_state != 0)
+    return hw_state > 0;
+
+  if (hw_group(0) == 0)
+    hw_state = 1;
+  else if (hw_group(1) == 0)
+  {
+    hw_state = 1;
+    hw_user  = 1;
+  }
+  else
+  {
+    hw_state = -1;
+    if (!warned++)
+    {
+      snprintf(log_buf, sizeof(log_buf), "Hardware counters unavailable, "
+               "perf_event_open: %s", strerror(errno));
+      log_error(log_buf, logfile);
+    }
+  }
+  return hw_state > 0;
+}
+
+/* Reads this thread's counters into v */
+static int hw_read(uint64_t* v)
+{
+  uint64_t buf[1 + METRIC_HW_EVENTS];   // nr, then the values
+
+  if (read(hw_fds[0], buf, sizeof(buf)) != (ssize_t)sizeof(buf) ||
+      buf[0] != METRIC_HW_EVENTS)
+    return -1;
+  memcpy(v, buf + 1, sizeof(uint64_t) * METRIC_HW_EVENTS);
+  return 0;
+}
+
+/* Reads the counters as a phase starts; pass hw to metrics_hw_since()
+   when it ends */
+void metrics_hw_start(metrics_hw* hw)
+{
+  hw->ok = enabled && hw_ready() && hw_read(hw->v) == 0;
+}
+
+/* Adds what the counters went up by since metrics_hw_start() to phase */
+void metrics_hw_since(int phase, const metrics_hw* hw)
+{
+  uint64_t now[METRIC_HW_EVENTS];
+  shard* s;
+  int k;
+
+  if (!hw->ok || (s = my_shard()) == NULL || hw_read(now))
+    return;
+
+  for (k = 0; k < METRIC_HW_EVENTS; k++)
+    bump(&s->hw[phase][k], now[k] - hw->v[k]);
+  bump(&s->hw_count[phase], 1);
+}
+#endif
+
+void metrics_accepted(int https)
+{
+  if (enabled && my_shard() != NULL)
+    bump(&mine->accepted[https ? 1 : 0], 1);
+}
+
+void metrics_received(size_t bytes)
+{
+  if (enabled && my_shard() != NULL)
+    bump(&mine->bytes_in, bytes);
+}
+
+/*******************************************************************/
+/* @brief A response head was queued: counts its status code, and  */
+/* the time to it from start_us (access_clock(), when its request  */
+/* began to come in; 0 if that isn't known).                       */
+/*******************************************************************/
+void metrics_head(uint64_t start_us, const char* head)
+{
+  uint64_t now;
+  int code;
+
+  if (!enabled || my_shard() == NULL)
+    return;
+
+  if (!strncmp(head, "HTTP/1.", 7) && head[8] == ' ' &&
+      (code = atoi(head + 9)) >= 0 && code < METRIC_CODES)
+    bump(&mine->codes[code], 1);
+
+  if (start_us != 0 && (now = access_clock()) > start_us)
+    metrics_time(METRIC_TTFB, (now - start_us) * 1000);
+}
+
+/* Every shard's numbers summed into *sum */
+static void merge(shard* sum)
+{
+  uint64_t v;
+  shard* s;
+  int k, b;
+
+  memset(sum, 0, sizeof(*sum));
+  pthread_mutex_lock(&shards_lock);
+  for (s = shards; s != NULL; s = s->next)
+  {
+    for (k = 0; k < METRIC_PHASES; k++)
+    {
+      /* The count is the buckets', so +Inf agrees with them even if
+         the thread recorded more while they were read */
+      sum->phase[k].sum += peek(&s->phase[k].sum);
+      for (b = 0; b < BUCKETS; b++)
+      {
+        v = peek(&s->phase[k].bucket[b]);
+        sum->phase[k].bucket[b] += v;
+        sum->phase[k].count     += v;
+      }
+    }
+    for (k = 0; k < 2; k++)
+      sum->accepted[k] += peek(&s->accepted[k]);
+    sum->bytes_in += peek(&s->bytes_in);
+    for (k = 0; k < METRIC_CODES; k++)
+      sum->codes[k] += peek(&s->codes[k]);
+#ifdef LISO_PERF_COUNTERS
+    for (k = 0; k < METRIC_PHASES; k++)
+    {
+      for (b = 0; b < METRIC_HW_EVENTS; b++)
+        sum->hw[k][b] += peek(&s->hw[k][b]);
+      sum->hw_count[k] += peek(&s->hw_count[k]);
+    }
+#endif
+  }
+  pthread_mutex_unlock(&shards_lock);
+}
+
+/* The value below which fraction q of h's samples fall, in ns */
+static uint64_t quantile(const hist* h, double q)
+{
+  uint64_t seen = 0, rank;
+  int b;
+
+  if (h->count == 0)
+    return 0;
+
+  rank = (uint64_t)(q * h->count);
+  if (rank >= h->count)
+    rank = h->count - 1;
+  for (b = 0; b < BUCKETS; b++)
+    if ((seen += h->bucket[b]) > rank)
+      break;
+  return bucket_top(b < BUCKETS ? b : BUCKETS - 1);
+}
+
+/* Writes the Prometheus text for *m */
+static void exposition(FILE* f, const shard* m)
+{
+  const hist* h;
+  uint64_t below;
+  int k, b, e;
+
+  fprintf(f, "# HELP lisod_accepted_connections_total Connections "
+          "accepted.\n# TYPE lisod_accepted_connections_total counter\n"
+          "lisod_accepted_connections_total{scheme=\"http\"} %llu\n"
+          "lisod_accepted_connections_total{scheme=\"https\"} %llu\n",
+          (unsigned long long)m->accepted[0],
+          (unsigned long long)m->accepted[1]);
+
+  fprintf(f, "# HELP lisod_received_bytes_total Bytes read from clients."
+          "\n# TYPE lisod_received_bytes_total counter\n"
+          "lisod_received_bytes_total %llu\n",
+          (unsigned long long)m->bytes_in);
+  fprintf(f, "# HELP lisod_sent_bytes_total Bytes written to clients.\n"
+          "# TYPE lisod_sent_bytes_total counter\n"
+          "lisod_sent_bytes_total %lu\n", outq_stats.bytes);
+
+  fprintf(f, "# HELP lisod_responses_total Response heads queued, by "
+          "status code.\n# TYPE lisod_responses_total counter\n");
+  for (k = 0; k < METRIC_CODES; k++)
+    if (m->codes[k] != 0)
+      fprintf(f, "lisod_responses_total{code=\"%d\"} %llu\n", k,
+              (unsigned long long)m->codes[k]);
+
+  fprintf(f, "# HELP lisod_phase_seconds Time spent in each phase of "
+          "handling a request.\n# TYPE lisod_phase_seconds histogram\n");
+  for (k = 0; k < METRIC_PHASES; k++)
+  {
+    h = &m->phase[k];
+    for (below = 0, b = 0, e = LE_FIRST; e <= LE_LAST; e++)
+    {
+      /* Buckets wholly under 2^e */
+      for (; b < BUCKETS && bucket_top(b) <= (1ULL << e); b++)
+        below += h->bucket[b];
+      fprintf(f, "lisod_phase_seconds_bucket{phase=\"%s\",le=\"%.9g\"} "
+              "%llu\n", phase_names[k], (double)(1ULL << e) / 1e9,
+              (unsigned long long)below);
+    }
+    fprintf(f, "lisod_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} "
+            "%llu\n", phase_names[k], (unsigned long long)h->count);
+    fprintf(f, "lisod_phase_seconds_sum{phase=\"%s\"} %.9f\n",
+            phase_names[k], (double)h->sum / 1e9);
+    fprintf(f, "lisod_phase_seconds_count{phase=\"%s\"} %llu\n",
+            phase_names[k], (unsigned long long)h->count);
+  }
+
+  fprintf(f, "# HELP lisod_phase_quantile_seconds Quantiles of "
+          "lisod_phase_seconds, from the full resolution histogram.\n"
+          "# TYPE lisod_phase_quantile_seconds gauge\n");
+  for (k = 0; k < METRIC_PHASES; k++)
+    for (b = 0; b < (int)(sizeof(quantiles) / sizeof(quantiles[0])); b++)
+      fprintf(f, "lisod_phase_quantile_seconds{phase=\"%s\","
+              "quantile=\"%g\"} %.9g\n", phase_names[k], quantiles[b],
+              (double)quantile(&m->phase[k], quantiles[b]) / 1e9);
+
+#ifdef LISO_PERF_COUNTERS
+  fprintf(f, "# HELP lisod_phase_hw_events_total Hardware events counted "
+          "in each phase%s.\n# TYPE lisod_phase_hw_events_total counter\n",
+          hw_user ? ", user space only" : "");
+  for (k = 0; k < METRIC_PHASES; k++)
+    for (b = 0; m->hw_count[k] > 0 && b < METRIC_HW_EVENTS; b++)
+      fprintf(f, "lisod_phase_hw_events_total{phase=\"%s\",event=\"%s\"} "
+              "%llu\n", phase_names[k], hw_names[b],
+              (unsigned long long)m->hw[k][b]);
+  fprintf(f, "# HELP lisod_phase_hw_counted_total Phases the hardware "
+          "events were counted over.\n"
+          "# TYPE lisod_phase_hw_counted_total counter\n");
+  for (k = 0; k < METRIC_PHASES; k++)
+    if (m->hw_count[k] > 0)
+      fprintf(f, "lisod_phase_hw_counted_total{phase=\"%s\"} %llu\n",
+              phase_names[k], (unsigned long long)m->hw_count[k]);
+#endif
+}
+
+/* The metrics page: every thread's shards, summed (serve_page()) */
+static int write_page(FILE* f)
+{
+  shard* sum;
+
+  if ((sum = malloc(sizeof(shard))) == NULL)
+    return -1;
+  merge(sum);
+  exposition(f, sum);
+  free(sum);
+  return 0;
+}
+
+/*******************************************************************/
+/* @brief Answers a GET or HEAD for LISO_METRICS_URI from a client */
+/* on the loopback address; the page goes in state as for a static */
+/* file. Anything else is left to the file system.                 */
+/*                                                                 */
+/* @retval -1  not the metrics page                                */
+/* @retval  0  answered                                            */
+/* @retval 500 out of memory                                       */
+/*******************************************************************/
+int metrics_serve(fsm* state)
+{
+  if (!enabled)
+    return -1;
+
+  return serve_page(state, config.metrics_uri,
+                    "text/plain; version=0.0.4", write_page);
+}
+
+/* The SIGUSR1 dump: how many of each phase, and their p50 and p99 */
+void metrics_print(FILE* file)
+{
+  shard* sum;
+  int k;
+
+  if (!enabled || (sum = malloc(sizeof(shard))) == NULL)
+    return;
+
+  merge(sum);
+  fprintf(file, "Metrics:");
+  for (k = 0; k < METRIC_PHASES; k++)
+    if (sum->phase[k].count > 0)
+      fprintf(file, " %s %llu (p50 %.1fus p99 %.1fus)", phase_names[k],
+              (unsigned long long)sum->phase[k].count,
+              quantile(&sum->phase[k], 0.5) / 1e3,
+              quantile(&sum->phase[k], 0.99) / 1e3);
+#ifdef LISO_PERF_COUNTERS
+  /* Per call: instructions per cycle, and the misses */
+  for (k = 0; k < METRIC_PHASES; k++)
+    if (sum->hw_count[k] > 0 && sum->hw[k][METRIC_HW_CYCLES] > 0)
+      fprintf(file, " %s ipc %.2f (%.0f cycles, %.1f cache misses, "
+              "%.1f branch misses)", phase_names[k],
+              (double)sum->hw[k][METRIC_HW_INSNS] /
+              sum->hw[k][METRIC_HW_CYCLES],
+              (double)sum->hw[k][METRIC_HW_CYCLES] / sum->hw_count[k],
+              (double)sum->hw[k][METRIC_HW_CACHE_MISSES] / sum->hw_count[k],
+              (double)sum->hw[k][METRIC_HW_BRANCH_MISSES] / sum->hw_count[k]);
+#endif
+  fprintf(file, "\n");
+  fflush(file);
+  free(sum);
+}
@@ -0,0 +1,69 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Timed phases, each with a histogram of its own (metrics.c) */
+enum {
+  METRIC_TLS,          // SSL_accept()
+  METRIC_PARSE_LINE,   // parse_line() calls
+  METRIC_PARSE_HDRS,   // parse_headers() calls
+  METRIC_BODY,         // relay_body() calls
+  METRIC_SERVICE,      // service() calls
+  METRIC_TTFB,         // First byte of a request -> its response head queued
+  METRIC_CGI_SPAWN,    // Starting a script
+  METRIC_CGI_RUN,      // A script started -> it exited (or was killed)
+  METRIC_PLUGIN,       // A plugin handler's run, on whichever thread
+  METRIC_HEAD_GEN,     // Writing a static response's head, in service()
+  METRIC_WRITE,        // flush_client(): Send()/SSL_write() of the output
+  METRIC_PHASES
+};
+
+/* Hardware counters read around a phase (make PERF_COUNTERS=1): the
+   calling thread's cycles, instructions, cache misses and branch
+   misses, summed per phase. Without the flag these cost nothing */
+enum {
+  METRIC_HW_CYCLES,
+  METRIC_HW_INSNS,
+  METRIC_HW_CACHE_MISSES,
+  METRIC_HW_BRANCH_MISSES,
+  METRIC_HW_EVENTS
+};
+
+#ifdef LISO_PERF_COUNTERS
+typedef struct metrics_hw {
+  uint64_t v[METRIC_HW_EVENTS];
+  int      ok;                  // The counters could be read
+} metrics_hw;
+
+void     metrics_hw_start(metrics_hw* hw);
+void     metrics_hw_since(int phase, const metrics_hw* hw);
+#else
+typedef struct metrics_hw {
+  int      ok;
+} metrics_hw;
+
+static inline void metrics_hw_start(metrics_hw* hw) { hw->ok = 0; }
+static inline void metrics_hw_since(int phase, const metrics_hw* hw)
+{
+  (void)phase; (void)hw;
+}
+#endif
+
+#define METRIC_CODES 600   /* Status codes counted, 0-599 */
+
+struct state;
+
+int      metrics_init(void);
+int      metrics_enabled(void);
+uint64_t metrics_clock(void);
+void     metrics_since(int phase, uint64_t start);
+void     metrics_time(int phase, uint64_t ns);
+void     metrics_accepted(int https);
+void     metrics_received(size_t bytes);
+void     metrics_head(uint64_t start_us, const char* head);
+int      metrics_serve(struct state* state);
+void     metrics_print(FILE* file);
+
+#endif
@@ -0,0 +1,431 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file outq.c                                                    */
+/*                                                                 */
+/* @brief Per-connection output queue. Responses are queued as     */
+/* segments while requests are serviced and written out together   */
+/* once per readiness event: consecutive buffers go out in one     */
+/* sendmsg(), file bodies go through sendfile() and CGI output is  */
+/* splice()d straight from its pipe, with MSG_MORE and TCP_CORK    */
+/* keeping headers and bodies in full segments.                    */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#define _GNU_SOURCE   /* splice() */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "outq.h"
+#include "alloc.h"
+
+#define SSL_CHUNK (16*1024)  /* One TLS record's worth of plaintext */
+
+outq_counters outq_stats;
+
+void outq_init(outq* q, size_t* acct)
+{
+  memset(q, 0, sizeof(outq));
+  q->acct = acct;
+}
+
+static outseg* tail(outq* q)
+{
+  return &q->seg[(q->head + q->count) % OUTQ_MAX];
+}
+
+/*********************************************************/
+/* @brief Queues a buffer allocated with liso_malloc.    */
+/* The queue frees it once it has been sent.             */
+/*                                                       */
+/* @retval  0 queued                                     */
+/* @retval -1 queue full; the caller still owns data     */
+/*********************************************************/
+int outq_push(outq* q, char* data, size_t len)
+{
+  outseg* s;
+
+  if (len == 0)
+  {
+    liso_free(data);
+    return 0;
+  }
+
+  if (q->count == OUTQ_MAX)
+    return -1;
+
+  s = tail(q);
+  s->data    = data;
+  s->file_fd = -1;
+  s->is_pipe = 0;
+  s->off     = 0;
+  s->end     = len;
+
+  q->count++;
+  q->bytes  += len;
+  q->queued += len;
+  return 0;
+}
+
+/* Queues a copy of len bytes of data. Same return values as outq_push */
+int outq_copy(outq* q, char* data, size_t len)
+{
+  char* copy;
+
+  if (len == 0)
+    return 0;
+
+  if (q->count == OUTQ_MAX ||
+      (copy = liso_malloc_acct(len, MEM_BODY, q->acct)) == NULL)
+    return -1;
+
+  memcpy(copy, data, len);
+  return outq_push(q, copy, len);
+}
+
+/*********************************************************/
+/* @brief Queues the first len bytes of an open file.    */
+/* The queue closes file_fd once it has been sent.       */
+/*                                                       */
+/* @retval  0 queued                                     */
+/* @retval -1 queue full; the caller still owns file_fd  */
+/*********************************************************/
+int outq_file(outq* q, int file_fd, size_t len)
+{
+  outseg* s;
+
+  if (q->count == OUTQ_MAX)
+    return -1;
+
+  s = tail(q);
+  s->data    = NULL;
+  s->file_fd = file_fd;
+  s->is_pipe = 0;
+  s->off     = 0;
+  s->end     = len;
+
+  q->count++;
+  q->bytes  += len;
+  q->queued += len;
+  return 0;
+}
+
+/*********************************************************/
+/* @brief Queues len bytes that are waiting in a pipe,   */
+/* to be spliced to the socket without being copied      */
+/* through user space. HTTP sockets only; the pipe must  */
+/* not be read from until they have been sent, and stays */
+/* open.                                                 */
+/*                                                       */
+/* @retval  0 queued                                     */
+/* @retval -1 queue full                                 */
+/*********************************************************/
+int outq_pipe(outq* q, int pipe_fd, size_t len)
+{
+  if (outq_file(q, pipe_fd, len))
+    return -1;
+
+  q->seg[(q->head + q->count - 1) % OUTQ_MAX].is_pipe = 1;
+  return 0;
+}
+
+/*********************************************************/
+/* @brief Moves segments from the front of src to the    */
+/* back of dst, as many as dst has room for.             */
+/*                                                       */
+/* @retval  0 src is empty                               */
+/* @retval -1 dst filled up first                        */
+/*********************************************************/
+int outq_move(outq* dst, outq* src)
+{
+  outseg* s;
+
+  while (src->count > 0)
+  {
+    if (dst->count == OUTQ_MAX)
+      return -1;
+
+    s = &src->seg[src->head];
+    *tail(dst) = *s;
+    dst->count++;
+    dst->bytes += s->end - s->off;
+    src->bytes -= s->end - s->off;
+
+    src->head = (src->head + 1) % OUTQ_MAX;
+    src->count--;
+  }
+
+  return 0;
+}
+
+/* Drops the oldest segment, releasing what it owns */
+static void pop(outq* q)
+{
+  outseg* s = &q->seg[q->head];
+
+  if (s->data != NULL)
+    liso_free(s->data);
+  if (s->file_fd >= 0 && !s->is_pipe)
+    close(s->file_fd);
+
+  s->data    = NULL;
+  s->file_fd = -1;
+  s->is_pipe = 0;
+
+  q->head = (q->head + 1) % OUTQ_MAX;
+  q->count--;
+}
+
+/* Marks n bytes as sent, popping every segment that is now done */
+static void consume(outq* q, size_t n)
+{
+  q->bytes -= n;
+  outq_stats.bytes += n;
+
+  while (q->count > 0)
+  {
+    outseg* s = &q->seg[q->head];
+    size_t left = s->end - s->off;
+
+    if (n < left)
+    {
+      s->off += n;
+      return;
+    }
+
+    n -= left;
+    pop(q);
+  }
+}
+
+static void cork(int fd, int on)
+{
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/* Writes as much of the queue as an HTTP socket will take */
+static int flush_plain(outq* q, int fd)
+{
+  struct iovec iov[OUTQ_MAX];
+  struct msghdr msg;
+  int k, n_iov, flags, corked = 0, rc = 0;
+  ssize_t n;
+
+  while (q->count > 0)
+  {
+    outseg* s = &q->seg[q->head];
+
+    if (s->file_fd >= 0)
+    {
+      /* A body followed by more output: hold partial frames back
+         until everything queued has been handed to the kernel */
+      if (!corked && q->count > 1)
+      {
+        cork(fd, 1);
+        corked = 1;
+      }
+
+      if (s->is_pipe)
+      {
+        n = splice(s->file_fd, NULL, fd, NULL, s->end - s->off,
+                   SPLICE_F_NONBLOCK | (q->count > 1 ? SPLICE_F_MORE : 0));
+        outq_stats.writes++;
+
+        if (n > 0)
+        {
+          consume(q, n);
+          continue;
+        }
+        if (n == 0)
+        {
+          n = -1;   // The bytes we were promised aren't there
+          errno = EPIPE;
+        }
+      }
+      else
+      {
+        n = sendfile(fd, s->file_fd, &s->off, s->end - s->off);
+        outq_stats.writes++;
+
+        if (n > 0)
+        {
+          /* sendfile() already advanced s->off */
+          s->off -= n;
+          consume(q, n);
+          continue;
+        }
+      }
+    }
+    else
+    {
+      /* Gather the run of buffers up to the next file segment */
+      for (k = 0, n_iov = 0; k < q->count; k++)
+      {
+        outseg* m = &q->seg[(q->head + k) % OUTQ_MAX];
+        if (m->file_fd >= 0)
+          break;
+        iov[n_iov].iov_base = m->data + m->off;
+        iov[n_iov].iov_len  = m->end - m->off;
+        n_iov++;
+      }
+
+      /* Headers right before a file body: let them share a segment */
+      flags = MSG_NOSIGNAL;
+      if (k < q->count)
+        flags |= MSG_MORE;
+
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov    = iov;
+      msg.msg_iovlen = n_iov;
+
+      n = sendmsg(fd, &msg, flags);
+      outq_stats.writes++;
+
+      if (n > 0)
+      {
+        consume(q, n);
+        continue;
+      }
+    }
+
+    if (n == -1 && errno == EINTR)
+      continue;
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      rc = 1;
+    else
+      rc = -1;
+    break;
+  }
+
+  if (corked)
+    cork(fd, 0);
+
+  return rc;
+}
+
+/* Writes the queue to an HTTPS socket, packing small buffers into
+   full TLS records */
+static int flush_ssl(outq* q, SSL* context)
+{
+  char* buf = liso_malloc(SSL_CHUNK);
+  size_t used;
+  ssize_t n;
+
+  if (buf == NULL)
+    return -1;
+
+  while (q->count > 0)
+  {
+    used = 0;
+
+    for (int k = 0; k < q->count && used < SSL_CHUNK; k++)
+    {
+      outseg* s = &q->seg[(q->head + k) % OUTQ_MAX];
+      off_t off = s->off;
+
+      while (off < s->end && used < SSL_CHUNK)
+      {
+        size_t want = s->end - off;
+        if (want > SSL_CHUNK - used)
+          want = SSL_CHUNK - used;
+
+        if (s->file_fd >= 0)
+        {
+          n = pread(s->file_fd, buf + used, want, off);
+          if (n <= 0)
+          {
+            liso_free(buf);
+            return -1;
+          }
+        }
+        else
+        {
+          memcpy(buf + used, s->data + off, want);
+          n = want;
+        }
+
+        used += n;
+        off  += n;
+      }
+    }
+
+    n = SSL_write(context, buf, used);
+    outq_stats.writes++;
+
+    if (n <= 0)
+    {
+      /* Nothing was consumed, so the retry hands SSL_write() the same
+         bytes again (SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER) */
+      switch (SSL_get_error(context, n))
+      {
+        case SSL_ERROR_WANT_WRITE:
+        case SSL_ERROR_WANT_READ:
+          liso_free(buf);
+          return 1;
+      }
+      liso_free(buf);
+      return -1;
+    }
+
+    consume(q, n);
+  }
+
+  liso_free(buf);
+  return 0;
+}
+
+/*****************************************************************/
+/* @brief Writes queued output to a client.                      */
+/*                                                               */
+/* @param q        The connection's output queue                 */
+/* @param fd       The client socket                             */
+/* @param context  SSL context, or NULL for HTTP                 */
+/*                                                               */
+/* @retval  0  everything was written                            */
+/* @retval  1  the socket is full; call again when writable      */
+/* @retval -1  the client is gone                                */
+/*****************************************************************/
+int outq_flush(outq* q, int fd, SSL* context)
+{
+  if (q->count == 0)
+    return 0;
+
+  outq_stats.flushes++;
+
+  if (context == NULL)
+    return flush_plain(q, fd);
+
+  return flush_ssl(q, context);
+}
+
+/* Drops everything still queued */
+void outq_clear(outq* q)
+{
+  while (q->count > 0)
+    pop(q);
+  q->bytes = 0;
+}
+
+void outq_print(FILE* file)
+{
+  outq_counters* c = &outq_stats;
+
+  fprintf(file, "Output: %lu responses, %lu flushes, %lu writes, %lu bytes",
+          c->responses, c->flushes, c->writes, c->bytes);
+  if (c->responses > 0)
+    fprintf(file, " (%.2f writes/response)",
+            (double)c->writes / c->responses);
+  fprintf(file, "\n");
+  fflush(file);
+}
@@ -0,0 +1,49 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+#define OUTQ_MAX 64   /* Segments a connection can have queued */
+
+/* One piece of queued output: a buffer owned by the queue, a range
+   of an open file that the queue closes when done, or bytes waiting
+   in a pipe (which the queue does not close). */
+typedef struct outseg {
+  char*  data;     // Memory to send, or NULL for a file segment
+  int    file_fd;  // File (or pipe) to send from, -1 for memory
+  int    is_pipe;  // file_fd is a pipe: splice() from it, don't close it
+  off_t  off;      // Offset of the next byte to send
+  off_t  end;      // Offset one past the last byte to send
+} outseg;
+
+typedef struct outq {
+  outseg  seg[OUTQ_MAX];
+  int     head;     // Index of the oldest segment
+  int     count;    // Number of segments queued
+  size_t  bytes;    // Bytes left to send
+  size_t  queued;   // Bytes ever queued here, not counting moved in
+  size_t* acct;     // Connection counter that copies are charged to
+} outq;
+
+typedef struct outq_counters {
+  unsigned long responses;  // Responses queued
+  unsigned long flushes;    // outq_flush() calls with data queued
+  unsigned long writes;     // sendmsg/sendfile/splice/SSL_write syscalls
+  unsigned long bytes;      // Bytes written
+} outq_counters;
+
+extern outq_counters outq_stats;
+
+void outq_init (outq* q, size_t* acct);
+int  outq_push (outq* q, char* data, size_t len);
+int  outq_copy (outq* q, char* data, size_t len);
+int  outq_file (outq* q, int file_fd, size_t len);
+int  outq_pipe (outq* q, int pipe_fd, size_t len);
+int  outq_move (outq* dst, outq* src);
+int  outq_flush(outq* q, int fd, SSL* context);
+void outq_clear(outq* q);
+void outq_print(FILE* file);
+
+#endif
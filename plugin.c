@@ -0,0 +1,913 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file plugin.c                                                  */
+/*                                                                 */
+/* @brief In-process request handlers (liso_plugin.h). Shared      */
+/* objects named in LISO_PLUGINS are loaded at startup, each on a  */
+/* URI prefix, and answer the requests under it from service()     */
+/* without a process or a socket in between. A GET or HEAD is      */
+/* answered there and then, like a static file. A POST's body is   */
+/* collected first (relay_body() hands it over, up to              */
+/* LISO_PLUGIN_BODY bytes), and the answer is queued in its turn   */
+/* once the handler has run. Handlers marked LISO_PLUGIN_BLOCKING  */
+/* run on a pool of LISO_PLUGIN_THREADS worker threads instead of  */
+/* the event loop; a finished one is picked up through an eventfd  */
+/* in the select set.                                              */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "plugin.h"
+#include "liso_plugin.h"
+#include "engine.h"
+#include "alloc.h"
+#include "config.h"
+#include "metrics.h"
+
+#define PLUGIN_MAX        16     /* Prefixes handlers can be registered on */
+#define PLUGIN_QUEUE_MAX  1024   /* Requests waiting for a worker thread   */
+#define PLUGIN_HDRS       4096   /* Bytes of headers a handler may add     */
+
+/* A handler registered on a prefix */
+typedef struct handler {
+  char*              prefix;
+  size_t             prefix_len;
+  const liso_plugin* plugin;
+  void*              data;     // From its init()
+} handler;
+
+/* Behind liso_request.host: the header block and the body */
+typedef struct req_data {
+  const char* headers;   // Header lines, CRLF separated, NUL terminated
+  const char* body;
+  size_t      body_len;
+  size_t      body_off;  // Read up to here
+} req_data;
+
+/* Behind liso_response.host: what the handler wrote */
+typedef struct reply {
+  int     status;
+  char    hdrs[PLUGIN_HDRS];
+  size_t  hdrs_len;
+  char*   body;
+  size_t  len;
+  size_t  cap;
+  size_t* acct;      // Charged to the connection on the event loop
+  int     oom;
+} reply;
+
+/* A request answered later: its body is still coming, or it runs on
+   a worker thread */
+typedef struct plugin_job {
+  handler*  h;
+  int       slot;      // The client
+  int       fd;        // Its fd, to tell it is the same client still
+  unsigned  seq;       // The response it answers
+  unsigned long id;    // The connection's, for the trace
+  int       traced;    // The response is traced (trace.c)
+  int       conn;      // Keep-alive after it
+  int       head_only; // HEAD: no body goes out
+  int       https;
+  char*     strings;   // method, uri, path, query, address, headers
+  char*     method; char* uri; char* path; char* query; char* addr;
+  char*     headers;
+  char*     body;
+  size_t    body_len;
+  size_t    body_cap;
+  int       error;     // Answer with this instead: 413, 500
+  reply     out;
+  struct plugin_job* next;
+} plugin_job;
+
+plugin_counters plugin_stats;
+
+static pool*       ppool;
+static handler     handlers[PLUGIN_MAX];   /* Longest prefix first */
+static int         nhandlers;
+static plugin_job* receiving;   /* Jobs whose body is still coming */
+static plugin_job* answered_head;   /* Run here, answered by plugin_reap() */
+static plugin_job* answered_tail;
+
+/* Worker threads: todo is theirs to take, done is ours to answer */
+static pthread_mutex_t lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ready = PTHREAD_COND_INITIALIZER;
+static plugin_job*     todo_head;
+static plugin_job*     todo_tail;
+static int             ntodo;
+static plugin_job*     done;
+static int             nworkers;
+static int             evfd = -1;   /* Written when something is done */
+
+/* Reason phrases for the status codes handlers are likely to use */
+static const char* reason(int code)
+{
+  switch (code)
+  {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 413: return "Payload Too Large";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+  }
+  return code < 300 ? "OK" : code < 400 ? "Redirect" :
+         code < 500 ? "Client Error" : "Server Error";
+}
+
+/*********************** The request view ***********************/
+
+static const char* get_header(liso_request* req, const char* name,
+                              size_t* len)
+{
+  req_data* rd = req->host;
+  const char* line = rd->headers;
+  const char* eol; const char* val;
+  size_t n = strlen(name);
+
+  for (; (eol = strstr(line, "\r\n")) != NULL && eol > line; line = eol + 2)
+  {
+    if ((size_t)(eol - line) <= n || line[n] != ':' ||
+        strncasecmp(line, name, n))
+      continue;
+
+    for (val = line + n + 1; val < eol && (*val == ' ' || *val == '\t');
+         val++)
+      ;
+    *len = eol - val;
+    return val;
+  }
+
+  return NULL;
+}
+
+static size_t read_body(liso_request* req, void* buf, size_t len)
+{
+  req_data* rd = req->host;
+  size_t n = rd->body_len - rd->body_off;
+
+  if (n > len)
+    n = len;
+  memcpy(buf, rd->body + rd->body_off, n);
+  rd->body_off += n;
+  return n;
+}
+
+/*********************** The response writer ***********************/
+
+static void set_status(liso_response* resp, int code)
+{
+  reply* r = resp->host;
+
+  if (code >= 100 && code <= 999)
+    r->status = code;
+}
+
+static int add_header(liso_response* resp, const char* name,
+                      const char* value)
+{
+  reply* r = resp->host;
+  size_t n = strlen(name), v = strlen(value);
+
+  /* No header splitting, and the framing is ours */
+  if (strpbrk(name, "\r\n:") != NULL || strpbrk(value, "\r\n") != NULL ||
+      (n == 14 && !strncasecmp(name, "Content-Length", 14)) ||
+      (n == 17 && !strncasecmp(name, "Transfer-Encoding", 17)) ||
+      (n == 10 && !strncasecmp(name, "Connection", 10)))
+    return -1;
+
+  if (r->hdrs_len + n + v + 4 > sizeof(r->hdrs))
+    return -1;
+
+  r->hdrs_len += sprintf(r->hdrs + r->hdrs_len, "%s: %s\r\n", name, value);
+  return 0;
+}
+
+static int write_body(liso_response* resp, const void* data, size_t len)
+{
+  reply* r = resp->host;
+  size_t cap;
+  char* buf;
+
+  if (r->len + len > r->cap)
+  {
+    cap = r->cap ? r->cap * 2 : 4096;
+    while (cap < r->len + len)
+      cap *= 2;
+    if ((buf = liso_malloc_acct(cap, MEM_BODY, r->acct)) == NULL)
+    {
+      r->oom = 1;
+      return -1;
+    }
+    memcpy(buf, r->body, r->len);
+    liso_free(r->body);
+    r->body = buf;
+    r->cap  = cap;
+  }
+
+  memcpy(r->body + r->len, data, len);
+  r->len += len;
+  return 0;
+}
+
+/* Runs h on a request, its answer going to out */
+static int call(handler* h, liso_request* req, req_data* rd, reply* out)
+{
+  uint64_t started = metrics_clock();
+  liso_response resp;
+  int rc;
+
+  req->prefix = h->prefix;
+  req->header = get_header;
+  req->read   = read_body;
+  req->host   = rd;
+
+  out->status   = 200;
+  out->hdrs_len = 0;
+  out->body     = NULL;
+  out->len      = 0;
+  out->cap      = 0;
+  out->oom      = 0;
+
+  resp.status = set_status;
+  resp.header = add_header;
+  resp.write  = write_body;
+  resp.host   = out;
+
+  rc = h->plugin->handle(h->data, req, &resp);
+  metrics_since(METRIC_PLUGIN, started);   // On the thread it ran on
+  return rc != 0 || out->oom ? -1 : 0;
+}
+
+/* The HTTP head for what a handler wrote. Returns its length, or -1
+   if it doesn't fit in cap bytes */
+static int build_head(reply* r, int conn, char* head, size_t cap)
+{
+  char date[64];
+  time_t t = time(NULL);
+  int n;
+
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %Z", gmtime(&t));
+  n = snprintf(head, cap, "HTTP/1.1 %d %s\r\nDate: %s\r\n"
+               "Server: Liso/1.0\r\nConnection: %s\r\n%.*s"
+               "Content-Length: %zu\r\n\r\n", r->status, reason(r->status),
+               date, conn ? "keep-alive" : "close", (int)r->hdrs_len,
+               r->hdrs, r->len);
+
+  return n < 0 || (size_t)n >= cap ? -1 : n;
+}
+
+/* Splits uri (a copy) into the path past h's prefix and the query */
+static void split_uri(handler* h, char* uri, char** path, char** query)
+{
+  char* q = strchr(uri, '?');
+
+  *query = "";
+  if (q != NULL)
+  {
+    *q = '\0';
+    *query = q + 1;
+  }
+  *path = uri + (strlen(uri) < h->prefix_len ? strlen(uri) : h->prefix_len);
+}
+
+/* The handler whose prefix uri is under, if any */
+static handler* route(const char* uri)
+{
+  handler* h;
+  char c;
+  int k;
+
+  for (k = 0; k < nhandlers; k++)
+  {
+    h = &handlers[k];
+    if (strncmp(uri, h->prefix, h->prefix_len))
+      continue;
+    c = uri[h->prefix_len];
+    if (h->prefix[h->prefix_len - 1] == '/' || c == '\0' || c == '/' ||
+        c == '?')
+      return h;
+  }
+
+  return NULL;
+}
+
+/*********************** Worker threads ***********************/
+
+static void run_job(plugin_job* job)
+{
+  liso_request req;
+  req_data rd;
+  uint64_t started;
+
+  memset(&req, 0, sizeof(req));
+  req.method         = job->method;
+  req.uri            = job->uri;
+  req.path           = job->path;
+  req.query          = job->query;
+  req.remote_addr    = job->addr;
+  req.https          = job->https;
+  req.content_length = job->body_len;
+
+  rd.headers  = job->headers;
+  rd.body     = job->body;
+  rd.body_len = job->body_len;
+  rd.body_off = 0;
+
+  job->out.acct = NULL;   // Not the event loop's to account
+  started = trace_clock();
+  if (call(job->h, &req, &rd, &job->out))
+    job->error = 500;
+  if (job->traced)
+    trace_emit(TRACE_PLUGIN, job->id, job->seq, started, job->error);
+}
+
+static void* worker(void* arg)
+{
+  plugin_job* job;
+  uint64_t one = 1;
+
+  (void)arg;
+  for (;;)
+  {
+    pthread_mutex_lock(&lock);
+    while (todo_head == NULL)
+      pthread_cond_wait(&ready, &lock);
+    job = todo_head;
+    if ((todo_head = job->next) == NULL)
+      todo_tail = NULL;
+    ntodo--;
+    pthread_mutex_unlock(&lock);
+
+    run_job(job);
+
+    pthread_mutex_lock(&lock);
+    job->next = done;
+    done = job;
+    pthread_mutex_unlock(&lock);
+
+    /* Can only fail with the counter full: it is signalled already */
+    if (write(evfd, &one, sizeof(one)) < 0)
+      continue;
+  }
+
+  return NULL;
+}
+
+/* Starts the worker threads, with every signal blocked: signals are
+   the event loop's */
+static int start_workers(int n)
+{
+  sigset_t all, old;
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  if ((evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    return -1;
+  FD_SET(evfd, &ppool->masterfds);
+  if (evfd > ppool->maxfd)
+    ppool->maxfd = evfd;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (nworkers = 0; nworkers < n; nworkers++)
+    if (pthread_create(&tid, &attr, worker, NULL) != 0)
+      break;
+
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return nworkers > 0 ? 0 : -1;
+}
+
+/*********************** Loading ***********************/
+
+/* Loads the handler at path onto prefix (prefix_len bytes) */
+static int load(char* prefix, size_t prefix_len, char* path)
+{
+  const liso_plugin* plugin;
+  handler* h;
+  void* so;
+  int k;
+
+  if (nhandlers == PLUGIN_MAX || prefix_len == 0 || prefix[0] != '/')
+  {
+    fprintf(stderr, "Bad plugin prefix: %.*s\n", (int)prefix_len, prefix);
+    return -1;
+  }
+
+  if ((so = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL ||
+      (plugin = dlsym(so, LISO_PLUGIN_SYMBOL)) == NULL)
+  {
+    fprintf(stderr, "Unable to load plugin %s: %s\n", path, dlerror());
+    return -1;
+  }
+
+  if (plugin->abi != LISO_PLUGIN_ABI || plugin->handle == NULL)
+  {
+    fprintf(stderr, "Plugin %s is for another ABI version\n", path);
+    return -1;
+  }
+
+  /* Keep them longest prefix first, so route() finds the closest */
+  for (k = nhandlers; k > 0 && handlers[k - 1].prefix_len < prefix_len; k--)
+    handlers[k] = handlers[k - 1];
+  h = &handlers[k];
+  nhandlers++;
+
+  h->prefix     = liso_strndup(prefix, prefix_len);
+  h->prefix_len = prefix_len;
+  h->plugin     = plugin;
+  h->data       = NULL;
+
+  if (h->prefix == NULL ||
+      (plugin->init != NULL && plugin->init(h->prefix, &h->data) != 0))
+  {
+    fprintf(stderr, "Plugin %s refused prefix %s\n", path, h->prefix);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*******************************************************************/
+/* @brief Loads the handlers in LISO_PLUGINS, a comma separated    */
+/* list of prefix=path.so, and starts the worker threads if any of */
+/* them blocks.                                                    */
+/*                                                                 */
+/* @retval 0 on success (or nothing to load), -1 on failure        */
+/*******************************************************************/
+int plugin_init(pool* p)
+{
+  char* spec = config.plugins;
+  char path[BUF_SIZE];
+  size_t len;
+  char* eq;
+  int k, blocking = 0;
+
+  ppool = p;
+
+  while (spec != NULL && *spec != '\0')
+  {
+    spec += strspn(spec, ", ");
+    if ((len = strcspn(spec, ",")) == 0)
+      break;
+
+    if ((eq = memchr(spec, '=', len)) == NULL ||
+        (size_t)(spec + len - eq - 1) >= sizeof(path))
+    {
+      fprintf(stderr, "LISO_PLUGINS wants prefix=path.so: %.*s\n",
+              (int)len, spec);
+      return -1;
+    }
+    snprintf(path, sizeof(path), "%.*s", (int)(spec + len - eq - 1), eq + 1);
+
+    if (load(spec, eq - spec, path))
+      return -1;
+    spec += len;
+  }
+
+  for (k = 0; k < nhandlers; k++)
+    if (handlers[k].plugin->flags & LISO_PLUGIN_BLOCKING)
+      blocking = 1;
+
+  if (blocking && config.plugin_threads > 0 &&
+      start_workers(config.plugin_threads))
+  {
+    fprintf(stderr, "Unable to start plugin worker threads.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int plugin_enabled(void)
+{
+  return nhandlers > 0;
+}
+
+/* 1 if a handler answers state's request */
+int plugin_routed(fsm* state)
+{
+  return nhandlers > 0 && route(state->uri) != NULL;
+}
+
+/*********************** Answering ***********************/
+
+/******************************************************************/
+/* @brief Runs a handler on the event loop for a request without  */
+/* a body; the answer goes in state as for a static file.         */
+/******************************************************************/
+static int answer_now(fsm* state, handler* h)
+{
+  char uri[BUF_SIZE];
+  liso_request req;
+  req_data rd;
+  reply out;
+  int n;
+
+  memset(&req, 0, sizeof(req));
+  snprintf(uri, sizeof(uri), "%s", state->uri);
+  split_uri(h, uri, (char**)&req.path, (char**)&req.query);
+  req.method      = state->method;
+  req.uri         = state->uri;
+  req.remote_addr = state->cold->cli_ip;
+  req.https       = state->context != NULL;
+
+  rd.headers  = state->header;
+  rd.body     = NULL;
+  rd.body_len = 0;
+  rd.body_off = 0;
+
+  out.acct = &state->mem;
+  plugin_stats.inline_calls++;
+  if (call(h, &req, &rd, &out) ||
+      (n = build_head(&out, state->conn, state->response, BUF_SIZE)) < 0)
+  {
+    plugin_stats.failed++;
+    liso_free(out.body);
+    return 500;
+  }
+
+  state->resp_idx  = n;
+  state->body      = NULL;
+  state->body_size = 0;
+  if (out.len > 0 && strncmp(state->method, "HEAD", 4))
+  {
+    state->body      = out.body;
+    state->body_size = out.len;
+    addtofree(state->cold->freebuf, out.body, FREE_SIZE);
+  }
+  else
+    liso_free(out.body);
+
+  return 0;
+}
+
+/* Copies what a job needs of state's request, which is gone by the
+   time it runs */
+static plugin_job* new_job(fsm* state, handler* h)
+{
+  size_t lm = strlen(state->method) + 1, lu = strlen(state->uri) + 1;
+  size_t la = strlen(state->cold->cli_ip) + 1;
+  size_t lh = strlen(state->header) + 1;
+  plugin_job* job;
+  char* s;
+
+  if ((job = liso_malloc_acct(sizeof(plugin_job), MEM_CGI, NULL)) == NULL)
+    return NULL;
+  memset(job, 0, sizeof(plugin_job));
+
+  /* The uri twice: as is, and split into path and query */
+  if ((s = liso_malloc_acct(lm + 2 * lu + la + lh, MEM_CGI, NULL)) == NULL)
+  {
+    liso_free(job);
+    return NULL;
+  }
+  job->strings = s;
+  job->method  = memcpy(s, state->method, lm);              s += lm;
+  job->uri     = memcpy(s, state->uri, lu);                 s += lu;
+  split_uri(h, memcpy(s, state->uri, lu), &job->path, &job->query);
+  s += lu;
+  job->addr    = memcpy(s, state->cold->cli_ip, la);        s += la;
+  job->headers = memcpy(s, state->header, lh);
+
+  job->h         = h;
+  job->slot      = state - ppool->states;
+  job->fd        = state->fd;
+  job->conn      = state->conn;
+  job->head_only = !strncmp(state->method, "HEAD", 4);
+  job->https     = state->context != NULL;
+  return job;
+}
+
+static void free_job(plugin_job* job)
+{
+  liso_free(job->out.body);
+  liso_free(job->body);
+  liso_free(job->strings);
+  liso_free(job);
+}
+
+/********************************************************************/
+/* @brief Queues a job's answer on its client in its turn: what the */
+/* handler wrote, or an error. Nothing if the client went away.     */
+/********************************************************************/
+static void answer(plugin_job* job)
+{
+  fsm* client = &ppool->states[job->slot];
+  char head[BUF_SIZE];
+  int n, alive;
+  outq* q;
+
+  alive = client->fd == job->fd && client->pipefds < 0 &&
+          client->cgi_pending;
+  if (alive)
+    client->cgi_pending--;
+
+  if (job->error == 500)
+    plugin_stats.failed++;
+
+  if (!alive || !resp_live(client, job->seq))
+  {
+    free_job(job);
+    return;
+  }
+
+  if (job->error)
+    resp_fail(ppool, job->slot, job->seq, job->error);
+  else if ((n = build_head(&job->out, job->conn, head, sizeof(head))) < 0 ||
+           (q = resp_queue(client, job->seq)) == NULL ||
+           outq_copy(q, head, n))
+    resp_fail(ppool, job->slot, job->seq, 500);
+  else if (!job->head_only && job->out.len > 0 &&
+           outq_push(q, job->out.body, job->out.len))
+    resp_fail(ppool, job->slot, job->seq, 0);   // Cut short
+  else
+  {
+    resp_head(client, job->seq, head);
+    if (!job->head_only && job->out.len > 0)
+      job->out.body = NULL;   // The queue frees it now
+    if (!job->conn)
+      resp_cut(ppool, job->slot, job->seq);
+    resp_done(ppool, job->slot, job->seq);
+  }
+
+  if (client->fd >= 0)
+    flush_client(ppool, job->slot);
+  free_job(job);
+}
+
+/* Puts off a job's answer to plugin_reap(): answer() may close its
+   client, and whoever started the job is still using the client's state */
+static void answer_later(plugin_job* job)
+{
+  job->next = NULL;
+  if (answered_tail != NULL)
+    answered_tail->next = job;
+  else
+    answered_head = job;
+  answered_tail = job;
+}
+
+/* Runs a job whose request is all in: on a worker thread if its
+   handler blocks, otherwise now */
+static void start(plugin_job* job)
+{
+  /* Turned away while its body came in; the handler never sees it */
+  if (job->error)
+  {
+    answer_later(job);
+    return;
+  }
+
+  if (evfd < 0 || !(job->h->plugin->flags & LISO_PLUGIN_BLOCKING))
+  {
+    plugin_stats.inline_calls++;
+    job->out.acct = NULL;
+    run_job(job);
+    answer_later(job);
+    return;
+  }
+
+  if (ntodo >= PLUGIN_QUEUE_MAX)
+  {
+    plugin_stats.rejected++;
+    job->error = 503;
+    answer_later(job);
+    return;
+  }
+
+  plugin_stats.offloaded++;
+  job->next = NULL;
+  pthread_mutex_lock(&lock);
+  if (todo_tail != NULL)
+    todo_tail->next = job;
+  else
+    todo_head = job;
+  todo_tail = job;
+  ntodo++;
+  pthread_cond_signal(&ready);
+  pthread_mutex_unlock(&lock);
+}
+
+/*******************************************************************/
+/* @brief Answers a request under a handler's prefix. A GET or     */
+/* HEAD for a handler that doesn't block is answered now, in state */
+/* as for a static file; anything else becomes a job whose answer  */
+/* is queued in its turn when it has run. A POST's body is taken   */
+/* through plugin_body() first.                                    */
+/*                                                                 */
+/* @retval -1   no handler is registered on the URI                */
+/* @retval  0   answered, or state->deferred                       */
+/* @retval 413  the body is over LISO_PLUGIN_BODY                  */
+/* @retval 500  the handler failed, or out of memory               */
+/* @retval 503  too many requests waiting for a worker thread      */
+/*******************************************************************/
+int plugin_serve(fsm* state)
+{
+  int post = !strncmp(state->method, "POST", 4);
+  int blocking;
+  plugin_job* job;
+  handler* h;
+
+  if (nhandlers == 0 || (h = route(state->uri)) == NULL)
+    return -1;
+
+  blocking = evfd >= 0 && (h->plugin->flags & LISO_PLUGIN_BLOCKING);
+  if (!post && !blocking)
+    return answer_now(state, h);
+
+  if (post && (size_t)state->body_size > config.plugin_body)
+    return 413;
+  if (blocking && ntodo >= PLUGIN_QUEUE_MAX)
+  {
+    plugin_stats.rejected++;
+    return 503;
+  }
+
+  if ((job = new_job(state, h)) == NULL)
+    return 500;
+
+  job->seq    = state->seq_next++;   // Its turn
+  job->id     = state->cold->id;
+  job->traced = trace_on(state, job->seq);
+  state->cgi_pending++;
+  state->deferred = 1;
+
+  if (post && state->body_state != BODY_DONE)
+  {
+    job->next = receiving;
+    receiving = job;
+    state->cgi_in = CGI_IN_PLUGIN;
+  }
+  else
+    start(job);
+
+  return 0;
+}
+
+/* The job state's request body is going to, if any */
+static plugin_job** receiving_job(fsm* state)
+{
+  plugin_job** link;
+  int slot = state - ppool->states;
+
+  for (link = &receiving; *link != NULL; link = &(*link)->next)
+    if ((*link)->slot == slot && (*link)->fd == state->fd)
+      return link;
+  return NULL;
+}
+
+/*******************************************************************/
+/* @brief Takes the next piece of a request body for a handler     */
+/* (relay_body()); len 0 ends it, and the handler runs. A body     */
+/* over LISO_PLUGIN_BODY is dropped and answered with a 413.       */
+/*                                                                 */
+/* @retval 0 on success, -1 if there is no job for it              */
+/*******************************************************************/
+int plugin_body(fsm* state, char* data, size_t len)
+{
+  plugin_job** link = receiving_job(state);
+  plugin_job* job;
+  size_t cap;
+  char* buf;
+
+  if (link == NULL)
+    return -1;
+  job = *link;
+
+  if (len == 0)
+  {
+    *link = job->next;
+    start(job);
+    return 0;
+  }
+
+  if (job->error)
+    return 0;   // Dropping the rest
+
+  if (job->body_len + len > config.plugin_body)
+  {
+    job->error = 413;
+    return 0;
+  }
+
+  if (job->body_len + len > job->body_cap)
+  {
+    cap = job->body_cap ? job->body_cap * 2 : 4096;
+    while (cap < job->body_len + len)
+      cap *= 2;
+    if ((buf = liso_malloc_acct(cap, MEM_BODY, NULL)) == NULL)
+    {
+      job->error = 500;
+      return 0;
+    }
+    memcpy(buf, job->body, job->body_len);
+    liso_free(job->body);
+    job->body     = buf;
+    job->body_cap = cap;
+  }
+
+  memcpy(job->body + job->body_len, data, len);
+  job->body_len += len;
+  return 0;
+}
+
+/* client is going: the body it was sending a handler won't come */
+void plugin_detach(fsm* client)
+{
+  plugin_job** link;
+  plugin_job* job;
+
+  while (receiving != NULL && (link = receiving_job(client)) != NULL)
+  {
+    job = *link;
+    *link = job->next;
+    free_job(job);
+  }
+}
+
+/*****************************************************************/
+/* @brief Answers the jobs run on this thread since the last     */
+/* pass, and those worker threads have finished if the eventfd   */
+/* says there are any.                                           */
+/*****************************************************************/
+void plugin_reap(pool* p)
+{
+  plugin_job* list; plugin_job* job;
+  uint64_t n;
+
+  list = answered_head;
+  answered_head = answered_tail = NULL;
+  while ((job = list) != NULL)
+  {
+    list = job->next;
+    answer(job);
+  }
+
+  if (evfd < 0 || !FD_ISSET(evfd, &p->readfds))
+    return;
+  p->nready--;
+
+  if (read(evfd, &n, sizeof(n)) < 0)
+    n = 0;   // Spurious; done is looked at anyway
+
+  pthread_mutex_lock(&lock);
+  list = done;
+  done = NULL;
+  pthread_mutex_unlock(&lock);
+
+  while ((job = list) != NULL)
+  {
+    list = job->next;
+    answer(job);
+  }
+}
+
+/* 0 if plugin_reap() has answers waiting, -1 if none */
+long plugin_wakeup(void)
+{
+  return answered_head != NULL ? 0 : -1;
+}
+
+void plugin_print(FILE* file)
+{
+  if (nhandlers == 0)
+    return;
+
+  fprintf(file, "Plugins: %lu inline, %lu on workers, %lu failed, "
+          "%lu rejected; %d handlers, %d workers, %d queued\n",
+          plugin_stats.inline_calls, plugin_stats.offloaded,
+          plugin_stats.failed, plugin_stats.rejected, nhandlers, nworkers,
+          ntodo);
+  fflush(file);
+}
@@ -0,0 +1,27 @@
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include <stdio.h>
+
+#include "lisod.h"
+
+typedef struct plugin_counters {
+  unsigned long inline_calls;  // Handlers run on the event loop
+  unsigned long offloaded;     // Handlers run on a worker thread
+  unsigned long failed;        // Handlers that returned -1: a 500 instead
+  unsigned long rejected;      // 503s, the worker queue being full
+} plugin_counters;
+
+extern plugin_counters plugin_stats;
+
+int  plugin_init(pool* p);
+int  plugin_enabled(void);
+int  plugin_routed(fsm* state);
+int  plugin_serve(fsm* state);
+int  plugin_body(fsm* state, char* data, size_t len);
+void plugin_detach(fsm* client);
+void plugin_reap(pool* p);
+long plugin_wakeup(void);
+void plugin_print(FILE* file);
+
+#endif
@@ -0,0 +1,54 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file plugin_hello.c                                            */
+/*                                                                 */
+/* @brief An example in-process handler (liso_plugin.h). It        */
+/* answers with the method, the path under its prefix, the query   */
+/* string, the client's User-Agent and how many bytes were posted. */
+/* It doesn't block, so it runs on the event loop.                 */
+/*                                                                 */
+/* make plugin_hello.so; LISO_PLUGINS=/hello=./plugin_hello.so     */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "liso_plugin.h"
+
+static int hello(void* data, liso_request* req, liso_response* resp)
+{
+  char line[1024], buf[4096];
+  const char* agent;
+  size_t len, n, posted = 0;
+  int k;
+
+  (void)data;
+  while ((n = req->read(req, buf, sizeof(buf))) > 0)
+    posted += n;
+
+  if ((agent = req->header(req, "User-Agent", &len)) == NULL)
+  {
+    agent = "-";
+    len = 1;
+  }
+
+  k = snprintf(line, sizeof(line), "Hello from %s\nmethod: %s\npath: %s\n"
+               "query: %s\nagent: %.*s\nposted: %zu\n", req->prefix,
+               req->method, req->path, req->query, (int)len, agent, posted);
+  if (k < 0 || (size_t)k >= sizeof(line))
+    return -1;
+
+  resp->header(resp, "Content-Type", "text/plain");
+  return resp->write(resp, line, k);
+}
+
+const liso_plugin liso_plugin_entry = {
+  .abi    = LISO_PLUGIN_ABI,
+  .name   = "hello",
+  .flags  = 0,
+  .init   = NULL,
+  .handle = hello,
+};
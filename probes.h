@@ -0,0 +1,29 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* USDT probes (provider lisod), listed in trace/probes.txt. Built in
+   whenever <sys/sdt.h> is there (systemtap-sdt-dev, systemtap-sdt-devel),
+   unless make NO_USDT=1. A probe is a single nop until bpftrace or perf
+   attaches to it; its arguments are values already at hand, so it
+   costs next to nothing when nobody is tracing. */
+
+#if !defined(LISO_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LISO_USDT 1
+#endif
+#endif
+
+#ifdef LISO_USDT
+#define PROBE1(name, a)          DTRACE_PROBE1(lisod, name, a)
+#define PROBE2(name, a, b)       DTRACE_PROBE2(lisod, name, a, b)
+#define PROBE3(name, a, b, c)    DTRACE_PROBE3(lisod, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(lisod, name, a, b, c, d)
+#else
+#define PROBE1(name, a)          do {} while (0)
+#define PROBE2(name, a, b)       do {} while (0)
+#define PROBE3(name, a, b, c)    do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif
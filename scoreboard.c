@@ -0,0 +1,298 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file scoreboard.c                                              */
+/*                                                                 */
+/* @brief The scoreboard (format in scoreboard.h): a live view of  */
+/* every connection and CGI run, in a file mapped with mmap that   */
+/* lisotop reads from another process. A slot is rewritten when    */
+/* its connection moves on (a request comes in, is serviced, is    */
+/* handed to a CGI, is written out) under a seqlock, so publishing */
+/* costs a few stores and no system call, and a reader never waits */
+/* on the event loop nor makes it wait.                            */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "scoreboard.h"
+#include "lisod.h"
+#include "engine.h"
+#include "config.h"
+
+_Static_assert(sizeof(sb_hdr)  == SB_SLOT, "sb_hdr must be one slot");
+_Static_assert(sizeof(sb_slot) == SB_SLOT, "sb_slot must be SB_SLOT bytes");
+
+static sb_hdr*  hdr;     /* NULL: no scoreboard */
+static sb_slot* slots;   /* MAX_CLIENTS of them, after hdr */
+static size_t   size;
+
+static uint64_t scoreboard_clock(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Opens a write on seq: readers retry until close_write() */
+static void open_write(uint32_t* seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void close_write(uint32_t* seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************/
+/* @brief Creates the scoreboard, if LISO_SCOREBOARD names a file. */
+/*                                                                 */
+/* @retval 0 on success (or none configured), -1 on failure        */
+/*******************************************************************/
+int scoreboard_init(void)
+{
+  int fd;
+  void* map;
+
+  if (config.scoreboard == NULL || config.scoreboard[0] == '\0')
+    return 0;
+
+  size = sizeof(sb_hdr) + MAX_CLIENTS * sizeof(sb_slot);
+
+  if ((fd = open(config.scoreboard, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0644)) < 0)
+    return -1;
+
+  if (ftruncate(fd, size) < 0 ||
+      (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))
+      == MAP_FAILED)
+  {
+    close(fd);
+    return -1;
+  }
+  close(fd);   // The mapping keeps it
+
+  hdr   = map;
+  slots = (sb_slot*)(hdr + 1);
+
+  hdr->version    = SB_VERSION;
+  hdr->slots      = MAX_CLIENTS;
+  hdr->slot_size  = SB_SLOT;
+  hdr->pid        = getpid();
+  hdr->started_us = scoreboard_clock();
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(hdr->magic, SB_MAGIC, 8);   // Last: readers check it first
+  return 0;
+}
+
+int scoreboard_enabled(void)
+{
+  return hdr != NULL;
+}
+
+/* An SSL_accept() step is starting (1) or done (0); the event loop
+   waits on it, so it is worth seeing */
+void scoreboard_handshake(int started)
+{
+  if (hdr == NULL)
+    return;
+
+  open_write(&hdr->seq);
+  hdr->handshake_us = started ? scoreboard_clock() : 0;
+  close_write(&hdr->seq);
+}
+
+/* The phase a connection is in, going by its fsm */
+static int phase_of(pool* p, fsm* state, int was)
+{
+  /* A CGI slot: waiting for a place, running, or draining the pipe
+     after the script exited */
+  if (state->pipefds > 0)
+    return state->pid > 0 ? SB_CGI_RUNNING :
+           was == SB_CGI_QUEUED ? SB_CGI_QUEUED : SB_CGI_DRAINING;
+
+  if (FD_ISSET(state->fd, &p->writers))
+    return SB_WRITING;
+  if (state->body_state != BODY_DONE)
+    return SB_BODY;
+  if (state->seq_out != state->seq_next)
+    return SB_BACKEND;
+  if (state->end_idx > 0)
+    return SB_HEADERS;
+  return SB_IDLE;
+}
+
+/* Moves slot to phase, stamping the time if it changed. The caller
+   holds the slot open */
+static void enter(sb_slot* slot, int phase)
+{
+  if (slot->phase != phase)
+  {
+    slot->phase    = phase;
+    slot->phase_us = scoreboard_clock();
+  }
+}
+
+/*****************************************************************/
+/* @brief Slot i was just taken: by a client, or (from >= 0) by  */
+/* a CGI run for the client in slot from, whose request it shows */
+/*****************************************************************/
+void scoreboard_open(pool* p, int i, int from)
+{
+  fsm* state = &p->states[i];
+  sb_slot* slot;
+  struct in_addr addr;
+
+  if (hdr == NULL)
+    return;
+
+  slot = &slots[i];
+  open_write(&slot->seq);
+  memset((char*)slot + sizeof(slot->seq), 0, sizeof(sb_slot) -
+         sizeof(slot->seq));
+
+  slot->open_us  = scoreboard_clock();
+  slot->phase_us = slot->open_us;
+  slot->owner    = -1;
+
+  if (from >= 0)
+  {
+    slot->kind     = SB_CGI;
+    slot->phase    = SB_CGI_QUEUED;
+    slot->owner    = state->owner;
+    slot->addr     = slots[from].addr;
+    slot->flags    = slots[from].flags & SB_TLS;
+    slot->method   = slots[from].method;
+    slot->uri_len  = slots[from].uri_len;
+    slot->request_us = slots[from].request_us;
+    memcpy(slot->uri, slots[from].uri, slots[from].uri_len);
+  }
+  else
+  {
+    slot->kind     = SB_CLIENT;
+    slot->phase    = SB_IDLE;
+    slot->flags    = state->context != NULL ? SB_TLS : 0;
+    slot->addr     = inet_pton(AF_INET, state->cold->cli_ip, &addr) == 1 ?
+                     addr.s_addr : 0;
+  }
+  close_write(&slot->seq);
+
+  if (from < 0)
+  {
+    open_write(&hdr->seq);
+    hdr->accepted++;
+    close_write(&hdr->seq);
+  }
+}
+
+/* Slot i's request is parsed and about to be serviced */
+void scoreboard_request(pool* p, int i)
+{
+  fsm* state = &p->states[i];
+  sb_slot* slot;
+  size_t len;
+
+  if (hdr == NULL)
+    return;
+
+  slot = &slots[i];
+  len  = strlen(state->uri);
+  if (len > SB_URI_MAX)
+    len = SB_URI_MAX;
+
+  open_write(&slot->seq);
+  slot->method  = !strcmp(state->method, "GET")  ? SB_GET :
+                  !strcmp(state->method, "HEAD") ? SB_HEAD :
+                  !strcmp(state->method, "POST") ? SB_POST : SB_NONE;
+  slot->uri_len = len;
+  memcpy(slot->uri, state->uri, len);
+  slot->requests++;
+  enter(slot, SB_SERVICE);
+  close_write(&slot->seq);
+}
+
+/* Slot i read bytes from its client */
+void scoreboard_received(pool* p, int i, size_t bytes)
+{
+  fsm* state = &p->states[i];
+  sb_slot* slot;
+
+  if (hdr == NULL)
+    return;
+
+  slot = &slots[i];
+  open_write(&slot->seq);
+  slot->bytes_in += bytes;
+  if ((size_t)state->end_idx == bytes)   // The buffer was empty
+    slot->request_us = scoreboard_clock();
+  enter(slot, phase_of(p, state, slot->phase));
+  close_write(&slot->seq);
+}
+
+/* Slot i wrote bytes to its client */
+void scoreboard_sent(pool* p, int i, size_t bytes)
+{
+  sb_slot* slot;
+
+  if (hdr == NULL)
+    return;
+
+  slot = &slots[i];
+  open_write(&slot->seq);
+  slot->bytes_out += bytes;
+  enter(slot, phase_of(p, &p->states[i], slot->phase));
+  slot->flags = (slot->flags & ~SB_CLOSING) |
+                (p->states[i].closing ? SB_CLOSING : 0);
+  close_write(&slot->seq);
+}
+
+/* Slot i may have moved on: a CGI started or exited, a request was
+   handed off */
+void scoreboard_update(pool* p, int i)
+{
+  fsm* state = &p->states[i];
+  sb_slot* slot;
+
+  if (hdr == NULL)
+    return;
+
+  slot = &slots[i];
+  open_write(&slot->seq);
+  if (state->pipefds > 0)
+    slot->pid = state->pid;
+  enter(slot, phase_of(p, state, slot->phase));
+  close_write(&slot->seq);
+}
+
+/* Slot i is free again */
+void scoreboard_close(int i)
+{
+  if (hdr == NULL)
+    return;
+
+  open_write(&slots[i].seq);
+  slots[i].kind = SB_FREE;
+  close_write(&slots[i].seq);
+}
+
+/* lisod is exiting: lisotop stops looking */
+void scoreboard_exit(void)
+{
+  if (hdr == NULL)
+    return;
+
+  open_write(&hdr->seq);
+  hdr->pid = 0;
+  close_write(&hdr->seq);
+}
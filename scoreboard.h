@@ -0,0 +1,98 @@
+#ifndef SCOREBOARD_H
+#define SCOREBOARD_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* The scoreboard (LISO_SCOREBOARD), read by lisotop.c. A file, best
+   kept in /dev/shm, holding an sb_hdr and then one sb_slot per slot
+   of the connection table, which lisod keeps up to date as its
+   connections move from phase to phase. lisod is the only writer:
+   a slot's seq is odd while it is being written, and a reader copies
+   the slot and takes the copy only if seq was even and unchanged
+   across it. Times are CLOCK_MONOTONIC_COARSE microseconds, which
+   readers on the same machine share. Integers are in the writer's byte
+   order. */
+
+#define SB_MAGIC    "LISOSB01"
+#define SB_VERSION  1
+#define SB_SLOT     256     /* sizeof(sb_slot) */
+#define SB_URI_MAX  (SB_SLOT - 66)   /* Longer URIs are kept cut short */
+
+/* sb_slot.kind */
+#define SB_FREE    0
+#define SB_CLIENT  1
+#define SB_CGI     2       /* Relaying a script's output to slot owner */
+
+/* sb_slot.phase */
+enum {
+  SB_IDLE,         // Keep-alive, waiting for the next request
+  SB_HEADERS,      // Reading a request line and headers
+  SB_BODY,         // Reading a request body on to its CGI
+  SB_SERVICE,      // In service()
+  SB_BACKEND,      // Waiting on a CGI, FastCGI worker or plugin
+  SB_WRITING,      // Output queued that the client hasn't taken
+  SB_CGI_QUEUED,   // CGI slots: waiting for a place (LISO_CGI_MAX)
+  SB_CGI_RUNNING,  // CGI slots: the script is running
+  SB_CGI_DRAINING, // CGI slots: it exited, output is left in the pipe
+  SB_PHASES
+};
+
+/* sb_slot.flags */
+#define SB_TLS      1
+#define SB_CLOSING  2      /* Closes once its output is out */
+
+/* sb_slot.method */
+#define SB_NONE     0
+#define SB_GET      1
+#define SB_HEAD     2
+#define SB_POST     3
+
+typedef struct sb_hdr {
+  char     magic[8];      // SB_MAGIC
+  uint32_t version;       // SB_VERSION
+  uint32_t slots;         // sb_slots that follow
+  uint32_t slot_size;     // SB_SLOT
+  int32_t  pid;           // lisod's, 0 once it has exited
+  uint64_t started_us;    // When lisod started
+  uint32_t seq;           // Seqlock for the fields below
+  uint32_t pad;
+  uint64_t handshake_us;  // An SSL_accept() running since then, or 0
+  uint64_t accepted;      // Connections accepted
+  char     reserved[SB_SLOT - 56];
+} sb_hdr;
+
+typedef struct sb_slot {
+  uint32_t seq;           // Odd while the slot is being written
+  uint8_t  kind;          // SB_FREE ...
+  uint8_t  phase;         // SB_IDLE ...
+  uint8_t  flags;         // SB_TLS ...
+  uint8_t  method;        // SB_GET ... of the request last taken on
+  uint32_t addr;          // Client IPv4 address, network byte order
+  int32_t  pid;           // SB_CGI: the script, 0 if not running
+  int32_t  owner;         // SB_CGI: the client slot it answers, or -1
+  uint32_t requests;      // Requests taken on
+  uint64_t open_us;       // When the connection (or CGI) started
+  uint64_t phase_us;      // When it entered phase
+  uint64_t request_us;    // When the last request's first byte came in
+  uint64_t bytes_in;      // Read from the client
+  uint64_t bytes_out;     // Written to the client
+  uint16_t uri_len;       // Of the last request's URI, as kept
+  char     uri[SB_URI_MAX];   // Not NUL terminated
+} sb_slot;
+
+struct state;
+struct pool;
+
+int      scoreboard_init(void);
+int      scoreboard_enabled(void);
+void     scoreboard_handshake(int started);
+void     scoreboard_open(struct pool* p, int i, int from);
+void     scoreboard_request(struct pool* p, int i);
+void     scoreboard_received(struct pool* p, int i, size_t bytes);
+void     scoreboard_sent(struct pool* p, int i, size_t bytes);
+void     scoreboard_update(struct pool* p, int i);
+void     scoreboard_close(int i);
+void     scoreboard_exit(void);
+
+#endif
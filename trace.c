@@ -0,0 +1,434 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file trace.c                                                   */
+/*                                                                 */
+/* @brief Request tracing. One request in LISO_TRACE_SAMPLE, and   */
+/* every request carrying the LISO_TRACE_HEADER header, is traced: */
+/* each stage it goes through (reading, parsing, service(), the    */
+/* body relay, a CGI's start, run and relay, writing) is recorded  */
+/* as a span in a ring belonging to the thread it ran on. The      */
+/* rings are written out in Chrome trace-event format, to be       */
+/* loaded into Perfetto or chrome://tracing: to LISO_TRACE_FILE on */
+/* SIGUSR2, or as the answer to a GET of LISO_TRACE_URI from the   */
+/* loopback address. Each connection is a track of its own, with   */
+/* the requests on it as async slices above their stages.          */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#define _GNU_SOURCE   /* open_memstream() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "lisod.h"
+#include "engine.h"
+#include "alloc.h"
+#include "config.h"
+#include "logger.h"
+#include "util.h"
+
+#define TRACE_EVENTS 8192   /* Spans a thread keeps, newest first */
+
+extern FILE* logfile;
+
+/* One span. done is written last, so a reader can tell it whole */
+typedef struct trace_event {
+  uint64_t      start;    // trace_clock()
+  uint64_t      dur;
+  uint64_t      arg;
+  unsigned long id;       // Connection
+  uint32_t      seq;      // Response on it
+  uint16_t      kind;
+  uint16_t      len;      // Of note
+  char          note[TRACE_NOTE];   // TRACE_REQUEST: its URI
+  uint64_t      done;     // Its index in the ring, plus one
+} trace_event;
+
+/* One thread's spans. Only that thread writes them */
+typedef struct trace_ring {
+  trace_event ev[TRACE_EVENTS];
+  uint64_t    head;       // Spans ever written
+  long        tid;
+  struct trace_ring* next;
+} trace_ring;
+
+/* How each kind is shown */
+static const struct {
+  const char* name;
+  const char* arg;     // Name of its argument, or NULL
+  char        ph;      // X: a slice, b: an async slice, i: an instant
+} kinds[TRACE_KINDS] = {
+  { "request",       "bytes",  'b' },
+  { "read",          NULL,     'b' },
+  { "parse_line",    NULL,     'X' },
+  { "parse_headers", NULL,     'X' },
+  { "service",       "error",  'X' },
+  { "body",          "rc",     'X' },
+  { "head",          "status", 'i' },
+  { "flush",         "bytes",  'X' },
+  { "cgi_spawn",     "pid",    'X' },
+  { "cgi_run",       "pid",    'b' },
+  { "cgi_relay",     NULL,     'X' },
+  { "plugin",        NULL,     'X' },
+};
+
+trace_counters trace_stats;
+
+static int              enabled;
+static unsigned long    requests;     /* Seen, for 1 in N */
+static char             needle[LOG_SIZE];   /* "<LISO_TRACE_HEADER>:" */
+static size_t           needle_len;
+static trace_ring*      rings;
+static pthread_mutex_t  rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_ring* mine;
+
+/*******************************************************************/
+/* @brief Turns tracing on, if LISO_TRACE_SAMPLE or                */
+/* LISO_TRACE_HEADER asks for it.                                  */
+/*                                                                 */
+/* @retval 0 on success (or tracing is off)                        */
+/*******************************************************************/
+int trace_init(void)
+{
+  if (config.trace_header != NULL)
+    needle_len = snprintf(needle, sizeof(needle), "%s:", config.trace_header);
+
+  enabled = config.trace_sample > 0 || needle_len > 0;
+  return 0;
+}
+
+int trace_enabled(void)
+{
+  return enabled;
+}
+
+/* Monotonic nanoseconds; 0 (and no clock read) when tracing is off */
+uint64_t trace_clock(void)
+{
+  return enabled ? mono_ns() : 0;
+}
+
+static trace_ring* my_ring(void)
+{
+  if (mine != NULL)
+    return mine;
+
+  if ((mine = calloc(1, sizeof(trace_ring))) == NULL)
+    return NULL;
+  mine->tid = syscall(SYS_gettid);
+
+  pthread_mutex_lock(&rings_lock);
+  mine->next = rings;
+  rings = mine;
+  pthread_mutex_unlock(&rings_lock);
+  return mine;
+}
+
+/* Adds a span to this thread's ring, over its oldest; one ending at
+   end, or now if end is 0 */
+static void record(int kind, unsigned long id, unsigned seq, uint64_t start,
+                   uint64_t end, uint64_t arg, const char* note)
+{
+  trace_ring* ring = my_ring();
+  uint64_t now = end ? end : trace_clock();
+  trace_event* ev;
+  uint64_t k;
+
+  if (ring == NULL || start == 0)
+    return;
+
+  k  = ring->head;
+  ev = &ring->ev[k % TRACE_EVENTS];
+  __atomic_store_n(&ev->done, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  ev->start = start;
+  ev->dur   = now > start ? now - start : 0;
+  ev->arg   = arg;
+  ev->id    = id;
+  ev->seq   = seq;
+  ev->kind  = kind;
+  ev->len   = 0;
+  if (note != NULL)
+  {
+    ev->len = strnlen(note, TRACE_NOTE);
+    memcpy(ev->note, note, ev->len);
+  }
+
+  __atomic_store_n(&ev->done, k + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->head, k + 1, __ATOMIC_RELEASE);
+}
+
+/* Records a span of a traced request: kind, from start until now */
+void trace_emit(int kind, unsigned long id, unsigned seq, uint64_t start,
+                uint64_t arg)
+{
+  if (enabled)
+    record(kind, id, seq, start, 0, arg, NULL);
+}
+
+/* Whether response seq on state is being traced */
+int trace_on(fsm* state, unsigned seq)
+{
+  return enabled && (state->cold->traced & (1u << (seq % RESP_MAX)));
+}
+
+/* A parse_line() (kind TRACE_PARSE_LINE) or parse_headers() call
+   that started at start just succeeded. Kept on the connection
+   until trace_begin() knows whether its request is traced */
+void trace_parsed(fsm* state, int kind, uint64_t start)
+{
+  uint64_t* t = state->cold->trace_parse;
+
+  if (!enabled)
+    return;
+
+  t[kind == TRACE_PARSE_LINE ? 0 : 2] = start;
+  t[kind == TRACE_PARSE_LINE ? 1 : 3] = trace_clock();
+}
+
+/******************************************************************/
+/* @brief Decides whether the request just parsed, answered by    */
+/* response seq_next, is traced; if it is, records its read and   */
+/* parse spans and keeps its URI.                                 */
+/******************************************************************/
+void trace_begin(fsm* state)
+{
+  fsm_cold* cold = state->cold;
+  unsigned seq = state->seq_next, bit = 1u << (seq % RESP_MAX);
+  uint64_t* t = cold->trace_parse;
+  uint64_t now, start;
+
+  if (!enabled)
+    return;
+
+  cold->traced &= ~bit;
+  if (needle_len > 0 && search_hdr(state, needle, needle_len) != NULL)
+    trace_stats.triggered++;
+  else if (config.trace_sample > 0 && requests++ % config.trace_sample == 0)
+    trace_stats.sampled++;
+  else
+  {
+    memset(t, 0, sizeof(cold->trace_parse));
+    return;
+  }
+  cold->traced |= bit;
+
+  snprintf(cold->trace_uri[seq % RESP_MAX], TRACE_NOTE, "%s", state->uri);
+
+  /* started[] is in access_clock() microseconds */
+  start = cold->started[seq % RESP_MAX] * 1000;
+  now   = trace_clock();
+  if (start == 0 || start > now)
+    start = now;
+
+  record(TRACE_READ, cold->id, seq, start, now, 0, NULL);
+  if (t[0] != 0)
+    record(TRACE_PARSE_LINE, cold->id, seq, t[0], t[1], 0, NULL);
+  if (t[2] != 0)
+    record(TRACE_PARSE_HDRS, cold->id, seq, t[2], t[3], 0, NULL);
+  memset(t, 0, sizeof(cold->trace_parse));
+}
+
+/* Response seq is complete (or will never be), bytes queued for it
+   since its head: records the request's span. The response stays
+   traced while it is written out; take_on() clears its bit when its
+   slot is reused */
+void trace_done(fsm* state, unsigned seq, size_t bytes)
+{
+  fsm_cold* cold = state->cold;
+  uint64_t start;
+
+  if (!trace_on(state, seq))
+    return;
+
+  start = cold->started[seq % RESP_MAX] * 1000;
+  record(TRACE_REQUEST, cold->id, seq, start ? start : trace_clock(), 0,
+         bytes, cold->trace_uri[seq % RESP_MAX]);
+}
+
+/* Writes a string as a JSON string */
+static void put_json(FILE* f, const char* s, size_t len)
+{
+  size_t k;
+
+  fputc('"', f);
+  for (k = 0; k < len; k++)
+  {
+    if (s[k] == '"' || s[k] == '\\')
+      fprintf(f, "\\%c", s[k]);
+    else if ((unsigned char)s[k] < 0x20)
+      fprintf(f, "\\u%04x", (unsigned char)s[k]);
+    else
+      fputc(s[k], f);
+  }
+  fputc('"', f);
+}
+
+/* Writes one span as trace events. Connections are tracks of
+   process 1, the threads plugin handlers ran on of process 2 */
+static void put_event(FILE* f, const trace_event* ev, long tid)
+{
+  int kind = ev->kind;
+  int thread = kind == TRACE_PLUGIN;
+  const char* cat = kind == TRACE_CGI_RUN ? "cgi" :
+                    kind == TRACE_READ ? "read" : "request";
+
+  if (kind == TRACE_REQUEST)
+    fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+            "\"tid\":%lu,\"args\":{\"name\":\"conn %lu\"}}", ev->id, ev->id);
+
+  fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%ld,"
+          "\"ts\":%.3f", kinds[kind].name, kinds[kind].ph, thread ? 2 : 1,
+          thread ? tid : (long)ev->id, ev->start / 1000.0);
+
+  if (kinds[kind].ph == 'X')
+    fprintf(f, ",\"dur\":%.3f", ev->dur / 1000.0);
+  else if (kinds[kind].ph == 'i')
+    fprintf(f, ",\"s\":\"t\"");
+  else
+    fprintf(f, ",\"cat\":\"%s\",\"id\":\"%lu.%u\"", cat, ev->id, ev->seq);
+
+  fprintf(f, ",\"args\":{\"conn\":%lu,\"seq\":%u", ev->id, ev->seq);
+  if (kinds[kind].arg != NULL)
+    fprintf(f, ",\"%s\":%lld", kinds[kind].arg, (long long)ev->arg);
+  if (ev->len > 0)
+  {
+    fprintf(f, ",\"uri\":");
+    put_json(f, ev->note, ev->len);
+  }
+  fprintf(f, "}}");
+
+  /* An async slice ends where it ends */
+  if (kinds[kind].ph == 'b')
+    fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"e\",\"pid\":1,\"tid\":%lu,"
+            "\"ts\":%.3f,\"cat\":\"%s\",\"id\":\"%lu.%u\"}",
+            kinds[kind].name, ev->id, (ev->start + ev->dur) / 1000.0, cat,
+            ev->id, ev->seq);
+}
+
+/* Writes every ring's spans to f as a trace-event JSON object */
+static void put_trace(FILE* f)
+{
+  trace_event ev;
+  trace_ring* ring;
+  uint64_t head, k;
+
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+          "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,"
+          "\"args\":{\"name\":\"lisod %d connections\"}},\n"
+          "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":2,"
+          "\"args\":{\"name\":\"lisod %d threads\"}}", (int)getpid(),
+          (int)getpid());
+
+  pthread_mutex_lock(&rings_lock);
+  for (ring = rings; ring != NULL; ring = ring->next)
+  {
+    fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":2,"
+            "\"tid\":%ld,\"args\":{\"name\":\"thread %ld\"}}", ring->tid,
+            ring->tid);
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (k = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0; k < head; k++)
+    {
+      /* Skip a span its thread is writing over right now */
+      if (__atomic_load_n(&ring->ev[k % TRACE_EVENTS].done,
+                          __ATOMIC_ACQUIRE) != k + 1)
+        continue;
+      memcpy(&ev, &ring->ev[k % TRACE_EVENTS], sizeof(ev));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&ring->ev[k % TRACE_EVENTS].done,
+                          __ATOMIC_RELAXED) != k + 1 ||
+          ev.kind >= TRACE_KINDS)
+        continue;
+      put_event(f, &ev, ring->tid);
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  fprintf(f, "\n]}\n");
+}
+
+/*****************************************************************/
+/* @brief Writes the trace to LISO_TRACE_FILE (by default        */
+/* lisod-trace.<pid>.json): to a temporary file first, renamed   */
+/* over it once complete. Called from the event loop on SIGUSR2. */
+/*****************************************************************/
+void trace_write(void)
+{
+  char path[LOG_SIZE], tmp[LOG_SIZE + 8], log_buf[LOG_SIZE * 2];
+  FILE* f;
+
+  if (!enabled)
+    return;
+
+  if (config.trace_file != NULL)
+    snprintf(path, sizeof(path), "%s", config.trace_file);
+  else
+    snprintf(path, sizeof(path), "lisod-trace.%d.json", (int)getpid());
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  if ((f = fopen(tmp, "w")) == NULL)
+  {
+    log_error("Unable to write the trace", logfile);
+    return;
+  }
+  put_trace(f);
+  if (fclose(f) != 0 || rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+    log_error("Unable to write the trace", logfile);
+    return;
+  }
+
+  trace_stats.dumps++;
+  snprintf(log_buf, sizeof(log_buf), "Trace written to %s", path);
+  log_error(log_buf, logfile);
+}
+
+/* The trace page (serve_page()) */
+static int write_page(FILE* f)
+{
+  put_trace(f);
+  return 0;
+}
+
+/*******************************************************************/
+/* @brief Answers a GET or HEAD of LISO_TRACE_URI from a client on */
+/* 127.0.0.1 with the trace, as metrics_serve() does the metrics.  */
+/*                                                                 */
+/* @retval -1  not the trace URI (or tracing is off)               */
+/* @retval  0  the response is in state                            */
+/* @retval 500 out of memory                                       */
+/*******************************************************************/
+int trace_serve(fsm* state)
+{
+  int rc;
+
+  if (!enabled || config.trace_uri == NULL)
+    return -1;
+
+  if ((rc = serve_page(state, config.trace_uri, "application/json",
+                       write_page)) == 0)
+    trace_stats.dumps++;
+  return rc;
+}
+
+void trace_print(FILE* file)
+{
+  if (!enabled)
+    return;
+
+  fprintf(file, "Tracing: %lu requests sampled, %lu triggered by header, "
+          "%lu traces written\n", trace_stats.sampled, trace_stats.triggered,
+          trace_stats.dumps);
+  fflush(file);
+}
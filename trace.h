@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Request tracing (trace.c): spans of sampled requests, dumped in
+   Chrome trace-event format */
+
+#define TRACE_NOTE 48   /* Bytes of a traced request's URI kept */
+
+/* Span kinds */
+enum {
+  TRACE_REQUEST,      // First byte of the request -> response complete
+  TRACE_READ,         // First byte of the request -> headers parsed
+  TRACE_PARSE_LINE,   // The parse_line() call that found the line
+  TRACE_PARSE_HDRS,   // parse_headers()
+  TRACE_SERVICE,      // service(); arg: error, 0 if none
+  TRACE_BODY,         // A relay_body() call; arg: what it returned
+  TRACE_HEAD,         // The response head is queued; arg: status
+  TRACE_FLUSH,        // Writing the connection's output; arg: bytes
+  TRACE_CGI_SPAWN,    // Starting a script; arg: pid
+  TRACE_CGI_RUN,      // A script started -> it exited; arg: pid
+  TRACE_CGI_RELAY,    // A relay_cgi() call
+  TRACE_PLUGIN,       // A plugin handler run on a worker thread
+  TRACE_KINDS
+};
+
+typedef struct trace_counters {
+  unsigned long sampled;    // Requests traced, 1 in LISO_TRACE_SAMPLE
+  unsigned long triggered;  // Requests traced for LISO_TRACE_HEADER
+  unsigned long dumps;      // Traces written out
+} trace_counters;
+
+extern trace_counters trace_stats;
+
+struct state;
+
+int      trace_init(void);
+int      trace_enabled(void);
+uint64_t trace_clock(void);
+void     trace_parsed(struct state* state, int kind, uint64_t start);
+void     trace_begin(struct state* state);
+int      trace_on(struct state* state, unsigned seq);
+void     trace_emit(int kind, unsigned long id, unsigned seq, uint64_t start,
+                    uint64_t arg);
+void     trace_done(struct state* state, unsigned seq, size_t bytes);
+int      trace_serve(struct state* state);
+void     trace_write(void);
+void     trace_print(FILE* file);
+
+#endif
@@ -0,0 +1,38 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file util.c                                                    */
+/*                                                                 */
+/* @brief The clock the request phases, CGI deadlines and request  */
+/* coalescing are timed with, and the hash the micro-cache, the    */
+/* coalescing table and the access log key URIs by.                */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <time.h>
+
+#include "util.h"
+
+/* Monotonic nanoseconds */
+uint64_t mono_ns(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* FNV-1a over len bytes; tables take as many low bits as they need */
+uint64_t fnv1a(const void* data, size_t len)
+{
+  const unsigned char* s = data;
+  uint64_t h = 14695981039346656037ULL;
+
+  while (len-- > 0)
+  {
+    h ^= *s++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
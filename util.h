@@ -0,0 +1,12 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Helpers several modules share */
+
+uint64_t mono_ns(void);                        /* CLOCK_MONOTONIC, in ns */
+uint64_t fnv1a(const void* data, size_t len);  /* 64-bit FNV-1a */
+
+#endif
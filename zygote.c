@@ -0,0 +1,397 @@
+/*******************************************************************/
+/*                                                                 */
+/* @file zygote.c                                                  */
+/*                                                                 */
+/* @brief CGI zygote. A helper forked from lisod at startup, while */
+/* the server is still small, that starts CGI processes for it.    */
+/* For each request lisod sends the environment and the two pipe   */
+/* ends over a Unix socket (SCM_RIGHTS), and the zygote forks a    */
+/* child from its own warm state: either straight into a script    */
+/* it preloaded (LISO_CGI_PRELOAD) or into execve() of the CGI     */
+/* path. The server process itself never forks per request. The    */
+/* zygote answers with the child's pid and a pidfd on it, opened   */
+/* before the child can be reaped, so lisod can watch and kill it  */
+/* without ever naming a recycled pid.                             */
+/*                                                                 */
+/* @author Fadhil Abubaker                                         */
+/*                                                                 */
+/*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "zygote.h"
+#include "engine.h"
+#include "config.h"
+#include "logger.h"
+
+#define ZYGOTE_MSG_MAX (64 * 1024)   /* Largest environment we send */
+
+extern FILE* logfile;
+
+static int   zsock = -1;    /* lisod's end of the socket */
+static pid_t zpid;
+static char* zapp;
+
+static liso_cgi_main_fn preload_main;
+
+static volatile sig_atomic_t child_exited;   /* Set by SIGCHLD */
+
+/* A pidfd on pid, or -1 where the kernel has none */
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static void sigchld_handler(int sig)
+{
+  (void)sig;
+  child_exited = 1;
+}
+
+/* Reaps the children that exited, reporting the ones that failed. Only
+   the loop does this, never between a fork and its pidfd_open() */
+static void reap_children(void)
+{
+  int status;
+  pid_t pid;
+
+  child_exited = 0;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+  {
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      continue;
+    if (WIFSIGNALED(status))
+      fprintf(stderr, "CGI child %d killed by signal %d\n", (int)pid,
+              WTERMSIG(status));
+    else
+      fprintf(stderr, "CGI child %d exited with status %d\n", (int)pid,
+              WEXITSTATUS(status));
+  }
+}
+
+/* Answers lisod with pid and, as ancillary data, pidfd */
+static void reply(int sock, pid_t pid, int pidfd)
+{
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg; struct iovec iov;
+  struct cmsghdr* cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(cbuf, 0, sizeof(cbuf));
+  iov.iov_base   = &pid;
+  iov.iov_len    = sizeof(pid);
+  msg.msg_iov    = &iov;
+  msg.msg_iovlen = 1;
+
+  if (pidfd >= 0)
+  {
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg               = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level   = SOL_SOCKET;
+    cmsg->cmsg_type    = SCM_RIGHTS;
+    cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pidfd, sizeof(int));
+  }
+
+  sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+/**************************************************************/
+/* @brief Starts the child for one request: stdin and stdout  */
+/* go to the pipes lisod passed, then the preloaded script    */
+/* runs, or the CGI path is exec'd.                           */
+/**************************************************************/
+static void run_child(int sock, int in_fd, int out_fd, char** envp)
+{
+  char* argv[2] = {zapp, NULL};
+
+  close(sock);
+  dup2(in_fd,  STDIN_FILENO);
+  dup2(out_fd, STDOUT_FILENO);
+  close(in_fd);
+  close(out_fd);
+
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+
+  if (preload_main != NULL)
+  {
+    fflush(stdout);
+    exit(preload_main(zapp, envp));
+  }
+
+  execve(zapp, argv, envp);
+  execve_error_handler();
+  _exit(1);
+}
+
+/**************************************************************/
+/* @brief The zygote's loop: one message per request, holding */
+/* the environment as NUL-separated strings and the stdin and */
+/* stdout pipe ends as ancillary data. Exits when lisod does. */
+/**************************************************************/
+static void zygote_loop(int sock)
+{
+  static char buf[ZYGOTE_MSG_MAX];
+  char cbuf[CMSG_SPACE(2 * sizeof(int))];
+  char* envp[ZYGOTE_MAX_ENV + 1];
+  struct msghdr msg; struct iovec iov;
+  struct cmsghdr* cmsg;
+  int fds[2], n, k, pidfd; ssize_t len;
+  pid_t pid;
+  char* p;
+
+  for (;;)
+  {
+    if (child_exited)
+      reap_children();
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base       = buf;
+    iov.iov_len        = sizeof(buf) - 1;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if ((len = recvmsg(sock, &msg, 0)) <= 0)
+    {
+      if (len < 0 && errno == EINTR)
+        continue;
+      _exit(0);   // lisod is gone
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+      continue;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    /* Split the environment */
+    buf[len] = '\0';
+    for (p = buf, n = 0; p < buf + len && n < ZYGOTE_MAX_ENV; n++)
+    {
+      envp[n] = p;
+      p += strlen(p) + 1;
+    }
+    envp[n] = NULL;
+
+    if ((pid = fork()) == 0)
+      run_child(sock, fds[0], fds[1], envp);
+
+    for (k = 0; k < 2; k++)
+      close(fds[k]);
+
+    /* lisod watches the child itself (cgi.c), through a pidfd taken
+       while the child can't have been reaped yet */
+    pidfd = -1;
+    if (pid > 0 && (pidfd = open_pidfd(pid)) < 0)
+    {
+      kill(pid, SIGKILL);   // Still ours: unreaped, so not recycled
+      pid = -1;
+    }
+    reply(sock, pid, pidfd);
+    if (pidfd >= 0)
+      close(pidfd);
+  }
+}
+
+/******************************************************************/
+/* @brief Forks the zygote, if LISO_CGI_ZYGOTE is set. Call early */
+/* in main(), before the server has grown. With LISO_CGI_PRELOAD  */
+/* naming a shared object, the zygote loads it and calls its      */
+/* liso_cgi_init() once; children then run liso_cgi_main()        */
+/* instead of exec'ing app.                                       */
+/*                                                                */
+/* @param app  The CGI script                                     */
+/*                                                                */
+/* @retval  0  started, or the zygote is not configured           */
+/* @retval -1  it could not be started                            */
+/******************************************************************/
+int zygote_start(char* app)
+{
+  liso_cgi_init_fn preload_init;
+  struct sigaction sa;
+  void* handle;
+  int sv[2], fd;
+
+  if (!config.cgi_zygote)
+    return 0;
+
+  /* Its children can only be watched through pidfds */
+  if ((fd = open_pidfd(getpid())) < 0)
+  {
+    log_error("No pidfd_open() on this kernel; CGI zygote disabled",
+              logfile);
+    return 0;
+  }
+  close(fd);
+
+  zapp = app;
+  fflush(NULL);   // Nothing buffered may be written twice
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+    return -1;
+
+  if ((zpid = fork()) < 0)
+  {
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+
+  if (zpid == 0)
+  {
+    close(sv[0]);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGINT,  SIG_DFL);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGHUP,  SIG_IGN);   // Meant for the log
+    /* Children are reaped by the loop; SIGCHLD only cuts recvmsg()
+       short so that it gets to them */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (config.cgi_preload != NULL)
+    {
+      if ((handle = dlopen(config.cgi_preload, RTLD_NOW)) == NULL ||
+          (preload_main = (liso_cgi_main_fn)dlsym(handle,
+                                                  "liso_cgi_main")) == NULL)
+      {
+        fprintf(stderr, "Unable to preload %s: %s\n", config.cgi_preload,
+                dlerror());
+        _exit(1);
+      }
+      preload_init = (liso_cgi_init_fn)dlsym(handle, "liso_cgi_init");
+      if (preload_init != NULL && preload_init(app) != 0)
+      {
+        fprintf(stderr, "liso_cgi_init failed for %s\n", app);
+        _exit(1);
+      }
+    }
+
+    zygote_loop(sv[1]);
+  }
+
+  close(sv[1]);
+  zsock = sv[0];
+  return 0;
+}
+
+int zygote_enabled(void)
+{
+  return zsock >= 0;
+}
+
+/*****************************************************************/
+/* @brief Has the zygote start a CGI process for one request.    */
+/* The caller keeps its own copies of the pipe ends it passes    */
+/* and closes them once this returns. The zygote answers with    */
+/* the child's pid and a pidfd on it.                            */
+/*                                                               */
+/* @param envp    The CGI environment, NULL terminated           */
+/* @param in_fd   Read end of the pipe that becomes stdin        */
+/* @param out_fd  Write end of the pipe that becomes stdout      */
+/* @param pid     Set to the child's pid                         */
+/* @param pidfd   Set to a pidfd on the child (close-on-exec)    */
+/*                                                               */
+/* @retval 0 on success, -1 if the zygote could not be reached   */
+/* or could not fork                                             */
+/*****************************************************************/
+int zygote_spawn(char** envp, int in_fd, int out_fd, pid_t* pid,
+                 int* pidfd)
+{
+  static char buf[ZYGOTE_MSG_MAX];
+  char cbuf[CMSG_SPACE(2 * sizeof(int))];
+  struct msghdr msg; struct iovec iov;
+  struct cmsghdr* cmsg;
+  int fds[2] = {in_fd, out_fd};
+  size_t len = 0, n;
+  int k;
+
+  for (k = 0; envp[k] != NULL && k < ZYGOTE_MAX_ENV; k++)
+  {
+    n = strlen(envp[k]) + 1;
+    if (len + n > sizeof(buf))
+      return -1;
+    memcpy(buf + len, envp[k], n);
+    len += n;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(cbuf, 0, sizeof(cbuf));
+  iov.iov_base       = buf;
+  iov.iov_len        = len;
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  cmsg             = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  while (sendmsg(zsock, &msg, MSG_NOSIGNAL) == -1)
+  {
+    if (errno == EINTR)
+      continue;
+    goto gone;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(cbuf, 0, sizeof(cbuf));
+  iov.iov_base       = pid;
+  iov.iov_len        = sizeof(*pid);
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = cbuf;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int));
+
+  while ((n = recvmsg(zsock, &msg, MSG_CMSG_CLOEXEC)) != sizeof(*pid))
+  {
+    if (n == (size_t)-1 && errno == EINTR)
+      continue;
+    goto gone;
+  }
+
+  *pidfd = -1;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    memcpy(pidfd, CMSG_DATA(cmsg), sizeof(int));
+
+  if (*pid > 0 && *pidfd >= 0)
+    return 0;
+  if (*pidfd >= 0)
+    close(*pidfd);
+  return -1;
+
+gone:
+  log_error("CGI zygote is gone, spawning directly", logfile);
+  close(zsock);
+  zsock = -1;
+  return -1;
+}
@@ -0,0 +1,21 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <sys/types.h>
+
+/* A CGI script preloaded into the zygote (LISO_CGI_PRELOAD) is a shared
+   object exporting these. liso_cgi_init runs once in the zygote, so
+   whatever it loads is shared, warm, by every child; liso_cgi_main runs
+   in a fresh fork of the zygote per request, with stdin and stdout
+   already connected, and its return value is the exit status. */
+typedef int (*liso_cgi_init_fn)(const char* script);
+typedef int (*liso_cgi_main_fn)(const char* script, char** envp);
+
+#define ZYGOTE_MAX_ENV 64   /* Environment strings per request */
+
+int  zygote_start(char* app);
+int  zygote_enabled(void);
+int  zygote_spawn(char** envp, int in_fd, int out_fd, pid_t* pid,
+                  int* pidfd);
+
+#endif